@@ -0,0 +1,177 @@
+/*
+ * CPU affinity for connection threads.
+ *
+ * With -C cpulist, each connection's thread is created pinned to the
+ * CPU on which the kernel processed the connection's packets, as
+ * reported by SO_INCOMING_CPU, if that CPU is in the list.  The request
+ * is then parsed and answered where its data is already cache-hot.
+ * Connections arriving on other CPUs are spread round-robin over the
+ * list.  With -c, connections are steered the same way to a scheduler
+ * thread pinned to their CPU, see affinity_incoming().
+ *
+ * Threads also set their memory policy to MPOL_LOCAL, so that the
+ * buffers they allocate and touch first, such as the bufio buffer,
+ * come from the NUMA node of the CPU they run on.
+ */
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "affinity.h"
+#include "stats.h"
+
+#ifndef MPOL_LOCAL
+#define MPOL_LOCAL 4            // from <linux/mempolicy.h>
+#endif
+
+bool affinity_enabled = false;
+
+static cpu_set_t allowed;       // CPUs given with -C
+static int *cpus;               // the same, as a list for round-robin
+static int ncpus;
+static atomic_uint next_cpu;
+static atomic_ulong steered, spread;
+
+static void
+affinity_report(FILE *out)
+{
+    fprintf(out, "on incoming cpu: %lu, round-robin: %lu, cpus: %d\n",
+            atomic_load(&steered), atomic_load(&spread), ncpus);
+}
+
+/* Parse a list of CPUs such as "0-3,8,10-11" and enable pinning
+ * to them.  CPUs the process may not run on are ignored. */
+bool
+affinity_init(const char *cpulist)
+{
+    cpu_set_t usable;
+    if (sched_getaffinity(0, sizeof usable, &usable) == -1) {
+        perror("sched_getaffinity");
+        return false;
+    }
+
+    CPU_ZERO(&allowed);
+    const char *p = cpulist;
+    while (*p) {
+        char *end;
+        long lo = strtol(p, &end, 10), hi = lo;
+        if (end == p)
+            goto bad;
+        if (*end == '-') {
+            p = end + 1;
+            hi = strtol(p, &end, 10);
+            if (end == p || hi < lo)
+                goto bad;
+        }
+        if (hi >= CPU_SETSIZE)
+            goto bad;
+        for (long cpu = lo; cpu <= hi; cpu++)
+            if (CPU_ISSET(cpu, &usable))
+                CPU_SET(cpu, &allowed);
+        if (*end == ',')
+            end++;
+        else if (*end != '\0')
+            goto bad;
+        p = end;
+    }
+
+    ncpus = CPU_COUNT(&allowed);
+    if (ncpus == 0) {
+        fprintf(stderr, "-C %s: none of these CPUs are available\n", cpulist);
+        return false;
+    }
+    cpus = malloc(ncpus * sizeof *cpus);
+    if (cpus == NULL) {
+        perror("malloc");
+        return false;
+    }
+    for (int cpu = 0, i = 0; i < ncpus; cpu++)
+        if (CPU_ISSET(cpu, &allowed))
+            cpus[i++] = cpu;
+
+    affinity_enabled = true;
+    stats_register("cpu affinity", affinity_report);
+    return true;
+
+bad:
+    fprintf(stderr, "-C %s: invalid CPU list\n", cpulist);
+    return false;
+}
+
+/* Return the listed CPU on which the kernel processed the
+ * connection's packets, or -1 if it is not listed. */
+static int
+incoming_cpu(int client_socket)
+{
+    int cpu = -1;
+    socklen_t len = sizeof cpu;
+    if (getsockopt(client_socket, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0
+        && cpu >= 0 && cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+        return cpu;
+    return -1;
+}
+
+/* Set up attr to create the thread for a connection on its CPU. */
+void
+affinity_steer(pthread_attr_t *attr, int client_socket)
+{
+    int cpu = incoming_cpu(client_socket);
+    if (cpu != -1) {
+        atomic_fetch_add_explicit(&steered, 1, memory_order_relaxed);
+    } else {
+        cpu = cpus[atomic_fetch_add_explicit(&next_cpu, 1, memory_order_relaxed) % ncpus];
+        atomic_fetch_add_explicit(&spread, 1, memory_order_relaxed);
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_attr_setaffinity_np(attr, sizeof set, &set);
+}
+
+/* Set up attr to create a thread on the index'th listed CPU,
+ * wrapping around. */
+void
+affinity_pin(pthread_attr_t *attr, int index)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpus[index % ncpus], &set);
+    pthread_attr_setaffinity_np(attr, sizeof set, &set);
+}
+
+/* Of nthreads threads pinned with affinity_pin(), return the index of
+ * one that runs on the connection's CPU, or -1 if none does.  Several
+ * threads on that CPU take turns. */
+int
+affinity_incoming(int client_socket, int nthreads)
+{
+    int cpu = incoming_cpu(client_socket), index = 0;
+    while (cpu != -1 && cpus[index] != cpu)
+        index++;
+    if (cpu == -1 || index >= nthreads) {
+        atomic_fetch_add_explicit(&spread, 1, memory_order_relaxed);
+        return -1;
+    }
+    atomic_fetch_add_explicit(&steered, 1, memory_order_relaxed);
+    // threads index, index + ncpus, ... run on the CPU
+    int nsame = (nthreads - 1 - index) / ncpus + 1;
+    return index + ncpus * (atomic_fetch_add_explicit(&next_cpu, 1, memory_order_relaxed) % nsame);
+}
+
+/* Make the calling thread allocate memory on its local node. */
+void
+affinity_local_memory(void)
+{
+    if (syscall(SYS_set_mempolicy, MPOL_LOCAL, NULL, 0) == -1 && errno != ENOSYS) {
+        static atomic_bool warned;
+        if (!atomic_exchange(&warned, true))
+            perror("set_mempolicy");
+    }
+}
@@ -0,0 +1,18 @@
+#ifndef _AFFINITY_H
+#define _AFFINITY_H
+/*
+ * Placement of connection threads on CPUs, and of their memory
+ * on the local NUMA node.
+ */
+#include <pthread.h>
+#include <stdbool.h>
+
+extern bool affinity_enabled;
+
+bool affinity_init(const char *cpulist);
+void affinity_steer(pthread_attr_t *attr, int client_socket);
+void affinity_pin(pthread_attr_t *attr, int index);
+int affinity_incoming(int client_socket, int nthreads);
+void affinity_local_memory(void);
+
+#endif /* _AFFINITY_H */
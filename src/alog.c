@@ -0,0 +1,327 @@
+/*
+ * Asynchronous access log.
+ *
+ * Records are kept in NRINGS bounded ring buffers.  Each thread is
+ * assigned a ring on its first log call, so producers rarely share a
+ * ring; since connection threads come and go, a ring may nevertheless
+ * have several producers, and the rings are therefore multi-producer,
+ * single-consumer queues in which each slot carries a sequence number
+ * (after D. Vyukov's bounded MPMC queue).
+ *
+ * The log thread drains all rings every FLUSH_INTERVAL_MS, formats the
+ * records into a single buffer, and writes it with one write() call.
+ */
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "alog.h"
+#include "buffer.h"
+#include "socket.h"
+#include "stats.h"
+#include "timing.h"
+
+#define NRINGS 16
+#define RING_SIZE 1024              // records per ring, power of 2
+#define FLUSH_INTERVAL_MS 20
+#define PATH_LEN 64
+
+enum alog_kind {
+    ALOG_ACCEPT,
+    ALOG_REQUEST
+};
+
+/* A fixed-size log record. */
+struct alog_record {
+    uint64_t time_ns;           // CLOCK_REALTIME
+    uint64_t duration_ns;
+    uint64_t bytes;
+    uint16_t kind;
+    uint16_t status;
+    uint16_t family;
+    uint16_t port;
+    uint8_t addr[16];
+    char method[8];
+    char path[PATH_LEN];
+};
+
+struct alog_slot {
+    _Atomic size_t seq;
+    struct alog_record rec;
+};
+
+struct alog_ring {
+    _Atomic size_t head __attribute__((aligned(64)));   // next slot to fill
+    _Atomic uint64_t dropped;
+    size_t tail __attribute__((aligned(64)));           // next slot to drain
+    struct alog_slot slots[RING_SIZE];
+};
+
+bool alog_enabled = false;
+
+static struct alog_ring *rings;
+static _Atomic unsigned next_ring;
+static __thread int my_ring = -1;
+static int log_fd = -1;
+static _Atomic uint64_t written;
+
+static void
+ring_init(struct alog_ring *ring)
+{
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->dropped, 0);
+    ring->tail = 0;
+    for (size_t i = 0; i < RING_SIZE; i++)
+        atomic_init(&ring->slots[i].seq, i);
+}
+
+/* Enqueue a record, returning false if the ring is full. */
+static bool
+ring_put(struct alog_ring *ring, const struct alog_record *rec)
+{
+    size_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    struct alog_slot *slot;
+    for (;;) {
+        slot = &ring->slots[pos & (RING_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + 1,
+                        memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        }
+    }
+    slot->rec = *rec;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    return true;
+}
+
+/* Dequeue a record; called only by the log thread. */
+static bool
+ring_get(struct alog_ring *ring, struct alog_record *rec)
+{
+    struct alog_slot *slot = &ring->slots[ring->tail & (RING_SIZE - 1)];
+    size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    if (seq != ring->tail + 1)
+        return false;
+
+    *rec = slot->rec;
+    atomic_store_explicit(&slot->seq, ring->tail + RING_SIZE, memory_order_release);
+    ring->tail++;
+    return true;
+}
+
+static void
+record_peer(struct alog_record *rec, const struct sockaddr_storage *peer)
+{
+    rec->family = peer->ss_family;
+    if (peer->ss_family == AF_INET) {
+        const struct sockaddr_in *sin = (const struct sockaddr_in *) peer;
+        memcpy(rec->addr, &sin->sin_addr, sizeof sin->sin_addr);
+        rec->port = ntohs(sin->sin_port);
+    } else if (peer->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *) peer;
+        memcpy(rec->addr, &sin6->sin6_addr, sizeof sin6->sin6_addr);
+        rec->port = ntohs(sin6->sin6_port);
+    } else if (peer->ss_family == AF_UNIX) {
+        const struct sockaddr_peercred *pc = (const struct sockaddr_peercred *) peer;
+        uint32_t cred[3] = { pc->pid, pc->uid, pc->gid };
+        memcpy(rec->addr, cred, sizeof cred);
+    }
+}
+
+static void
+submit(struct alog_record *rec)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    rec->time_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+    if (my_ring == -1)
+        my_ring = atomic_fetch_add_explicit(&next_ring, 1, memory_order_relaxed) % NRINGS;
+
+    struct alog_ring *ring = &rings[my_ring];
+    if (!ring_put(ring, rec))
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+}
+
+/* Log an accepted connection. */
+void
+alog_accept(const struct sockaddr_storage *peer)
+{
+    if (!alog_enabled)
+        return;
+
+    struct alog_record rec;
+    memset(&rec, 0, sizeof rec);
+    rec.kind = ALOG_ACCEPT;
+    record_peer(&rec, peer);
+    submit(&rec);
+}
+
+/* Log a completed request; start_ns is a timing_now() timestamp. */
+void
+alog_request(const struct sockaddr_storage *peer, const char *method,
+             const char *path, int status, uint64_t bytes, uint64_t start_ns)
+{
+    if (!alog_enabled)
+        return;
+
+    struct alog_record rec;
+    memset(&rec, 0, sizeof rec);
+    rec.kind = ALOG_REQUEST;
+    record_peer(&rec, peer);
+    rec.status = status;
+    rec.bytes = bytes;
+    rec.duration_ns = timing_now() - start_ns;
+    strncpy(rec.method, method, sizeof rec.method - 1);
+    strncpy(rec.path, path, sizeof rec.path - 1);
+    submit(&rec);
+}
+
+static void
+format_record(buffer_t *out, const struct alog_record *rec)
+{
+    // the client, as address:port or, for a UNIX socket, its credentials
+    char addr[INET6_ADDRSTRLEN] = "-";
+    char peer[64];
+    if (rec->family == AF_INET || rec->family == AF_INET6)
+        inet_ntop(rec->family, rec->addr, addr, sizeof addr);
+    if (rec->family == AF_UNIX) {
+        uint32_t cred[3];
+        memcpy(cred, rec->addr, sizeof cred);
+        if (cred[0] == 0)
+            snprintf(peer, sizeof peer, "unix");
+        else
+            snprintf(peer, sizeof peer, "unix:pid=%u,uid=%u,gid=%u", cred[0], cred[1], cred[2]);
+    } else {
+        snprintf(peer, sizeof peer, "%s:%d", addr, rec->port);
+    }
+
+    time_t secs = rec->time_ns / 1000000000ULL;
+    struct tm tm;
+    gmtime_r(&secs, &tm);
+    char when[32];
+    strftime(when, sizeof when, "%Y-%m-%dT%H:%M:%S", &tm);
+
+    char line[256];
+    int len;
+    if (rec->kind == ALOG_ACCEPT)
+        len = snprintf(line, sizeof line, "%s.%03dZ %s accept\n",
+                       when, (int) (rec->time_ns / 1000000 % 1000), peer);
+    else
+        len = snprintf(line, sizeof line, "%s.%03dZ %s \"%s %s\" %d %lu %.3fms\n",
+                       when, (int) (rec->time_ns / 1000000 % 1000), peer,
+                       rec->method, rec->path, rec->status,
+                       (unsigned long) rec->bytes, rec->duration_ns / 1e6);
+    buffer_append(out, line, len < sizeof line ? len : sizeof line - 1);
+}
+
+static void
+write_all(buffer_t *out)
+{
+    char *p = out->buf;
+    int left = out->len;
+    while (left > 0) {
+        ssize_t rc = write(log_fd, p, left);
+        if (rc <= 0)
+            break;
+        p += rc;
+        left -= rc;
+    }
+    out->len = 0;
+}
+
+static uint64_t
+total_dropped(void)
+{
+    uint64_t dropped = 0;
+    for (int i = 0; i < NRINGS; i++)
+        dropped += atomic_load_explicit(&rings[i].dropped, memory_order_relaxed);
+    return dropped;
+}
+
+static void *
+alog_thread(void *arg)
+{
+    buffer_t out;
+    buffer_init(&out, 64 * 1024);
+    uint64_t reported_drops = 0;
+    struct timespec interval = { .tv_sec = 0, .tv_nsec = FLUSH_INTERVAL_MS * 1000000L };
+
+    for (;;) {
+        struct alog_record rec;
+        uint64_t n = 0;
+        for (int i = 0; i < NRINGS; i++)
+            while (ring_get(&rings[i], &rec)) {
+                format_record(&out, &rec);
+                n++;
+            }
+
+        uint64_t dropped = total_dropped();
+        if (dropped != reported_drops) {
+            char line[80];
+            int len = snprintf(line, sizeof line, "access log: %lu records dropped\n",
+                               (unsigned long) (dropped - reported_drops));
+            buffer_append(&out, line, len);
+            reported_drops = dropped;
+        }
+
+        if (out.len > 0) {
+            write_all(&out);
+            atomic_fetch_add_explicit(&written, n, memory_order_relaxed);
+        }
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+static void
+alog_report(FILE *out)
+{
+    fprintf(out, "records written: %lu, dropped: %lu\n",
+            (unsigned long) atomic_load(&written), (unsigned long) total_dropped());
+}
+
+/* Start the access log, writing to path, or to stderr if path is "-". */
+void
+alog_init(const char *path)
+{
+    if (!strcmp(path, "-")) {
+        log_fd = STDERR_FILENO;
+    } else {
+        log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (log_fd == -1) {
+            perror(path);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    rings = aligned_alloc(64, NRINGS * sizeof *rings);
+    if (rings == NULL) {
+        perror("aligned_alloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < NRINGS; i++)
+        ring_init(&rings[i]);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, alog_thread, NULL) != 0) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+    alog_enabled = true;
+    stats_register("access log", alog_report);
+}
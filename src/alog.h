@@ -0,0 +1,23 @@
+#ifndef _ALOG_H
+#define _ALOG_H
+/*
+ * Asynchronous access log.
+ *
+ * Worker threads append fixed-size binary records to lock-free
+ * ring buffers; a background thread formats and writes them out in
+ * batches.  If a ring is full, the record is dropped and counted
+ * rather than blocking the worker.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+extern bool alog_enabled;
+
+void alog_init(const char *path);
+void alog_accept(const struct sockaddr_storage *peer);
+void alog_request(const struct sockaddr_storage *peer, const char *method,
+                  const char *path, int status, uint64_t bytes,
+                  uint64_t start_ns);
+
+#endif /* _ALOG_H */
@@ -0,0 +1,763 @@
+/*
+ * Microbenchmarks for the server's building blocks.
+ *
+ * Usage: microbench [-f filter] [-t millis] [corpus files...]
+ *
+ * Each benchmark is run with a growing number of iterations until it
+ * takes at least the given time (default 200ms).  Results are written
+ * to stdout as JSON, reporting ns/op and heap allocations/op for each
+ * benchmark.  Allocations are counted by interposing malloc & friends.
+ *
+ * Socket-based benchmarks run over a local socketpair, so their cost
+ * includes the write() that feeds the data in.
+ *
+ * The corpus files contain raw HTTP requests (see bench/corpus);
+ * each is benchmarked separately through request and header parsing.
+ */
+#include <sys/socket.h>
+#include <sys/utsname.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+#include <jansson.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../buffer.h"
+#include "../bufio.h"
+#include "../chain.h"
+#include "../coro.h"
+#include "../deque.h"
+#include "../http.h"
+#include "../token.h"
+#include "../route.h"
+#include "../mime.h"
+#include "../revoke.h"
+#include "../readahead.h"
+#include "../bufpool.h"
+#include "../slab.h"
+#include "../shmcache.h"
+#include "../json.h"
+#include "../main.h"
+
+/* Allocation counting. */
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+extern void __libc_free(void *);
+
+static uint64_t nallocs;
+
+void *malloc(size_t size) { nallocs++; return __libc_malloc(size); }
+void *calloc(size_t n, size_t size) { nallocs++; return __libc_calloc(n, size); }
+void *realloc(void *p, size_t size) { nallocs++; return __libc_realloc(p, size); }
+void free(void *p) { __libc_free(p); }
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+die(const char *msg)
+{
+    perror(msg);
+    exit(EXIT_FAILURE);
+}
+
+/* Per-benchmark state. */
+struct bench {
+    const char *name;
+    void (*setup)(struct bench *);
+    void (*run)(struct bench *, long iters);
+    void (*teardown)(struct bench *);
+    const char *data;           // input, e.g., a corpus request
+    size_t datalen;
+    int fds[2];                 // socketpair, if used
+    struct bufio *bufio;
+};
+
+static void
+write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t rc = write(fd, data, len);
+        if (rc <= 0)
+            die("write");
+        data += rc;
+        len -= rc;
+    }
+}
+
+/* socketpair with a bufio on the reading side */
+static void
+setup_socketpair(struct bench *b)
+{
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, b->fds) == -1)
+        die("socketpair");
+    int sz = 4 << 20;
+    setsockopt(b->fds[0], SOL_SOCKET, SO_SNDBUF, &sz, sizeof sz);
+    setsockopt(b->fds[1], SOL_SOCKET, SO_RCVBUF, &sz, sizeof sz);
+    b->bufio = bufio_create(b->fds[1]);
+}
+
+static void
+teardown_socketpair(struct bench *b)
+{
+    bufio_close(b->bufio);
+    close(b->fds[0]);
+}
+
+/* bufio_readline, one 40-byte header line per op, fed in batches */
+#define LINES_PER_BATCH 64
+static const char header_line[] = "X-Benchmark-Header: some-header-value\r\n";
+
+static void
+bench_bufio_readline(struct bench *b, long iters)
+{
+    char batch[LINES_PER_BATCH * sizeof header_line];
+    size_t linelen = sizeof header_line - 1;
+    for (int i = 0; i < LINES_PER_BATCH; i++)
+        memcpy(batch + i * linelen, header_line, linelen);
+
+    for (long i = 0; i < iters; i += LINES_PER_BATCH) {
+        long n = iters - i < LINES_PER_BATCH ? iters - i : LINES_PER_BATCH;
+        write_all(b->fds[0], batch, n * linelen);
+        for (long j = 0; j < n; j++) {
+            size_t offset;
+            if (bufio_readline(b->bufio, &offset) != linelen)
+                die("bufio_readline");
+        }
+        bufio_truncate(b->bufio);
+    }
+}
+
+/* bufio_read of a 4KB body per op */
+static void
+bench_bufio_read(struct bench *b, long iters)
+{
+    static char body[4096];
+    for (long i = 0; i < iters; i++) {
+        write_all(b->fds[0], body, sizeof body);
+        size_t offset;
+        if (bufio_read(b->bufio, sizeof body, &offset) != sizeof body)
+            die("bufio_read");
+        bufio_truncate(b->bufio);
+    }
+}
+
+/* bufio_sendchain of a 4KB body per op, drained on the other side */
+static void
+bench_bufio_sendchain(struct bench *b, long iters)
+{
+    static char body[4096], sink[4096];
+    struct chain c;
+    chain_init(&c);
+    chain_append_ref(&c, body, sizeof body);
+    for (long i = 0; i < iters; i++) {
+        if (bufio_sendchain(b->bufio, &c) != sizeof body)
+            die("bufio_sendchain");
+        for (size_t got = 0; got < sizeof body; ) {
+            ssize_t rc = read(b->fds[0], sink, sizeof sink - got);
+            if (rc <= 0)
+                die("read");
+            got += rc;
+        }
+    }
+    chain_delete(&c);
+}
+
+/* the same with user space pacing at a rate that never holds it back */
+static void
+setup_paced_socketpair(struct bench *b)
+{
+    setup_socketpair(b);
+    bufio_set_pacing(b->bufio, 1ULL << 40);
+}
+
+/* growing a buffer to 64KB in 16-byte appends, one append per op */
+static void
+bench_buffer_append(struct bench *b, long iters)
+{
+    static char chunk[16] = "0123456789ABCDEF";
+    buffer_t buf;
+    buffer_init(&buf, 0);
+    for (long i = 0; i < iters; i++) {
+        buffer_append(&buf, chunk, sizeof chunk);
+        if (buf.len >= 65536) {
+            buffer_delete(&buf);
+            buffer_init(&buf, 0);
+        }
+    }
+    buffer_delete(&buf);
+}
+
+/* the same with a chain, which appends into pooled segments */
+static void
+bench_chain_append(struct bench *b, long iters)
+{
+    static char chunk[16] = "0123456789ABCDEF";
+    struct chain c;
+    chain_init(&c);
+    for (long i = 0; i < iters; i++) {
+        chain_append(&c, chunk, sizeof chunk);
+        if (c.len >= 65536)
+            chain_delete(&c);
+    }
+    chain_delete(&c);
+}
+
+/* a contiguous view of a 16KB chain, which coalesces its 4 segments */
+static void
+bench_chain_view(struct bench *b, long iters)
+{
+    static char body[16384];
+    for (long i = 0; i < iters; i++) {
+        struct chain c;
+        chain_init(&c);
+        chain_append(&c, body, sizeof body);
+        buffer_t view;
+        if (!chain_view(&c, &view) || view.len != sizeof body)
+            die("chain_view");
+        chain_delete(&c);
+    }
+}
+
+/* an /api/video listing of 32 files, one listing per op */
+#define LISTING_FILES 32
+
+static void
+bench_json_write(struct bench *b, long iters)
+{
+    struct chain c;
+    chain_init(&c);
+    for (long i = 0; i < iters; i++) {
+        struct json_writer w;
+        json_writer_init(&w, &c);
+        json_write_begin_array(&w);
+        for (int f = 0; f < LISTING_FILES; f++) {
+            char name[32];
+            snprintf(name, sizeof name, "video-%02d.mp4", f);
+            json_write_begin_object(&w);
+            json_write_key(&w, "size");
+            json_write_int(&w, 1512799 + f);
+            json_write_key(&w, "name");
+            json_write_string(&w, name);
+            json_write_end_object(&w);
+        }
+        json_write_end_array(&w);
+        chain_delete(&c);
+    }
+}
+
+/* the same listing built as a jansson tree and dumped, as it used to be */
+static void
+bench_json_write_jansson(struct bench *b, long iters)
+{
+    struct chain c;
+    chain_init(&c);
+    for (long i = 0; i < iters; i++) {
+        json_t *arr = json_array();
+        for (int f = 0; f < LISTING_FILES; f++) {
+            char name[32];
+            snprintf(name, sizeof name, "video-%02d.mp4", f);
+            json_t *json = json_object();
+            json_object_set_new(json, "size", json_integer(1512799 + f));
+            json_object_set_new(json, "name", json_string(name));
+            json_array_append_new(arr, json);
+        }
+        char *dump = json_dumps(arr, JSON_COMPACT);
+        chain_appends(&c, dump);
+        free(dump);
+        json_decref(arr);
+        chain_delete(&c);
+    }
+}
+
+/* the credentials of a POST /api/login body, including the copy the
+ * in-place scan needs to run again */
+static const char login_body[] = "{\"username\": \"user0\", \"password\": \"thepassword\"}";
+
+static void
+bench_json_scan(struct bench *b, long iters)
+{
+    char body[sizeof login_body];
+    for (long i = 0; i < iters; i++) {
+        memcpy(body, login_body, sizeof body);
+        struct json_field fields[] = { { "username" }, { "password" } };
+        if (!json_scan_object(body, sizeof body - 1, fields, 2) || fields[1].value == NULL)
+            die("json_scan_object");
+    }
+}
+
+static void
+bench_json_scan_jansson(struct bench *b, long iters)
+{
+    for (long i = 0; i < iters; i++) {
+        json_error_t error;
+        json_t *root = json_loadb(login_body, sizeof login_body - 1, 0, &error);
+        const char *user = json_string_value(json_object_get(root, "username"));
+        const char *pass = json_string_value(json_object_get(root, "password"));
+        if (user == NULL || pass == NULL)
+            die("json_loadb");
+        json_decref(root);
+    }
+}
+
+/* http_add_header, one header per op */
+static void
+bench_http_add_header(struct bench *b, long iters)
+{
+    buffer_t buf;
+    buffer_init(&buf, 1024);
+    for (long i = 0; i < iters; i++) {
+        http_add_header(&buf, "Content-Range", "bytes %ld-%ld/%ld", i, i + 1023, 1L << 30);
+        if ((i & 63) == 63)
+            buf.len = 0;
+    }
+    buffer_delete(&buf);
+}
+
+/* request line and header parsing of a corpus request, one request per op */
+static void
+bench_parse_request(struct bench *b, long iters)
+{
+    struct http_client client;
+    http_setup_client(&client, b->bufio);
+    for (long i = 0; i < iters; i++) {
+        write_all(b->fds[0], b->data, b->datalen);
+
+        struct http_transaction ta;
+        memset(&ta, 0, sizeof ta);
+        ta.client = &client;
+        if (!http_parse_request(&ta) || !http_process_headers(&ta))
+            die("parse");
+        if (ta.req_content_len > 0
+            && bufio_read(b->bufio, ta.req_content_len, &ta.req_body) != ta.req_content_len)
+            die("bufio_read");
+        bufio_truncate(b->bufio);
+    }
+}
+
+static void
+bench_token_generate(struct bench *b, long iters)
+{
+    for (long i = 0; i < iters; i++)
+        free(token_generate("user0"));
+}
+
+static char *valid_token;
+
+static void
+setup_token(struct bench *b)
+{
+    valid_token = token_generate("user0");
+}
+
+static void
+teardown_token(struct bench *b)
+{
+    free(valid_token);
+}
+
+static void
+bench_token_validate(struct bench *b, long iters)
+{
+    for (long i = 0; i < iters; i++)
+        if (!token_validate(valid_token, NULL))
+            die("token_validate");
+}
+
+/* RS256 and ES256 tokens, signed with a freshly generated key */
+static void
+setup_key(int type, const char *alg)
+{
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(type, NULL);
+    EVP_PKEY *key = NULL;
+    if (ctx == NULL || EVP_PKEY_keygen_init(ctx) != 1
+        || (type == EVP_PKEY_RSA ? EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, 2048)
+                                 : EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, NID_X9_62_prime256v1)) != 1
+        || EVP_PKEY_keygen(ctx, &key) != 1)
+        die("keygen");
+    EVP_PKEY_CTX_free(ctx);
+
+    char path[] = "/tmp/microbench-key-XXXXXX";
+    int fd = mkstemp(path);
+    FILE *f = fd == -1 ? NULL : fdopen(fd, "w");
+    if (f == NULL || PEM_write_PrivateKey(f, key, NULL, NULL, 0, NULL, NULL) != 1)
+        die("write key");
+    fclose(f);
+    EVP_PKEY_free(key);
+
+    bool ok = token_init(alg, path);
+    unlink(path);
+    if (!ok)
+        die("token_init");
+    valid_token = token_generate("user0");
+    if (valid_token == NULL)
+        die("token_generate");
+}
+
+static void
+setup_rs256(struct bench *b)
+{
+    setup_key(EVP_PKEY_RSA, "RS256");
+}
+
+static void
+setup_es256(struct bench *b)
+{
+    setup_key(EVP_PKEY_EC, "ES256");
+}
+
+static void
+teardown_key(struct bench *b)
+{
+    free(valid_token);
+    token_init("HS256", NULL);
+}
+
+/* route_lookup over a table of 64 API endpoints plus prefixes, one lookup per op */
+static bool
+dummy_handler(struct http_transaction *ta)
+{
+    return true;
+}
+
+static struct route bench_routes[67];
+static char bench_route_paths[64][32];
+static struct route_table *bench_table;
+
+static void
+setup_routes(struct bench *b)
+{
+    for (int i = 0; i < 64; i++) {
+        snprintf(bench_route_paths[i], sizeof bench_route_paths[i], "/api/endpoint%d", i);
+        bench_routes[i] = (struct route) { ROUTE_EXACT, bench_route_paths[i],
+                                           ROUTE_METHOD(HTTP_GET), dummy_handler };
+    }
+    bench_routes[64] = (struct route) { ROUTE_PREFIX, "/api", ROUTE_ANY, dummy_handler };
+    bench_routes[65] = (struct route) { ROUTE_PREFIX, "/private", ROUTE_ANY, dummy_handler };
+    bench_routes[66] = (struct route) { ROUTE_PREFIX, "/", ROUTE_ANY, dummy_handler };
+    bench_table = route_compile(bench_routes, 67);
+    if (bench_table == NULL)
+        die("route_compile");
+}
+
+static void
+bench_route(struct bench *b, long iters)
+{
+    static const char *paths[] = { "/api/endpoint63", "/private/secure.html", "/js/jquery.min.js" };
+    for (long i = 0; i < iters; i++) {
+        bool method_not_allowed;
+        if (route_lookup(bench_table, paths[i % 3], HTTP_GET, &method_not_allowed) == NULL)
+            die("route_lookup");
+    }
+}
+
+static void
+bench_mime_type(struct bench *b, long iters)
+{
+    static const char *names[] = { "./index.html", "./js/jquery.min.js", "./v1.mp4", "./doc.PDF" };
+    for (long i = 0; i < iters; i++)
+        if (mime_type(names[i & 3]) == NULL)
+            die("mime_type");
+}
+
+static void
+bench_coro_body(void *arg)
+{
+    for (;;)
+        coro_yield();
+}
+
+/* a switch into a coroutine and back, one round trip per op */
+static void
+bench_coro_switch(struct bench *b, long iters)
+{
+    struct coro *co = coro_create(bench_coro_body, NULL);
+    for (long i = 0; i < iters; i++)
+        coro_resume(co);
+    coro_destroy(co);
+}
+
+/* a push and a pop at the owner's end of a work-stealing deque, one pair per op */
+static void
+bench_deque_push_pop(struct bench *b, long iters)
+{
+    static struct deque q;
+    static bool initialized;
+    if (!initialized) {
+        deque_init(&q);
+        initialized = true;
+    }
+    for (long i = 0; i < iters; i++) {
+        deque_push(&q, &q);
+        if (deque_pop(&q) == NULL)
+            die("deque_pop");
+    }
+}
+
+/* revoke_contains for a token that was not revoked, with 1000 revoked ones */
+static void
+setup_revoke(struct bench *b)
+{
+    static bool initialized;
+    if (initialized)
+        return;
+    revoke_init(NULL);
+    for (int i = 0; i < 1000; i++) {
+        char token[64];
+        snprintf(token, sizeof token, "hdr.payload.revoked-signature-%d", i);
+        revoke_add(token, 0);
+    }
+    initialized = true;
+}
+
+/* readahead_begin/end for a client reading a 64MB file in 64KB ranges */
+#define RA_FILE_SIZE (64 << 20)
+#define RA_RANGE (64 << 10)
+
+static void
+setup_readahead(struct bench *b)
+{
+    static bool started;
+    if (!started && !readahead_start(4096, 0))
+        die("readahead_start");
+    started = true;
+    char path[] = "/tmp/microbench-XXXXXX";
+    b->fds[0] = mkstemp(path);
+    if (b->fds[0] == -1 || ftruncate(b->fds[0], RA_FILE_SIZE) == -1)
+        die("mkstemp");
+    unlink(path);
+}
+
+static void
+teardown_readahead(struct bench *b)
+{
+    close(b->fds[0]);
+}
+
+static void
+bench_readahead(struct bench *b, long iters)
+{
+    struct stat st;
+    if (fstat(b->fds[0], &st) == -1)
+        die("fstat");
+    for (long i = 0; i < iters; i++) {
+        off_t from = i * RA_RANGE % RA_FILE_SIZE;
+        struct readahead ra;
+        readahead_begin(&ra, b->fds[0], &st, from, from + RA_RANGE - 1);
+        readahead_end(&ra, from + RA_RANGE);
+    }
+}
+
+static void
+bench_revoke_contains(struct bench *b, long iters)
+{
+    const char *token = "eyJhbGciOiJIUzI1NiJ9.eyJzdWIiOiJ1c2VyMCJ9"
+                        ".dBjftJeZ4CVP-mB92K27uhbUJU1p1r_wW1gFWFOEjXk";
+    for (long i = 0; i < iters; i++)
+        if (revoke_contains(token))
+            die("revoke_contains");
+}
+
+/* a receive buffer taken from and put back into the local pool */
+static void
+bench_bufpool(struct bench *b, long iters)
+{
+    for (long i = 0; i < iters; i++)
+        bufpool_put(bufpool_get());
+}
+
+/* an object allocated from and freed to a slab */
+static void
+bench_slab(struct bench *b, long iters)
+{
+    static struct slab slab;
+    static bool initialized;
+    if (!initialized) {
+        slab_init(&slab, "bench", 144);
+        initialized = true;
+    }
+    for (long i = 0; i < iters; i++)
+        slab_free(&slab, slab_alloc(&slab));
+}
+
+/* a hit in a shared-memory cache of 4096 entries with 128-byte keys */
+static void
+bench_shmcache(struct bench *b, long iters)
+{
+    static struct shmcache *cache;
+    char key[128] = "/index.html", value[160] = "";
+    if (cache == NULL) {
+        cache = shmcache_create("bench", 4096, sizeof key, sizeof value);
+        shmcache_put(cache, key, value);
+    }
+    for (long i = 0; i < iters; i++)
+        if (!shmcache_get(cache, key, value))
+            die("shmcache_get");
+}
+
+/* token_validate with the verified-token cache.  Must come after the
+ * uncached token benchmarks, since the cache cannot be turned off. */
+static void
+setup_token_cache(struct bench *b)
+{
+    static bool initialized;
+    if (!initialized)
+        token_cache_init();
+    initialized = true;
+    setup_token(b);
+}
+
+static struct bench benchmarks[] = {
+    { "bufio_readline", setup_socketpair, bench_bufio_readline, teardown_socketpair },
+    { "bufio_read_4k", setup_socketpair, bench_bufio_read, teardown_socketpair },
+    { "bufio_sendchain_4k", setup_socketpair, bench_bufio_sendchain, teardown_socketpair },
+    { "bufio_sendchain_4k_paced", setup_paced_socketpair, bench_bufio_sendchain, teardown_socketpair },
+    { "buffer_append_16b", NULL, bench_buffer_append, NULL },
+    { "chain_append_16b", NULL, bench_chain_append, NULL },
+    { "chain_view_16k", NULL, bench_chain_view, NULL },
+    { "http_add_header", NULL, bench_http_add_header, NULL },
+    { "json_write_listing", NULL, bench_json_write, NULL },
+    { "json_write_listing_jansson", NULL, bench_json_write_jansson, NULL },
+    { "json_scan_login", NULL, bench_json_scan, NULL },
+    { "json_scan_login_jansson", NULL, bench_json_scan_jansson, NULL },
+    { "token_generate", NULL, bench_token_generate, NULL },
+    { "token_validate", setup_token, bench_token_validate, teardown_token },
+    { "token_generate_rs256", setup_rs256, bench_token_generate, teardown_key },
+    { "token_validate_rs256", setup_rs256, bench_token_validate, teardown_key },
+    { "token_generate_es256", setup_es256, bench_token_generate, teardown_key },
+    { "token_validate_es256", setup_es256, bench_token_validate, teardown_key },
+    { "route_lookup", setup_routes, bench_route, NULL },
+    { "mime_type", NULL, bench_mime_type, NULL },
+    { "coro_switch", NULL, bench_coro_switch, NULL },
+    { "deque_push_pop", NULL, bench_deque_push_pop, NULL },
+    { "revoke_contains", setup_revoke, bench_revoke_contains, NULL },
+    { "readahead_range_64k", setup_readahead, bench_readahead, teardown_readahead },
+    { "bufpool_get_put", NULL, bench_bufpool, NULL },
+    { "slab_alloc_free", NULL, bench_slab, NULL },
+    { "shmcache_get", NULL, bench_shmcache, NULL },
+    { "token_validate_cached", setup_token_cache, bench_token_validate, teardown_token },
+};
+
+static bool first_result = true;
+
+static void
+run_benchmark(struct bench *b, uint64_t min_ns)
+{
+    if (b->setup)
+        b->setup(b);
+
+    long iters = 1;
+    uint64_t elapsed, allocs;
+    for (;;) {
+        uint64_t allocs_before = nallocs;
+        uint64_t start = now_ns();
+        b->run(b, iters);
+        elapsed = now_ns() - start;
+        allocs = nallocs - allocs_before;
+        if (elapsed >= min_ns)
+            break;
+        // aim for 1.2x the minimum time, growing at most 100x per round
+        long next = elapsed > 0 ? (long) (iters * 1.2 * min_ns / elapsed) : iters * 100;
+        iters = next > iters * 100 ? iters * 100 : next <= iters ? iters + 1 : next;
+    }
+
+    if (b->teardown)
+        b->teardown(b);
+
+    printf("%s\n    { \"name\": \"%s\", \"iterations\": %ld, "
+           "\"ns_per_op\": %.2f, \"allocs_per_op\": %.3f }",
+           first_result ? "" : ",", b->name, iters,
+           (double) elapsed / iters, (double) allocs / iters);
+    first_result = false;
+    fflush(stdout);
+}
+
+static char *
+read_file(const char *name, size_t *len)
+{
+    FILE *f = fopen(name, "r");
+    if (f == NULL)
+        die(name);
+    buffer_t buf;
+    buffer_init(&buf, 4096);
+    size_t n;
+    while ((n = fread(buffer_ensure_capacity(&buf, 4096), 1, 4096, f)) > 0)
+        buf.len += n;
+    fclose(f);
+    *len = buf.len;
+    return buf.buf;
+}
+
+int
+main(int ac, char *av[])
+{
+    const char *filter = NULL;
+    uint64_t min_ns = 200 * 1000000ULL;
+    int opt;
+
+    server_root = ".";
+    silent_mode = true;
+    while ((opt = getopt(ac, av, "f:t:h")) != -1) {
+        switch (opt) {
+        case 'f':
+            filter = optarg;
+            break;
+        case 't':
+            min_ns = atol(optarg) * 1000000ULL;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-f filter] [-t millis] [corpus files...]\n", av[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // token_generate/validate read the key from the environment
+    setenv("SECRET", "microbench-secret", 0);
+    mime_init("/etc/mime.types");
+
+    struct utsname uts;
+    uname(&uts);
+    printf("{\n  \"host\": \"%s\",\n  \"timestamp\": %ld,\n  \"benchmarks\": [",
+           uts.nodename, (long) time(NULL));
+
+    int nbench = sizeof benchmarks / sizeof benchmarks[0];
+    for (int i = 0; i < nbench; i++)
+        if (filter == NULL || strstr(benchmarks[i].name, filter))
+            run_benchmark(&benchmarks[i], min_ns);
+
+    for (int i = optind; i < ac; i++) {
+        char name[256];
+        char *path = strdup(av[i]);
+        snprintf(name, sizeof name, "parse_request/%s", basename(path));
+        free(path);
+        if (filter != NULL && !strstr(name, filter))
+            continue;
+
+        struct bench b = {
+            .name = name,
+            .setup = setup_socketpair,
+            .run = bench_parse_request,
+            .teardown = teardown_socketpair,
+        };
+        b.data = read_file(av[i], &b.datalen);
+        run_benchmark(&b, min_ns);
+        free((void *) b.data);
+    }
+    printf("\n  ]\n}\n");
+    return 0;
+}
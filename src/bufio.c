@@ -7,14 +7,28 @@
  * Since it encapsulates a connection's socket, it also provides 
  * methods for sending data.
  *
+ * The socket may be non-blocking: an operation that would block waits
+ * for the socket with scheduler_wait_fd(), which yields to the scheduler
+ * when called from a coroutine.
+ *
+ * The rate at which data is sent can be limited with bufio_set_pacing().
+ *
+ * The receive buffer is taken from a bufpool only once data arrives,
+ * so a connection that is idle before its request holds none.
+ *
  * Written by G. Back for CS 3214 Spring 2018
  */
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/sendfile.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -22,34 +36,59 @@
 #include <assert.h>
 
 #include "bufio.h"
+#include "bufpool.h"
+#include "scheduler.h"
+#include "slab.h"
+#include "timing.h"
 
 /*****************************************************************/
 struct bufio {
     int socket;         // underlying socket file descriptor
     size_t bufpos;      // offset of next byte to be read
     buffer_t buf;       // holds data that was received
+    size_t sent;        // bytes sent so far
+    uint64_t pace_rate; // user space pacing in bytes per second, 0 = off
+    int64_t pace_tokens;    // bytes that may be sent now
+    uint64_t pace_last;     // when pace_tokens was last topped up
 };
 
-static const int BUFSIZE = 8192;
 static const int READSIZE = 2048;
 static int min(int a, int b) { return a < b ? a : b; }
 
+static struct slab bufio_slab;
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+
+static void
+init_slab(void)
+{
+    slab_init(&bufio_slab, "bufio", sizeof(struct bufio));
+}
+
 /* Create a new bufio object from a socket. */
 struct bufio *
 bufio_create(int socket)
 {
-    struct bufio * rc = malloc(sizeof(*rc));
-    if (rc == NULL) {
-        perror("malloc");
-        exit(EXIT_FAILURE);
-    }
-
+    pthread_once(&slab_once, init_slab);
+    struct bufio * rc = slab_alloc(&bufio_slab);
     rc->bufpos = 0;
+    rc->sent = 0;
+    rc->pace_rate = 0;
     rc->socket = socket;
-    buffer_init(&rc->buf, BUFSIZE);
+    rc->buf = (buffer_t) { NULL, 0, 0 };
     return rc;
 }
 
+/* Give back a receive buffer, unless it outgrew the pool's size. */
+static void
+release_buffer(buffer_t *buf)
+{
+    if (buf->cap == BUFPOOL_BUFSIZE)
+        bufpool_put(buf->buf);
+    else
+        free(buf->buf);
+    *buf = (buffer_t) { NULL, 0, 0 };
+}
+
 /* Close a bufio object, freeing its storage and closing its socket. */
 void
 bufio_close(struct bufio * self)
@@ -57,8 +96,75 @@ bufio_close(struct bufio * self)
     if (close(self->socket))
         perror("close");
 
-    buffer_delete(&self->buf);
-    free(self);
+    release_buffer(&self->buf);
+    slab_free(&bufio_slab, self);
+}
+
+/* The token bucket holds at most 1/PACE_HZ seconds' worth of bytes,
+ * and at least PACE_MIN_BURST. */
+#define PACE_HZ 100
+#define PACE_MIN_BURST 16384
+
+static int64_t
+pace_burst(uint64_t rate)
+{
+    return rate / PACE_HZ > PACE_MIN_BURST ? rate / PACE_HZ : PACE_MIN_BURST;
+}
+
+/*
+ * Limit the rate at which data is sent to rate bytes per second, or
+ * lift the limit if rate is 0.  On a TCP socket, the kernel paces its
+ * packets (SO_MAX_PACING_RATE, most precisely with the fq qdisc).
+ * Otherwise, sends are held back by a token bucket in user space.
+ */
+void
+bufio_set_pacing(struct bufio *self, uint64_t rate)
+{
+    int protocol;
+    socklen_t len = sizeof protocol;
+    self->pace_rate = 0;
+    if (getsockopt(self->socket, SOL_SOCKET, SO_PROTOCOL, &protocol, &len) == 0
+        && protocol == IPPROTO_TCP) {
+        unsigned kernel_rate = rate == 0 || rate > UINT_MAX ? UINT_MAX : rate;
+        if (setsockopt(self->socket, SOL_SOCKET, SO_MAX_PACING_RATE,
+                       &kernel_rate, sizeof kernel_rate) == 0)
+            return;
+    }
+    self->pace_rate = rate;
+    self->pace_tokens = pace_burst(rate);
+    self->pace_last = timing_now();
+}
+
+/* Wait until user space pacing lets some of len bytes be sent,
+ * and return how many. */
+static size_t
+pace(struct bufio *self, size_t len)
+{
+    if (self->pace_rate == 0)
+        return len;
+    int64_t burst = pace_burst(self->pace_rate);
+    int64_t want = (int64_t) len < burst ? (int64_t) len : burst;
+    for (;;) {
+        uint64_t now = timing_now();
+        uint64_t elapsed = now - self->pace_last;
+        if (elapsed > 1000000000)
+            elapsed = 1000000000;
+        self->pace_tokens += elapsed * self->pace_rate / 1000000000;
+        self->pace_last = now;
+        if (self->pace_tokens > burst)
+            self->pace_tokens = burst;
+        if (self->pace_tokens >= want)
+            return (int64_t) len < self->pace_tokens ? len : self->pace_tokens;
+        scheduler_sleep((want - self->pace_tokens) * 1000000000 / self->pace_rate);
+    }
+}
+
+/* Account for n bytes sent. */
+static void
+add_sent(struct bufio *self, ssize_t n)
+{
+    self->sent += n;
+    self->pace_tokens -= n;
 }
 
 static ssize_t
@@ -81,23 +187,89 @@ void bufio_truncate(struct bufio * self)
     if (self->buf.len > TRUNCATE_THRESHOLD) {
         int unread = bytes_buffered(self);
         assert(unread >= 0);
-        if (unread == 0) {
-            buffer_reset(&self->buf, BUFSIZE);
-        } else {
-            buffer_t oldbuf = self->buf; 
-            buffer_init(&self->buf, BUFSIZE);
-            buffer_append(&self->buf, oldbuf.buf + self->bufpos, unread);
-            buffer_delete(&oldbuf);
-        }
+        buffer_t oldbuf = self->buf; 
+        self->buf = (buffer_t) { bufpool_get(), 0, BUFPOOL_BUFSIZE };
+        buffer_append(&self->buf, oldbuf.buf + self->bufpos, unread);
+        release_buffer(&oldbuf);
         self->bufpos = 0;
     }
 }
 
+/* Return the current read position, for use with bufio_discard_since. */
+size_t
+bufio_mark(struct bufio *self)
+{
+    return self->bufpos;
+}
+
+/*
+ * Discard the data read since mark was taken, keeping the data read
+ * before it and any data buffered but not yet read.  Offsets past
+ * mark become invalid.
+ *
+ * This keeps the buffer from growing when reading framing, such as
+ * chunk headers, around data that is passed on with bufio_splice.
+ */
+void
+bufio_discard_since(struct bufio *self, size_t mark)
+{
+    size_t unread = bytes_buffered(self);
+    if (unread > 0)
+        memmove(self->buf.buf + mark, self->buf.buf + self->bufpos, unread);
+    self->buf.len = mark + unread;
+    self->bufpos = mark;
+}
+
+/*
+ * Return errno.  Functions that may wait for the socket read errno
+ * only through this, because the address of errno they computed
+ * before waiting is stale if the coroutine moved to another thread.
+ */
+static int
+last_error(void)
+{
+    __asm__ volatile("" ::: "memory");     // see coro_current()
+    return errno;
+}
+
+/*
+ * Called after an operation on the socket returned rc.  Returns true
+ * if it should be retried, waiting for the socket to become ready
+ * for events first if it would have blocked.
+ */
+static bool
+retry(struct bufio *self, ssize_t rc, int events)
+{
+    if (rc != -1)
+        return false;
+    int err = last_error();
+    if (err == EINTR)
+        return true;
+    if (err != EAGAIN && err != EWOULDBLOCK)
+        return false;
+    return scheduler_wait_fd(self->socket, events);
+}
+
 static ssize_t
 read_more(struct bufio *self)
 {
+    if (self->buf.buf == NULL) {
+        // wait for data before taking a buffer
+        char c;
+        ssize_t rc;
+        do {
+            rc = recv(self->socket, &c, 1, MSG_PEEK | MSG_NOSIGNAL);
+        } while (retry(self, rc, SCHEDULER_READABLE));
+        if (rc < 1)
+            return rc;
+        self->buf = (buffer_t) { bufpool_get(), 0, BUFPOOL_BUFSIZE };
+    }
+
     char * buf = buffer_ensure_capacity(&self->buf, READSIZE);
-    int bread = recv(self->socket, buf, READSIZE, MSG_NOSIGNAL);
+    int bread;
+    do {
+        bread = recv(self->socket, buf, READSIZE, MSG_NOSIGNAL);
+    } while (retry(self, bread, SCHEDULER_READABLE));
     if (bread < 1)
         return bread;
 
@@ -199,7 +371,14 @@ bufio_read(struct bufio *self, size_t count, size_t *buf_offset)
 ssize_t
 bufio_sendfile(struct bufio *self, int fd, off_t *off, size_t filesize)
 {
-    return sendfile(self->socket, fd, off, filesize);
+    ssize_t rc;
+    filesize = pace(self, filesize);
+    do {
+        rc = sendfile(self->socket, fd, off, filesize);
+    } while (retry(self, rc, SCHEDULER_WRITABLE));
+    if (rc > 0)
+        add_sent(self, rc);
+    return rc;
 }
 
 /*
@@ -209,7 +388,13 @@ bufio_sendfile(struct bufio *self, int fd, off_t *off, size_t filesize)
 ssize_t 
 bufio_sendbuffer(struct bufio *self, buffer_t *resp)
 {
-    return send(self->socket, resp->buf, resp->len, MSG_NOSIGNAL);
+    ssize_t rc;
+    do {
+        rc = send(self->socket, resp->buf, resp->len, MSG_NOSIGNAL);
+    } while (retry(self, rc, SCHEDULER_WRITABLE));
+    if (rc > 0)
+        add_sent(self, rc);
+    return rc;
 }
 
 /*
@@ -228,5 +413,205 @@ bufio_sendbuffers(struct bufio *self, buffer_t **resp, size_t n)
         .msg_iov = vecs,
         .msg_iovlen = n
     };
-    return sendmsg(self->socket, &msg, MSG_NOSIGNAL);
+    ssize_t rc;
+    do {
+        rc = sendmsg(self->socket, &msg, MSG_NOSIGNAL);
+    } while (retry(self, rc, SCHEDULER_WRITABLE));
+    if (rc > 0)
+        add_sent(self, rc);
+    return rc;
+}
+
+/*
+ * Send the contents of a chain to the socket, continuing after
+ * partial writes.  Runs of memory links are gathered into one
+ * sendmsg; file regions are sent with sendfile.  Data followed by
+ * a file region is sent with MSG_MORE so that it can share packets
+ * with the file's first bytes.  With user space pacing, each send is
+ * limited to what the token bucket allows.
+ * Returns the number of bytes sent, or -1 on error.
+ */
+ssize_t
+bufio_sendchain(struct bufio *self, struct chain *c)
+{
+    struct chain_link *l = c->head;
+    size_t skip = 0;        // bytes of l already sent
+    ssize_t total = 0;
+    while (l != NULL) {
+        ssize_t rc;
+        if (l->kind == CHAIN_FILE) {
+            off_t off = l->off + skip;
+            rc = sendfile(self->socket, l->fd, &off, pace(self, l->len - skip));
+        } else {
+            struct iovec iov[64];
+            int n = 0;
+            size_t len = 0;
+            struct chain_link *m = l;
+            for (size_t s = skip; m != NULL && m->kind != CHAIN_FILE && n < 64; m = m->next, s = 0) {
+                iov[n].iov_base = m->data + s;
+                iov[n].iov_len = m->len - s;
+                len += iov[n++].iov_len;
+            }
+            size_t allowed = pace(self, len);
+            if (allowed < len) {
+                // trim the vector to the allowed length
+                for (n = 0, len = 0; len + iov[n].iov_len < allowed; n++)
+                    len += iov[n].iov_len;
+                iov[n].iov_len = allowed - len;
+                n++;
+                m = l;      // more data follows
+            }
+            struct msghdr msg = {
+                .msg_iov = iov,
+                .msg_iovlen = n
+            };
+            rc = sendmsg(self->socket, &msg, MSG_NOSIGNAL | (m != NULL ? MSG_MORE : 0));
+        }
+        if (retry(self, rc, SCHEDULER_WRITABLE))
+            continue;
+        if (rc <= 0)
+            return -1;
+        add_sent(self, rc);
+        total += rc;
+
+        // advance past what was sent
+        skip += rc;
+        while (l != NULL && skip >= l->len) {
+            skip -= l->len;
+            l = l->next;
+        }
+    }
+    return total;
+}
+
+#define SPLICE_CHUNK (1 << 20)
+
+static bool
+write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t rc = write(fd, data, len);
+        if (rc == -1 && last_error() == EINTR)
+            continue;
+        if (rc <= 0)
+            return false;
+        data += rc;
+        len -= rc;
+    }
+    return true;
+}
+
+/* Copy from the socket to fd through a user space buffer, for
+ * files that do not support splice. */
+static off_t
+copy_to_file(struct bufio *self, int fd, off_t count)
+{
+    char buf[65536];
+    off_t done = 0;
+    while (done < count) {
+        size_t want = count - done < sizeof buf ? count - done : sizeof buf;
+        ssize_t rc = recv(self->socket, buf, want, MSG_NOSIGNAL);
+        if (retry(self, rc, SCHEDULER_READABLE))
+            continue;
+        if (rc == -1)
+            return -1;
+        if (rc == 0)
+            break;
+        if (!write_all(fd, buf, rc))
+            return -1;
+        done += rc;
+    }
+    return done;
+}
+
+/* Move len bytes that are in the pipe to fd through a user space
+ * buffer, for files that splice cannot write to. */
+static ssize_t
+drain_pipe(int pipefd, int fd, size_t len)
+{
+    char buf[65536];
+    size_t done = 0;
+    while (done < len) {
+        size_t want = len - done < sizeof buf ? len - done : sizeof buf;
+        ssize_t rc = read(pipefd, buf, want);
+        if (rc == -1 && last_error() == EINTR)
+            continue;
+        if (rc <= 0 || !write_all(fd, buf, rc))
+            return -1;
+        done += rc;
+    }
+    return done;
+}
+
+/*
+ * Read the next count bytes of input into the file fd.  Data that
+ * is already buffered is written out first; the rest is moved from
+ * the socket into the file with splice(2) through a pipe, so it is
+ * never copied into user space.  If the socket cannot be spliced
+ * from, the data is copied with recv and write instead; if the file
+ * cannot be spliced to, the pipe is drained with read and write.
+ * Returns the number of bytes stored, which is less than count if
+ * the client closed the connection early, or -1 on error.
+ */
+off_t
+bufio_splice(struct bufio *self, int fd, off_t count)
+{
+    off_t done = bytes_buffered(self) < count ? bytes_buffered(self) : count;
+    if (!write_all(fd, self->buf.buf + self->bufpos, done))
+        return -1;
+    self->bufpos += done;
+    if (done == count)
+        return done;
+
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) == -1)
+        return -1;
+    fcntl(pipefd[1], F_SETPIPE_SZ, SPLICE_CHUNK);   // may fail, which is fine
+
+    bool error = false, spliced = false, drain = false;
+    while (!error && done < count) {
+        size_t want = count - done < SPLICE_CHUNK ? count - done : SPLICE_CHUNK;
+        ssize_t in = splice(self->socket, NULL, pipefd[1], NULL, want,
+                            SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in == -1 && !spliced && last_error() == EINVAL) {
+            off_t rc = copy_to_file(self, fd, count - done);
+            error = rc == -1;
+            done += error ? 0 : rc;
+            break;
+        }
+        if (retry(self, in, SCHEDULER_READABLE))
+            continue;
+        if (in <= 0) {
+            error = in == -1;
+            break;
+        }
+        spliced = true;
+        while (in > 0) {
+            ssize_t out = -1;
+            if (!drain) {
+                out = splice(pipefd[0], NULL, fd, NULL, in, SPLICE_F_MOVE);
+                if (out == -1 && last_error() == EINTR)
+                    continue;
+                drain = out == -1 && last_error() == EINVAL;
+            }
+            if (drain)
+                out = drain_pipe(pipefd[0], fd, in);
+            if (out <= 0) {
+                error = true;
+                break;
+            }
+            in -= out;
+            done += out;
+        }
+    }
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return error ? -1 : done;
+}
+
+/* Return the number of bytes sent on this connection so far. */
+size_t
+bufio_bytes_sent(struct bufio *self)
+{
+    return self->sent;
 }
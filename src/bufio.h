@@ -1,7 +1,10 @@
 #ifndef _BUFIO_H
 #define _BUFIO_H
 
+#include <stdint.h>
+
 #include "buffer.h"
+#include "chain.h"
 
 struct bufio;   // opaque type
                 // users should interact only via the public functions below
@@ -13,8 +16,14 @@ ssize_t bufio_readline(struct bufio *self, size_t *line_offset);
 ssize_t bufio_read(struct bufio *self, size_t count, size_t *buf_offset);
 char * bufio_offset2ptr(struct bufio *self, size_t offset);
 size_t bufio_ptr2offset(struct bufio *self, char *ptr);
+size_t bufio_mark(struct bufio *self);
+void bufio_discard_since(struct bufio *self, size_t mark);
+off_t bufio_splice(struct bufio *self, int fd, off_t count);
 ssize_t bufio_sendfile(struct bufio *self, int fd, off_t *off, size_t filesize);
 ssize_t bufio_sendbuffer(struct bufio *self, buffer_t *response);
 ssize_t bufio_sendbuffers(struct bufio *self, buffer_t **responses, size_t n);
+ssize_t bufio_sendchain(struct bufio *self, struct chain *c);
+size_t bufio_bytes_sent(struct bufio *self);
+void bufio_set_pacing(struct bufio *self, uint64_t rate);
 
 #endif /* _BUFIO_H */
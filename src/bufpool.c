@@ -0,0 +1,95 @@
+/*
+ * Receive buffer pools.
+ *
+ * Each pool is a stack of free buffers under a mutex, which is rarely
+ * contended since threads only use the pool of the CPU they run on.
+ * A thread may migrate between looking up its CPU and locking the
+ * pool, which is harmless.  A pool keeps at most POOL_MAX buffers;
+ * buffers beyond that are freed, and an empty pool allocates new ones.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bufpool.h"
+#include "stats.h"
+
+#define NPOOLS 64                   // CPUs beyond this share pools
+#define POOL_MAX 256
+
+struct pool {
+    pthread_mutex_t lock;
+    int count;
+    void *free[POOL_MAX];
+} __attribute__((aligned(64)));
+
+static struct pool pools[NPOOLS] = {
+    [0 ... NPOOLS - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+static atomic_ulong gets, allocated;
+
+static struct pool *
+local_pool(void)
+{
+    int cpu = sched_getcpu();
+    return &pools[cpu < 0 ? 0 : cpu % NPOOLS];
+}
+
+/* Take a buffer of BUFPOOL_BUFSIZE bytes. */
+void *
+bufpool_get(void)
+{
+    struct pool *p = local_pool();
+    void *buf = NULL;
+    pthread_mutex_lock(&p->lock);
+    if (p->count > 0)
+        buf = p->free[--p->count];
+    pthread_mutex_unlock(&p->lock);
+    atomic_fetch_add_explicit(&gets, 1, memory_order_relaxed);
+    if (buf != NULL)
+        return buf;
+
+    atomic_fetch_add_explicit(&allocated, 1, memory_order_relaxed);
+    buf = malloc(BUFPOOL_BUFSIZE);
+    if (buf == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    return buf;
+}
+
+/* Put back a buffer obtained from bufpool_get(). */
+void
+bufpool_put(void *buf)
+{
+    struct pool *p = local_pool();
+    pthread_mutex_lock(&p->lock);
+    if (p->count < POOL_MAX) {
+        p->free[p->count++] = buf;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&p->lock);
+    free(buf);
+}
+
+static void
+bufpool_report(FILE *out)
+{
+    int pooled = 0;
+    for (int i = 0; i < NPOOLS; i++) {
+        pthread_mutex_lock(&pools[i].lock);
+        pooled += pools[i].count;
+        pthread_mutex_unlock(&pools[i].lock);
+    }
+    fprintf(out, "buffers taken: %lu, allocated: %lu, pooled: %d of %d bytes\n",
+            atomic_load(&gets), atomic_load(&allocated), pooled, BUFPOOL_BUFSIZE);
+}
+
+void
+bufpool_init(void)
+{
+    stats_register("receive buffers", bufpool_report);
+}
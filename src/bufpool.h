@@ -0,0 +1,19 @@
+#ifndef _BUFPOOL_H
+#define _BUFPOOL_H
+/*
+ * Per-CPU pools of receive buffers.
+ *
+ * A connection takes a buffer when it has data to read and puts it
+ * back when done, so idle connections hold none.  Buffers are taken
+ * from and put back into the pool of the CPU the caller runs on,
+ * which keeps them in that CPU's cache and NUMA node.
+ */
+#include <stddef.h>
+
+#define BUFPOOL_BUFSIZE 8192
+
+void bufpool_init(void);
+void *bufpool_get(void);
+void bufpool_put(void *buf);
+
+#endif /* _BUFPOOL_H */
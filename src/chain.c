@@ -0,0 +1,311 @@
+/*
+ * Chained buffers.
+ *
+ * Segments and reference links are recycled through process-wide
+ * pools, so a request that builds a body of a few segments does not
+ * touch malloc once the server has warmed up.  Each pool keeps at most
+ * POOL_MAX free links.
+ */
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "chain.h"
+
+#define POOL_MAX 1024
+
+struct link_pool {
+    pthread_mutex_t lock;
+    struct chain_link *free;
+    int nfree;
+    size_t size;            // allocation size of a link
+};
+
+static struct link_pool segment_pool = {
+    PTHREAD_MUTEX_INITIALIZER, NULL, 0, sizeof(struct chain_link) + CHAIN_SEGMENT_SIZE
+};
+static struct link_pool ref_pool = {
+    PTHREAD_MUTEX_INITIALIZER, NULL, 0, sizeof(struct chain_link)
+};
+
+static struct chain_link *
+pool_get(struct link_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    struct chain_link *l = pool->free;
+    if (l != NULL) {
+        pool->free = l->next;
+        pool->nfree--;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (l == NULL) {
+        l = malloc(pool->size);
+        if (l == NULL) {
+            perror("can't alloc memory: ");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return l;
+}
+
+static void
+pool_put(struct link_pool *pool, struct chain_link *l)
+{
+    pthread_mutex_lock(&pool->lock);
+    if (pool->nfree < POOL_MAX) {
+        l->next = pool->free;
+        pool->free = l;
+        pool->nfree++;
+        l = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    free(l);
+}
+
+static void
+link_append(struct chain *c, struct chain_link *l)
+{
+    l->next = NULL;
+    if (c->tail)
+        c->tail->next = l;
+    else
+        c->head = l;
+    c->tail = l;
+    c->len += l->len;
+}
+
+static struct chain_link *
+new_segment(struct chain *c)
+{
+    struct chain_link *l = pool_get(&segment_pool);
+    l->kind = CHAIN_SEGMENT;
+    l->data = (char *) (l + 1);
+    l->len = 0;
+    l->cap = CHAIN_SEGMENT_SIZE;
+    link_append(c, l);
+    return l;
+}
+
+/* Space left in the tail segment. */
+static size_t
+tail_room(struct chain *c)
+{
+    struct chain_link *t = c->tail;
+    return t != NULL && t->kind == CHAIN_SEGMENT ? t->cap - t->len : 0;
+}
+
+void
+chain_init(struct chain *c)
+{
+    c->head = c->tail = NULL;
+    c->len = 0;
+}
+
+/* Free the chain's links.  Referenced memory and files are not
+ * freed or closed. */
+void
+chain_delete(struct chain *c)
+{
+    struct chain_link *l = c->head;
+    while (l != NULL) {
+        struct chain_link *next = l->next;
+        switch (l->kind) {
+        case CHAIN_SEGMENT:
+            pool_put(&segment_pool, l);
+            break;
+        case CHAIN_HEAP:
+            free(l->data);
+            /* fall through */
+        default:
+            pool_put(&ref_pool, l);
+        }
+        l = next;
+    }
+    chain_init(c);
+}
+
+/* Append a copy of mem[0:len]. */
+void
+chain_append(struct chain *c, const void *mem, size_t len)
+{
+    const char *p = mem;
+    struct chain_link *t = c->tail;
+    if (t != NULL && t->kind == CHAIN_SEGMENT && t->cap - t->len >= len) {
+        memcpy(t->data + t->len, p, len);
+        t->len += len;
+        c->len += len;
+        return;
+    }
+    while (len > 0) {
+        size_t room = tail_room(c);
+        if (room == 0) {
+            new_segment(c);
+            room = CHAIN_SEGMENT_SIZE;
+        }
+        size_t n = len < room ? len : room;
+        memcpy(c->tail->data + c->tail->len, p, n);
+        c->tail->len += n;
+        c->len += n;
+        p += n;
+        len -= n;
+    }
+}
+
+/* Return space at the end of the chain to write at least min bytes
+ * into, min being at most CHAIN_SEGMENT_SIZE, and store how many bytes
+ * there is room for in *room.  The bytes are added by chain_commit(). */
+char *
+chain_reserve(struct chain *c, size_t min, size_t *room)
+{
+    if (tail_room(c) < min)
+        new_segment(c);
+    *room = c->tail->cap - c->tail->len;
+    return c->tail->data + c->tail->len;
+}
+
+/* Append a copy of the zero-terminated string str. */
+void
+chain_appends(struct chain *c, const char *str)
+{
+    chain_append(c, str, strlen(str));
+}
+
+void
+chain_vprintf(struct chain *c, const char *fmt, va_list ap)
+{
+    va_list ap2;
+    va_copy(ap2, ap);
+    size_t room = tail_room(c);
+    char *dst = room > 0 ? c->tail->data + c->tail->len : NULL;
+    int n = vsnprintf(dst, room, fmt, ap);
+    if (n <= 0)
+        goto out;
+
+    if (n < room) {
+        c->tail->len += n;
+        c->len += n;
+    } else if (n < CHAIN_SEGMENT_SIZE) {
+        struct chain_link *l = new_segment(c);
+        vsnprintf(l->data, CHAIN_SEGMENT_SIZE, fmt, ap2);
+        l->len = n;
+        c->len += n;
+    } else {
+        char *tmp = malloc(n + 1);
+        if (tmp == NULL) {
+            perror("can't alloc memory: ");
+            exit(EXIT_FAILURE);
+        }
+        vsnprintf(tmp, n + 1, fmt, ap2);
+        chain_append(c, tmp, n);
+        free(tmp);
+    }
+out:
+    va_end(ap2);
+}
+
+/* Append formatted output, like printf. */
+void
+chain_printf(struct chain *c, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    chain_vprintf(c, fmt, ap);
+    va_end(ap);
+}
+
+/* Append a reference to mem[0:len] without copying it.
+ * The memory must remain valid until the chain is sent. */
+void
+chain_append_ref(struct chain *c, const void *mem, size_t len)
+{
+    if (len == 0)
+        return;
+    struct chain_link *l = pool_get(&ref_pool);
+    l->kind = CHAIN_REF;
+    l->data = (char *) mem;
+    l->len = len;
+    link_append(c, l);
+}
+
+/* Append len bytes of the file open as fd, starting at offset off.
+ * The file must remain open until the chain is sent. */
+void
+chain_append_file(struct chain *c, int fd, off_t off, size_t len)
+{
+    if (len == 0)
+        return;
+    struct chain_link *l = pool_get(&ref_pool);
+    l->kind = CHAIN_FILE;
+    l->data = NULL;
+    l->fd = fd;
+    l->off = off;
+    l->len = len;
+    link_append(c, l);
+}
+
+/* Move all links of src to the end of dst, leaving src empty. */
+void
+chain_concat(struct chain *dst, struct chain *src)
+{
+    if (src->head == NULL)
+        return;
+    if (dst->tail)
+        dst->tail->next = src->head;
+    else
+        dst->head = src->head;
+    dst->tail = src->tail;
+    dst->len += src->len;
+    chain_init(src);
+}
+
+/*
+ * Provide a buffer_t view of the chain's contents for code that
+ * needs them contiguous.  A chain of more than one link is first
+ * coalesced into a single link.  The view is valid until the chain
+ * is modified and must not be buffer_delete'd.  Since referenced
+ * memory is copied, a chain that refers to a file mapping must not be
+ * viewed, see filecache.h.  Returns false if the contents do not fit
+ * a buffer_t, or a file region cannot be read.
+ */
+bool
+chain_view(struct chain *c, buffer_t *view)
+{
+    if (c->len > INT_MAX)
+        return false;
+
+    if (c->head != c->tail || (c->head != NULL && c->head->kind == CHAIN_FILE)) {
+        char *data = malloc(c->len + 1);
+        if (data == NULL) {
+            perror("can't alloc memory: ");
+            exit(EXIT_FAILURE);
+        }
+        size_t off = 0;
+        for (struct chain_link *l = c->head; l != NULL; l = l->next) {
+            if (l->kind == CHAIN_FILE) {
+                if (pread(l->fd, data + off, l->len, l->off) != l->len) {
+                    free(data);
+                    return false;
+                }
+            } else {
+                memcpy(data + off, l->data, l->len);
+            }
+            off += l->len;
+        }
+        size_t len = c->len;
+        chain_delete(c);
+        struct chain_link *l = pool_get(&ref_pool);
+        l->kind = CHAIN_HEAP;
+        l->data = data;
+        l->len = len;
+        link_append(c, l);
+    }
+
+    view->buf = c->head ? c->head->data : NULL;
+    view->len = c->len;
+    view->cap = c->len;
+    return true;
+}
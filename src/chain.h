@@ -0,0 +1,66 @@
+#ifndef _CHAIN_H
+#define _CHAIN_H
+/*
+ * A buffer made of a chain of links, for response bodies.
+ *
+ * Unlike buffer_t, a chain never moves data once appended: copied
+ * data goes into fixed-size segments taken from a pool, and a chain
+ * can refer to memory owned by someone else, or to a region of a
+ * file, without copying.  A chain is sent with bufio_sendchain().
+ *
+ * Like buffer_t, a chain is not thread-safe and handles out-of-memory
+ * situations by exiting the process.
+ */
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "buffer.h"
+
+#define CHAIN_SEGMENT_SIZE 4096
+
+enum chain_link_kind {
+    CHAIN_SEGMENT,      // pooled segment owned by the chain
+    CHAIN_HEAP,         // malloc'ed memory owned by the chain
+    CHAIN_REF,          // memory owned by someone else
+    CHAIN_FILE          // region of a file
+};
+
+struct chain_link {
+    struct chain_link *next;
+    enum chain_link_kind kind;
+    char *data;         // memory links
+    size_t len;
+    size_t cap;         // CHAIN_SEGMENT only
+    int fd;             // CHAIN_FILE only
+    off_t off;
+};
+
+struct chain {
+    struct chain_link *head, *tail;
+    size_t len;         // total bytes
+};
+
+void chain_init(struct chain *c);
+void chain_delete(struct chain *c);
+void chain_append(struct chain *c, const void *mem, size_t len);
+void chain_appends(struct chain *c, const char *str);
+void chain_printf(struct chain *c, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+void chain_vprintf(struct chain *c, const char *fmt, va_list ap);
+char *chain_reserve(struct chain *c, size_t min, size_t *room);
+void chain_append_ref(struct chain *c, const void *mem, size_t len);
+void chain_append_file(struct chain *c, int fd, off_t off, size_t len);
+void chain_concat(struct chain *dst, struct chain *src);
+bool chain_view(struct chain *c, buffer_t *view);
+
+/* Add len bytes written into the space returned by chain_reserve(). */
+static inline void
+chain_commit(struct chain *c, size_t len)
+{
+    c->tail->len += len;
+    c->len += len;
+}
+
+#endif /* _CHAIN_H */
@@ -0,0 +1,88 @@
+/*
+ * The server's settings, with their defaults.  main() sets them from the
+ * command line; they are kept apart from main.c so that the
+ * microbenchmarks link against the same definitions.
+ */
+#include <stddef.h>
+#include "main.h"
+
+/* Implement HTML5 fallback.
+ * If HTML5 fallback is implemented and activated, the server should
+ * treat requests to non-API paths specially.
+ * If the requested file is not found, the server will serve /index.html
+ * instead; that is, it should treat the request as if it
+ * had been for /index.html instead.
+ */
+bool html5_fallback = false;
+
+// silent_mode. During benchmarking, this will be true
+bool silent_mode = false;
+
+// default token expiration time is 1 day
+int token_expiration_time = 24 * 60 * 60;
+
+// root from which static files are served
+char *server_root;
+
+// access log destination, "-" for stderr; defaults to stderr unless -s
+char *access_log_path = NULL;
+
+// number of slowest requests to retain with their phase breakdown, 0 = off
+int slowest_requests = 0;
+
+// UNIX domain socket to accept connections on, in addition to or
+// instead of the TCP port; NULL = none
+char *unix_socket_path = NULL;
+
+// TCP Fast Open queue length, 0 = disabled
+int tcp_fastopen_qlen = 0;
+
+// index server_root at startup instead of resolving paths per request
+bool index_server_root = false;
+
+// files up to this size (in KB) are sent from cached mappings with sendmsg,
+// larger ones with sendfile; 0 = always use sendfile
+int mmap_max_kb = 256;
+
+// total size (in MB) of the file mappings kept cached
+int mmap_cache_mb = 64;
+
+// CPUs to run connection threads on, e.g. "0-3,8"; NULL = no pinning
+char *cpu_list = NULL;
+
+// after a handoff, seconds to wait for open connections before exiting
+int drain_timeout = 60;
+
+// file in which revoked tokens are kept across restarts; NULL = memory only
+char *revocation_file = NULL;
+
+// serve MP4 files with the moov box ahead of the media data
+bool mp4_faststart = false;
+
+// prefetch up to this many KB ahead of files sent with sendfile; 0 = off
+int readahead_kb = 4096;
+
+// drop downloads from the page cache behind them once a stream of a file
+// no one else reads has sent this many MB; 0 = never
+int uncached_mb = 0;
+
+// cap on the rate at which each connection is sent data, in KB/s; 0 = none
+int pacing_kb = 0;
+
+// send MP4 video at most at this multiple of its bitrate; 0 = no cap
+double video_pacing = 0;
+
+// token signature algorithm, HS256 (with SECRET), RS256 or ES256
+char *token_algorithm = "HS256";
+
+// PEM key for RS256 and ES256 tokens
+char *token_key_file = NULL;
+
+// threads for slow private-key operations, 0 = one per CPU
+int offload_threads = 0;
+
+// serve connections as coroutines on this many threads, 0 = thread per connection
+int coroutine_threads = 0;
+
+// worker processes to fork, each serving as a single process would; 0 = none
+int prefork_workers = 0;
@@ -0,0 +1,245 @@
+/*
+ * Stackful coroutines.
+ *
+ * Each coroutine's stack is an anonymous mapping of CORO_STACK_SIZE
+ * bytes whose lowest page is made inaccessible as a guard.  The struct
+ * coro itself lives at the top of the mapping, above the stack.  Pages
+ * are only committed when touched, so a coroutine that runs shallow
+ * code costs a few pages, not the whole mapping.  Finished coroutines'
+ * stacks are kept in a pool of at most POOL_MAX for reuse.
+ *
+ * On x86-64, switching saves the callee-saved registers on the current
+ * stack and swaps stack pointers, which takes a few nanoseconds.  Other
+ * architectures use swapcontext(3), which also saves the signal mask
+ * with a system call.
+ */
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "coro.h"
+#include "stats.h"
+
+#if !defined(__x86_64__)
+#define CORO_UCONTEXT
+#endif
+
+#ifdef CORO_UCONTEXT
+#include <ucontext.h>
+#endif
+
+#define POOL_MAX 1024
+
+struct coro {
+    struct coro *next;          // pool link
+    char *base;                 // start of the mapping
+#ifdef CORO_UCONTEXT
+    ucontext_t ctx, caller;
+#else
+    void *sp, *caller_sp;       // saved stack pointers
+#endif
+    coro_fn fn;
+    void *arg;
+    bool finished;
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct coro *pool;
+static int npooled;
+static atomic_long nmapped, nlive;
+static pthread_once_t report_once = PTHREAD_ONCE_INIT;
+
+static __thread struct coro *current;
+
+#ifndef CORO_UCONTEXT
+/*
+ * Save the callee-saved registers on the current stack, store the stack
+ * pointer in *save, then load the stack pointer load and restore the
+ * registers saved there.  Returns to whoever last saved into load.
+ */
+void coro_switch_context(void **save, void *load) __attribute__((visibility("hidden")));
+__asm__(
+    ".text\n"
+    ".p2align 4\n"
+    ".globl coro_switch_context\n"
+    ".hidden coro_switch_context\n"
+    ".type coro_switch_context, @function\n"
+    "coro_switch_context:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size coro_switch_context, .-coro_switch_context\n");
+#endif
+
+static void
+coro_report(FILE *out)
+{
+    pthread_mutex_lock(&pool_lock);
+    int pooled = npooled;
+    pthread_mutex_unlock(&pool_lock);
+    fprintf(out, "live: %ld, stacks mapped: %ld, pooled: %d, stack size: %d KB\n",
+            atomic_load(&nlive), atomic_load(&nmapped), pooled, CORO_STACK_SIZE / 1024);
+}
+
+static void
+register_report(void)
+{
+    stats_register("coroutines", coro_report);
+}
+
+/* The coroutine of the calling thread, or NULL.
+ * The empty asm keeps the compiler from treating this function as
+ * const and reusing its result after the coroutine moved to another
+ * thread. */
+struct coro *
+coro_current(void)
+{
+    __asm__ volatile("" ::: "memory");
+    return current;
+}
+
+static void
+switch_to_caller(struct coro *co)
+{
+#ifdef CORO_UCONTEXT
+    swapcontext(&co->ctx, &co->caller);
+#else
+    coro_switch_context(&co->sp, co->caller_sp);
+#endif
+}
+
+static void
+coro_entry(void)
+{
+    struct coro *co = coro_current();
+    co->fn(co->arg);
+    co->finished = true;
+    switch_to_caller(co);
+    abort();    // a finished coroutine is never resumed
+}
+
+static struct coro *
+new_stack(void)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    char *base = mmap(NULL, CORO_STACK_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    if (mprotect(base, page, PROT_NONE) == -1) {
+        perror("mprotect");
+        exit(EXIT_FAILURE);
+    }
+    uintptr_t top = (uintptr_t) (base + CORO_STACK_SIZE - sizeof(struct coro));
+    struct coro *co = (struct coro *) (top & ~(uintptr_t) 63);
+    co->base = base;
+    atomic_fetch_add(&nmapped, 1);
+    return co;
+}
+
+/* Create a coroutine that will run fn(arg) when first resumed. */
+struct coro *
+coro_create(coro_fn fn, void *arg)
+{
+    pthread_once(&report_once, register_report);
+
+    pthread_mutex_lock(&pool_lock);
+    struct coro *co = pool;
+    if (co != NULL) {
+        pool = co->next;
+        npooled--;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    if (co == NULL)
+        co = new_stack();
+
+    co->fn = fn;
+    co->arg = arg;
+    co->finished = false;
+
+#ifdef CORO_UCONTEXT
+    size_t page = sysconf(_SC_PAGESIZE);
+    getcontext(&co->ctx);
+    co->ctx.uc_stack.ss_sp = co->base + page;
+    co->ctx.uc_stack.ss_size = (char *) co - (co->base + page);
+    co->ctx.uc_link = NULL;
+    makecontext(&co->ctx, coro_entry, 0);
+#else
+    /* Build a frame for coro_switch_context to return into coro_entry
+     * as if it had been called, with the stack aligned as the ABI
+     * requires at function entry. */
+    void **sp = (void **) ((uintptr_t) co & ~(uintptr_t) 15);
+    *--sp = NULL;                   // coro_entry's return address, never used
+    *--sp = (void *) coro_entry;
+    for (int i = 0; i < 6; i++)
+        *--sp = NULL;               // rbp, rbx, r12-r15
+    co->sp = sp;
+#endif
+    atomic_fetch_add(&nlive, 1);
+    return co;
+}
+
+/* Release a coroutine that has finished or was never resumed. */
+void
+coro_destroy(struct coro *co)
+{
+    atomic_fetch_sub(&nlive, 1);
+    pthread_mutex_lock(&pool_lock);
+    if (npooled < POOL_MAX) {
+        co->next = pool;
+        pool = co;
+        npooled++;
+        co = NULL;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    if (co != NULL) {
+        munmap(co->base, CORO_STACK_SIZE);
+        atomic_fetch_sub(&nmapped, 1);
+    }
+}
+
+/* Run co on the calling thread until it yields or finishes. */
+void
+coro_resume(struct coro *co)
+{
+    current = co;
+#ifdef CORO_UCONTEXT
+    swapcontext(&co->caller, &co->ctx);
+#else
+    coro_switch_context(&co->caller_sp, co->sp);
+#endif
+    current = NULL;
+}
+
+/* Return from the coro_resume() that is running the calling coroutine. */
+void
+coro_yield(void)
+{
+    switch_to_caller(coro_current());
+}
+
+bool
+coro_finished(struct coro *co)
+{
+    return co->finished;
+}
@@ -0,0 +1,32 @@
+#ifndef _CORO_H
+#define _CORO_H
+/*
+ * Stackful coroutines.
+ *
+ * A coroutine runs a function on its own stack.  coro_resume() runs
+ * it on the calling thread until it calls coro_yield() or returns.
+ * Stacks are taken from a pool and have a guard page below them, so
+ * that an overflow faults instead of corrupting other memory.
+ *
+ * A coroutine may be resumed on a different thread than the one it
+ * last ran on.  Code running in a coroutine must therefore not keep
+ * the addresses of thread-local variables, such as errno, across a
+ * coro_yield().
+ */
+#include <stdbool.h>
+#include <stddef.h>
+
+#define CORO_STACK_SIZE (256 * 1024)
+
+struct coro;
+
+typedef void (*coro_fn)(void *arg);
+
+struct coro *coro_create(coro_fn fn, void *arg);
+void coro_destroy(struct coro *co);
+void coro_resume(struct coro *co);
+void coro_yield(void);
+bool coro_finished(struct coro *co);
+struct coro *coro_current(void);
+
+#endif /* _CORO_H */
@@ -0,0 +1,123 @@
+/*
+ * Chase-Lev work-stealing deque, with the C11 memory orderings of
+ * Le, Pop, Cohen & Zappa Nardelli, "Correct and Efficient Work-Stealing
+ * for Weak Memory Models", PPoPP 2013.
+ *
+ * When the circular array fills up, the owner replaces it with one of
+ * twice the size.  A thief may still be reading the old array, so old
+ * arrays are kept, chained from the new one, rather than freed.  They
+ * add up to less than the current array.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "deque.h"
+
+#define INITIAL_SIZE 1024
+
+struct deque_array {
+    struct deque_array *prev;   // the array this one replaced
+    long size;                  // a power of 2
+    _Atomic(void *) items[];
+};
+
+static struct deque_array *
+new_array(long size, struct deque_array *prev)
+{
+    struct deque_array *a = malloc(sizeof *a + size * sizeof a->items[0]);
+    if (a == NULL) {
+        perror("can't alloc memory: ");
+        exit(EXIT_FAILURE);
+    }
+    a->prev = prev;
+    a->size = size;
+    return a;
+}
+
+void
+deque_init(struct deque *q)
+{
+    atomic_init(&q->top, 0);
+    atomic_init(&q->bottom, 0);
+    atomic_init(&q->array, new_array(INITIAL_SIZE, NULL));
+}
+
+static struct deque_array *
+grow(struct deque *q, struct deque_array *a, long top, long bottom)
+{
+    struct deque_array *b = new_array(a->size * 2, a);
+    for (long i = top; i < bottom; i++) {
+        void *item = atomic_load_explicit(&a->items[i & (a->size - 1)], memory_order_relaxed);
+        atomic_store_explicit(&b->items[i & (b->size - 1)], item, memory_order_relaxed);
+    }
+    atomic_store_explicit(&q->array, b, memory_order_release);
+    return b;
+}
+
+/* Push item at the bottom.  Owner only. */
+void
+deque_push(struct deque *q, void *item)
+{
+    long b = atomic_load_explicit(&q->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&q->top, memory_order_acquire);
+    struct deque_array *a = atomic_load_explicit(&q->array, memory_order_relaxed);
+    if (b - t > a->size - 1)
+        a = grow(q, a, t, b);
+    atomic_store_explicit(&a->items[b & (a->size - 1)], item, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+}
+
+/* Pop the item at the bottom, or return NULL if empty.  Owner only. */
+void *
+deque_pop(struct deque *q)
+{
+    long b = atomic_load_explicit(&q->bottom, memory_order_relaxed) - 1;
+    struct deque_array *a = atomic_load_explicit(&q->array, memory_order_relaxed);
+    atomic_store_explicit(&q->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long t = atomic_load_explicit(&q->top, memory_order_relaxed);
+
+    void *item = NULL;
+    if (t <= b) {
+        item = atomic_load_explicit(&a->items[b & (a->size - 1)], memory_order_relaxed);
+        if (t == b) {
+            // last item: race against thieves for it
+            if (!atomic_compare_exchange_strong_explicit(&q->top, &t, t + 1,
+                    memory_order_seq_cst, memory_order_relaxed))
+                item = NULL;
+            atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+        }
+    } else {
+        atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+    }
+    return item;
+}
+
+/* Steal the item at the top.  Returns NULL if the deque is empty or
+ * another thread took the item first. */
+void *
+deque_steal(struct deque *q)
+{
+    long t = atomic_load_explicit(&q->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&q->bottom, memory_order_acquire);
+    if (t >= b)
+        return NULL;
+
+    struct deque_array *a = atomic_load_explicit(&q->array, memory_order_acquire);
+    void *item = atomic_load_explicit(&a->items[t & (a->size - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&q->top, &t, t + 1,
+            memory_order_seq_cst, memory_order_relaxed))
+        return NULL;
+    return item;
+}
+
+/* Number of items, which may be out of date by the time it is used. */
+long
+deque_size(struct deque *q)
+{
+    long b = atomic_load_explicit(&q->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&q->top, memory_order_relaxed);
+    return b > t ? b - t : 0;
+}
@@ -0,0 +1,25 @@
+#ifndef _DEQUE_H
+#define _DEQUE_H
+/*
+ * Chase-Lev work-stealing deque.
+ *
+ * The thread that owns a deque pushes and pops items at its bottom
+ * end without locking; any other thread may steal items from its top
+ * end.  The deque grows as needed.  Items must not be NULL.
+ */
+#include <stdatomic.h>
+
+struct deque_array;
+
+struct deque {
+    atomic_long top, bottom;
+    _Atomic(struct deque_array *) array;
+};
+
+void deque_init(struct deque *q);
+void deque_push(struct deque *q, void *item);
+void *deque_pop(struct deque *q);
+void *deque_steal(struct deque *q);
+long deque_size(struct deque *q);
+
+#endif /* _DEQUE_H */
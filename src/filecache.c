@@ -0,0 +1,209 @@
+/*
+ * A cache of read-only file mappings.
+ *
+ * Entries live in a hash table keyed by file identity and on an LRU
+ * list.  When the mapped total exceeds the capacity, unreferenced
+ * entries are unmapped from the cold end of the list.  An entry that is
+ * still being sent from when it is evicted or replaced is removed from
+ * the table immediately and unmapped when its last user puts it.
+ *
+ * A file may be truncated in place while it is being sent.  Touching
+ * the mapping past the new end of the file from user space would raise
+ * SIGBUS, so the server never reads a mapping itself: it hands the
+ * mapped range to sendmsg, where the kernel's copy fails with EFAULT
+ * instead, and the connection is closed with the response cut short.
+ * Files replaced by rename, as uploads are, keep their old inode and
+ * mapping intact until it is no longer used.
+ */
+#include <sys/mman.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "filecache.h"
+#include "stats.h"
+
+#define NBUCKETS 1024
+
+struct cache_entry {
+    struct mapped_file file;        // must be first
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    int refcount;                   // users, plus 1 while in the table
+    struct cache_entry *next;       // hash chain
+    struct cache_entry *lru_prev, *lru_next;
+};
+
+bool filecache_enabled = false;
+
+static size_t max_size;             // largest file to map
+static size_t capacity;             // bytes to keep mapped
+static size_t mapped;
+static struct cache_entry *buckets[NBUCKETS];
+static struct cache_entry lru = { .lru_prev = &lru, .lru_next = &lru };
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t hits, misses, evictions;
+
+static unsigned
+hash(dev_t dev, ino_t ino)
+{
+    return (unsigned) ((ino * 0x9E3779B97F4A7C15ULL) ^ dev) % NBUCKETS;
+}
+
+static void
+lru_unlink(struct cache_entry *e)
+{
+    e->lru_prev->lru_next = e->lru_next;
+    e->lru_next->lru_prev = e->lru_prev;
+}
+
+static void
+lru_push_front(struct cache_entry *e)
+{
+    e->lru_next = lru.lru_next;
+    e->lru_prev = &lru;
+    lru.lru_next->lru_prev = e;
+    lru.lru_next = e;
+}
+
+static void
+release(struct cache_entry *e)
+{
+    if (--e->refcount == 0) {
+        munmap(e->file.addr, e->file.size);
+        mapped -= e->file.size;
+        free(e);
+    }
+}
+
+/* Remove an entry from the table; called with lock held. */
+static void
+remove_entry(struct cache_entry *e)
+{
+    struct cache_entry **pp = &buckets[hash(e->dev, e->ino)];
+    while (*pp != e)
+        pp = &(*pp)->next;
+    *pp = e->next;
+    lru_unlink(e);
+    release(e);
+}
+
+static void
+evict(void)
+{
+    struct cache_entry *e = lru.lru_prev;
+    while (mapped > capacity && e != &lru) {
+        struct cache_entry *prev = e->lru_prev;
+        if (e->refcount == 1) {
+            remove_entry(e);
+            evictions++;
+        }
+        e = prev;
+    }
+}
+
+static void
+filecache_report(FILE *out)
+{
+    pthread_mutex_lock(&lock);
+    fprintf(out, "hits: %lu, misses: %lu, evictions: %lu, mapped: %zu/%zu bytes\n",
+            (unsigned long) hits, (unsigned long) misses,
+            (unsigned long) evictions, mapped, capacity);
+    pthread_mutex_unlock(&lock);
+}
+
+/* Serve files of up to max_file_size bytes from mappings, keeping
+ * up to cache_capacity bytes mapped.
+ */
+void
+filecache_init(size_t max_file_size, size_t cache_capacity)
+{
+    if (max_file_size == 0)
+        return;
+
+    max_size = max_file_size;
+    capacity = cache_capacity;
+    filecache_enabled = true;
+    stats_register("file mapping cache", filecache_report);
+}
+
+/* Should this file be served from a mapping? */
+bool
+filecache_eligible(const struct stat *st)
+{
+    return filecache_enabled && S_ISREG(st->st_mode)
+        && st->st_size > 0 && st->st_size <= max_size;
+}
+
+/* Return a mapping of the file open as fd with attributes st,
+ * or NULL if it cannot be mapped.  The caller must filecache_put()
+ * the mapping when done sending from it.
+ */
+struct mapped_file *
+filecache_get(int fd, const struct stat *st)
+{
+    unsigned h = hash(st->st_dev, st->st_ino);
+    pthread_mutex_lock(&lock);
+    for (struct cache_entry *e = buckets[h]; e != NULL; e = e->next) {
+        if (e->dev != st->st_dev || e->ino != st->st_ino)
+            continue;
+        if (e->file.size == st->st_size
+            && e->mtime.tv_sec == st->st_mtim.tv_sec
+            && e->mtime.tv_nsec == st->st_mtim.tv_nsec) {
+            e->refcount++;
+            lru_unlink(e);
+            lru_push_front(e);
+            hits++;
+            pthread_mutex_unlock(&lock);
+            return &e->file;
+        }
+        remove_entry(e);    // stale
+        break;
+    }
+    misses++;
+    pthread_mutex_unlock(&lock);
+
+    // map outside the lock; MAP_POPULATE prefaults the page cache pages
+    void *addr = mmap(NULL, st->st_size, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+    if (addr == MAP_FAILED)
+        return NULL;
+    madvise(addr, st->st_size, MADV_WILLNEED);
+
+    struct cache_entry *e = calloc(1, sizeof *e);
+    if (e == NULL) {
+        munmap(addr, st->st_size);
+        return NULL;
+    }
+    e->file.addr = addr;
+    e->file.size = st->st_size;
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->mtime = st->st_mtim;
+    e->refcount = 2;        // the table's reference and the caller's
+
+    pthread_mutex_lock(&lock);
+    // another thread may have mapped the same file in the meantime
+    for (struct cache_entry *o = buckets[h]; o != NULL; o = o->next)
+        if (o->dev == e->dev && o->ino == e->ino) {
+            remove_entry(o);
+            break;
+        }
+    e->next = buckets[h];
+    buckets[h] = e;
+    lru_push_front(e);
+    mapped += e->file.size;
+    evict();
+    pthread_mutex_unlock(&lock);
+    return &e->file;
+}
+
+/* Drop a reference obtained from filecache_get(). */
+void
+filecache_put(struct mapped_file *file)
+{
+    pthread_mutex_lock(&lock);
+    release((struct cache_entry *) file);
+    pthread_mutex_unlock(&lock);
+}
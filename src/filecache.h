@@ -0,0 +1,28 @@
+#ifndef _FILECACHE_H
+#define _FILECACHE_H
+/*
+ * A cache of read-only file mappings for serving small and
+ * medium-sized files with sendmsg() instead of sendfile().
+ *
+ * Mappings are keyed by the file's identity (device, inode, size,
+ * and modification time), so a changed file is mapped anew.  Only
+ * pass a mapping to system calls; reading it directly raises SIGBUS
+ * if the file was truncated meanwhile.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+struct mapped_file {
+    void *addr;
+    size_t size;
+};
+
+extern bool filecache_enabled;
+
+void filecache_init(size_t max_file_size, size_t capacity);
+bool filecache_eligible(const struct stat *st);
+struct mapped_file *filecache_get(int fd, const struct stat *st);
+void filecache_put(struct mapped_file *file);
+
+#endif /* _FILECACHE_H */
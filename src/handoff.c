@@ -0,0 +1,247 @@
+/*
+ * Listening-socket handoff for zero-downtime restarts.
+ *
+ * SIGUSR2 is blocked in every thread and handled by a dedicated
+ * thread via sigwait(), like SIGUSR1 in stats.c.  On SIGUSR2, that
+ * thread spawns argv[0] with the original arguments, passing one end
+ * of a socketpair whose descriptor number is in HANDOFF_ENV.  It sends
+ * the listening sockets over the socketpair as SCM_RIGHTS and waits for
+ * the new instance to report that it is about to accept.  Only then is
+ * the accept loop woken to stop accepting, so the listening sockets are
+ * served throughout and no connection is refused.  If the new instance
+ * fails to start, the old one keeps serving.
+ */
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "handoff.h"
+
+#define HANDOFF_ENV "PSERVER_HANDOFF_FD"
+#define MAX_LISTENERS 16
+#define READY_TIMEOUT_MS 60000
+#define READY 'R'
+
+extern char **environ;
+
+static char **saved_argv;
+static sigset_t handoff_signals;
+static int predecessor = -1;    // channel to the instance we replace
+static int listeners[MAX_LISTENERS];
+static int nlisteners;
+static int wake_pipe[2];
+
+/* Block SIGUSR2.  Like stats_start(), this must be called before
+ * any other thread is created. */
+void
+handoff_init(char *argv[])
+{
+    saved_argv = argv;
+    sigemptyset(&handoff_signals);
+    sigaddset(&handoff_signals, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &handoff_signals, NULL);
+}
+
+/*
+ * If this instance was started by a handoff, receive the listening
+ * sockets of the old instance into fds[].  Returns their number, 0 if
+ * this instance was not started by a handoff, or -1 on error.
+ */
+int
+handoff_inherit(int *fds, int max)
+{
+    const char *env = getenv(HANDOFF_ENV);
+    if (env == NULL)
+        return 0;
+    int chan = atoi(env);
+    unsetenv(HANDOFF_ENV);
+    fcntl(chan, F_SETFD, FD_CLOEXEC);
+
+    int n = 0;
+    char cbuf[CMSG_SPACE(MAX_LISTENERS * sizeof(int))];
+    struct iovec iov = { .iov_base = &n, .iov_len = sizeof n };
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = cbuf, .msg_controllen = sizeof cbuf
+    };
+    ssize_t rc;
+    do {
+        rc = recvmsg(chan, &msg, MSG_CMSG_CLOEXEC);
+    } while (rc == -1 && errno == EINTR);
+    if (rc == -1) {
+        perror("handoff: recvmsg");
+        close(chan);
+        return -1;
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (rc != sizeof n || (msg.msg_flags & MSG_CTRUNC) || n <= 0 || n > max
+        || cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+        || cmsg->cmsg_len != CMSG_LEN(n * sizeof(int))) {
+        fprintf(stderr, "handoff: bad message from old instance\n");
+        close(chan);
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), n * sizeof(int));
+    predecessor = chan;
+    return n;
+}
+
+static bool
+send_listeners(int chan)
+{
+    char cbuf[CMSG_SPACE(MAX_LISTENERS * sizeof(int))];
+    memset(cbuf, 0, sizeof cbuf);
+    struct iovec iov = { .iov_base = &nlisteners, .iov_len = sizeof nlisteners };
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = cbuf, .msg_controllen = CMSG_SPACE(nlisteners * sizeof(int))
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nlisteners * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), listeners, nlisteners * sizeof(int));
+
+    if (sendmsg(chan, &msg, 0) != sizeof nlisteners) {
+        perror("handoff: sendmsg");
+        return false;
+    }
+    return true;
+}
+
+static bool
+wait_ready(int chan)
+{
+    struct pollfd pfd = { .fd = chan, .events = POLLIN };
+    int rc;
+    do {
+        rc = poll(&pfd, 1, READY_TIMEOUT_MS);
+    } while (rc == -1 && errno == EINTR);
+    char c;
+    return rc == 1 && read(chan, &c, 1) == 1 && c == READY;
+}
+
+/* Spawn a new instance and pass it the listening sockets.
+ * Returns true once it is accepting. */
+static bool
+spawn_successor(void)
+{
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+        perror("handoff: socketpair");
+        return false;
+    }
+    // the successor's end must survive exec
+    fcntl(sv[1], F_SETFD, 0);
+
+    int nenv = 0;
+    while (environ[nenv] != NULL)
+        nenv++;
+    char **envp = malloc((nenv + 2) * sizeof *envp);
+    char chanvar[sizeof HANDOFF_ENV + 16];
+    if (envp == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(envp, environ, nenv * sizeof *envp);
+    snprintf(chanvar, sizeof chanvar, HANDOFF_ENV "=%d", sv[1]);
+    envp[nenv] = chanvar;
+    envp[nenv + 1] = NULL;
+
+    // start with no signals blocked, as if from a shell
+    posix_spawnattr_t attr;
+    sigset_t none;
+    sigemptyset(&none);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &none);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+    pid_t pid;
+    int rc = posix_spawnp(&pid, saved_argv[0], NULL, &attr, saved_argv, envp);
+    posix_spawnattr_destroy(&attr);
+    free(envp);
+    close(sv[1]);
+    if (rc != 0) {
+        fprintf(stderr, "handoff: cannot start %s: %s\n", saved_argv[0], strerror(rc));
+        close(sv[0]);
+        return false;
+    }
+
+    fprintf(stderr, "handoff: started new instance, pid %d\n", (int) pid);
+    bool ok = send_listeners(sv[0]) && wait_ready(sv[0]);
+    close(sv[0]);
+    if (!ok) {
+        // the new instance exits when it finds the channel closed
+        fprintf(stderr, "handoff: new instance did not start, continuing\n");
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+    return ok;
+}
+
+static void *
+handoff_thread(void *arg)
+{
+    for (;;) {
+        int sig;
+        if (sigwait(&handoff_signals, &sig) != 0)
+            continue;
+        if (spawn_successor())
+            break;
+    }
+    if (write(wake_pipe[1], "", 1) != 1)
+        perror("handoff: write");
+    return NULL;
+}
+
+/*
+ * Begin serving the listening sockets fds[] and handle SIGUSR2.
+ * If this instance replaces an old one, tell it that it may stop
+ * accepting.  Returns a descriptor that becomes readable once the
+ * sockets have been handed to a new instance, or -1 on error.
+ */
+int
+handoff_start(const int *fds, int n)
+{
+    if (n > MAX_LISTENERS) {
+        fprintf(stderr, "handoff: too many listening sockets\n");
+        return -1;
+    }
+    memcpy(listeners, fds, n * sizeof *fds);
+    nlisteners = n;
+
+    if (pipe2(wake_pipe, O_CLOEXEC) == -1) {
+        perror("pipe2");
+        return -1;
+    }
+
+    if (predecessor != -1) {
+        char c = READY;
+        if (write(predecessor, &c, 1) != 1) {
+            perror("handoff: old instance gave up");
+            return -1;
+        }
+        close(predecessor);
+        predecessor = -1;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, handoff_thread, NULL) != 0) {
+        perror("pthread_create");
+        return -1;
+    }
+    pthread_detach(thread);
+    return wake_pipe[0];
+}
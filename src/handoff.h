@@ -0,0 +1,17 @@
+#ifndef _HANDOFF_H
+#define _HANDOFF_H
+/*
+ * Zero-downtime restart.
+ *
+ * On SIGUSR2, the server starts a new instance of its binary with the
+ * same arguments and passes it the listening sockets over a UNIX socket
+ * with SCM_RIGHTS.  Once the new instance reports that it is accepting,
+ * the old one stops accepting, drains its connections, and exits.
+ */
+#include <stdbool.h>
+
+void handoff_init(char *argv[]);
+int handoff_inherit(int *fds, int max);
+int handoff_start(const int *fds, int n);
+
+#endif /* _HANDOFF_H */
@@ -7,6 +7,7 @@
  *
  * @author G. Back for CS 3214 Spring 2018
  */
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -19,14 +20,28 @@
 #include <time.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <limits.h>
 #include <linux/limits.h>
 #include "http.h"
 #include "hexdump.h"
 #include "socket.h"
 #include "bufio.h"
 #include "main.h"
+#include "timing.h"
+#include "alog.h"
+#include "token.h"
+#include "revoke.h"
+#include "filecache.h"
+#include "pathindex.h"
+#include "route.h"
+#include "mime.h"
+#include "mp4.h"
+#include "readahead.h"
+#include "shmcache.h"
+#include "json.h"
 #include <dirent.h>
-#include <jansson.h>
 
 // Need macros here because of the sizeof
 #define CRLF "\r\n"
@@ -34,8 +49,22 @@
 #define STARTS_WITH(field_name, header) \
     (!strncasecmp(field_name, header, sizeof(header) - 1))
 
-/* Parse HTTP request line, setting req_method, req_path, and req_version. */
-static bool
+static const char *
+method_name(enum http_method method)
+{
+    switch (method)
+    {
+    case HTTP_GET:
+        return "GET";
+    case HTTP_POST:
+        return "POST";
+    default:
+        return "UNKNOWN";
+    }
+}
+
+/* Parse HTTP request line, setting req_method, req_path, req_query, and req_version. */
+bool
 http_parse_request(struct http_transaction *ta)
 {
     size_t req_offset;
@@ -61,6 +90,13 @@ http_parse_request(struct http_transaction *ta)
     if (req_path == NULL)
         return false;
 
+    // split off the query string, which is not part of the path
+    char *query = strchr(req_path, '?');
+    if (query != NULL)
+    {
+        *query++ = '\0';
+        ta->req_query = bufio_ptr2offset(ta->client->bufio, query);
+    }
     ta->req_path = bufio_ptr2offset(ta->client->bufio, req_path);
 
     char *http_version = strtok_r(NULL, CR, &endptr);
@@ -79,7 +115,7 @@ http_parse_request(struct http_transaction *ta)
 }
 
 /* Process HTTP headers. */
-static bool
+bool
 http_process_headers(struct http_transaction *ta)
 {
     for (;;)
@@ -113,7 +149,19 @@ http_process_headers(struct http_transaction *ta)
         // printf("Header: %s: %s\n", field_name, field_value);
         if (!strcasecmp(field_name, "Content-Length"))
         {
-            ta->req_content_len = atoi(field_value);
+            // no errno check: this loop may resume on another thread,
+            // see coro.h; an overflow yields LLONG_MAX, which is rejected
+            char *end;
+            long long len = strtoll(field_value, &end, 10);
+            if (end == field_value || *end != '\0' || len < 0 || len == LLONG_MAX)
+                return false;
+            ta->req_content_len = len;
+        }
+        if (!strcasecmp(field_name, "Transfer-Encoding"))
+        {
+            if (strcasecmp(field_value, "chunked"))
+                return false;
+            ta->req_chunked = true;
         }
 
         /* Handle other headers here. Both field_value and field_name
@@ -172,6 +220,9 @@ http_process_headers(struct http_transaction *ta)
 
 const int MAX_HEADER_LEN = 2048;
 
+// limit for request bodies read into memory; uploads are streamed
+static const off_t MAX_BODY_LENGTH = 16 << 20;
+
 /* add a formatted header to the response buffer. */
 void http_add_header(buffer_t *resp, char *key, char *fmt, ...)
 {
@@ -211,7 +262,8 @@ start_response(struct http_transaction *ta, buffer_t *res)
     //     buffer_appends(res, "HTTP/1.1 ");
     // }
     // else {
-    buffer_appends(res, "HTTP/1.0 ");
+    // a chunked response must be HTTP/1.1; all others are sent as HTTP/1.0
+    buffer_appends(res, ta->resp_chunked ? "HTTP/1.1 " : "HTTP/1.0 ");
     //}
 
     switch (ta->resp_status)
@@ -219,6 +271,9 @@ start_response(struct http_transaction *ta, buffer_t *res)
     case HTTP_OK:
         buffer_appends(res, "200 OK");
         break;
+    case HTTP_CREATED:
+        buffer_appends(res, "201 Created");
+        break;
     case HTTP_PARTIAL_CONTENT:
         buffer_appends(res, "206 Partial Content");
         break;
@@ -237,6 +292,9 @@ start_response(struct http_transaction *ta, buffer_t *res)
     case HTTP_REQUEST_TIMEOUT:
         buffer_appends(res, "408 Request Timeout");
         break;
+    case HTTP_PAYLOAD_TOO_LARGE:
+        buffer_appends(res, "413 Payload Too Large");
+        break;
     case HTTP_REQUEST_TOO_LONG:
         buffer_appends(res, "414 Request Too Long");
         break;
@@ -268,7 +326,9 @@ send_response_header(struct http_transaction *ta)
     buffer_t *response_and_headers[2] = {
         &response, &ta->resp_headers};
 
+    PHASE_BEGIN(ta, PHASE_SEND_HEADERS);
     int rc = bufio_sendbuffers(ta->client->bufio, response_and_headers, 2);
+    PHASE_END(ta, PHASE_SEND_HEADERS);
     buffer_delete(&response);
     return rc != -1;
 }
@@ -284,15 +344,103 @@ send_response(struct http_transaction *ta)
     buffer_t response;
     start_response(ta, &response);
 
-    buffer_t *response_and_headers[3] = {
-        &response, &ta->resp_headers, &ta->resp_body};
+    struct chain out;
+    chain_init(&out);
+    chain_append_ref(&out, response.buf, response.len);
+    chain_append_ref(&out, ta->resp_headers.buf, ta->resp_headers.len);
+    chain_concat(&out, &ta->resp_body);
 
-    int rc = bufio_sendbuffers(ta->client->bufio, response_and_headers, 3);
+    PHASE_BEGIN(ta, PHASE_SEND_RESPONSE);
+    ssize_t rc = bufio_sendchain(ta->client->bufio, &out);
+    PHASE_END(ta, PHASE_SEND_RESPONSE);
+    chain_delete(&out);
     buffer_delete(&response);
     return rc != -1;
 }
 
-const int MAX_ERROR_LEN = 2048;
+/*
+ * Streaming responses, for bodies that are produced as they are sent.
+ *
+ * A handler calls stream_begin(), then appends to resp_body as usual,
+ * calling stream_flush() after each piece, and finishes with
+ * stream_end().  Whenever STREAM_BATCH bytes have accumulated they are
+ * sent, the first time together with the headers,
+ * so the body is never held in memory as a whole.  An HTTP/1.1 client
+ * gets each batch as one chunk of a chunked response; an HTTP/1.0
+ * client gets the body as is, ended by closing the connection.  A body
+ * that stays below STREAM_BATCH is sent as an ordinary response with a
+ * Content-Length.
+ *
+ * Once the headers are out, a handler can no longer report an error;
+ * returning false closes the connection, which a client of a chunked
+ * response notices as a missing last chunk.
+ */
+#define STREAM_BATCH (16 * 1024)    // about what one send() to a socket takes
+
+/* Start a 200 response of the given type.  Other headers may follow. */
+static void
+stream_begin(struct http_transaction *ta, const char *content_type)
+{
+    ta->resp_status = HTTP_OK;
+    http_add_header(&ta->resp_headers, "Content-Type", "%s", content_type);
+}
+
+/* Send what is in resp_body, preceded by the headers if not sent yet. */
+static bool
+stream_send(struct http_transaction *ta, bool last)
+{
+    struct chain out;
+    chain_init(&out);
+
+    bool first = !ta->resp_header_sent;
+    buffer_t response;
+    if (first) {
+        ta->resp_chunked = ta->req_version == HTTP_1_1;
+        if (ta->resp_chunked)
+            http_add_header(&ta->resp_headers, "Transfer-Encoding", "chunked");
+        http_add_header(&ta->resp_headers, "Connection", "close");
+        buffer_appends(&ta->resp_headers, CRLF);
+        start_response(ta, &response);
+        chain_append_ref(&out, response.buf, response.len);
+        chain_append_ref(&out, ta->resp_headers.buf, ta->resp_headers.len);
+        ta->resp_header_sent = true;
+    }
+
+    size_t len = ta->resp_body.len;
+    if (ta->resp_chunked && len > 0)
+        chain_printf(&out, "%zx\r\n", len);
+    chain_concat(&out, &ta->resp_body);
+    if (ta->resp_chunked && len > 0)
+        chain_appends(&out, CRLF);
+    if (ta->resp_chunked && last)
+        chain_appends(&out, "0\r\n\r\n");
+
+    PHASE_BEGIN(ta, PHASE_SEND_RESPONSE);
+    ssize_t rc = bufio_sendchain(ta->client->bufio, &out);
+    PHASE_END(ta, PHASE_SEND_RESPONSE);
+    chain_delete(&out);
+    if (first)
+        buffer_delete(&response);
+    return rc != -1;
+}
+
+/* Send resp_body if a batch has accumulated. */
+static bool
+stream_flush(struct http_transaction *ta)
+{
+    if (ta->resp_body.len < STREAM_BATCH)
+        return true;
+    return stream_send(ta, false);
+}
+
+/* Send the rest of the body and end the response. */
+static bool
+stream_end(struct http_transaction *ta)
+{
+    if (!ta->resp_header_sent)
+        return send_response(ta);
+    return stream_send(ta, true);
+}
 
 /* Send an error response. */
 static bool
@@ -301,9 +449,7 @@ send_error(struct http_transaction *ta, enum http_response_status status, const
     va_list ap;
 
     va_start(ap, fmt);
-    char *error = buffer_ensure_capacity(&ta->resp_body, MAX_ERROR_LEN);
-    int len = vsnprintf(error, MAX_ERROR_LEN, fmt, ap);
-    ta->resp_body.len += len > MAX_ERROR_LEN ? MAX_ERROR_LEN - 1 : len;
+    chain_vprintf(&ta->resp_body, fmt, ap);
     va_end(ap);
     ta->resp_status = status;
     http_add_header(&ta->resp_headers, "Content-Type", "text/plain");
@@ -318,47 +464,6 @@ send_not_found(struct http_transaction *ta)
                       bufio_offset2ptr(ta->client->bufio, ta->req_path));
 }
 
-/* A start at assigning an appropriate mime type.  Real-world
- * servers use more extensive lists such as /etc/mime.types
- */
-static const char *
-guess_mime_type(char *filename)
-{
-    char *suffix = strrchr(filename, '.');
-    if (suffix == NULL)
-        return "text/plain";
-
-    if (!strcasecmp(suffix, ".html"))
-        return "text/html";
-
-    if (!strcasecmp(suffix, ".gif"))
-        return "image/gif";
-
-    if (!strcasecmp(suffix, ".png"))
-        return "image/png";
-
-    if (!strcasecmp(suffix, ".jpg"))
-        return "image/jpeg";
-
-    if (!strcasecmp(suffix, ".js"))
-        return "text/javascript";
-
-    /* hint: you need to add support for (at least) .css, .svg, and .mp4
-     * You can grep /etc/mime.types for the correct types */
-
-    if (!strcasecmp(suffix, ".css"))
-        return "text/css";
-
-    if (!strcasecmp(suffix, ".svg"))
-        return "image/svg+xml";
-
-    // video test 3/4
-    if (!strcasecmp(suffix, ".mp4"))
-        return "video/mp4";
-
-    return "text/plain";
-}
-
 // Helper function to check if the path has a dot
 static bool has_dot(const char *path)
 {
@@ -374,14 +479,88 @@ static bool has_dot(const char *path)
     return false;
 }
 
-/* Handle HTTP transaction for static files. */
+/* Find the value of the query parameter name, which ends at the
+ * next '&' or the end of the string.  Returns NULL if it is absent. */
+static const char *
+query_param(struct http_transaction *ta, const char *name)
+{
+    if (ta->req_query == 0)
+        return NULL;
+
+    size_t len = strlen(name);
+    const char *p = bufio_offset2ptr(ta->client->bufio, ta->req_query);
+    while (strncmp(p, name, len) || p[len] != '=')
+    {
+        p = strchr(p, '&');
+        if (p == NULL)
+            return NULL;
+        p++;
+    }
+    return p + len + 1;
+}
+
+/*
+ * Static files that were found are remembered in a cache shared by the
+ * worker processes (see shmcache.c), keyed by request path, for
+ * FILE_INFO_TTL_NS.  Within that time, a request for the same path
+ * opens the file without checking for it first.  Its attributes are
+ * taken from the open file, not the cache, since the file may have been
+ * replaced or changed meanwhile; if so, the entry is updated.  A path
+ * that was mapped to the /200.html fallback is remembered as such, so
+ * a file created there may only be served FILE_INFO_TTL_NS later.
+ * Requests for which no file was found are not remembered.
+ */
+#define FILE_INFO_ENTRIES 4096
+#define FILE_INFO_TTL_NS 1000000000ULL
+#define FILE_INFO_PATH 128
+
+struct file_info_key {
+    char path[FILE_INFO_PATH];      // zero-padded
+};
+
+struct file_info {
+    uint64_t expires_ns;            // timing_now() time
+    bool fallback;                  // request was mapped to /200.html
+    struct stat st;
+};
+
+static struct shmcache *file_info_cache;
+
 static bool
-handle_static_asset(struct http_transaction *ta, char *basedir)
+same_file(const struct stat *a, const struct stat *b)
 {
-    char fname[PATH_MAX];
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size
+        && a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/* Map a request path to a file below basedir, applying the .html
+ * extension rewrite and the /200.html fallback, using the path index
+ * of server_root if enabled (-I).
+ * On success, returns HTTP_OK with the file opened in *filefd and
+ * its name and attributes in fname and *st.  Otherwise, returns
+ * the status to be reported to the client.
+ */
+static enum http_response_status
+open_static_file(char *req_path, char *basedir, char *fname, struct stat *st, int *filefd)
+{
+    if (pathindex_enabled)
+    {
+        enum http_response_status status = pathindex_lookup(req_path, fname, st);
+        if (status != HTTP_OK)
+            return status;
+        // the file may have changed since it was indexed
+        *filefd = open(fname, O_RDONLY);
+        if (*filefd == -1)
+            return HTTP_NOT_FOUND;
+        if (fstat(*filefd, st) == -1)
+        {
+            close(*filefd);
+            return HTTP_INTERNAL_ERROR;
+        }
+        return HTTP_OK;
+    }
+
     char fname2[PATH_MAX];
-    assert(basedir != NULL || !!!"No base directory. Did you specify -R?");
-    char *req_path = bufio_offset2ptr(ta->client->bufio, ta->req_path);
     if (!strcmp(req_path, "/"))
     {
         req_path = "/index.html";
@@ -393,49 +572,195 @@ handle_static_asset(struct http_transaction *ta, char *basedir)
         snprintf(fname2, sizeof fname2, "%s.html", req_path);
         req_path = fname2;
     }
-    snprintf(fname, sizeof fname, "%s%s", basedir, req_path);
+
+    struct file_info_key key;
+    struct file_info info;
+    bool cacheable = file_info_cache != NULL && strlen(req_path) < sizeof key.path;
+    if (cacheable)
+    {
+        memset(&key, 0, sizeof key);
+        memcpy(key.path, req_path, strlen(req_path));
+        if (shmcache_get(file_info_cache, &key, &info) && info.expires_ns > timing_now())
+        {
+            snprintf(fname, PATH_MAX, "%s%s", basedir, info.fallback ? "/200.html" : req_path);
+            *filefd = open(fname, O_RDONLY);
+            if (*filefd != -1 && fstat(*filefd, st) == 0)
+            {
+                if (!same_file(st, &info.st))
+                {
+                    info.st = *st;
+                    shmcache_put(file_info_cache, &key, &info);
+                }
+                return HTTP_OK;
+            }
+            if (*filefd != -1)
+                close(*filefd);
+        }
+    }
+
+    info.fallback = false;
+    snprintf(fname, PATH_MAX, "%s%s", basedir, req_path);
     if (access(fname, R_OK) == -1)
     {
         if (errno == EACCES)
-            return send_error(ta, HTTP_PERMISSION_DENIED, "Permission denied.");
+            return HTTP_PERMISSION_DENIED;
         else
         {
             if (!strstr(req_path, "/api"))
             {
+                info.fallback = true;
                 req_path = "/200.html";
-                snprintf(fname, sizeof fname, "%s%s", basedir, req_path);
+                snprintf(fname, PATH_MAX, "%s%s", basedir, req_path);
                 if (access(fname, R_OK) == -1)
                 {
-                    return send_not_found(ta);
+                    return HTTP_NOT_FOUND;
                 }
             }
             else
             {
-                return send_not_found(ta);
+                return HTTP_NOT_FOUND;
             }
         }
     }
 
     // Determine file size
-    struct stat st;
-    int rc = stat(fname, &st);
+    int rc = stat(fname, st);
     /* Remove this line once your code handles this case */
     // assert(!(html5_fallback && rc == 0 && S_ISDIR(st.st_mode)));
 
     if (rc == -1)
-        return send_error(ta, HTTP_INTERNAL_ERROR, "Could not stat file.");
+        return HTTP_INTERNAL_ERROR;
+
+    *filefd = open(fname, O_RDONLY);
+    if (*filefd == -1)
+        return HTTP_NOT_FOUND;
 
-    int filefd = open(fname, O_RDONLY);
-    if (filefd == -1)
+    if (cacheable)
     {
+        info.expires_ns = timing_now() + FILE_INFO_TTL_NS;
+        info.st = *st;
+        shmcache_put(file_info_cache, &key, &info);
+    }
+    return HTTP_OK;
+}
+
+/* Send bytes from..to of filefd with sendfile, prefetching what comes
+ * next and dropping one-off huge downloads from the page cache behind
+ * them, see readahead.c.  sendfile may send fewer bytes than requested,
+ * hence the loop; with readahead, each call is limited to
+ * SENDFILE_CHUNK so that the readahead keeps pace. */
+#define SENDFILE_CHUNK (1 << 20)
+
+static bool
+send_file_range(struct http_transaction *ta, int filefd, const struct stat *st, off_t from, off_t to)
+{
+    struct readahead ra;
+    readahead_begin(&ra, filefd, st, from, to);
+    bool success = true;
+    while (success && from <= to)
+    {
+        size_t len = to + 1 - from;
+        if ((ra.window > 0 || ra.drop_behind) && len > SENDFILE_CHUNK)
+            len = SENDFILE_CHUNK;
+        success = bufio_sendfile(ta->client->bufio, filefd, &from, len) > 0;
+        readahead_progress(&ra, from);
+    }
+    readahead_end(&ra, from);
+    return success;
+}
+
+/* Send bytes from..to of an MP4 file in its layout, which splices
+ * data held in memory between pieces of the file.  The headers and
+ * all pieces go into one chain, with the file pieces as file links,
+ * so that bufio_sendchain() sends them without copying.  Unlike
+ * send_file_range(), this does no readahead of its own. */
+static bool
+send_mp4_range(struct http_transaction *ta, const struct mp4_file *mp4, int filefd,
+               off_t from, off_t to)
+{
+    if (to >= mp4->segments[mp4->nsegments - 1].end)
+        to = mp4->segments[mp4->nsegments - 1].end - 1;
+    add_content_length(&ta->resp_headers, from <= to ? to + 1 - from : 0);
+    buffer_appends(&ta->resp_headers, CRLF);
+
+    buffer_t response;
+    start_response(ta, &response);
+
+    struct chain out;
+    chain_init(&out);
+    chain_append_ref(&out, response.buf, response.len);
+    chain_append_ref(&out, ta->resp_headers.buf, ta->resp_headers.len);
+    for (int i = 0; i < mp4->nsegments && from <= to; i++)
+    {
+        const struct mp4_segment *seg = &mp4->segments[i];
+        if (from >= seg->end)
+            continue;
+        off_t end = to + 1 < seg->end ? to + 1 : seg->end;
+        if (seg->data != NULL)
+            chain_append_ref(&out, (char *) seg->data + (from - seg->start), end - from);
+        else
+            chain_append_file(&out, filefd, seg->file_offset + (from - seg->start), end - from);
+        from = end;
+    }
+
+    PHASE_BEGIN(ta, PHASE_SENDFILE);
+    ssize_t rc = bufio_sendchain(ta->client->bufio, &out);
+    PHASE_END(ta, PHASE_SENDFILE);
+    chain_delete(&out);
+    buffer_delete(&response);
+    return rc != -1;
+}
+
+/* Handle HTTP transaction for static files. */
+static bool
+handle_static_asset(struct http_transaction *ta, char *basedir)
+{
+    char fname[PATH_MAX];
+    assert(basedir != NULL || !!!"No base directory. Did you specify -R?");
+    char *req_path = bufio_offset2ptr(ta->client->bufio, ta->req_path);
+
+    struct stat st;
+    int filefd = -1;
+    PHASE_BEGIN(ta, PHASE_FS_LOOKUP);
+    enum http_response_status status = open_static_file(req_path, basedir, fname, &st, &filefd);
+    PHASE_END(ta, PHASE_FS_LOOKUP);
+
+    switch (status)
+    {
+    case HTTP_OK:
+        break;
+    case HTTP_PERMISSION_DENIED:
+        return send_error(ta, HTTP_PERMISSION_DENIED, "Permission denied.");
+    case HTTP_INTERNAL_ERROR:
+        return send_error(ta, HTTP_INTERNAL_ERROR, "Could not stat file.");
+    default:
         return send_not_found(ta);
     }
 
     ta->resp_status = HTTP_OK;
-    http_add_header(&ta->resp_headers, "Content-Type", "%s", guess_mime_type(fname));
+    const char *content_type = mime_type(fname);
+    http_add_header(&ta->resp_headers, "Content-Type", "%s", content_type);
+
+    // MP4 files are indexed for seeking with ?t=seconds, and with -V
+    // may be served in a faststart layout
+    const char *seek = query_param(ta, "t");
+    struct mp4_file *mp4 = NULL;
+    if ((mp4_faststart || seek != NULL || video_pacing > 0) && !strcmp(content_type, "video/mp4"))
+        mp4 = mp4_get(filefd, &st);
+
+    // with -v, video is sent no faster than a multiple of its bitrate,
+    // leaving the bandwidth to interactive requests
+    if (mp4 != NULL && video_pacing > 0 && mp4_bitrate(mp4) > 0)
+    {
+        uint64_t rate = mp4_bitrate(mp4) * video_pacing;
+        if (pacing_kb == 0 || rate < pacing_kb * 1024ULL)
+            bufio_set_pacing(ta->client->bufio, rate);
+    }
+
     // video test 1/3/4
     http_add_header(&ta->resp_headers, "Accept-Ranges", "bytes");
     off_t from = 0, to = st.st_size - 1;
+    double seek_time;
     if (ta->range.is_set)
     {
         ta->resp_status = HTTP_PARTIAL_CONTENT;
@@ -446,211 +771,402 @@ handle_static_asset(struct http_transaction *ta, char *basedir)
         }
         http_add_header(&ta->resp_headers, "Content-Range", "bytes %ld-%ld/%ld", from, to, st.st_size);
     }
+    else if (mp4 != NULL && seek != NULL && mp4_seek(mp4, strtod(seek, NULL), &from, &seek_time))
+    {
+        // respond as if the range from the keyframe on had been requested
+        ta->resp_status = HTTP_PARTIAL_CONTENT;
+        http_add_header(&ta->resp_headers, "Content-Range", "bytes %ld-%ld/%ld", from, to, st.st_size);
+        http_add_header(&ta->resp_headers, "X-Seek-Time", "%.3f", seek_time);
+    }
 
     off_t content_length = to + 1 - from;
-    add_content_length(&ta->resp_headers, content_length);
 
-    bool success = send_response_header(ta);
+    bool success;
+    if (mp4 != NULL && mp4->nsegments > 1)
+    {
+        success = send_mp4_range(ta, mp4, filefd, from, to);
+        goto out;
+    }
+
+    // small and medium files are sent from a cached mapping together
+    // with the headers; large files and odd ranges go through sendfile
+    struct mapped_file *mf;
+    if (filecache_eligible(&st) && from <= to && to < st.st_size
+        && (mf = filecache_get(filefd, &st)) != NULL)
+    {
+        chain_append_ref(&ta->resp_body, (char *) mf->addr + from, content_length);
+        success = send_response(ta);
+        filecache_put(mf);
+        goto out;
+    }
+
+    add_content_length(&ta->resp_headers, content_length);
+    success = send_response_header(ta);
     if (!success)
         goto out;
 
-    // sendfile may send fewer bytes than requested, hence the loop
-    while (success && from <= to)
-        success = bufio_sendfile(ta->client->bufio, filefd, &from, to + 1 - from) > 0;
+    PHASE_BEGIN(ta, PHASE_SENDFILE);
+    success = send_file_range(ta, filefd, &st, from, to);
+    PHASE_END(ta, PHASE_SENDFILE);
 
 out:
+    if (mp4 != NULL)
+        mp4_put(mp4);
     close(filefd);
     return success;
 }
 
-// Helper function to generate a jwt
-static char *generate_jwt(const char *username)
+// Helper function to validate a jwt that was not revoked
+static bool validate_jwt(struct http_transaction *ta, const char *token)
 {
-    jwt_t *jwt = NULL;
-    const char *secret = getenv("SECRET");
-    time_t now = time(NULL);
-    int exp = now + token_expiration_time;
-
-    jwt_new(&jwt);
-    jwt_add_grant(jwt, "sub", username);
-    jwt_add_grant_int(jwt, "iat", now);
-    jwt_add_grant_int(jwt, "exp", exp);
-    jwt_set_alg(jwt, JWT_ALG_HS256, (unsigned char *)secret, strlen(secret));
-
-    char *encoded = jwt_encode_str(jwt);
-    jwt_free(jwt);
+    PHASE_BEGIN(ta, PHASE_VALIDATE_JWT);
+    bool valid = token_validate(token, NULL) && !revoke_contains(token);
+    PHASE_END(ta, PHASE_VALIDATE_JWT);
+    return valid;
+}
 
-    return encoded;
+/* GET /api/login: respond with the claims if the token is valid,
+ * or an empty json if not */
+static bool
+handle_login_status(struct http_transaction *ta)
+{
+    ta->resp_status = HTTP_OK;
+    if (ta->token && validate_jwt(ta, bufio_offset2ptr(ta->client->bufio, ta->token)))
+    {
+        char *claims_json = token_claims(bufio_offset2ptr(ta->client->bufio, ta->token));
+        chain_appends(&ta->resp_body, claims_json ? claims_json : "{}");
+        free(claims_json);
+    }
+    else
+    {
+        chain_appends(&ta->resp_body, "{}");
+    }
+    http_add_header(&ta->resp_headers, "Content-Type", "application/json");
+    return send_response(ta);
 }
 
-// Helper function to validate a jwt
-static bool validate_jwt(const char *token)
+/* POST /api/login: check the credentials and set the token cookie */
+static bool
+handle_login(struct http_transaction *ta)
 {
-    jwt_t *jwt = NULL;
-    const char *secret = getenv("SECRET");
-    time_t now = time(NULL);
-    int exp = now + token_expiration_time;
+    ta->resp_status = HTTP_OK;
+
+    // the credentials are unescaped in place in the request body
+    char *body = bufio_offset2ptr(ta->client->bufio, ta->req_body);
+    struct json_field fields[] = { { "username" }, { "password" } };
+    json_scan_object(body, ta->req_content_len, fields, 2);
+
+    // Getting username and pass from request/env
+    const char *user = fields[0].value;
+    const char *pass = fields[1].value;
+    const char *env_user = getenv("USER_NAME");
+    const char *env_pass = getenv("USER_PASS");
 
-    if (exp < now)
+    if (!user || !pass || strcmp(user, env_user) != 0 || strcmp(pass, env_pass) != 0)
     {
-        jwt_free(jwt);
-        return false;
+        return send_error(ta, HTTP_PERMISSION_DENIED, "Invalid username or password");
     }
 
-    int valid = 0;
-    valid = jwt_decode(&jwt, token, (unsigned char *)secret, strlen(secret));
-    jwt_free(jwt);
-    return (valid == 0);
+    // Generate jwt
+    char *token = token_generate(user);
+    if (!token)
+    {
+        return send_error(ta, HTTP_INTERNAL_ERROR, "Token generation failed");
+    }
+
+    char *claims_json = token_claims(token);
+    chain_appends(&ta->resp_body, claims_json ? claims_json : "{}");
+    free(claims_json);
+
+    char fname[PATH_MAX];
+    snprintf(fname, sizeof fname, "auth_jwt_token=%s; Path=/; HttpOnly; SameSite=Lax; Max-Age=%d", token, token_expiration_time);
+    free(token);
+    http_add_header(&ta->resp_headers, "Set-Cookie", "%s", fname);
+    http_add_header(&ta->resp_headers, "Content-Type", "application/json");
+    return send_response(ta);
 }
 
+/* POST /api/logout: revoke the token and clear the cookie */
 static bool
-handle_api(struct http_transaction *ta)
+handle_logout(struct http_transaction *ta)
 {
-    char *req_path = bufio_offset2ptr(ta->client->bufio, ta->req_path);
-    if (strcmp(req_path, "/api/login") == 0)
+    ta->resp_status = HTTP_OK;
+    // revoke the token, so that copies of it are no longer accepted either
+    if (ta->token)
     {
-        ta->resp_status = HTTP_OK;
-        if (ta->req_method == HTTP_GET)
-        {
-            // respond with the claims if token is valid, or an empty json if not
-            if (ta->token && validate_jwt(bufio_offset2ptr(ta->client->bufio, ta->token)))
-            {
-                jwt_t *jwt = NULL;
-                const char *secret = getenv("SECRET");
-                char *token_str = bufio_offset2ptr(ta->client->bufio, ta->token);
-                jwt_decode(&jwt, token_str, (unsigned char *)secret, strlen(secret));
-                char *claims_json = jwt_get_grants_json(jwt, NULL);
-                buffer_appends(&ta->resp_body, claims_json);
-                jwt_free(jwt);
-            }
-            else
-            {
-                buffer_appends(&ta->resp_body, "{}");
-            }
-            http_add_header(&ta->resp_headers, "Content-Type", "application/json");
-            return send_response(ta);
-        }
+        char *token = bufio_offset2ptr(ta->client->bufio, ta->token);
+        time_t exp;
+        if (token_validate(token, &exp))
+            revoke_add(token, exp);
+    }
+    http_add_header(&ta->resp_headers, "Set-Cookie", "auth_jwt_token=deleted; Path=/; HttpOnly; SameSite=Lax; Max-Age=0");
+    chain_appends(&ta->resp_body, "{}");
+    http_add_header(&ta->resp_headers, "Content-Type", "application/json");
+    return send_response(ta);
+}
 
-        if (ta->req_method == HTTP_POST)
-        {
-            ta->resp_status = HTTP_OK;
+// video test 2
+/* GET /api/video: list the files in server_root with their sizes */
+static bool
+handle_video_list(struct http_transaction *ta)
+{
+    /*
+    OPENDIR(3)                 Linux Programmer's Manual                OPENDIR(3)
 
-            char *body = bufio_offset2ptr(ta->client->bufio, ta->req_body);
-            json_error_t error;
-            json_t *root = json_loadb(body, ta->req_content_len, 0, &error);
+    NAME
+                                opendir, fdopendir - open a directory
 
-            // Getting username and pass from request/env
-            const char *user = json_string_value(json_object_get(root, "username"));
-            const char *pass = json_string_value(json_object_get(root, "password"));
-            const char *env_user = getenv("USER_NAME");
-            const char *env_pass = getenv("USER_PASS");
+    SYNOPSIS
+                                #include <sys/types.h>
+                                #include <dirent.h>
 
-            if (!user || !pass || strcmp(user, env_user) != 0 || strcmp(pass, env_pass) != 0)
-            {
-                return send_error(ta, HTTP_PERMISSION_DENIED, "Invalid username or password");
-            }
-            else
-            {
-                // Generate jwt
-                char *token = generate_jwt(user);
-                if (token)
-                {
-                    jwt_t *jwt = NULL;
-                    const char *secret = getenv("SECRET");
-                    jwt_decode(&jwt, token, (unsigned char *)secret, strlen(secret));
-                    char *claims_json = jwt_get_grants_json(jwt, NULL);
-                    buffer_appends(&ta->resp_body, claims_json);
-                    jwt_free(jwt);
-
-                    char fname[PATH_MAX];
-                    snprintf(fname, sizeof fname, "auth_jwt_token=%s; Path=/; HttpOnly; SameSite=Lax; Max-Age=%d", token, token_expiration_time);
-                    http_add_header(&ta->resp_headers, "Set-Cookie", "%s", fname);
-                    http_add_header(&ta->resp_headers, "Content-Type", "application/json");
-                    return send_response(ta);
-                }
-                else
-                {
-                    return send_error(ta, HTTP_INTERNAL_ERROR, "Token generation failed");
-                }
-            }
-        }
-    }
-    // else if (strcmp(req_path, "/api/logout") == 0) {
-    //     ta->resp_status = HTTP_OK;
-    // }
-    // video test 2
-    else if (strcmp(req_path, "/api/video") == 0)
+                                DIR *opendir(const char *name);
+                                DIR *fdopendir(int fd);
+    */
+    DIR *dir = opendir(server_root);
+    if (dir == NULL)
     {
-        if (ta->req_method == HTTP_GET)
-        {
-            ta->resp_status = HTTP_OK;
+        return send_error(ta, HTTP_INTERNAL_ERROR, "Could not open directory.");
+    }
 
-            /*
-            OPENDIR(3)                 Linux Programmer's Manual                OPENDIR(3)
+    // streamed as [{"size":N,"name":"..."},...]; a file that can no
+    // longer be stat'ed, because it was just removed, is left out
+    stream_begin(ta, "application/json");
+    struct json_writer w;
+    json_writer_init(&w, &ta->resp_body);
+    json_write_begin_array(&w);
+    bool ok = true;
+    for (struct dirent *file = readdir(dir); ok && file != NULL; file = readdir(dir))
+    {
+        char fname[PATH_MAX];
+        snprintf(fname, sizeof fname, "%s/%s", server_root, file->d_name);
+
+        // Determine file size
+        struct stat st;
+        if (stat(fname, &st) == -1)
+            continue;
+        json_write_begin_object(&w);
+        json_write_key(&w, "size");
+        json_write_int(&w, st.st_size);
+        json_write_key(&w, "name");
+        json_write_string(&w, file->d_name);
+        json_write_end_object(&w);
+        ok = stream_flush(ta);
+    }
+    closedir(dir);
+    if (!ok)
+        return false;
+    json_write_end_array(&w);
+    return stream_end(ta);
+}
 
-            NAME
-                                        opendir, fdopendir - open a directory
+/* Get the file name for an upload from the name=... query parameter.
+ * Only plain file names made of letters, digits, '.', '-', and '_'
+ * that do not start with a '.' are accepted. */
+static bool
+upload_name(struct http_transaction *ta, char *name, size_t size)
+{
+    const char *p = query_param(ta, "name");
+    if (p == NULL)
+        return false;
 
-            SYNOPSIS
-                                        #include <sys/types.h>
-                                        #include <dirent.h>
+    size_t len = strcspn(p, "&");
+    if (len == 0 || len >= size || p[0] == '.')
+        return false;
+    for (size_t i = 0; i < len; i++)
+        if (!isalnum((unsigned char) p[i]) && !strchr(".-_", p[i]))
+            return false;
+    memcpy(name, p, len);
+    name[len] = '\0';
+    return true;
+}
 
-                                        DIR *opendir(const char *name);
-                                        DIR *fdopendir(int fd);
-            */
-            DIR *dir = opendir(server_root);
-            struct dirent *file;
-            json_t *arr = json_array();
+/* Store a chunked request body in fd.  Returns its length, or -1
+ * if the body is malformed or the client went away. */
+static off_t
+receive_chunked(struct http_transaction *ta, int fd)
+{
+    struct bufio *bufio = ta->client->bufio;
+    size_t mark = bufio_mark(bufio);
+    off_t total = 0;
+    for (;;)
+    {
+        size_t offset;
+        ssize_t len = bufio_readline(bufio, &offset);
+        if (len < 3)
+            return -1;
+        char *line = bufio_offset2ptr(bufio, offset);
+        // an overflow yields ULLONG_MAX, which fails the last test
+        char *end;
+        unsigned long long size = strtoull(line, &end, 16);
+        if (end == line || (*end != '\r' && *end != ';')
+            || size > INT64_MAX - total)
+            return -1;
+        bufio_discard_since(bufio, mark);
+        if (size == 0)
+            break;
+
+        if (bufio_splice(bufio, fd, size) != size)
+            return -1;
+        total += size;
+
+        if (bufio_readline(bufio, &offset) != 2)
+            return -1;
+        bufio_discard_since(bufio, mark);
+    }
 
-            for (file = readdir(dir); file != NULL; file = readdir(dir))
-            {
-                json_t *json = json_object();
-                char fname[PATH_MAX];
-                snprintf(fname, sizeof fname, "%s/%s", server_root, file->d_name);
-
-                // Determine file size
-                struct stat st;
-                int rc = stat(fname, &st);
-                if (rc == -1)
-                {
-                    return send_error(ta, HTTP_INTERNAL_ERROR, "Could not stat file.");
-                }
-                else
-                {
-                    json_object_set_new(json, "size", json_integer(st.st_size));
-                    json_object_set_new(json, "name", json_string(file->d_name));
-                    json_array_append_new(arr, json);
-                }
-            }
-            closedir(dir);
-            buffer_appends(&ta->resp_body, json_dumps(arr, JSON_COMPACT));
-            http_add_header(&ta->resp_headers, "Content-Type", "application/json");
-            return send_response(ta);
-        }
+    // skip any trailer fields up to the final empty line
+    for (;;)
+    {
+        size_t offset;
+        ssize_t len = bufio_readline(bufio, &offset);
+        if (len <= 0)
+            return -1;
+        bufio_discard_since(bufio, mark);
+        if (len == 2)
+            return total;
     }
-    else if (strcmp(req_path, "/api/logout") == 0)
+}
+
+/*
+ * POST /api/upload?name=<file>: store the request body as <file>
+ * in server_root.  The body, of any length, is streamed into a
+ * temporary file in server_root with splice, which then replaces
+ * <file> with a rename.  Requires a valid token.
+ */
+static bool
+handle_upload(struct http_transaction *ta)
+{
+    if (!ta->token || !validate_jwt(ta, bufio_offset2ptr(ta->client->bufio, ta->token)))
+        return send_error(ta, HTTP_PERMISSION_DENIED, "Invalid token");
+
+    char name[NAME_MAX + 1];
+    if (!upload_name(ta, name, sizeof name))
+        return send_error(ta, HTTP_BAD_REQUEST, "Missing or invalid file name");
+
+    char tmpname[PATH_MAX], fname[PATH_MAX];
+    snprintf(tmpname, sizeof tmpname, "%s/.upload-XXXXXX", server_root);
+    snprintf(fname, sizeof fname, "%s/%s", server_root, name);
+    int fd = mkostemp(tmpname, O_CLOEXEC);
+    if (fd == -1)
+        return send_error(ta, HTTP_INTERNAL_ERROR, "Could not create file");
+
+    PHASE_BEGIN(ta, PHASE_READ_BODY);
+    off_t len = ta->req_chunked ? receive_chunked(ta, fd)
+                                : bufio_splice(ta->client->bufio, fd, ta->req_content_len);
+    PHASE_END(ta, PHASE_READ_BODY);
+
+    // fd is closed exactly once, whatever happened; a failed close()
+    // releases it all the same
+    bool complete = ta->req_chunked ? len >= 0 : len == ta->req_content_len;
+    bool stored = complete && fchmod(fd, 0644) != -1;
+    if (close(fd) == -1)
+        stored = false;
+    if (!stored)
     {
-        if (ta->req_method == HTTP_POST)
-        {
-            ta->resp_status = HTTP_OK;
-            http_add_header(&ta->resp_headers, "Set-Cookie", "auth_jwt_token=deleted; Path=/; HttpOnly; SameSite=Lax; Max-Age=0");
-            buffer_appends(&ta->resp_body, "{}");
-            http_add_header(&ta->resp_headers, "Content-Type", "application/json");
-            return send_response(ta);
-        }
+        unlink(tmpname);
+        if (!complete)
+            send_error(ta, HTTP_BAD_REQUEST, "Incomplete request body");
         else
-        {
-            return send_error(ta, HTTP_METHOD_NOT_ALLOWED, "Method has to be POST");
-        }
+            send_error(ta, HTTP_INTERNAL_ERROR, "Could not store file");
+        return false;
     }
+    if (rename(tmpname, fname) == -1)
+    {
+        unlink(tmpname);
+        return send_error(ta, HTTP_INTERNAL_ERROR, "Could not store file");
+    }
+
+    ta->resp_status = HTTP_CREATED;
+    chain_printf(&ta->resp_body, "{\"name\":\"%s\",\"size\":%lld}", name, (long long) len);
+    http_add_header(&ta->resp_headers, "Content-Type", "application/json");
+    return send_response(ta);
+}
 
+static bool
+handle_api_not_found(struct http_transaction *ta)
+{
     return send_error(ta, HTTP_NOT_FOUND, "API not implemented");
 }
 
+/* Files below /private require a valid token. */
+static bool
+handle_private(struct http_transaction *ta)
+{
+    if (ta->token && validate_jwt(ta, bufio_offset2ptr(ta->client->bufio, ta->token)))
+        return handle_static_asset(ta, server_root);
+
+    send_error(ta, HTTP_PERMISSION_DENIED, "Invalid token");
+    return false;
+}
+
+static bool
+handle_public(struct http_transaction *ta)
+{
+    return handle_static_asset(ta, server_root);
+}
+
+/* The server's endpoints.  Prefix routes match case-insensitively,
+ * so that, e.g., /PRIVATE/ is protected like /private/. */
+static const struct route routes[] = {
+    { ROUTE_EXACT,  "/api/login",  ROUTE_METHOD(HTTP_GET),  handle_login_status },
+    { ROUTE_EXACT,  "/api/login",  ROUTE_METHOD(HTTP_POST), handle_login },
+    { ROUTE_EXACT,  "/api/logout", ROUTE_METHOD(HTTP_POST), handle_logout },
+    { ROUTE_EXACT,  "/api/video",  ROUTE_METHOD(HTTP_GET),  handle_video_list },
+    { ROUTE_EXACT,  "/api/upload", ROUTE_METHOD(HTTP_POST), handle_upload, .stream_body = true },
+    { ROUTE_PREFIX, "/api",        ROUTE_ANY, handle_api_not_found },
+    { ROUTE_PREFIX, "/private",    ROUTE_ANY, handle_private },
+    { ROUTE_PREFIX, "/",           ROUTE_ANY, handle_public },
+};
+
+static struct route_table *route_table;
+
+/* Compile the route table, load MIME types, and set up the cache of
+ * static files.  Call once at startup, before forking workers. */
+bool
+http_init(void)
+{
+    mime_init("/etc/mime.types");
+    file_info_cache = shmcache_create("static files", FILE_INFO_ENTRIES,
+                                      sizeof(struct file_info_key), sizeof(struct file_info));
+    route_table = route_compile(routes, sizeof routes / sizeof routes[0]);
+    return route_table != NULL;
+}
+
+/* Read a request body of up to MAX_BODY_LENGTH bytes into the bufio.
+ * Returns false, after sending an error if appropriate, if it cannot. */
+static bool
+read_request_body(struct http_transaction *ta)
+{
+    if (ta->req_chunked)
+    {
+        send_error(ta, HTTP_NOT_IMPLEMENTED, "Chunked request bodies are supported only for uploads");
+        return false;
+    }
+    if (ta->req_content_len > MAX_BODY_LENGTH)
+    {
+        send_error(ta, HTTP_PAYLOAD_TOO_LARGE, "Request body too large");
+        return false;
+    }
+    if (ta->req_content_len == 0)
+        return true;
+
+    PHASE_BEGIN(ta, PHASE_READ_BODY);
+    ssize_t rc = bufio_read(ta->client->bufio, ta->req_content_len, &ta->req_body);
+    PHASE_END(ta, PHASE_READ_BODY);
+
+    // To see the body, use this:
+    // char *body = bufio_offset2ptr(ta->client->bufio, ta->req_body);
+    // hexdump(body, ta->req_content_len);
+    return rc == ta->req_content_len;
+}
+
 /* Set up an http client, associating it with a bufio buffer. */
 void http_setup_client(struct http_client *self, struct bufio *bufio)
 {
     self->bufio = bufio;
+    if (pacing_kb > 0)
+        bufio_set_pacing(bufio, pacing_kb * 1024ULL);
 }
 
 /* Handle a single HTTP transaction.  Returns true on success. */
@@ -660,26 +1176,25 @@ bool http_handle_transaction(struct http_client *self)
     memset(&ta, 0, sizeof ta);
     ta.client = self;
 
-    if (!http_parse_request(&ta))
-        return false;
+    uint64_t start_ns = alog_enabled ? timing_now() : 0;
+    timing_request_begin(&ta.timing);
+    TRACE_PROBE1(request_begin, &ta);
 
-    if (!http_process_headers(&ta))
+    PHASE_BEGIN(&ta, PHASE_PARSE_REQUEST);
+    bool parsed = http_parse_request(&ta);
+    PHASE_END(&ta, PHASE_PARSE_REQUEST);
+    if (!parsed)
         return false;
 
-    if (ta.req_content_len > 0)
-    {
-        int rc = bufio_read(self->bufio, ta.req_content_len, &ta.req_body);
-        if (rc != ta.req_content_len)
-            return false;
-
-        // To see the body, use this:
-        // char *body = bufio_offset2ptr(ta.client->bufio, ta.req_body);
-        // hexdump(body, ta.req_content_len);
-    }
+    PHASE_BEGIN(&ta, PHASE_PROCESS_HEADERS);
+    parsed = http_process_headers(&ta);
+    PHASE_END(&ta, PHASE_PROCESS_HEADERS);
+    if (!parsed)
+        return false;
 
     buffer_init(&ta.resp_headers, 1024);
     http_add_header(&ta.resp_headers, "Server", "CS3214-Personal-Server");
-    buffer_init(&ta.resp_body, 0);
+    chain_init(&ta.resp_body);
 
     bool rc = false;
     char *req_path = bufio_offset2ptr(ta.client->bufio, ta.req_path);
@@ -687,44 +1202,25 @@ bool http_handle_transaction(struct http_client *self)
     {
         send_error(&ta, HTTP_BAD_REQUEST, "Bad path");
     }
-    if (STARTS_WITH(req_path, "/api"))
-    {
-        rc = handle_api(&ta);
-    }
-    else if (STARTS_WITH(req_path, "/private"))
-    {
-        // priv:
-        /* implemented */
-        bool error = false;
-        char *token = "";
-        if (ta.token)
-        {
-            token = bufio_offset2ptr(ta.client->bufio, ta.token);
-            if (validate_jwt(token))
-            {
-                rc = handle_static_asset(&ta, server_root);
-            }
-            else
-            {
-                error = true;
-            }
-        }
-        else
-        {
-            error = true;
-        }
-        if (error)
-        {
-            send_error(&ta, HTTP_PERMISSION_DENIED, "Invalid token");
-        }
-    }
     else
     {
-        rc = handle_static_asset(&ta, server_root);
+        bool method_not_allowed;
+        const struct route *route = route_lookup(route_table, req_path, ta.req_method, &method_not_allowed);
+        if (route == NULL && method_not_allowed)
+            send_error(&ta, HTTP_METHOD_NOT_ALLOWED, "Method not allowed");
+        else if (route == NULL)
+            send_not_found(&ta);
+        else if (route->stream_body || read_request_body(&ta))
+            rc = route->handler(&ta);
     }
+    req_path = bufio_offset2ptr(ta.client->bufio, ta.req_path);    // the bufio may have moved
 
     buffer_delete(&ta.resp_headers);
-    buffer_delete(&ta.resp_body);
+    chain_delete(&ta.resp_body);
 
+    TRACE_PROBE2(request_end, &ta, ta.resp_status);
+    timing_request_end(&ta.timing, method_name(ta.req_method), req_path, ta.resp_status);
+    alog_request(&self->peer, method_name(ta.req_method), req_path, ta.resp_status,
+                 bufio_bytes_sent(self->bufio), start_ns);
     return rc;
 }
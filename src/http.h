@@ -3,8 +3,12 @@
 
 #include <jwt.h>
 #include <stdbool.h>
+#include <sys/socket.h>
+#include <sys/types.h>
 
 #include "buffer.h"
+#include "chain.h"
+#include "timing.h"
 struct bufio;
 
 enum http_method {
@@ -20,12 +24,14 @@ enum http_version {
 
 enum http_response_status {
     HTTP_OK = 200,
+    HTTP_CREATED = 201,
     HTTP_PARTIAL_CONTENT = 206,
     HTTP_BAD_REQUEST = 400,
     HTTP_PERMISSION_DENIED = 403,
     HTTP_NOT_FOUND = 404,
     HTTP_METHOD_NOT_ALLOWED = 405,
     HTTP_REQUEST_TIMEOUT = 408,
+    HTTP_PAYLOAD_TOO_LARGE = 413,
     HTTP_REQUEST_TOO_LONG = 414,
     HTTP_INTERNAL_ERROR = 500,
     HTTP_NOT_IMPLEMENTED = 501,
@@ -45,27 +51,39 @@ struct http_transaction {
     enum http_method req_method;
     enum http_version req_version;
     size_t req_path;        // expressed as offset into the client's bufio.
+    size_t req_query;       // ditto, 0 if the request has no query string
     size_t req_body;        // ditto
-    int req_content_len;    // content length of request body
+    off_t req_content_len;  // content length of request body
+    bool req_chunked;       // body uses chunked transfer-coding
 
 
     /* response related fields */
     enum http_response_status resp_status;
     buffer_t resp_headers;
-    buffer_t resp_body;
+    struct chain resp_body;
+    bool resp_header_sent;  // by a streaming response
+    bool resp_chunked;      // body uses chunked transfer-coding
     size_t token;
 
     struct http_client *client;
 
     struct range_request range;
+
+    struct req_timing timing;
 };
 
 struct http_client {
     struct bufio *bufio;
+    struct sockaddr_storage peer;   // client's address, for logging
 };
 
+bool http_init(void);
 void http_setup_client(struct http_client *, struct bufio *bufio);
 bool http_handle_transaction(struct http_client *);
 void http_add_header(buffer_t * resp, char* key, char* fmt, ...);
 
+/* exposed for the microbenchmarks in bench/ */
+bool http_parse_request(struct http_transaction *ta);
+bool http_process_headers(struct http_transaction *ta);
+
 #endif /* _HTTP_H */
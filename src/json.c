@@ -0,0 +1,492 @@
+/*
+ * JSON writer and in-place object scanner.
+ *
+ * The writer writes into the space left in the chain's last segment,
+ * with chain_reserve(), and takes a new segment when that runs out.
+ * Control characters, quotes and backslashes are escaped, and bytes
+ * that are not valid UTF-8 are replaced with U+FFFD, so that a file
+ * name in any encoding still makes valid JSON.
+ *
+ * The scanner checks the whole text against the JSON grammar, as
+ * jansson would, but keeps nothing but the strings it is asked for.
+ * Strings are unescaped where they are, which never makes them longer,
+ * and terminated by overwriting their closing quote or a byte before.
+ * Like jansson by default, it rejects \u0000 and unpaired surrogates.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "json.h"
+
+#define MAX_DEPTH 32
+#define MAX_TOKEN 24                // bytes, for a separator plus a number
+
+/* Where a writer call writes, in the space reserved in the chain. */
+struct cursor {
+    struct chain *chain;
+    char *start, *p, *end;
+};
+
+static inline void
+cursor_open(struct cursor *cur, struct chain *chain)
+{
+    struct chain_link *t = chain->tail;
+    cur->chain = chain;
+    if (t != NULL && t->kind == CHAIN_SEGMENT && t->cap - t->len >= MAX_TOKEN) {
+        cur->start = cur->p = t->data + t->len;
+        cur->end = t->data + t->cap;
+    } else {
+        size_t room;
+        cur->start = cur->p = chain_reserve(chain, MAX_TOKEN, &room);
+        cur->end = cur->p + room;
+    }
+}
+
+static inline void
+cursor_close(struct cursor *cur)
+{
+    chain_commit(cur->chain, cur->p - cur->start);
+}
+
+/* Make sure there is room for n more bytes. */
+static inline void
+cursor_need(struct cursor *cur, size_t n)
+{
+    if ((size_t) (cur->end - cur->p) < n) {
+        cursor_close(cur);
+        cursor_open(cur, cur->chain);
+    }
+}
+
+/* Write a separator if the value or key follows another. */
+static void
+separate(struct json_writer *w, struct cursor *cur)
+{
+    cursor_open(cur, w->out);
+    if (w->need_comma)
+        *cur->p++ = ',';
+}
+
+static void
+write_char(struct json_writer *w, char c, bool need_comma)
+{
+    struct cursor cur;
+    if (c == '{' || c == '[')
+        separate(w, &cur);
+    else
+        cursor_open(&cur, w->out);
+    *cur.p++ = c;
+    cursor_close(&cur);
+    w->need_comma = need_comma;
+}
+
+void
+json_writer_init(struct json_writer *w, struct chain *out)
+{
+    w->out = out;
+    w->need_comma = false;
+}
+
+void
+json_write_begin_object(struct json_writer *w)
+{
+    write_char(w, '{', false);
+}
+
+void
+json_write_end_object(struct json_writer *w)
+{
+    write_char(w, '}', true);
+}
+
+void
+json_write_begin_array(struct json_writer *w)
+{
+    write_char(w, '[', false);
+}
+
+void
+json_write_end_array(struct json_writer *w)
+{
+    write_char(w, ']', true);
+}
+
+/* Length of the valid UTF-8 sequence of 2 to 4 bytes at p, else 0. */
+static size_t
+utf8_sequence(const unsigned char *p)
+{
+    unsigned char lo = 0x80, hi = 0xBF;     // range of the second byte
+    size_t n;
+    if (p[0] >= 0xC2 && p[0] <= 0xDF)
+        n = 2;
+    else if (p[0] >= 0xE0 && p[0] <= 0xEF) {
+        n = 3;
+        if (p[0] == 0xE0)
+            lo = 0xA0;                      // overlong
+        else if (p[0] == 0xED)
+            hi = 0x9F;                      // surrogates
+    } else if (p[0] >= 0xF0 && p[0] <= 0xF4) {
+        n = 4;
+        if (p[0] == 0xF0)
+            lo = 0x90;                      // overlong
+        else if (p[0] == 0xF4)
+            hi = 0x8F;                      // above U+10FFFF
+    } else
+        return 0;
+
+    if (p[1] < lo || p[1] > hi)
+        return 0;
+    for (size_t i = 2; i < n; i++)
+        if (p[i] < 0x80 || p[i] > 0xBF)
+            return 0;
+    return n;
+}
+
+static void
+write_escaped(struct cursor *cur, const char *s)
+{
+    static const char hex[] = "0123456789abcdef";
+    cursor_need(cur, 1);
+    *cur->p++ = '"';
+    for (const unsigned char *p = (const unsigned char *) s; *p != '\0'; ) {
+        cursor_need(cur, 6);
+        unsigned char c = *p;
+        if (c >= 0x20 && c < 0x80 && c != '"' && c != '\\') {
+            // copy what needs no escaping, as far as there is room
+            char *q = cur->p, *end = cur->end - 6;
+            do {
+                *q++ = c;
+                c = *++p;
+            } while (c >= 0x20 && c < 0x80 && c != '"' && c != '\\' && q < end);
+            cur->p = q;
+            continue;
+        }
+        size_t n = c >= 0x80 ? utf8_sequence(p) : 0;
+        if (n > 0) {
+            memcpy(cur->p, p, n);
+            cur->p += n;
+            p += n;
+            continue;
+        }
+
+        *cur->p++ = '\\';
+        switch (c) {
+        case '"': *cur->p++ = '"'; break;
+        case '\\': *cur->p++ = '\\'; break;
+        case '\b': *cur->p++ = 'b'; break;
+        case '\f': *cur->p++ = 'f'; break;
+        case '\n': *cur->p++ = 'n'; break;
+        case '\r': *cur->p++ = 'r'; break;
+        case '\t': *cur->p++ = 't'; break;
+        default:
+            if (c >= 0x80) {
+                memcpy(cur->p, "ufffd", 5);
+            } else {
+                memcpy(cur->p, "u00", 3);
+                cur->p[3] = hex[c >> 4];
+                cur->p[4] = hex[c & 15];
+            }
+            cur->p += 5;
+        }
+        p++;
+    }
+    cursor_need(cur, 2);
+    *cur->p++ = '"';
+}
+
+void
+json_write_key(struct json_writer *w, const char *key)
+{
+    struct cursor cur;
+    separate(w, &cur);
+    write_escaped(&cur, key);
+    *cur.p++ = ':';
+    cursor_close(&cur);
+    w->need_comma = false;
+}
+
+void
+json_write_string(struct json_writer *w, const char *s)
+{
+    struct cursor cur;
+    separate(w, &cur);
+    write_escaped(&cur, s);
+    cursor_close(&cur);
+    w->need_comma = true;
+}
+
+void
+json_write_int(struct json_writer *w, long long v)
+{
+    char buf[20], *end = buf + sizeof buf, *p = end;
+    unsigned long long u = v < 0 ? -(unsigned long long) v : (unsigned long long) v;
+    do {
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while (u != 0);
+
+    struct cursor cur;
+    separate(w, &cur);
+    if (v < 0)
+        *cur.p++ = '-';
+    memcpy(cur.p, p, end - p);
+    cur.p += end - p;
+    cursor_close(&cur);
+    w->need_comma = true;
+}
+
+struct scanner {
+    char *p, *end;
+};
+
+static void
+skip_space(struct scanner *s)
+{
+    while (s->p < s->end && (*s->p == ' ' || *s->p == '\t' || *s->p == '\n' || *s->p == '\r'))
+        s->p++;
+}
+
+static bool
+expect(struct scanner *s, char c)
+{
+    skip_space(s);
+    if (s->p == s->end || *s->p != c)
+        return false;
+    s->p++;
+    return true;
+}
+
+/* Read the 4 hex digits of a \u escape, or return -1. */
+static long
+scan_hex4(struct scanner *s)
+{
+    if (s->end - s->p < 4)
+        return -1;
+    long v = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = *s->p++;
+        int d = c >= '0' && c <= '9' ? c - '0'
+              : c >= 'a' && c <= 'f' ? c - 'a' + 10
+              : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+        if (d == -1)
+            return -1;
+        v = v << 4 | d;
+    }
+    return v;
+}
+
+static char *
+put_utf8(char *w, uint32_t cp)
+{
+    if (cp < 0x80) {
+        *w++ = cp;
+    } else if (cp < 0x800) {
+        *w++ = 0xC0 | cp >> 6;
+        *w++ = 0x80 | (cp & 0x3F);
+    } else if (cp < 0x10000) {
+        *w++ = 0xE0 | cp >> 12;
+        *w++ = 0x80 | (cp >> 6 & 0x3F);
+        *w++ = 0x80 | (cp & 0x3F);
+    } else {
+        *w++ = 0xF0 | cp >> 18;
+        *w++ = 0x80 | (cp >> 12 & 0x3F);
+        *w++ = 0x80 | (cp >> 6 & 0x3F);
+        *w++ = 0x80 | (cp & 0x3F);
+    }
+    return w;
+}
+
+/* Unescape the string whose opening quote s->p is at, in place.
+ * Returns it NUL-terminated, or NULL if it is malformed. */
+static char *
+scan_string(struct scanner *s)
+{
+    char *start = ++s->p, *w = start;
+    while (s->p < s->end) {
+        unsigned char c = *s->p++;
+        if (c == '"') {
+            *w = '\0';
+            return start;
+        }
+        if (c < 0x20)
+            return NULL;
+        if (c != '\\') {
+            *w++ = c;
+            continue;
+        }
+        if (s->p == s->end)
+            return NULL;
+        switch (*s->p++) {
+        case '"': *w++ = '"'; break;
+        case '\\': *w++ = '\\'; break;
+        case '/': *w++ = '/'; break;
+        case 'b': *w++ = '\b'; break;
+        case 'f': *w++ = '\f'; break;
+        case 'n': *w++ = '\n'; break;
+        case 'r': *w++ = '\r'; break;
+        case 't': *w++ = '\t'; break;
+        case 'u': {
+            long cp = scan_hex4(s);
+            if (cp >= 0xD800 && cp <= 0xDBFF) {
+                if (s->end - s->p < 2 || s->p[0] != '\\' || s->p[1] != 'u')
+                    return NULL;
+                s->p += 2;
+                long low = scan_hex4(s);
+                if (low < 0xDC00 || low > 0xDFFF)
+                    return NULL;
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+            } else if (cp <= 0 || (cp >= 0xDC00 && cp <= 0xDFFF)) {
+                return NULL;
+            }
+            w = put_utf8(w, cp);
+            break;
+        }
+        default:
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+static bool
+scan_digits(struct scanner *s)
+{
+    char *start = s->p;
+    while (s->p < s->end && *s->p >= '0' && *s->p <= '9')
+        s->p++;
+    return s->p > start;
+}
+
+static bool
+scan_number(struct scanner *s)
+{
+    if (s->p < s->end && *s->p == '-')
+        s->p++;
+    if (s->p < s->end && *s->p == '0')
+        s->p++;
+    else if (!scan_digits(s))
+        return false;
+    if (s->p < s->end && *s->p == '.') {
+        s->p++;
+        if (!scan_digits(s))
+            return false;
+    }
+    if (s->p < s->end && (*s->p == 'e' || *s->p == 'E')) {
+        s->p++;
+        if (s->p < s->end && (*s->p == '+' || *s->p == '-'))
+            s->p++;
+        if (!scan_digits(s))
+            return false;
+    }
+    return true;
+}
+
+static bool
+scan_literal(struct scanner *s, const char *lit)
+{
+    size_t len = strlen(lit);
+    if ((size_t) (s->end - s->p) < len || memcmp(s->p, lit, len) != 0)
+        return false;
+    s->p += len;
+    return true;
+}
+
+static bool scan_value(struct scanner *s, int depth);
+
+/* Scan the members of an object or the elements of an array, whose
+ * opening bracket was consumed.  If fields is not NULL, the values of
+ * the members named there are stored in it. */
+static bool
+scan_container(struct scanner *s, char close, struct json_field *fields, int nfields, int depth)
+{
+    if (depth >= MAX_DEPTH)
+        return false;
+    skip_space(s);
+    if (s->p < s->end && *s->p == close) {
+        s->p++;
+        return true;
+    }
+    for (;;) {
+        struct json_field *field = NULL;
+        if (close == '}') {
+            skip_space(s);
+            char *key;
+            if (s->p == s->end || *s->p != '"' || (key = scan_string(s)) == NULL || !expect(s, ':'))
+                return false;
+            for (int i = 0; fields != NULL && i < nfields; i++)
+                if (strcmp(fields[i].name, key) == 0)
+                    field = &fields[i];
+        }
+
+        skip_space(s);
+        if (field != NULL) {
+            // the last member of that name counts, as with jansson
+            field->value = NULL;
+            if (s->p < s->end && *s->p == '"') {
+                if ((field->value = scan_string(s)) == NULL)
+                    return false;
+            } else if (!scan_value(s, depth + 1)) {
+                return false;
+            }
+        } else if (!scan_value(s, depth + 1)) {
+            return false;
+        }
+
+        skip_space(s);
+        if (s->p == s->end)
+            return false;
+        char c = *s->p++;
+        if (c == close)
+            return true;
+        if (c != ',')
+            return false;
+    }
+}
+
+static bool
+scan_value(struct scanner *s, int depth)
+{
+    skip_space(s);
+    if (s->p == s->end)
+        return false;
+    switch (*s->p) {
+    case '"':
+        return scan_string(s) != NULL;
+    case '{':
+        s->p++;
+        return scan_container(s, '}', NULL, 0, depth);
+    case '[':
+        s->p++;
+        return scan_container(s, ']', NULL, 0, depth);
+    case 't':
+        return scan_literal(s, "true");
+    case 'f':
+        return scan_literal(s, "false");
+    case 'n':
+        return scan_literal(s, "null");
+    default:
+        return scan_number(s);
+    }
+}
+
+/*
+ * Check that text[0:len] is a JSON object, and find the members named
+ * in fields[] whose values are strings.  Their values are unescaped in
+ * place in text, and pointed to from fields[].  text is modified even
+ * if it turns out not to be valid.  Returns false if it is not.
+ */
+bool
+json_scan_object(char *text, size_t len, struct json_field *fields, int nfields)
+{
+    struct scanner s = { text, text + len };
+    for (int i = 0; i < nfields; i++)
+        fields[i].value = NULL;
+    bool ok = expect(&s, '{') && scan_container(&s, '}', fields, nfields, 0);
+    skip_space(&s);
+    if (ok && s.p == s.end)
+        return true;
+    for (int i = 0; i < nfields; i++)
+        fields[i].value = NULL;
+    return false;
+}
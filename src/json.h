@@ -0,0 +1,38 @@
+#ifndef _JSON_H
+#define _JSON_H
+/*
+ * JSON for the API handlers, without building a tree.
+ *
+ * A json_writer emits JSON straight into a response body, adding the
+ * separators and escaping strings as it goes.  json_scan_object() picks
+ * the string members it is asked for out of a JSON object in place,
+ * without allocating.  Token claims still go through jansson.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "chain.h"
+
+struct json_writer {
+    struct chain *out;
+    bool need_comma;        // before the next value or key
+};
+
+void json_writer_init(struct json_writer *w, struct chain *out);
+void json_write_begin_object(struct json_writer *w);
+void json_write_end_object(struct json_writer *w);
+void json_write_begin_array(struct json_writer *w);
+void json_write_end_array(struct json_writer *w);
+void json_write_key(struct json_writer *w, const char *key);
+void json_write_string(struct json_writer *w, const char *s);
+void json_write_int(struct json_writer *w, long long v);
+
+/* A member to look for with json_scan_object(). */
+struct json_field {
+    const char *name;
+    const char *value;      // NULL if missing or not a string
+};
+
+bool json_scan_object(char *text, size_t len, struct json_field *fields, int nfields);
+
+#endif /* _JSON_H */
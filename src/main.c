@@ -15,71 +15,184 @@
 #include "socket.h"
 #include "bufio.h"
 #include "main.h"
+#include "stats.h"
+#include "alog.h"
+#include "timing.h"
+#include "filecache.h"
+#include "pathindex.h"
+#include "affinity.h"
+#include "handoff.h"
+#include "scheduler.h"
+#include "revoke.h"
+#include "token.h"
+#include "offload.h"
+#include "mp4.h"
+#include "readahead.h"
+#include "bufpool.h"
+#include "slab.h"
+#include "prefork.h"
+#include "coro.h"
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
+#include <unistd.h>
 
-/* Implement HTML5 fallback.
- * If HTML5 fallback is implemented and activated, the server should
- * treat requests to non-API paths specially.
- * If the requested file is not found, the server will serve /index.html
- * instead; that is, it should treat the request as if it
- * had been for /index.html instead.
- */
-bool html5_fallback = false;
+static atomic_int active_connections;
+
+struct connection {
+    struct http_client client;
+    int socket;
+};
 
-// silent_mode. During benchmarking, this will be true
-bool silent_mode = false;
+static struct slab connection_slab;
 
-// default token expiration time is 1 day
-int token_expiration_time = 24 * 60 * 60;
+// Connection threads get a stack as small as a coroutine's.
+#define THREAD_STACK_SIZE CORO_STACK_SIZE
 
-// root from which static files are served
-char *server_root;
+// Serve a client, in its own thread or as a coroutine.
+// The bufio is created here rather than in server_loop so that its
+// receive buffer is taken from the pool of the CPU serving the client.
+static void serve_connection(void *arg)
+{
+    struct connection *conn = arg;
+    struct http_client *client = &conn->client;
+    http_setup_client(client, bufio_create(conn->socket));
+    http_handle_transaction(client);
+    bufio_close(client->bufio);
+    slab_free(&connection_slab, conn);
+    atomic_fetch_sub(&active_connections, 1);
+}
 
 // Multithread helper function
 static void *start_routine(void *arg)
 {
-    int sock = (intptr_t)arg;
-    struct http_client client;
-    http_setup_client(&client, bufio_create(sock));
-    http_handle_transaction(&client);
-    bufio_close(client.bufio);
+    if (affinity_enabled)
+        affinity_local_memory();
+    serve_connection(arg);
     return NULL;
 }
+
+/*
+ * Wait for the connections still being served to finish,
+ * for at most drain_timeout seconds.
+ */
+static void
+drain_connections(void)
+{
+    fprintf(stderr, "stopped accepting, draining %d connections\n",
+            atomic_load(&active_connections));
+    for (int waited_ms = 0; atomic_load(&active_connections) > 0; waited_ms += 100)
+    {
+        if (waited_ms >= drain_timeout * 1000)
+        {
+            fprintf(stderr, "%d connections still open after %d seconds, exiting\n",
+                    atomic_load(&active_connections), drain_timeout);
+            return;
+        }
+        usleep(100 * 1000);
+    }
+    // let the access log thread write out the last records
+    usleep(100 * 1000);
+}
+
 /*
- * A non-concurrent, iterative server that serves one client at a time.
+ * A concurrent server that spawns one thread per client.
  * For each client, it handles exactly 1 HTTP transaction.
+ * Clients are accepted in batches of up to ACCEPT_BATCH per wakeup.
+ * With -C, each client's thread is pinned to a CPU, see affinity.c.
+ * With -c, clients are served by coroutines instead, see scheduler.c;
+ * with -C as well, on a scheduler pinned to the client's CPU.
+ * Clients of the TCP port and of the UNIX socket (-U) are served alike.
+ * Once wake_fd becomes readable, because the listening sockets were
+ * handed to a new instance of the server (see handoff.c) or, in a worker
+ * process, the master is done (see prefork.c), this drains and returns.
  */
+#define ACCEPT_BATCH 64
+#define MAX_LISTENERS 16
+
 static void
-server_loop(char *port_string)
+server_loop(int *listeners, int nlisteners, int wake_fd)
 {
-    int accepting_socket = socket_open_bind_listen(port_string, 10000);
-    while (accepting_socket != -1)
+    for (;;)
     {
-        fprintf(stderr, "Waiting for client...\n");
-        int client_socket = socket_accept_client(accepting_socket);
-        if (client_socket == -1)
+        int fds[ACCEPT_BATCH];
+        struct sockaddr_storage peers[ACCEPT_BATCH];
+        int n = socket_accept_clients(listeners, nlisteners, wake_fd, fds, peers, ACCEPT_BATCH);
+        if (n == -1)
             return;
+        if (n == 0)
+            break;
 
-        // Create threads    
-        pthread_t thread;
-        if (pthread_create(&thread, NULL, start_routine, (void*)(intptr_t)client_socket) != 0)
+        for (int i = 0; i < n; i++)
         {
-            fprintf(stderr, "Thread creation failed...\n");
-        }
+            struct connection *conn = slab_alloc(&connection_slab);
+            conn->client.peer = peers[i];
+            conn->socket = fds[i];
+            atomic_fetch_add(&active_connections, 1);
+
+            if (coroutine_threads > 0)
+            {
+                scheduler_spawn(serve_connection, conn, fds[i]);
+                continue;
+            }
 
+            // Create threads
+            pthread_attr_t attr;
+            pthread_attr_init(&attr);
+            pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
+            if (affinity_enabled)
+                affinity_steer(&attr, fds[i]);
+            pthread_t thread;
+            int rc = pthread_create(&thread, &attr, start_routine, conn);
+            pthread_attr_destroy(&attr);
+            if (rc != 0)
+            {
+                fprintf(stderr, "Thread creation failed...\n");
+                atomic_fetch_sub(&active_connections, 1);
+                close(fds[i]);
+                slab_free(&connection_slab, conn);
+                continue;
+            }
+            pthread_detach(thread);
+        }
     }
+
+    for (int i = 0; i < nlisteners; i++)
+        close(listeners[i]);
+    drain_connections();
 }
 
 static void
 usage(char * av0)
 {
-    fprintf(stderr, "Usage: %s -p port [-R rootdir] [-h] [-e seconds]\n"
+    fprintf(stderr, "Usage: %s -p port | -U path [-R rootdir] [-h] [-e seconds]\n"
         "  -p port      port number to bind to\n"
+        "  -U path      accept connections on a UNIX domain socket at path,\n"
+        "               with or without -p\n"
         "  -R rootdir   root directory from which to serve files\n"
         "  -e seconds   expiration time for tokens in seconds\n"
         "  -a           enable HTML5 fallback\n"
+        "  -A alg       sign tokens with HS256 (default), RS256 or ES256\n"
+        "  -B kbytes    send each connection at most kbytes per second\n"
+        "  -c nthreads  serve connections as coroutines on nthreads threads\n"
+        "  -C cpulist   run connection threads on these CPUs, e.g. 0-3,8\n"
+        "  -D seconds   after handing off to a new instance (SIGUSR2),\n"
+        "               wait this long for open connections to finish\n"
+        "  -l file      write access log to file ('-' for stderr)\n"
+        "  -F qlen      enable TCP Fast Open with the given queue length\n"
+        "  -I           index rootdir (requires -R) at startup, updated on changes\n"
+        "  -K keyfile   PEM key for RS256/ES256 tokens\n"
+        "  -M kbytes    send files up to this size from mappings, 0 = sendfile only\n"
+        "  -m mbytes    size of the file mapping cache\n"
+        "  -O nthreads  run token signing on nthreads threads (default: one per CPU)\n"
+        "  -P nworkers  serve from nworkers pre-forked processes\n"
+        "  -T n         record per-request phase times, report n slowest on SIGUSR1\n"
+        "  -u mbytes    drop one-off downloads from the page cache after mbytes\n"
+        "  -v multiple  send MP4 video at most at this multiple of its bitrate\n"
+        "  -V           serve MP4 files with the moov box first (faststart)\n"
+        "  -W kbytes    prefetch up to kbytes ahead of files sent with sendfile\n"
+        "  -X file      keep revoked tokens in file across restarts\n"
         "  -h           display this help\n"
         , av0);
     exit(EXIT_FAILURE);
@@ -90,16 +203,36 @@ main(int ac, char *av[])
 {
     int opt;
     char *port_string = NULL;
-    while ((opt = getopt(ac, av, "ahp:R:se:")) != -1) {
+    while ((opt = getopt(ac, av, "ahIp:U:R:se:T:l:M:m:F:C:D:c:X:A:K:O:P:VB:v:W:u:")) != -1) {
         switch (opt) {
             case 'a':
                 html5_fallback = true;
                 break;
 
+            case 'A':
+                token_algorithm = optarg;
+                break;
+
+            case 'K':
+                token_key_file = optarg;
+                break;
+
+            case 'O':
+                offload_threads = atoi(optarg);
+                break;
+
+            case 'P':
+                prefork_workers = atoi(optarg);
+                break;
+
             case 'p':
                 port_string = optarg;
                 break;
 
+            case 'U':
+                unix_socket_path = optarg;
+                break;
+
             case 'e':
                 token_expiration_time = atoi(optarg);
                 fprintf(stderr, "token expiration time is %d\n", token_expiration_time);
@@ -113,23 +246,158 @@ main(int ac, char *av[])
                 server_root = optarg;
                 break;
 
+            case 'l':
+                access_log_path = optarg;
+                break;
+
+            case 'c':
+                coroutine_threads = atoi(optarg);
+                break;
+
+            case 'C':
+                cpu_list = optarg;
+                break;
+
+            case 'D':
+                drain_timeout = atoi(optarg);
+                break;
+
+            case 'F':
+                tcp_fastopen_qlen = atoi(optarg);
+                break;
+
+            case 'I':
+                index_server_root = true;
+                break;
+
+            case 'M':
+                mmap_max_kb = atoi(optarg);
+                break;
+
+            case 'm':
+                mmap_cache_mb = atoi(optarg);
+                break;
+
+            case 'T':
+                slowest_requests = atoi(optarg);
+                break;
+
+            case 'V':
+                mp4_faststart = true;
+                break;
+
+            case 'v':
+                video_pacing = atof(optarg);
+                break;
+
+            case 'B':
+                pacing_kb = atoi(optarg);
+                break;
+
+            case 'W':
+                readahead_kb = atoi(optarg);
+                break;
+
+            case 'u':
+                uncached_mb = atoi(optarg);
+                break;
+
+            case 'X':
+                revocation_file = optarg;
+                break;
+
             case 'h':
             default:    /* '?' */
                 usage(av[0]);
         }
     }
 
-    if (port_string == NULL)
+    if (port_string == NULL && unix_socket_path == NULL)
         usage(av[0]);
 
+    // the index is built from the root directory, which has no default
+    if (index_server_root && server_root == NULL) {
+        fprintf(stderr, "-I requires -R\n");
+        usage(av[0]);
+    }
+
     /* We ignore SIGPIPE to prevent the process from terminating when it tries
      * to send data to a connection that the client already closed.
      * This may happen, in particular, in bufio_sendfile.
      */ 
     signal(SIGPIPE, SIG_IGN);
 
-    fprintf(stderr, "Using port %s\n", port_string);
-    server_loop(port_string);
+    /* If we were started by a running server's handoff, take over its
+     * listening sockets instead of binding the port and the UNIX socket. */
+    handoff_init(av);
+    int listeners[MAX_LISTENERS];
+    int inherited = handoff_inherit(listeners, MAX_LISTENERS);
+    if (inherited == -1)
+        exit(EXIT_FAILURE);
+
+    /* What worker processes (-P) share is set up before forking them. */
+    if (!revoke_init(revocation_file))
+        exit(EXIT_FAILURE);
+    if (!token_init(token_algorithm, token_key_file))
+        exit(EXIT_FAILURE);
+    token_cache_init();
+    if (!http_init())
+        exit(EXIT_FAILURE);
+
+    if (port_string != NULL)
+        fprintf(stderr, "Using port %s\n", port_string);
+    if (unix_socket_path != NULL)
+        fprintf(stderr, "Using UNIX socket %s\n", unix_socket_path);
+    // with worker processes, a TCP listener for each, as far as they go
+    int ntcp = prefork_workers > 1 ? prefork_workers : 1;
+    if (ntcp > MAX_LISTENERS - 1)
+        ntcp = MAX_LISTENERS - 1;
+    int nlisteners = inherited;
+    for (int i = 0; !inherited && port_string != NULL && i < ntcp; i++)
+        listeners[nlisteners++] = socket_open_bind_listen(port_string, 10000);
+    if (!inherited && unix_socket_path != NULL)
+        listeners[nlisteners++] = socket_open_unix_listen(unix_socket_path, 10000);
+    for (int i = 0; i < nlisteners; i++)
+        if (listeners[i] == -1)
+            exit(EXIT_FAILURE);
+
+    /* Only worker processes return, with their share of the listeners.
+     * They start the threads below each for themselves. */
+    int wake_fd = -1;
+    if (prefork_workers > 0) {
+        wake_fd = prefork_start(prefork_workers, listeners, &nlisteners);
+        if (wake_fd == -1)
+            exit(EXIT_FAILURE);
+    }
+
+    stats_start();
+    timing_init(slowest_requests);
+    if (access_log_path == NULL && !silent_mode)
+        access_log_path = "-";
+    if (access_log_path != NULL)
+        alog_init(access_log_path);
+    if (cpu_list != NULL && !affinity_init(cpu_list))
+        exit(EXIT_FAILURE);
+    if (index_server_root && !pathindex_init(server_root))
+        exit(EXIT_FAILURE);
+    slab_init(&connection_slab, "connection", sizeof(struct connection));
+    bufpool_init();
+    filecache_init((size_t) mmap_max_kb << 10, (size_t) mmap_cache_mb << 20);
+    mp4_init(mp4_faststart);
+    if (!readahead_start(readahead_kb, uncached_mb))
+        exit(EXIT_FAILURE);
+    if (offload_threads == 0)
+        offload_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (!offload_start(offload_threads))
+        exit(EXIT_FAILURE);
+    if (coroutine_threads > 0 && !scheduler_start(coroutine_threads))
+        exit(EXIT_FAILURE);
+
+    if (prefork_workers == 0)
+        wake_fd = handoff_start(listeners, nlisteners);
+    if (wake_fd == -1)
+        exit(EXIT_FAILURE);
+    server_loop(listeners, nlisteners, wake_fd);
     exit(EXIT_SUCCESS);
 }
 
@@ -1,5 +1,5 @@
 /*
- * Declarations of various global variables.
+ * Declarations of various global variables, defined in config.c.
  */
 #include <stdbool.h>
 
@@ -7,3 +7,23 @@ extern char *server_root;
 extern bool silent_mode;
 extern int token_expiration_time;
 extern bool html5_fallback;
+extern int slowest_requests;
+extern char *access_log_path;
+extern int mmap_max_kb;
+extern int mmap_cache_mb;
+extern bool index_server_root;
+extern char *unix_socket_path;
+extern int tcp_fastopen_qlen;
+extern char *cpu_list;
+extern int drain_timeout;
+extern char *revocation_file;
+extern bool mp4_faststart;
+extern int readahead_kb;
+extern int uncached_mb;
+extern int pacing_kb;
+extern double video_pacing;
+extern char *token_algorithm;
+extern char *token_key_file;
+extern int offload_threads;
+extern int coroutine_threads;
+extern int prefork_workers;
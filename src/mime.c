@@ -0,0 +1,130 @@
+/*
+ * MIME types, loaded once into a hash table keyed by lower-case
+ * extension.
+ *
+ * The types the server always knew take precedence over those read
+ * from a mime.types file, so adding the file does not change how
+ * the site's own assets are served.  Extensions that are unknown,
+ * or longer than MAX_EXT, are served as text/plain.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mime.h"
+
+#define NSLOTS 4096                 // power of 2, > 2x the extensions in /etc/mime.types
+#define MAX_EXT 16
+
+struct mime_slot {
+    char ext[MAX_EXT];              // empty if unused
+    const char *type;
+};
+
+static struct mime_slot table[NSLOTS];
+static int nentries;
+
+static const char *builtin[][2] = {
+    { "html", "text/html" },
+    { "gif", "image/gif" },
+    { "png", "image/png" },
+    { "jpg", "image/jpeg" },
+    { "js", "text/javascript" },
+    { "css", "text/css" },
+    { "svg", "image/svg+xml" },
+    { "mp4", "video/mp4" },
+};
+
+static uint32_t
+hash_ext(const char *ext)
+{
+    uint32_t h = 2166136261u;       // FNV-1a
+    while (*ext)
+        h = (h ^ (unsigned char) *ext++) * 16777619u;
+    return h;
+}
+
+/* Copy the lower-cased ext into out; false if it does not fit. */
+static bool
+lower_ext(const char *ext, char out[MAX_EXT])
+{
+    int i;
+    for (i = 0; ext[i]; i++) {
+        if (i == MAX_EXT - 1)
+            return false;
+        char c = ext[i];
+        out[i] = c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+    }
+    out[i] = '\0';
+    return true;
+}
+
+static struct mime_slot *
+find_slot(const char *ext)
+{
+    uint32_t i = hash_ext(ext) & (NSLOTS - 1);
+    while (table[i].ext[0] && strcmp(table[i].ext, ext))
+        i = (i + 1) & (NSLOTS - 1);
+    return &table[i];
+}
+
+/* Add a mapping unless the extension is already known. */
+static void
+add(const char *ext, const char *type)
+{
+    char key[MAX_EXT];
+    if (!lower_ext(ext, key) || nentries >= NSLOTS / 2)
+        return;
+    struct mime_slot *slot = find_slot(key);
+    if (slot->ext[0])
+        return;
+    strcpy(slot->ext, key);
+    slot->type = type;
+    nentries++;
+}
+
+/* Load the built-in types and those in the mime.types file at path,
+ * if it exists.  Must be called before any lookups. */
+void
+mime_init(const char *path)
+{
+    for (int i = 0; i < sizeof builtin / sizeof builtin[0]; i++)
+        add(builtin[i][0], builtin[i][1]);
+
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return;
+
+    char line[1024];
+    while (fgets(line, sizeof line, f)) {
+        char *save;
+        char *type = strtok_r(line, " \t\r\n", &save);
+        if (type == NULL || type[0] == '#')
+            continue;
+        char *ext = strtok_r(NULL, " \t\r\n", &save);
+        if (ext == NULL)
+            continue;
+        // the types are never freed, like the table
+        type = strdup(type);
+        if (type == NULL)
+            break;
+        for (; ext != NULL; ext = strtok_r(NULL, " \t\r\n", &save))
+            add(ext, type);
+    }
+    fclose(f);
+}
+
+/* Return the MIME type for a file name. */
+const char *
+mime_type(const char *filename)
+{
+    const char *suffix = strrchr(filename, '.');
+    char key[MAX_EXT];
+    if (suffix == NULL || !lower_ext(suffix + 1, key))
+        return "text/plain";
+
+    struct mime_slot *slot = find_slot(key);
+    return slot->ext[0] ? slot->type : "text/plain";
+}
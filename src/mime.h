@@ -0,0 +1,10 @@
+#ifndef _MIME_H
+#define _MIME_H
+/*
+ * MIME type lookup by file name extension.
+ */
+
+void mime_init(const char *path);
+const char *mime_type(const char *filename);
+
+#endif /* _MIME_H */
@@ -0,0 +1,572 @@
+/*
+ * MP4 index cache.
+ *
+ * Parsing reads the top-level boxes of a file and its moov box.  The
+ * sample tables of the first video track yield the keyframes' decode
+ * times and byte offsets, which mp4_seek() searches.
+ *
+ * If the moov box follows the media data, which makes a player fetch
+ * the end of the file before it can start, the file is served in a
+ * faststart layout when that is enabled: the boxes ahead of the first
+ * mdat, then a copy of the moov box whose chunk offsets are moved past
+ * it, then the rest of the file without the moov box.  Only the moov
+ * copy is kept in memory; the rest is sent from the file.  The layout
+ * has the same size as the file.
+ *
+ * Cache entries are kept on an LRU list and evicted when they use more
+ * than CACHE_CAPACITY bytes, with the same reference counting as the
+ * file mapping cache.
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mp4.h"
+#include "stats.h"
+
+#define NBUCKETS 256
+#define CACHE_CAPACITY (16 << 20)   // bytes of indexes and moov copies
+#define MAX_MOOV (16 << 20)         // larger moov boxes are not parsed
+
+struct keyframe {
+    uint64_t time;                  // decode time, in timescale units
+    off_t offset;                   // in the served layout
+};
+
+struct cache_entry {
+    struct mp4_file file;           // must be first
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    uint32_t timescale;
+    uint64_t duration;              // of the video track, in timescale units
+    size_t nkeyframes;
+    struct keyframe *keyframes;
+    unsigned char *moov;            // patched copy for the faststart layout
+    size_t memory;                  // bytes used by the entry
+    int refcount;                   // users, plus 1 while in the table
+    struct cache_entry *next;       // hash chain
+    struct cache_entry *lru_prev, *lru_next;
+};
+
+/* The payload of a box in memory. */
+struct box {
+    unsigned char *data;
+    size_t size;
+};
+
+static bool faststart;
+static size_t used;
+static struct cache_entry *buckets[NBUCKETS];
+static struct cache_entry lru = { .lru_prev = &lru, .lru_next = &lru };
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t hits, misses, evictions, unparsable;
+
+static uint32_t
+be32(const unsigned char *p)
+{
+    return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static uint64_t
+be64(const unsigned char *p)
+{
+    return (uint64_t) be32(p) << 32 | be32(p + 4);
+}
+
+static void
+put_be32(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/* Parse the header of a box at p, of which avail bytes are present.
+ * Returns the header length and stores the box size in *size, or
+ * returns 0 if the header is malformed. */
+static size_t
+box_header(const unsigned char *p, uint64_t avail, uint64_t *size)
+{
+    if (avail < 8)
+        return 0;
+    size_t header = 8;
+    *size = be32(p);
+    if (*size == 1) {
+        if (avail < 16)
+            return 0;
+        *size = be64(p + 8);
+        header = 16;
+    } else if (*size == 0) {
+        *size = avail;          // extends to the end
+    }
+    return *size >= header && *size <= avail ? header : 0;
+}
+
+/* Find the nth child of parent with the given type. */
+static bool
+find_box(const struct box *parent, const char *type, int n, struct box *out)
+{
+    unsigned char *p = parent->data, *end = parent->data + parent->size;
+    while (p < end) {
+        uint64_t size;
+        size_t header = box_header(p, end - p, &size);
+        if (header == 0)
+            return false;
+        if (memcmp(p + 4, type, 4) == 0 && n-- == 0) {
+            out->data = p + header;
+            out->size = size - header;
+            return true;
+        }
+        p += size;
+    }
+    return false;
+}
+
+/* Find a box by a path of types, e.g. "mdia/minf/stbl", below parent. */
+static bool
+find_path(const struct box *parent, const char *path, struct box *out)
+{
+    struct box b = *parent;
+    for (; *path; path += path[4] == '/' ? 5 : 4) {
+        if (!find_box(&b, path, 0, &b))
+            return false;
+    }
+    *out = b;
+    return true;
+}
+
+/* A "full box" table: version and flags, a count, then count entries
+ * of entry_size bytes after skip more bytes.  Returns the entries. */
+static unsigned char *
+table(const struct box *b, size_t skip, size_t entry_size, uint32_t *count)
+{
+    if (b->size < 8 + skip)
+        return NULL;
+    *count = be32(b->data + 4 + skip);
+    if ((b->size - 8 - skip) / entry_size < *count)
+        return NULL;
+    return b->data + 8 + skip;
+}
+
+/* Is this trak a video track? */
+static bool
+is_video(const struct box *trak)
+{
+    struct box hdlr;
+    return find_path(trak, "mdia/hdlr", &hdlr) && hdlr.size >= 12
+        && memcmp(hdlr.data + 8, "vide", 4) == 0;
+}
+
+/* Where the byte at file offset o ends up in the served layout. */
+static off_t
+layout_offset(const struct cache_entry *e, off_t o)
+{
+    const struct mp4_segment *s = e->file.segments;
+    for (int i = 0; i < e->file.nsegments; i++)
+        if (s[i].data == NULL && o >= s[i].file_offset
+            && o < s[i].file_offset + (s[i].end - s[i].start))
+            return s[i].start + (o - s[i].file_offset);
+    return o;
+}
+
+/* Build the keyframe index from the sample tables of a video trak. */
+static bool
+index_keyframes(struct cache_entry *e, const struct box *trak)
+{
+    struct box mdhd, stbl, stts, stsc, stsz, stco, stss;
+    if (!find_path(trak, "mdia/mdhd", &mdhd) || !find_path(trak, "mdia/minf/stbl", &stbl)
+        || !find_box(&stbl, "stts", 0, &stts) || !find_box(&stbl, "stsc", 0, &stsc)
+        || !find_box(&stbl, "stsz", 0, &stsz))
+        return false;
+
+    // version 1 mdhd has 64-bit creation and modification times
+    size_t ts = mdhd.size > 0 && mdhd.data[0] == 1 ? 20 : 12;
+    if (mdhd.size < ts + 4 || (e->timescale = be32(mdhd.data + ts)) == 0)
+        return false;
+
+    bool co64 = !find_box(&stbl, "stco", 0, &stco);
+    if (co64 && !find_box(&stbl, "co64", 0, &stco))
+        return false;
+
+    uint32_t nstts, nstsc, nchunks, nsamples, nsync = 0;
+    unsigned char *stts_e = table(&stts, 0, 8, &nstts);
+    unsigned char *stsc_e = table(&stsc, 0, 12, &nstsc);
+    unsigned char *chunk_e = table(&stco, 0, co64 ? 8 : 4, &nchunks);
+    if (stts_e == NULL || stsc_e == NULL || chunk_e == NULL || stsz.size < 12)
+        return false;
+    // stsz has a sample size, which if 0, is followed by a table of sizes
+    uint32_t fixed_size = be32(stsz.data + 4);
+    unsigned char *size_e = NULL;
+    nsamples = be32(stsz.data + 8);
+    if (fixed_size == 0 && (size_e = table(&stsz, 4, 4, &nsamples)) == NULL)
+        return false;
+    // a table bounds its count, but a fixed size comes with any count;
+    // the samples must fit in the file, which also bounds the index
+    if (fixed_size != 0 && (uint64_t) nsamples * fixed_size > (uint64_t) e->size)
+        return false;
+    // without an stss box, every sample is a keyframe
+    unsigned char *sync_e = NULL;
+    if (find_box(&stbl, "stss", 0, &stss) && (sync_e = table(&stss, 0, 4, &nsync)) == NULL)
+        return false;
+
+    size_t max = sync_e ? nsync : nsamples;
+    e->keyframes = malloc((max ? max : 1) * sizeof *e->keyframes);
+    if (e->keyframes == NULL)
+        return false;
+
+    uint32_t sample = 1, stsc_i = 0, stts_i = 0, stts_left = nstts ? be32(stts_e) : 0, sync_i = 0;
+    uint64_t time = 0;
+    for (uint32_t chunk = 1; chunk <= nchunks && sample <= nsamples; chunk++) {
+        while (stsc_i + 1 < nstsc && be32(stsc_e + 12 * (stsc_i + 1)) <= chunk)
+            stsc_i++;
+        uint32_t per_chunk = nstsc ? be32(stsc_e + 12 * stsc_i + 4) : 0;
+        off_t offset = co64 ? be64(chunk_e + 8 * (chunk - 1)) : be32(chunk_e + 4 * (chunk - 1));
+
+        for (uint32_t k = 0; k < per_chunk && sample <= nsamples; k++, sample++) {
+            bool sync = sync_e == NULL;
+            if (sync_e != NULL && sync_i < nsync && be32(sync_e + 4 * sync_i) == sample) {
+                sync = true;
+                sync_i++;
+            }
+            if (sync && e->nkeyframes < max) {
+                e->keyframes[e->nkeyframes].time = time;
+                e->keyframes[e->nkeyframes].offset = layout_offset(e, offset);
+                e->nkeyframes++;
+            }
+            offset += fixed_size ? fixed_size : be32(size_e + 4 * (sample - 1));
+
+            while (stts_left == 0 && stts_i < nstts)
+                if (++stts_i < nstts)
+                    stts_left = be32(stts_e + 8 * stts_i);
+            if (stts_i < nstts) {
+                time += be32(stts_e + 8 * stts_i + 4);
+                stts_left--;
+            }
+        }
+    }
+    e->duration = time;
+    e->memory += max * sizeof *e->keyframes;
+    return e->nkeyframes > 0;
+}
+
+/* Move the chunk offsets in the moov copy that point between the
+ * first mdat and the moov box past the moov box.  Returns false if
+ * a 32-bit offset would overflow. */
+static bool
+patch_chunk_offsets(struct box *moov, off_t mdat_start, off_t moov_start, uint64_t shift)
+{
+    struct box trak;
+    for (int i = 0; find_box(moov, "trak", i, &trak); i++) {
+        struct box stbl, stco;
+        if (!find_path(&trak, "mdia/minf/stbl", &stbl))
+            continue;
+        bool co64 = !find_box(&stbl, "stco", 0, &stco);
+        if (co64 && !find_box(&stbl, "co64", 0, &stco))
+            continue;
+        uint32_t n;
+        unsigned char *p = table(&stco, 0, co64 ? 8 : 4, &n);
+        if (p == NULL)
+            return false;
+        for (uint32_t j = 0; j < n; j++) {
+            uint64_t o = co64 ? be64(p + 8 * j) : be32(p + 4 * j);
+            if (o < (uint64_t) mdat_start || o >= (uint64_t) moov_start)
+                continue;
+            o += shift;
+            if (co64) {
+                put_be32(p + 8 * j, o >> 32);
+                put_be32(p + 8 * j + 4, o);
+            } else if (o > UINT32_MAX) {
+                return false;
+            } else {
+                put_be32(p + 4 * j, o);
+            }
+        }
+    }
+    return true;
+}
+
+/* Set up the layout in which the file is served. */
+static void
+plan_layout(struct cache_entry *e, off_t mdat_start, off_t moov_start, uint64_t moov_size)
+{
+    struct mp4_segment *s = e->file.segments;
+    off_t moov_end = moov_start + moov_size;
+    struct box moov = { e->moov + 8, moov_size - 8 };
+    if (be32(e->moov) == 1)
+        moov.data += 8, moov.size -= 8;
+
+    if (!faststart || mdat_start < 0 || moov_start < mdat_start
+        || !patch_chunk_offsets(&moov, mdat_start, moov_start, moov_size)) {
+        free(e->moov);
+        e->moov = NULL;
+        s[0] = (struct mp4_segment) { 0, e->size, NULL, 0 };
+        e->file.nsegments = 1;
+        return;
+    }
+
+    int n = 0;
+    if (mdat_start > 0)
+        s[n++] = (struct mp4_segment) { 0, mdat_start, NULL, 0 };
+    s[n++] = (struct mp4_segment) { mdat_start, mdat_start + moov_size, e->moov, 0 };
+    s[n++] = (struct mp4_segment) { mdat_start + moov_size, moov_end, NULL, mdat_start };
+    if (moov_end < e->size)
+        s[n++] = (struct mp4_segment) { moov_end, e->size, NULL, moov_end };
+    e->file.nsegments = n;
+    e->memory += moov_size;
+}
+
+/* Parse the file open as fd into a new cache entry. */
+static struct cache_entry *
+parse(int fd, const struct stat *st)
+{
+    // find the first mdat and the moov box among the top-level boxes
+    off_t mdat_start = -1, moov_start = -1, pos = 0;
+    uint64_t moov_size = 0;
+    while (pos < st->st_size && moov_start == -1) {
+        unsigned char h[16];
+        ssize_t n = pread(fd, h, sizeof h, pos);
+        if (n < 8)
+            break;
+        uint64_t size = be32(h), header = 8;
+        if (size == 1) {
+            if (n < 16)
+                break;
+            size = be64(h + 8);
+            header = 16;
+        } else if (size == 0) {
+            size = st->st_size - pos;
+        }
+        if (size < header || size > (uint64_t) (st->st_size - pos))
+            break;
+        if (memcmp(h + 4, "mdat", 4) == 0 && mdat_start == -1)
+            mdat_start = pos;
+        if (memcmp(h + 4, "moov", 4) == 0) {
+            moov_start = pos;
+            moov_size = size;
+        }
+        pos += size;
+    }
+    if (moov_start == -1 || moov_size > MAX_MOOV)
+        return NULL;
+
+    struct cache_entry *e = calloc(1, sizeof *e);
+    if (e == NULL)
+        return NULL;
+    e->moov = malloc(moov_size);
+    if (e->moov == NULL || pread(fd, e->moov, moov_size, moov_start) != (ssize_t) moov_size)
+        goto fail;
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->size = st->st_size;
+    e->mtime = st->st_mtim;
+    e->memory = sizeof *e;
+
+    // index from an unpatched copy, so that offsets are the file's
+    unsigned char *orig = malloc(moov_size);
+    if (orig == NULL)
+        goto fail;
+    memcpy(orig, e->moov, moov_size);
+    plan_layout(e, mdat_start, moov_start, moov_size);
+
+    struct box moov = { orig + 8, moov_size - 8 };
+    if (be32(orig) == 1)
+        moov.data += 8, moov.size -= 8;
+    struct box trak;
+    bool indexed = false;
+    for (int i = 0; !indexed && find_box(&moov, "trak", i, &trak); i++)
+        if (is_video(&trak))
+            indexed = index_keyframes(e, &trak);
+    free(orig);
+    if (indexed)
+        return e;
+fail:
+    free(e->keyframes);
+    free(e->moov);
+    free(e);
+    return NULL;
+}
+
+static unsigned
+hash(dev_t dev, ino_t ino)
+{
+    return (unsigned) ((ino * 0x9E3779B97F4A7C15ULL) ^ dev) % NBUCKETS;
+}
+
+static void
+lru_unlink(struct cache_entry *e)
+{
+    e->lru_prev->lru_next = e->lru_next;
+    e->lru_next->lru_prev = e->lru_prev;
+}
+
+static void
+lru_push_front(struct cache_entry *e)
+{
+    e->lru_next = lru.lru_next;
+    e->lru_prev = &lru;
+    lru.lru_next->lru_prev = e;
+    lru.lru_next = e;
+}
+
+static void
+release(struct cache_entry *e)
+{
+    if (--e->refcount == 0) {
+        used -= e->memory;
+        free(e->keyframes);
+        free(e->moov);
+        free(e);
+    }
+}
+
+/* Remove an entry from the table; called with lock held. */
+static void
+remove_entry(struct cache_entry *e)
+{
+    struct cache_entry **pp = &buckets[hash(e->dev, e->ino)];
+    while (*pp != e)
+        pp = &(*pp)->next;
+    *pp = e->next;
+    lru_unlink(e);
+    release(e);
+}
+
+static void
+evict(void)
+{
+    struct cache_entry *e = lru.lru_prev;
+    while (used > CACHE_CAPACITY && e != &lru) {
+        struct cache_entry *prev = e->lru_prev;
+        if (e->refcount == 1) {
+            remove_entry(e);
+            evictions++;
+        }
+        e = prev;
+    }
+}
+
+static void
+mp4_report(FILE *out)
+{
+    pthread_mutex_lock(&lock);
+    fprintf(out, "hits: %lu, misses: %lu, unparsable: %lu, evictions: %lu, memory: %zu/%d bytes\n",
+            (unsigned long) hits, (unsigned long) misses, (unsigned long) unparsable,
+            (unsigned long) evictions, used, CACHE_CAPACITY);
+    pthread_mutex_unlock(&lock);
+}
+
+/* Set up the cache.  If enable_faststart, files whose moov box
+ * follows the media data are served in the faststart layout. */
+void
+mp4_init(bool enable_faststart)
+{
+    faststart = enable_faststart;
+    stats_register("mp4 index cache", mp4_report);
+}
+
+/* Return the index and layout of the MP4 file open as fd with
+ * attributes st, or NULL if it cannot be parsed.  The caller must
+ * mp4_put() it when done sending the file.
+ */
+struct mp4_file *
+mp4_get(int fd, const struct stat *st)
+{
+    unsigned h = hash(st->st_dev, st->st_ino);
+    pthread_mutex_lock(&lock);
+    for (struct cache_entry *e = buckets[h]; e != NULL; e = e->next) {
+        if (e->dev != st->st_dev || e->ino != st->st_ino)
+            continue;
+        if (e->size == st->st_size
+            && e->mtime.tv_sec == st->st_mtim.tv_sec
+            && e->mtime.tv_nsec == st->st_mtim.tv_nsec) {
+            e->refcount++;
+            lru_unlink(e);
+            lru_push_front(e);
+            hits++;
+            pthread_mutex_unlock(&lock);
+            return &e->file;
+        }
+        remove_entry(e);    // stale
+        break;
+    }
+    misses++;
+    pthread_mutex_unlock(&lock);
+
+    // parse outside the lock
+    struct cache_entry *e = parse(fd, st);
+    pthread_mutex_lock(&lock);
+    if (e == NULL) {
+        unparsable++;
+        pthread_mutex_unlock(&lock);
+        return NULL;
+    }
+    e->refcount = 2;        // the table's reference and the caller's
+
+    // another thread may have parsed the same file in the meantime
+    for (struct cache_entry *o = buckets[h]; o != NULL; o = o->next)
+        if (o->dev == e->dev && o->ino == e->ino) {
+            remove_entry(o);
+            break;
+        }
+    e->next = buckets[h];
+    buckets[h] = e;
+    lru_push_front(e);
+    used += e->memory;
+    evict();
+    pthread_mutex_unlock(&lock);
+    return &e->file;
+}
+
+/* Drop a reference obtained from mp4_get(). */
+void
+mp4_put(struct mp4_file *file)
+{
+    pthread_mutex_lock(&lock);
+    release((struct cache_entry *) file);
+    pthread_mutex_unlock(&lock);
+}
+
+/* Find the last keyframe at or before the given time.  Stores its
+ * offset in the served layout and its time in seconds. */
+bool
+mp4_seek(const struct mp4_file *file, double seconds, off_t *offset, double *keyframe_time)
+{
+    const struct cache_entry *e = (const struct cache_entry *) file;
+    if (!(seconds >= 0))
+        return false;
+    // any time past the end, even inf, seeks to the last keyframe;
+    // converting it to uint64_t unclamped would be undefined
+    double end = (double) e->duration / e->timescale;
+    if (seconds > end)
+        seconds = end;
+    uint64_t t = seconds * e->timescale;
+
+    size_t lo = 0, hi = e->nkeyframes;     // keyframes[lo].time <= t, if any is
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (e->keyframes[mid].time <= t)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    *offset = e->keyframes[lo].offset;
+    *keyframe_time = (double) e->keyframes[lo].time / e->timescale;
+    return true;
+}
+
+/* The file's average bitrate in bytes per second over the duration
+ * of its video track, or 0 if the duration is 0. */
+double
+mp4_bitrate(const struct mp4_file *file)
+{
+    const struct cache_entry *e = (const struct cache_entry *) file;
+    if (e->duration == 0)
+        return 0;
+    return e->size / ((double) e->duration / e->timescale);
+}
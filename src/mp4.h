@@ -0,0 +1,36 @@
+#ifndef _MP4_H
+#define _MP4_H
+/*
+ * An index of MP4 files for seeking by time, and a "faststart"
+ * layout of them with the moov box ahead of the media data.
+ *
+ * Files are parsed once and cached, keyed by their identity (device,
+ * inode, size, and modification time) like the file mapping cache.
+ */
+#include <stdbool.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define MP4_MAX_SEGMENTS 4
+
+/* A piece of the layout in which a file is served: bytes start to end
+ * are data in memory, or if data is NULL, the file's bytes from
+ * file_offset on. */
+struct mp4_segment {
+    off_t start, end;
+    const void *data;
+    off_t file_offset;
+};
+
+struct mp4_file {
+    struct mp4_segment segments[MP4_MAX_SEGMENTS];
+    int nsegments;                  // 1 if served as is
+};
+
+void mp4_init(bool faststart);
+struct mp4_file *mp4_get(int fd, const struct stat *st);
+void mp4_put(struct mp4_file *file);
+bool mp4_seek(const struct mp4_file *file, double seconds, off_t *offset, double *keyframe_time);
+double mp4_bitrate(const struct mp4_file *file);
+
+#endif /* _MP4_H */
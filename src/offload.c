@@ -0,0 +1,114 @@
+/*
+ * Offload thread pool.
+ *
+ * Jobs live on the stack of the thread or coroutine that waits for
+ * them and are queued in FIFO order under a mutex.  A waiting thread
+ * sleeps on a condition variable; a waiting coroutine is parked with
+ * scheduler_park() and unparked by the pool thread that ran its job.
+ */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "offload.h"
+#include "scheduler.h"
+#include "stats.h"
+
+struct job {
+    void (*fn)(void *);
+    void *arg;
+    struct task *task;          // waiting coroutine, or NULL
+    bool done;                  // for a waiting thread, under lock
+    struct job *next;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t finished = PTHREAD_COND_INITIALIZER;
+static struct job *head, *tail;
+static int nthreads;
+static atomic_ulong jobs_run, jobs_waiting;
+
+static void *
+offload_thread(void *arg)
+{
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        while (head == NULL)
+            pthread_cond_wait(&queued, &lock);
+        struct job *job = head;
+        head = job->next;
+        if (head == NULL)
+            tail = NULL;
+        pthread_mutex_unlock(&lock);
+        atomic_fetch_sub_explicit(&jobs_waiting, 1, memory_order_relaxed);
+
+        job->fn(job->arg);
+        atomic_fetch_add_explicit(&jobs_run, 1, memory_order_relaxed);
+
+        if (job->task != NULL) {
+            scheduler_unpark(job->task);
+        } else {
+            pthread_mutex_lock(&lock);
+            job->done = true;
+            pthread_cond_broadcast(&finished);
+            pthread_mutex_unlock(&lock);
+        }
+    }
+    return NULL;
+}
+
+static void
+offload_report(FILE *out)
+{
+    fprintf(out, "threads: %d, jobs run: %lu, queued: %lu\n", nthreads,
+            atomic_load(&jobs_run), atomic_load(&jobs_waiting));
+}
+
+/* Start a pool of n threads. */
+bool
+offload_start(int n)
+{
+    for (int i = 0; i < n; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, offload_thread, NULL) != 0) {
+            perror("pthread_create");
+            return false;
+        }
+        pthread_detach(thread);
+    }
+    nthreads = n;
+    stats_register("offload", offload_report);
+    return true;
+}
+
+/* Run fn(arg) on the pool and wait for it to finish.  Without a
+ * pool, fn runs on the calling thread. */
+void
+offload_run(void (*fn)(void *), void *arg)
+{
+    if (nthreads == 0) {
+        fn(arg);
+        return;
+    }
+
+    struct job job = { .fn = fn, .arg = arg, .task = scheduler_self() };
+    atomic_fetch_add_explicit(&jobs_waiting, 1, memory_order_relaxed);
+    pthread_mutex_lock(&lock);
+    if (tail)
+        tail->next = &job;
+    else
+        head = &job;
+    tail = &job;
+    pthread_cond_signal(&queued);
+
+    if (job.task != NULL) {
+        pthread_mutex_unlock(&lock);
+        scheduler_park();
+        return;
+    }
+    while (!job.done)
+        pthread_cond_wait(&finished, &lock);
+    pthread_mutex_unlock(&lock);
+}
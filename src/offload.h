@@ -0,0 +1,15 @@
+#ifndef _OFFLOAD_H
+#define _OFFLOAD_H
+/*
+ * A pool of threads for slow CPU-bound jobs, such as private-key
+ * operations, that should not hold up threads doing network I/O.
+ *
+ * offload_run() waits for the job to finish.  A coroutine parks
+ * meanwhile, so its scheduler runs other tasks.
+ */
+#include <stdbool.h>
+
+bool offload_start(int nthreads);
+void offload_run(void (*fn)(void *), void *arg);
+
+#endif /* _OFFLOAD_H */
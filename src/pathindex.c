@@ -0,0 +1,373 @@
+/*
+ * An immutable hash index of the files below the server root.
+ *
+ * Regular files are indexed under their request paths, with the
+ * request path rewrites done by the file system lookup precomputed:
+ * "/" maps to /index.html, and a path without a dot maps to the same
+ * path with .html appended.  A request path that is not in the index
+ * resolves to /200.html unless it contains "/api".  Request paths are
+ * normalized before the lookup; those with ".." segments are rejected.
+ *
+ * Readers use the current index under RCU.  When inotify reports a
+ * change, a background thread builds a new index, swaps the pointer,
+ * and frees the old index after a grace period.  Symbolic links to
+ * files are followed, but not those to directories.
+ */
+#include <sys/inotify.h>
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/limits.h>
+
+#include "pathindex.h"
+#include "rcu.h"
+#include "stats.h"
+#include "timing.h"
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+                    | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF)
+
+/* Wait for this long without further events before rebuilding. */
+#define SETTLE_MS 100
+
+struct index_file {
+    char *fname;                // root followed by the request path
+    char *stem;                 // request path without .html, or NULL
+    struct stat st;
+    bool denied;                // not readable by the server
+};
+
+struct index_slot {
+    uint64_t hash;
+    const char *key;            // NULL if empty
+    struct index_file *file;
+};
+
+struct path_index {
+    struct index_file *files;
+    size_t nfiles;
+    struct index_slot *slots;
+    size_t mask;                // number of slots - 1
+    size_t nkeys;
+    struct index_file *fallback;
+};
+
+bool pathindex_enabled = false;
+
+static char root_dir[PATH_MAX];
+static size_t root_len;
+static int inotify_fd = -1;
+static _Atomic(struct path_index *) current;
+static struct rcu_domain rcu = RCU_DOMAIN_INITIALIZER;
+
+static atomic_ulong rebuilds;
+static atomic_ulong last_build_us;
+
+static uint64_t
+hash_path(const char *s)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;     // FNV-1a
+    while (*s)
+        h = (h ^ (unsigned char) *s++) * 0x100000001b3ULL;
+    return h;
+}
+
+static struct index_file *
+find(struct path_index *index, const char *path)
+{
+    uint64_t h = hash_path(path);
+    for (size_t i = h & index->mask; index->slots[i].key != NULL; i = (i + 1) & index->mask)
+        if (index->slots[i].hash == h && !strcmp(index->slots[i].key, path))
+            return index->slots[i].file;
+    return NULL;
+}
+
+static void
+insert(struct path_index *index, const char *key, struct index_file *file)
+{
+    uint64_t h = hash_path(key);
+    size_t i = h & index->mask;
+    while (index->slots[i].key != NULL) {
+        if (index->slots[i].hash == h && !strcmp(index->slots[i].key, key))
+            return;
+        i = (i + 1) & index->mask;
+    }
+    index->slots[i] = (struct index_slot) { h, key, file };
+    index->nkeys++;
+}
+
+static void
+free_index(struct path_index *index)
+{
+    for (size_t i = 0; i < index->nfiles; i++) {
+        free(index->files[i].fname);
+        free(index->files[i].stem);
+    }
+    free(index->files);
+    free(index->slots);
+    free(index);
+}
+
+/* Add the files below the directory path, which is a buffer
+ * of PATH_MAX bytes holding len characters. */
+static bool
+walk(struct path_index *index, size_t *capacity, char *path, size_t len)
+{
+    if (inotify_fd != -1 && inotify_add_watch(inotify_fd, path, WATCH_MASK) == -1)
+        perror("inotify_add_watch");
+
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+        return errno == EACCES || errno == ENOENT;
+
+    bool ok = true;
+    struct dirent *ent;
+    while (ok && (ent = readdir(dir)) != NULL) {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+            continue;
+        int n = snprintf(path + len, PATH_MAX - len, "/%s", ent->d_name);
+        if (n >= PATH_MAX - len)
+            continue;
+
+        struct stat st;
+        if (stat(path, &st) == -1)
+            continue;
+        if (S_ISDIR(st.st_mode)) {
+            if (ent->d_type == DT_DIR)
+                ok = walk(index, capacity, path, len + n);
+        } else if (S_ISREG(st.st_mode)) {
+            if (index->nfiles == *capacity) {
+                *capacity = *capacity ? 2 * *capacity : 256;
+                struct index_file *files = realloc(index->files, *capacity * sizeof *files);
+                if (files == NULL) {
+                    ok = false;
+                    break;
+                }
+                index->files = files;
+            }
+            struct index_file *f = &index->files[index->nfiles];
+            *f = (struct index_file) {
+                .fname = strdup(path),
+                .st = st,
+                .denied = access(path, R_OK) == -1,
+            };
+            if (f->fname == NULL) {
+                ok = false;
+                break;
+            }
+            index->nfiles++;
+        }
+    }
+    path[len] = '\0';
+    closedir(dir);
+    return ok;
+}
+
+static bool
+has_dot(const char *path)
+{
+    return strchr(path, '.') != NULL;
+}
+
+static struct path_index *
+build_index(void)
+{
+    uint64_t start = timing_now();
+    struct path_index *index = calloc(1, sizeof *index);
+    if (index == NULL)
+        return NULL;
+
+    char path[PATH_MAX];
+    strcpy(path, root_dir);
+    size_t capacity = 0;
+    if (!walk(index, &capacity, path, root_len))
+        goto fail;
+
+    // at most two keys per file, plus "/", at a load factor <= 1/2
+    size_t nslots = 16;
+    while (nslots < 4 * (index->nfiles + 1))
+        nslots *= 2;
+    index->slots = calloc(nslots, sizeof *index->slots);
+    if (index->slots == NULL)
+        goto fail;
+    index->mask = nslots - 1;
+
+    // a path without a dot is always rewritten, so files
+    // without a dot in their path are never served
+    for (size_t i = 0; i < index->nfiles; i++) {
+        struct index_file *f = &index->files[i];
+        if (has_dot(f->fname + root_len))
+            insert(index, f->fname + root_len, f);
+    }
+    for (size_t i = 0; i < index->nfiles; i++) {
+        struct index_file *f = &index->files[i];
+        const char *rel = f->fname + root_len;
+        size_t len = strlen(rel);
+        if (len > 5 && !strcmp(rel + len - 5, ".html")) {
+            f->stem = strndup(rel, len - 5);
+            if (f->stem == NULL)
+                goto fail;
+            if (!has_dot(f->stem))
+                insert(index, f->stem, f);
+        }
+    }
+    struct index_file *home = find(index, "/index.html");
+    if (home != NULL)
+        insert(index, "/", home);
+    index->fallback = find(index, "/200.html");
+
+    atomic_store(&last_build_us, (timing_now() - start) / 1000);
+    return index;
+
+fail:
+    free_index(index);
+    return NULL;
+}
+
+/* Rebuild the index after changes below the root settle. */
+static void *
+watch_thread(void *arg)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        if (read(inotify_fd, buf, sizeof buf) == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("inotify read");
+            return NULL;
+        }
+        struct pollfd pfd = { .fd = inotify_fd, .events = POLLIN };
+        while (poll(&pfd, 1, SETTLE_MS) > 0)
+            if (read(inotify_fd, buf, sizeof buf) == -1 && errno != EINTR)
+                break;
+
+        struct path_index *index = build_index();
+        if (index == NULL) {
+            fprintf(stderr, "Could not rebuild the index of %s, keeping the old one\n", root_dir);
+            continue;
+        }
+        struct path_index *old = rcu_dereference(current);
+        rcu_assign(current, index);
+        rcu_synchronize(&rcu);
+        free_index(old);
+        atomic_fetch_add(&rebuilds, 1);
+    }
+}
+
+static void
+pathindex_report(FILE *out)
+{
+    int idx = rcu_read_lock(&rcu);
+    struct path_index *index = rcu_dereference(current);
+    fprintf(out, "files: %zu, paths: %zu, rebuilds: %lu, last build: %.3fms\n",
+            index->nfiles, index->nkeys, atomic_load(&rebuilds),
+            atomic_load(&last_build_us) / 1e3);
+    rcu_read_unlock(&rcu, idx);
+}
+
+/* Index the files below root and watch it for changes. */
+bool
+pathindex_init(const char *root)
+{
+    if (strlen(root) >= PATH_MAX) {
+        fprintf(stderr, "%s: path too long\n", root);
+        return false;
+    }
+    strcpy(root_dir, root);
+    root_len = strlen(root_dir);
+    while (root_len > 1 && root_dir[root_len - 1] == '/')
+        root_dir[--root_len] = '\0';
+
+    inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd == -1)
+        perror("inotify_init1, the index will not be updated");
+
+    struct path_index *index = build_index();
+    if (index == NULL) {
+        fprintf(stderr, "Could not index %s\n", root_dir);
+        return false;
+    }
+    rcu_assign(current, index);
+
+    if (inotify_fd != -1) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, watch_thread, NULL) != 0) {
+            perror("pthread_create");
+            return false;
+        }
+        pthread_detach(thread);
+    }
+    pathindex_enabled = true;
+    stats_register("path index", pathindex_report);
+    return true;
+}
+
+/* Normalize a request path as the file system would resolve it:
+ * collapse repeated slashes and drop "." segments.  A trailing slash
+ * is kept.  Returns false for paths with ".." segments, which the
+ * index cannot resolve, or that do not fit. */
+static bool
+normalize_path(const char *path, char *out, size_t size)
+{
+    size_t len = 0;
+    const char *p = path;
+    while (*p != '\0') {
+        while (*p == '/')
+            p++;
+        size_t seg = strcspn(p, "/");
+        if (seg == 2 && p[0] == '.' && p[1] == '.')
+            return false;
+        if (seg > 0 && !(seg == 1 && p[0] == '.')) {
+            if (len + 1 + seg >= size)
+                return false;
+            out[len++] = '/';
+            memcpy(out + len, p, seg);
+            len += seg;
+        }
+        p += seg;
+    }
+    if (len == 0 || (p > path && p[-1] == '/')) {
+        if (len + 1 >= size)
+            return false;
+        out[len++] = '/';
+    }
+    out[len] = '\0';
+    return true;
+}
+
+/* Resolve a request path like the file system lookup in http.c would.
+ * On success, returns HTTP_OK with the file's name and attributes
+ * in fname and *st.  Otherwise, returns the status to report.
+ */
+enum http_response_status
+pathindex_lookup(const char *req_path, char *fname, struct stat *st)
+{
+    char path[PATH_MAX];
+    if (!normalize_path(req_path, path, sizeof path))
+        return HTTP_NOT_FOUND;
+
+    enum http_response_status status = HTTP_OK;
+    int idx = rcu_read_lock(&rcu);
+    struct path_index *index = rcu_dereference(current);
+
+    struct index_file *f = find(index, path);
+    if (f != NULL && f->denied)
+        status = HTTP_PERMISSION_DENIED;
+    else if (f == NULL && !strstr(path, "/api"))
+        f = index->fallback;
+
+    if (status == HTTP_OK && (f == NULL || f->denied))
+        status = HTTP_NOT_FOUND;
+    if (status == HTTP_OK) {
+        strcpy(fname, f->fname);
+        *st = f->st;
+    }
+    rcu_read_unlock(&rcu, idx);
+    return status;
+}
@@ -0,0 +1,20 @@
+#ifndef _PATHINDEX_H
+#define _PATHINDEX_H
+/*
+ * An in-memory index of the files below server_root, mapping request
+ * paths to file names and attributes without touching the file system.
+ *
+ * The index is built at startup and rebuilt whenever inotify reports
+ * a change below the root.
+ */
+#include <stdbool.h>
+#include <sys/stat.h>
+
+#include "http.h"
+
+extern bool pathindex_enabled;
+
+bool pathindex_init(const char *root);
+enum http_response_status pathindex_lookup(const char *req_path, char *fname, struct stat *st);
+
+#endif /* _PATHINDEX_H */
@@ -0,0 +1,230 @@
+/*
+ * Pre-forked worker processes.
+ *
+ * The master blocks SIGCHLD and SIGUSR1 and reads them from a signalfd,
+ * polled together with the descriptor that handoff_start() makes
+ * readable once the listening sockets were handed to a new instance.
+ * SIGUSR1 is passed on to the workers, which report their own
+ * statistics.  A worker that dies is forked again; if it died within
+ * RESTART_DELAY of starting, only after that delay, so that a worker
+ * that cannot start does not keep the master forking.
+ *
+ * Each worker accepts on its own TCP listener, or shares one with other
+ * workers if there are fewer listeners than workers, and on all UNIX
+ * domain listeners.  It closes the others, which the master holds.
+ *
+ * The workers hold the read end of a pipe whose write end only the
+ * master holds.  It becomes readable when the master closes it after a
+ * handoff, or when the master dies, upon which the workers stop
+ * accepting and drain their connections as a single process does.
+ */
+#define _GNU_SOURCE
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "prefork.h"
+#include "handoff.h"
+
+#define RESTART_DELAY 1             // seconds
+
+struct worker {
+    pid_t pid;                      // 0 if not running
+    time_t started;                 // or when to restart it
+};
+
+static struct worker *workers;
+static int nworkers;
+static sigset_t old_mask;
+static int signal_fd = -1;
+static int hangup[2];               // the workers hold the read end
+
+static bool
+is_unix(int s)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof addr;
+    return getsockname(s, (struct sockaddr *) &addr, &len) == 0 && addr.ss_family == AF_UNIX;
+}
+
+/* Close the TCP listeners worker i does not accept on. */
+static void
+select_listeners(int i, int *listeners, int *nlisteners)
+{
+    int ntcp = 0;
+    for (int j = 0; j < *nlisteners; j++)
+        if (!is_unix(listeners[j]))
+            ntcp++;
+
+    int n = 0, tcp = 0;
+    for (int j = 0; j < *nlisteners; j++) {
+        bool keep = true;
+        if (!is_unix(listeners[j])) {
+            keep = ntcp >= nworkers ? tcp % nworkers == i : tcp == i % ntcp;
+            tcp++;
+        }
+        if (keep)
+            listeners[n++] = listeners[j];
+        else
+            close(listeners[j]);
+    }
+    *nlisteners = n;
+}
+
+/* Fork worker i.  Returns 0 in the worker, -1 on error. */
+static pid_t
+fork_worker(int i, int wake_fd, int *listeners, int *nlisteners)
+{
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return -1;
+    }
+    if (pid > 0) {
+        workers[i].pid = pid;
+        workers[i].started = time(NULL);
+        return pid;
+    }
+
+    close(signal_fd);
+    close(hangup[1]);
+    if (wake_fd != -1)
+        close(wake_fd);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    select_listeners(i, listeners, nlisteners);
+    return 0;
+}
+
+static void
+reap_workers(void)
+{
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (int i = 0; i < nworkers; i++) {
+            if (workers[i].pid != pid)
+                continue;
+            if (WIFSIGNALED(status))
+                fprintf(stderr, "worker %d (pid %d) killed by signal %d, restarting\n",
+                        i, (int) pid, WTERMSIG(status));
+            else
+                fprintf(stderr, "worker %d (pid %d) exited with status %d, restarting\n",
+                        i, (int) pid, WEXITSTATUS(status));
+            time_t now = time(NULL);
+            workers[i].pid = 0;
+            workers[i].started = now - workers[i].started < RESTART_DELAY ? now + RESTART_DELAY : now;
+        }
+    }
+}
+
+static void
+signal_workers(int sig)
+{
+    for (int i = 0; i < nworkers; i++)
+        if (workers[i].pid != 0)
+            kill(workers[i].pid, sig);
+}
+
+/*
+ * Fork nworkers workers to accept on the listening sockets and restart
+ * them when they die, until the sockets are handed to a new instance,
+ * upon which the master waits for the workers and exits.  In each
+ * worker, returns a descriptor that becomes readable when the worker
+ * is to stop accepting, with the worker's listening sockets left in
+ * listeners[].  Returns -1 on error.
+ */
+int
+prefork_start(int n, int *listeners, int *nlisteners)
+{
+    nworkers = n;
+    workers = calloc(n, sizeof *workers);
+    if (workers == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd == -1) {
+        perror("signalfd");
+        return -1;
+    }
+    if (pipe2(hangup, O_CLOEXEC) == -1) {
+        perror("pipe2");
+        return -1;
+    }
+
+    for (int i = 0; i < nworkers; i++) {
+        pid_t pid = fork_worker(i, -1, listeners, nlisteners);
+        if (pid == 0)
+            return hangup[0];
+        if (pid == -1)
+            return -1;
+    }
+    fprintf(stderr, "started %d workers\n", nworkers);
+
+    int wake_fd = handoff_start(listeners, *nlisteners);
+    if (wake_fd == -1)
+        return -1;
+
+    for (;;) {
+        time_t now = time(NULL);
+        bool pending = false;
+        for (int i = 0; i < nworkers; i++) {
+            if (workers[i].pid != 0)
+                continue;
+            if (workers[i].started > now) {
+                pending = true;
+                continue;
+            }
+            pid_t pid = fork_worker(i, wake_fd, listeners, nlisteners);
+            if (pid == 0)
+                return hangup[0];
+            if (pid == -1) {
+                workers[i].started = now + RESTART_DELAY;
+                pending = true;
+            }
+        }
+
+        struct pollfd pfd[2] = {
+            { .fd = signal_fd, .events = POLLIN },
+            { .fd = wake_fd, .events = POLLIN },
+        };
+        if (poll(pfd, 2, pending ? RESTART_DELAY * 1000 : -1) == -1 && errno != EINTR) {
+            perror("poll");
+            return -1;
+        }
+        if (pfd[1].revents != 0)
+            break;
+
+        struct signalfd_siginfo si;
+        while (read(signal_fd, &si, sizeof si) == sizeof si)
+            if (si.ssi_signo == SIGUSR1)
+                signal_workers(SIGUSR1);
+        reap_workers();
+    }
+
+    // handed off: tell the workers to drain, and wait for them
+    close(hangup[1]);
+    for (int i = 0; i < *nlisteners; i++)
+        close(listeners[i]);
+    fprintf(stderr, "handed off listening sockets, waiting for workers\n");
+    while (wait(NULL) > 0 || errno == EINTR)
+        continue;
+    exit(EXIT_SUCCESS);
+}
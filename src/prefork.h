@@ -0,0 +1,15 @@
+#ifndef _PREFORK_H
+#define _PREFORK_H
+/*
+ * Pre-forked worker processes (-P).
+ *
+ * A master process forks the workers, which serve clients as a single
+ * process would, and restarts any worker that dies.  Each worker has
+ * its own SO_REUSEPORT listening socket, held open by the master, so
+ * the connections queued on it wait for the restarted worker rather
+ * than being reset.  UNIX domain listeners are shared by all workers.
+ */
+
+int prefork_start(int nworkers, int *listeners, int *nlisteners);
+
+#endif /* _PREFORK_H */
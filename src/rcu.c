@@ -0,0 +1,51 @@
+/*
+ * A minimal sleepable RCU.
+ *
+ * Readers count themselves in one of two counters selected by the
+ * parity of the current epoch.  rcu_synchronize() advances the epoch
+ * and waits for the counter of the previous parity to drain, twice,
+ * so that a reader that sampled the epoch just before an advance is
+ * waited for as well.
+ */
+#include <sched.h>
+#include <unistd.h>
+
+#include "rcu.h"
+
+/* Enter a read-side critical section; pass the result to rcu_read_unlock. */
+int
+rcu_read_lock(struct rcu_domain *d)
+{
+    int idx = atomic_load(&d->epoch) & 1;
+    atomic_fetch_add(&d->readers[idx], 1);
+    return idx;
+}
+
+void
+rcu_read_unlock(struct rcu_domain *d, int idx)
+{
+    atomic_fetch_sub(&d->readers[idx], 1);
+}
+
+static void
+wait_for_readers(struct rcu_domain *d)
+{
+    int old = atomic_fetch_add(&d->epoch, 1) & 1;
+    for (int spins = 0; atomic_load(&d->readers[old]) != 0; spins++) {
+        if (spins < 100)
+            sched_yield();
+        else
+            usleep(1000);
+    }
+}
+
+/* Wait until all read-side critical sections that started before
+ * this call have ended. */
+void
+rcu_synchronize(struct rcu_domain *d)
+{
+    pthread_mutex_lock(&d->writer);
+    wait_for_readers(d);
+    wait_for_readers(d);
+    pthread_mutex_unlock(&d->writer);
+}
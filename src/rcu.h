@@ -0,0 +1,30 @@
+#ifndef _RCU_H
+#define _RCU_H
+/*
+ * Read-copy-update for data structures that are read on every request
+ * and replaced wholesale on rare updates.
+ *
+ * Readers bracket their accesses with rcu_read_lock()/rcu_read_unlock()
+ * and never block writers.  A writer publishes a new version with
+ * rcu_assign(), then calls rcu_synchronize() to wait until no reader
+ * can still see the old one before freeing it.
+ */
+#include <stdatomic.h>
+#include <pthread.h>
+
+struct rcu_domain {
+    atomic_uint epoch;
+    atomic_long readers[2];         // active readers per epoch parity
+    pthread_mutex_t writer;
+};
+
+#define RCU_DOMAIN_INITIALIZER { 0, { 0, 0 }, PTHREAD_MUTEX_INITIALIZER }
+
+#define rcu_dereference(p) atomic_load_explicit(&(p), memory_order_acquire)
+#define rcu_assign(p, v) atomic_store_explicit(&(p), (v), memory_order_release)
+
+int rcu_read_lock(struct rcu_domain *d);
+void rcu_read_unlock(struct rcu_domain *d, int idx);
+void rcu_synchronize(struct rcu_domain *d);
+
+#endif /* _RCU_H */
@@ -0,0 +1,294 @@
+/*
+ * Readahead I/O thread.
+ *
+ * The requests for a file are matched against a few stream cursors,
+ * the offsets at which the file's recent responses ended.  A request
+ * that starts near a cursor continues a sequential stream and is given
+ * the full readahead window; any other request starts a new stream,
+ * replacing the least recently used cursor, with a quarter of it.
+ * Files are tracked in a small direct-mapped table under a mutex; a
+ * file that has not been requested for FILE_IDLE seconds is forgotten.
+ *
+ * A stream is dropped behind once it has sent uncached_size bytes,
+ * unless the file has other streams, whose pages we would take away.
+ *
+ * The posix_fadvise() calls are made by the I/O thread, so that a
+ * sender never blocks on the disk queue for them.  Queued hints hold
+ * a duplicate of the file descriptor.  When the queue is full, hints
+ * are lost, which only costs the I/O they would have saved.  Pages
+ * that sendfile() queued on a socket cannot be dropped until the
+ * client has received them, so the I/O thread holds DONTNEED hints
+ * back for DROP_DELAY, and a stream is dropped DROP_LAG behind the
+ * sender until its response ends.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "readahead.h"
+#include "stats.h"
+
+#define NFILES 256
+#define NCURSORS 4
+#define SEQ_SLACK (256 << 10)       // distance from a cursor that is sequential
+#define FILE_IDLE 60                // seconds
+#define MIN_WINDOW (128 << 10)
+#define DROP_LAG (4 << 20)          // bytes
+#define DROP_DELAY 1                // seconds
+#define QUEUE_SIZE 256
+
+struct cursor {
+    off_t next;                     // where the stream's last response ended
+    off_t prefetched;               // end of what was prefetched for it
+    off_t bytes;                    // sent by the stream so far
+    time_t seen;                    // 0 if unused
+};
+
+struct file_state {
+    dev_t dev;
+    ino_t ino;
+    time_t seen;
+    struct cursor cursors[NCURSORS];
+};
+
+struct hint {
+    int fd;                         // a duplicate, closed once the hint is given
+    off_t offset, len;
+    int advice;
+    struct timespec due;            // for DONTNEED, when to give it
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct file_state files[NFILES];
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued = PTHREAD_COND_INITIALIZER;
+static struct hint queue[QUEUE_SIZE];
+static unsigned queue_head, queue_count;
+
+// DONTNEED hints held back by the I/O thread, in order of due time
+static struct hint deferred[QUEUE_SIZE];
+static unsigned deferred_head, deferred_count;
+
+static bool started;
+static off_t max_window, uncached_size;
+static atomic_ulong streams, sequential, prefetched_bytes, dropped_bytes, hints_lost;
+
+static void
+give(struct hint *h)
+{
+    posix_fadvise(h->fd, h->offset, h->len, h->advice);
+    close(h->fd);
+}
+
+static bool
+due(const struct timespec *t)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec > t->tv_sec || (now.tv_sec == t->tv_sec && now.tv_nsec >= t->tv_nsec);
+}
+
+static void *
+io_thread(void *arg)
+{
+    for (;;) {
+        while (deferred_count > 0 && due(&deferred[deferred_head].due)) {
+            give(&deferred[deferred_head]);
+            deferred_head = (deferred_head + 1) % QUEUE_SIZE;
+            deferred_count--;
+        }
+
+        pthread_mutex_lock(&queue_lock);
+        while (queue_count == 0) {
+            if (deferred_count == 0)
+                pthread_cond_wait(&queued, &queue_lock);
+            else if (pthread_cond_timedwait(&queued, &queue_lock, &deferred[deferred_head].due) == ETIMEDOUT)
+                break;
+        }
+        if (queue_count == 0) {
+            pthread_mutex_unlock(&queue_lock);
+            continue;
+        }
+        struct hint h = queue[queue_head];
+        queue_head = (queue_head + 1) % QUEUE_SIZE;
+        queue_count--;
+        pthread_mutex_unlock(&queue_lock);
+
+        if (h.advice == POSIX_FADV_DONTNEED && deferred_count < QUEUE_SIZE)
+            deferred[(deferred_head + deferred_count++) % QUEUE_SIZE] = h;
+        else
+            give(&h);
+    }
+    return NULL;
+}
+
+static bool
+queue_hint(int fd, off_t offset, off_t len, int advice)
+{
+    int dupfd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (dupfd == -1) {
+        atomic_fetch_add_explicit(&hints_lost, 1, memory_order_relaxed);
+        return false;
+    }
+    pthread_mutex_lock(&queue_lock);
+    if (queue_count == QUEUE_SIZE) {
+        pthread_mutex_unlock(&queue_lock);
+        close(dupfd);
+        atomic_fetch_add_explicit(&hints_lost, 1, memory_order_relaxed);
+        return false;
+    }
+    struct hint *h = &queue[(queue_head + queue_count++) % QUEUE_SIZE];
+    *h = (struct hint) { dupfd, offset, len, advice };
+    clock_gettime(CLOCK_REALTIME, &h->due);
+    h->due.tv_sec += DROP_DELAY;
+    pthread_cond_signal(&queued);
+    pthread_mutex_unlock(&queue_lock);
+    return true;
+}
+
+static void
+drop_until(struct readahead *ra, off_t pos)
+{
+    if (queue_hint(ra->fd, ra->dropped, pos - ra->dropped, POSIX_FADV_DONTNEED))
+        atomic_fetch_add_explicit(&dropped_bytes, pos - ra->dropped, memory_order_relaxed);
+    ra->dropped = pos;
+}
+
+static unsigned
+hash(dev_t dev, ino_t ino)
+{
+    return (unsigned) ((ino * 0x9E3779B97F4A7C15ULL) ^ dev) % NFILES;
+}
+
+static void
+readahead_report(FILE *out)
+{
+    pthread_mutex_lock(&queue_lock);
+    unsigned n = queue_count;
+    pthread_mutex_unlock(&queue_lock);
+    fprintf(out, "streams: %lu, sequential requests: %lu, prefetched: %lu KB, "
+            "dropped: %lu KB, hints queued: %u, lost: %lu\n",
+            atomic_load(&streams), atomic_load(&sequential),
+            atomic_load(&prefetched_bytes) >> 10, atomic_load(&dropped_bytes) >> 10,
+            n, atomic_load(&hints_lost));
+}
+
+/* Start the I/O thread, to prefetch up to window_kb ahead of senders
+ * and drop streams behind once they sent uncached_mb.  Either may be
+ * 0 to turn it off. */
+bool
+readahead_start(int window_kb, int uncached_mb)
+{
+    max_window = (off_t) window_kb << 10;
+    uncached_size = (off_t) uncached_mb << 20;
+    if (max_window == 0 && uncached_size == 0)
+        return true;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, io_thread, NULL) != 0) {
+        perror("pthread_create");
+        return false;
+    }
+    pthread_detach(thread);
+    started = true;
+    stats_register("readahead", readahead_report);
+    return true;
+}
+
+/* Begin sending bytes from to to of file fd. */
+void
+readahead_begin(struct readahead *ra, int fd, const struct stat *st, off_t from, off_t to)
+{
+    ra->fd = fd;
+    ra->dev = st->st_dev;
+    ra->ino = st->st_ino;
+    ra->size = st->st_size;
+    ra->window = 0;
+    ra->prefetched = ra->dropped = from;
+    ra->drop_behind = false;
+    if (!started)
+        return;
+
+    time_t now = time(NULL);
+    pthread_mutex_lock(&lock);
+    struct file_state *f = &files[hash(st->st_dev, st->st_ino)];
+    if (f->dev != st->st_dev || f->ino != st->st_ino || now - f->seen > FILE_IDLE) {
+        memset(f, 0, sizeof *f);
+        f->dev = st->st_dev;
+        f->ino = st->st_ino;
+    }
+    f->seen = now;
+
+    struct cursor *c = NULL, *lru = &f->cursors[0];
+    int active = 0;
+    for (int i = 0; i < NCURSORS; i++) {
+        struct cursor *cur = &f->cursors[i];
+        if (cur->seen != 0 && now - cur->seen <= FILE_IDLE)
+            active++;
+        if (c == NULL && cur->seen != 0 && from >= cur->next - SEQ_SLACK && from <= cur->next + SEQ_SLACK)
+            c = cur;
+        if (cur->seen < lru->seen)
+            lru = cur;
+    }
+    bool continued = c != NULL;
+    if (!continued) {
+        c = lru;
+        if (c->seen == 0 || now - c->seen > FILE_IDLE)
+            active++;
+        c->bytes = 0;
+        c->prefetched = 0;
+    }
+    if (c->prefetched > from)
+        ra->prefetched = c->prefetched;
+    c->next = to + 1;
+    c->bytes += to + 1 - from;
+    c->seen = now;
+    ra->drop_behind = uncached_size > 0 && active == 1 && c->bytes >= uncached_size;
+    pthread_mutex_unlock(&lock);
+
+    atomic_fetch_add_explicit(continued ? &sequential : &streams, 1, memory_order_relaxed);
+    ra->window = max_window;
+    if (!continued && max_window / 4 >= MIN_WINDOW)
+        ra->window = max_window / 4;
+    readahead_progress(ra, from);
+}
+
+/* Note that the bytes before pos have been sent. */
+void
+readahead_progress(struct readahead *ra, off_t pos)
+{
+    if (ra->window > 0 && pos + ra->window / 2 >= ra->prefetched && ra->prefetched < ra->size) {
+        off_t start = pos > ra->prefetched ? pos : ra->prefetched;
+        off_t end = pos + ra->window < ra->size ? pos + ra->window : ra->size;
+        if (end > start && queue_hint(ra->fd, start, end - start, POSIX_FADV_WILLNEED)) {
+            atomic_fetch_add_explicit(&prefetched_bytes, end - start, memory_order_relaxed);
+            ra->prefetched = end;
+        }
+    }
+    if (ra->drop_behind && pos - DROP_LAG >= ra->dropped + DROP_LAG)
+        drop_until(ra, pos - DROP_LAG);
+}
+
+/* Finish sending, pos being where the response ended. */
+void
+readahead_end(struct readahead *ra, off_t pos)
+{
+    if (ra->window > 0) {
+        // remember what was prefetched for the stream's next request
+        pthread_mutex_lock(&lock);
+        struct file_state *f = &files[hash(ra->dev, ra->ino)];
+        for (int i = 0; f->dev == ra->dev && f->ino == ra->ino && i < NCURSORS; i++)
+            if (f->cursors[i].next == pos && f->cursors[i].prefetched < ra->prefetched)
+                f->cursors[i].prefetched = ra->prefetched;
+        pthread_mutex_unlock(&lock);
+    }
+    if (ra->drop_behind && pos > ra->dropped)
+        drop_until(ra, pos);
+}
@@ -0,0 +1,35 @@
+#ifndef _READAHEAD_H
+#define _READAHEAD_H
+/*
+ * Readahead and page cache management for files sent with sendfile.
+ *
+ * A background I/O thread prefetches (POSIX_FADV_WILLNEED) the part of
+ * a file ahead of what is being sent, so that a seek into a cold file
+ * does not stall on one synchronous read after another.  Clients
+ * reading a file sequentially in ranges, as video players do, get a
+ * larger window.  A one-off download of a huge file is dropped from
+ * the page cache behind the sender (POSIX_FADV_DONTNEED), so that it
+ * does not evict the hot small files.
+ */
+#include <stdbool.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* The state of one response being sent. */
+struct readahead {
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    off_t size;                 // of the file
+    off_t window;               // bytes to keep prefetched, 0 for none
+    off_t prefetched;           // end of what was prefetched
+    bool drop_behind;           // drop sent pages from the page cache
+    off_t dropped;              // end of what was dropped
+};
+
+bool readahead_start(int window_kb, int uncached_mb);
+void readahead_begin(struct readahead *ra, int fd, const struct stat *st, off_t from, off_t to);
+void readahead_progress(struct readahead *ra, off_t pos);
+void readahead_end(struct readahead *ra, off_t pos);
+
+#endif /* _READAHEAD_H */
@@ -0,0 +1,402 @@
+/*
+ * Revoked tokens.
+ *
+ * A token is identified by a 128-bit hash of its id, see token_id():
+ * its jti claim, which the signer makes unique, rather than its text,
+ * which can be varied without invalidating it.  Revoked tokens are
+ * kept with their expiry time in an open-addressing hash table
+ * protected by a mutex.  Once a token has expired, token_validate()
+ * rejects it anyway, and its entry is dropped by a garbage collection
+ * that runs at most every GC_INTERVAL seconds, when a token is revoked
+ * or the table is consulted.
+ *
+ * In front of the table is a counting Bloom filter of one-byte
+ * counters.  Checking a token that was never revoked, which is nearly
+ * every check, reads BLOOM_PROBES counters with relaxed atomic loads
+ * and takes no lock.  Counters only change with the mutex held, when
+ * entries are added or collected.  A counter that reaches 255 stays
+ * there, which only costs false positives.
+ *
+ * If a path is given, revocations are appended to the file as they
+ * happen and loaded from it at startup.  The file is rewritten without
+ * expired entries when they are collected.
+ *
+ * With worker processes (-P), the store is set up by the master, and
+ * each worker has its own copy.  Revocations are also written to a
+ * journal in shared memory, a ring of JOURNAL_SIZE entries each marked
+ * with its position once written, which every worker replays into its
+ * copy before consulting it.  A worker that fell further behind than
+ * that reloads the file, if there is one, and otherwise counts the
+ * revocations as lost.  Workers do not rewrite the file, since the
+ * others would go on appending to the replaced one.
+ */
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "revoke.h"
+#include "stats.h"
+#include "token.h"
+#include "main.h"
+
+#define BLOOM_SIZE (1 << 20)        // counters, a power of 2
+#define BLOOM_PROBES 4
+#define GC_INTERVAL 60              // seconds
+#define MIN_CAPACITY 64
+#define JOURNAL_SIZE (1 << 18)      // entries, 8 MB
+
+struct entry {
+    uint64_t h[2];                  // h[1] is odd; 0 marks an empty slot
+    time_t exp;                     // 0 if the token does not expire
+};
+
+static atomic_uchar bloom[BLOOM_SIZE];
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct entry *table;
+static size_t capacity, count;
+static time_t next_gc;
+static char *log_path;
+static int log_fd = -1;
+static atomic_ulong bloom_hits, false_positives;
+
+struct journal_entry {
+    _Atomic uint64_t seq;           // position + 1, 0 while being written
+    struct entry e;
+};
+
+struct journal {
+    _Atomic uint64_t head;          // position of the next entry
+    struct journal_entry entries[JOURNAL_SIZE];
+};
+
+static struct journal *journal;     // shared by the workers, if any
+static _Atomic uint64_t replayed;   // journal entries replayed, under lock
+static atomic_ulong journal_lost;
+
+static inline uint64_t
+mix64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static void
+token_hash(const char *token, uint64_t h[2])
+{
+    char id[2048];
+    const char *key = token_id(token, id, sizeof id) ? id : token;
+    size_t len = strlen(key);
+
+    uint64_t a = len, b = ~(uint64_t) len;
+    for (; len >= 8; key += 8, len -= 8) {
+        uint64_t w;
+        memcpy(&w, key, 8);
+        a = mix64(a ^ w);
+        b = (b ^ w) * 0x9e3779b97f4a7c15ULL;
+    }
+    uint64_t w = 0;
+    memcpy(&w, key, len);
+    h[0] = mix64(a ^ w);
+    h[1] = mix64(b ^ w) | 1;
+}
+
+static inline size_t
+probe(const uint64_t h[2], int i)
+{
+    return (h[0] + i * h[1]) & (BLOOM_SIZE - 1);
+}
+
+static bool
+bloom_maybe(const uint64_t h[2])
+{
+    for (int i = 0; i < BLOOM_PROBES; i++)
+        if (atomic_load_explicit(&bloom[probe(h, i)], memory_order_relaxed) == 0)
+            return false;
+    return true;
+}
+
+static void
+bloom_change(const uint64_t h[2], int delta)
+{
+    for (int i = 0; i < BLOOM_PROBES; i++) {
+        atomic_uchar *c = &bloom[probe(h, i)];
+        unsigned char v = atomic_load_explicit(c, memory_order_relaxed);
+        if (v < 255 && (delta > 0 || v > 0))
+            atomic_store_explicit(c, v + delta, memory_order_relaxed);
+    }
+}
+
+static bool
+expired(const struct entry *e, time_t now)
+{
+    return e->exp != 0 && e->exp < now;
+}
+
+static struct entry *
+find_slot(struct entry *tab, size_t cap, const uint64_t h[2])
+{
+    size_t i = h[0] & (cap - 1);
+    while (tab[i].h[1] != 0 && (tab[i].h[0] != h[0] || tab[i].h[1] != h[1]))
+        i = (i + 1) & (cap - 1);
+    return &tab[i];
+}
+
+/* Move the entries into a table of new_capacity slots, dropping those
+ * that expired before now, unless now is 0. */
+static void
+rebuild(size_t new_capacity, time_t now)
+{
+    struct entry *tab = calloc(new_capacity, sizeof *tab);
+    if (tab == NULL) {
+        perror("can't alloc memory: ");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < capacity; i++) {
+        struct entry *e = &table[i];
+        if (e->h[1] == 0)
+            continue;
+        if (now != 0 && expired(e, now)) {
+            bloom_change(e->h, -1);
+            count--;
+            continue;
+        }
+        *find_slot(tab, new_capacity, e->h) = *e;
+    }
+    free(table);
+    table = tab;
+    capacity = new_capacity;
+}
+
+static bool
+insert(const uint64_t h[2], time_t exp)
+{
+    if ((count + 1) * 2 > capacity)
+        rebuild(capacity ? capacity * 2 : MIN_CAPACITY, 0);
+    struct entry *e = find_slot(table, capacity, h);
+    if (e->h[1] != 0)
+        return false;
+    e->h[0] = h[0];
+    e->h[1] = h[1];
+    e->exp = exp;
+    count++;
+    bloom_change(h, +1);
+    return true;
+}
+
+static void
+append_record(int fd, const struct entry *e)
+{
+    if (dprintf(fd, "%016llx %016llx %lld\n", (unsigned long long) e->h[0],
+                (unsigned long long) e->h[1], (long long) e->exp) < 0)
+        perror(log_path);
+}
+
+/* Replace the log with one holding just the current entries. */
+static void
+rewrite_log(void)
+{
+    char tmp[strlen(log_path) + 5];
+    snprintf(tmp, sizeof tmp, "%s.tmp", log_path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        perror(tmp);
+        return;
+    }
+    for (size_t i = 0; i < capacity; i++)
+        if (table[i].h[1] != 0)
+            append_record(fd, &table[i]);
+    if (rename(tmp, log_path) == -1) {
+        perror(log_path);
+        close(fd);
+        return;
+    }
+    if (log_fd != -1)
+        close(log_fd);
+    log_fd = fd;
+}
+
+/* Drop expired entries if it is time to.  Called with lock held. */
+static void
+maybe_gc(time_t now)
+{
+    if (now < next_gc)
+        return;
+    next_gc = now + GC_INTERVAL;
+    size_t before = count;
+    if (capacity > 0)
+        rebuild(capacity, now);
+    if (log_path != NULL && count != before && journal == NULL)
+        rewrite_log();
+}
+
+/* Insert the unexpired revocations in path.  Called with lock held,
+ * or before there are other threads. */
+static bool
+load_log(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return errno == ENOENT;
+
+    time_t now = time(NULL);
+    unsigned long long h0, h1;
+    long long exp;
+    while (fscanf(f, "%llx %llx %lld", &h0, &h1, &exp) == 3) {
+        struct entry e = { { h0, h1 | 1 }, exp };
+        if (!expired(&e, now))
+            insert(e.h, e.exp);
+    }
+    fclose(f);
+    return true;
+}
+
+static void
+journal_append(const struct entry *e)
+{
+    uint64_t pos = atomic_fetch_add_explicit(&journal->head, 1, memory_order_relaxed);
+    struct journal_entry *j = &journal->entries[pos % JOURNAL_SIZE];
+    atomic_store_explicit(&j->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    j->e = *e;
+    atomic_store_explicit(&j->seq, pos + 1, memory_order_release);
+}
+
+/* Insert the revocations other workers journaled since the last call.
+ * Stops at an entry that is still being written.  Called with lock held. */
+static void
+replay(void)
+{
+    uint64_t head = atomic_load_explicit(&journal->head, memory_order_acquire);
+    uint64_t pos = atomic_load_explicit(&replayed, memory_order_relaxed);
+    bool lost = false;
+    if (head - pos > JOURNAL_SIZE) {
+        atomic_fetch_add_explicit(&journal_lost, head - JOURNAL_SIZE - pos, memory_order_relaxed);
+        pos = head - JOURNAL_SIZE;
+        lost = true;
+    }
+    for (; pos < head; pos++) {
+        struct journal_entry *j = &journal->entries[pos % JOURNAL_SIZE];
+        uint64_t seq = atomic_load_explicit(&j->seq, memory_order_acquire);
+        struct entry e = j->e;
+        atomic_thread_fence(memory_order_acquire);
+        if (seq == 0 || seq < pos + 1 || atomic_load_explicit(&j->seq, memory_order_relaxed) != seq)
+            break;
+        if (seq > pos + 1) {
+            // overwritten by a later revocation before we got to it
+            atomic_fetch_add_explicit(&journal_lost, 1, memory_order_relaxed);
+            lost = true;
+            continue;
+        }
+        if (!expired(&e, time(NULL)))
+            insert(e.h, e.exp);
+    }
+    atomic_store_explicit(&replayed, pos, memory_order_relaxed);
+    if (lost && log_path != NULL)
+        load_log(log_path);
+}
+
+/* Is there anything in the journal that was not replayed yet? */
+static bool
+journal_pending(void)
+{
+    return journal != NULL && atomic_load_explicit(&journal->head, memory_order_acquire)
+                              != atomic_load_explicit(&replayed, memory_order_relaxed);
+}
+
+static void
+revoke_report(FILE *out)
+{
+    pthread_mutex_lock(&lock);
+    size_t n = count;
+    pthread_mutex_unlock(&lock);
+    fprintf(out, "revoked: %zu, bloom hits: %lu, false positives: %lu\n",
+            n, atomic_load(&bloom_hits), atomic_load(&false_positives));
+    if (journal != NULL)
+        fprintf(out, "journal: %lu written, %lu replayed, %lu lost\n",
+                (unsigned long) atomic_load(&journal->head),
+                (unsigned long) atomic_load(&replayed), atomic_load(&journal_lost));
+}
+
+/* Set up the store, loading revocations from path, to which
+ * new ones are then appended.  path may be NULL.  With worker
+ * processes, this must be called before they are forked. */
+bool
+revoke_init(const char *path)
+{
+    stats_register("token revocation", revoke_report);
+    next_gc = time(NULL) + GC_INTERVAL;
+    if (prefork_workers > 0) {
+        journal = mmap(NULL, sizeof *journal, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (journal == MAP_FAILED) {
+            perror("mmap");
+            return false;
+        }
+    }
+    if (path == NULL)
+        return true;
+
+    log_path = strdup(path);
+    if (!load_log(path)) {
+        perror(path);
+        return false;
+    }
+    // start from a compacted file
+    rewrite_log();
+    return log_fd != -1;
+}
+
+/* Revoke token, which expires at exp, or never if exp is 0. */
+void
+revoke_add(const char *token, time_t exp)
+{
+    struct entry e = { .exp = exp };
+    token_hash(token, e.h);
+
+    pthread_mutex_lock(&lock);
+    maybe_gc(time(NULL));
+    if (insert(e.h, exp)) {
+        if (log_fd != -1)
+            append_record(log_fd, &e);
+        if (journal != NULL)
+            journal_append(&e);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/* Has token been revoked? */
+bool
+revoke_contains(const char *token)
+{
+    uint64_t h[2];
+    token_hash(token, h);
+    if (journal_pending()) {
+        pthread_mutex_lock(&lock);
+        replay();
+        pthread_mutex_unlock(&lock);
+    }
+    if (!bloom_maybe(h))
+        return false;
+
+    atomic_fetch_add_explicit(&bloom_hits, 1, memory_order_relaxed);
+    pthread_mutex_lock(&lock);
+    maybe_gc(time(NULL));
+    bool found = capacity > 0 && find_slot(table, capacity, h)->h[1] != 0;
+    pthread_mutex_unlock(&lock);
+    if (!found)
+        atomic_fetch_add_explicit(&false_positives, 1, memory_order_relaxed);
+    return found;
+}
@@ -0,0 +1,15 @@
+#ifndef _REVOKE_H
+#define _REVOKE_H
+/*
+ * Store of revoked tokens, such as those of users who logged out.
+ *
+ * Checking a token that was not revoked takes no lock.
+ */
+#include <stdbool.h>
+#include <time.h>
+
+bool revoke_init(const char *path);
+void revoke_add(const char *token, time_t exp);
+bool revoke_contains(const char *token);
+
+#endif /* _REVOKE_H */
@@ -0,0 +1,143 @@
+/*
+ * Route tables compiled into a trie over the case-folded route paths.
+ *
+ * Each trie node records the exact and prefix routes whose paths end
+ * there.  A lookup walks the request path once, remembering the last
+ * node with prefix routes it passed; its cost does not depend on the
+ * number of routes.  Since the trie is case-insensitive, exact routes
+ * are confirmed with a final strcmp.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "route.h"
+
+#define ALPHABET 128                // request paths are ASCII
+#define MAX_VARIANTS 8              // routes per path, e.g., per method
+
+struct route_set {
+    const struct route *routes[MAX_VARIANTS];
+    int n;
+};
+
+struct trie_node {
+    uint16_t child[ALPHABET];       // 0 if none, since the root is no one's child
+    struct route_set exact, prefix;
+};
+
+struct route_table {
+    struct trie_node *nodes;
+    int nnodes;
+};
+
+static int
+fold(unsigned char c)
+{
+    if (c >= ALPHABET)
+        return -1;
+    return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+static int
+add_node(struct route_table *t)
+{
+    if (t->nnodes == UINT16_MAX)
+        return -1;
+    struct trie_node *nodes = realloc(t->nodes, (t->nnodes + 1) * sizeof *nodes);
+    if (nodes == NULL)
+        return -1;
+    t->nodes = nodes;
+    memset(&t->nodes[t->nnodes], 0, sizeof *nodes);
+    return t->nnodes++;
+}
+
+/* Compile n routes into a table; the routes must remain valid
+ * for the lifetime of the table.  Returns NULL on failure. */
+struct route_table *
+route_compile(const struct route *routes, int n)
+{
+    struct route_table *t = calloc(1, sizeof *t);
+    if (t == NULL || add_node(t) == -1)
+        goto fail;
+
+    for (int i = 0; i < n; i++) {
+        const struct route *r = &routes[i];
+        int node = 0;
+        for (const char *p = r->path; *p; p++) {
+            int c = fold(*p);
+            if (c == -1) {
+                fprintf(stderr, "route %s: paths must be ASCII\n", r->path);
+                goto fail;
+            }
+            if (t->nodes[node].child[c] == 0) {
+                int child = add_node(t);
+                if (child == -1)
+                    goto fail;
+                t->nodes[node].child[c] = child;
+            }
+            node = t->nodes[node].child[c];
+        }
+        struct route_set *set = r->match == ROUTE_EXACT ? &t->nodes[node].exact
+                                                        : &t->nodes[node].prefix;
+        if (set->n == MAX_VARIANTS) {
+            fprintf(stderr, "route %s: too many variants\n", r->path);
+            goto fail;
+        }
+        set->routes[set->n++] = r;
+    }
+    return t;
+
+fail:
+    if (t != NULL)
+        free(t->nodes);
+    free(t);
+    return NULL;
+}
+
+/* Pick the route for the method from set.  If there are routes for
+ * the path, but none for the method, sets *method_not_allowed. */
+static const struct route *
+select_route(const struct route_set *set, const char *path,
+             enum http_method method, bool *method_not_allowed)
+{
+    for (int i = 0; i < set->n; i++) {
+        const struct route *r = set->routes[i];
+        if (path != NULL && strcmp(r->path, path))
+            continue;
+        if (r->methods == ROUTE_ANY || (r->methods & ROUTE_METHOD(method)))
+            return r;
+        *method_not_allowed = true;
+    }
+    return NULL;
+}
+
+/* Find the route for a request.  Returns NULL if no route matches, and
+ * sets *method_not_allowed if that is because of the request method. */
+const struct route *
+route_lookup(struct route_table *t, const char *path,
+             enum http_method method, bool *method_not_allowed)
+{
+    const struct trie_node *prefix = NULL;
+    const struct trie_node *node = &t->nodes[0];
+    const char *p = path;
+    *method_not_allowed = false;
+    for (;;) {
+        if (node->prefix.n > 0)
+            prefix = node;
+        int c = fold(*p);
+        if (*p == '\0' || c == -1 || node->child[c] == 0)
+            break;
+        node = &t->nodes[node->child[c]];
+        p++;
+    }
+
+    const struct route *r = NULL;
+    if (*p == '\0')
+        r = select_route(&node->exact, path, method, method_not_allowed);
+    // an exact route for another method takes precedence over prefixes
+    if (r == NULL && !*method_not_allowed && prefix != NULL)
+        r = select_route(&prefix->prefix, NULL, method, method_not_allowed);
+    return r;
+}
@@ -0,0 +1,41 @@
+#ifndef _ROUTE_H
+#define _ROUTE_H
+/*
+ * Request dispatch through a route table compiled into a trie.
+ *
+ * An exact route matches its path exactly.  A prefix route matches
+ * any path starting with its path, ignoring case, and the longest
+ * matching prefix wins.  Exact routes take precedence over prefix
+ * routes.  A route applies to the methods in its method mask,
+ * or to all methods if the mask is ROUTE_ANY.
+ *
+ * The request body is read into memory before the handler is called,
+ * unless the route is marked stream_body.
+ */
+#include <stdbool.h>
+
+#include "http.h"
+
+enum route_match {
+    ROUTE_EXACT,
+    ROUTE_PREFIX
+};
+
+#define ROUTE_ANY 0
+#define ROUTE_METHOD(m) (1u << (m))
+
+struct route {
+    enum route_match match;
+    const char *path;
+    unsigned methods;
+    bool (*handler)(struct http_transaction *ta);
+    bool stream_body;       // handler reads the request body itself
+};
+
+struct route_table;
+
+struct route_table *route_compile(const struct route *routes, int n);
+const struct route *route_lookup(struct route_table *table, const char *path,
+                                 enum http_method method, bool *method_not_allowed);
+
+#endif /* _ROUTE_H */
@@ -0,0 +1,593 @@
+/*
+ * Per-core coroutine schedulers with work stealing.
+ *
+ * Each scheduler keeps its ready tasks in a Chase-Lev deque.  It runs
+ * them from the bottom of its own deque, and when that is empty and
+ * its epoll instance has nothing ready, it steals from the top of the
+ * other schedulers' deques.  A scheduler with more than one task ready
+ * wakes an idle one to steal.  A task can thus resume on any thread;
+ * see coro.h for what that implies for the code it runs.
+ *
+ * New tasks are assigned to schedulers' inboxes, which are protected by
+ * a mutex: with -C, a connection's task goes to a scheduler pinned to
+ * the CPU that received its packets, if there is one, and otherwise
+ * tasks are assigned round-robin.  A sleeping scheduler is woken through an
+ * eventfd registered with its epoll instance.
+ *
+ * A task's socket is registered edge-triggered for both directions
+ * with the epoll instance of the scheduler it first waits on, its
+ * home.  The task's state tells who may queue it:
+ *
+ *   RUNNING  -- on a thread; readiness is only recorded in task->ready
+ *   WAITING  -- parked; whoever sees readiness it waits for queues it
+ *   QUEUED   -- in a deque or inbox
+ *
+ * A task parks after it has switched back to its scheduler, so it is
+ * never queued while still running on its stack.  A task can also park
+ * until another thread calls scheduler_unpark() for it; that thread
+ * queues it through an inbox, since only a deque's owner may push.
+ * A task that sleeps is kept in a timer heap of the scheduler it
+ * sleeps on, which queues it when its time has come, and bounds its
+ * epoll_wait by the earliest deadline meanwhile.
+ *
+ * Because a finished task's home may be handling an event for it,
+ * its memory is freed by its home, before the home's next epoll_wait.
+ */
+#define _GNU_SOURCE
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "scheduler.h"
+#include "affinity.h"
+#include "deque.h"
+#include "stats.h"
+#include "timing.h"
+
+#define MAX_EVENTS 256
+
+// ready/waiting bit for scheduler_unpark(), which epoll never reports
+#define TASK_UNPARKED EPOLLONESHOT
+// ready/waiting bit for the end of scheduler_sleep()
+#define TASK_TIMER EPOLLWAKEUP
+
+enum task_state {
+    TASK_RUNNING,
+    TASK_WAITING,
+    TASK_QUEUED
+};
+
+struct scheduler;
+
+struct task {
+    struct coro *co;
+    struct task *next;          // inbox or retired list link
+    struct scheduler *home;     // whose epoll the socket is registered with
+    int fd;                     // registered socket, or -1
+    atomic_int state;
+    atomic_uint waiting;        // epoll events the task waits for
+    atomic_uint ready;          // epoll events seen since the task last waited
+    atomic_int unparking;       // threads in scheduler_unpark() for the task
+};
+
+struct task_queue {
+    struct task *head, *tail;
+};
+
+struct timer {
+    uint64_t deadline;          // timing_now() at which to wake the task
+    struct task *task;
+};
+
+struct scheduler {
+    int index;
+    int epfd;
+    int eventfd;                // wakes the thread from epoll_wait
+    atomic_bool sleeping;       // in epoll_wait without a timeout
+    struct deque runq;          // tasks ready to run
+    pthread_mutex_t lock;
+    struct task_queue inbox;    // spawned tasks, under lock
+    _Atomic(struct task *) retired;     // finished tasks to free
+    struct timer *timers;       // min-heap of sleeping tasks, by deadline
+    int ntimers, timers_capacity;
+    unsigned next_victim;
+    atomic_ulong spawned, resumed, steals, polls;
+};
+
+static struct scheduler *schedulers;
+static int nschedulers;
+static atomic_uint next_scheduler;
+static atomic_int nsleeping;
+
+static __thread struct scheduler *current_scheduler;
+static __thread struct task *current_task;
+
+static void
+wake(struct scheduler *s)
+{
+    if (atomic_exchange(&s->sleeping, false)) {
+        uint64_t one = 1;
+        if (write(s->eventfd, &one, sizeof one) == -1)
+            perror("write eventfd");
+    }
+}
+
+/* Wake one sleeping scheduler, if any, to steal from s. */
+static void
+wake_thief(struct scheduler *s)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&nsleeping) == 0 || deque_size(&s->runq) < 2)
+        return;
+    for (int i = 1; i < nschedulers; i++) {
+        struct scheduler *other = &schedulers[(s->index + i) % nschedulers];
+        if (atomic_load(&other->sleeping)) {
+            wake(other);
+            return;
+        }
+    }
+}
+
+/* Queue t on s from any thread. */
+static void
+inbox_add(struct scheduler *s, struct task *t)
+{
+    t->next = NULL;
+    pthread_mutex_lock(&s->lock);
+    if (s->inbox.tail)
+        s->inbox.tail->next = t;
+    else
+        s->inbox.head = t;
+    s->inbox.tail = t;
+    pthread_mutex_unlock(&s->lock);
+    wake(s);
+}
+
+/* Move the inbox into the deque. */
+static void
+take_inbox(struct scheduler *s)
+{
+    pthread_mutex_lock(&s->lock);
+    struct task *t = s->inbox.head;
+    s->inbox.head = s->inbox.tail = NULL;
+    pthread_mutex_unlock(&s->lock);
+
+    while (t != NULL) {
+        struct task *next = t->next;
+        deque_push(&s->runq, t);
+        t = next;
+    }
+}
+
+static bool
+inbox_empty(struct scheduler *s)
+{
+    pthread_mutex_lock(&s->lock);
+    bool empty = s->inbox.head == NULL;
+    pthread_mutex_unlock(&s->lock);
+    return empty;
+}
+
+static uint32_t
+wake_mask(uint32_t waiting)
+{
+    return waiting & (TASK_UNPARKED | TASK_TIMER) ? waiting : waiting | EPOLLERR | EPOLLHUP;
+}
+
+/* Queue t on s if it is waiting for events it has seen. */
+static void
+wake_if_ready(struct scheduler *s, struct task *t)
+{
+    if (atomic_load(&t->state) != TASK_WAITING
+        || !(atomic_load(&t->ready) & wake_mask(atomic_load_explicit(&t->waiting, memory_order_relaxed))))
+        return;
+    int waiting = TASK_WAITING;
+    if (atomic_compare_exchange_strong(&t->state, &waiting, TASK_QUEUED))
+        deque_push(&s->runq, t);
+}
+
+static void
+retire(struct task *t)
+{
+    if (t->home == NULL) {
+        free(t);
+        return;
+    }
+    struct scheduler *home = t->home;
+    t->next = atomic_load(&home->retired);
+    while (!atomic_compare_exchange_weak(&home->retired, &t->next, t))
+        ;
+}
+
+static void
+free_retired(struct scheduler *s)
+{
+    struct task *t = atomic_exchange(&s->retired, NULL);
+    while (t != NULL) {
+        struct task *next = t->next;
+        free(t);
+        t = next;
+    }
+}
+
+static void
+run_task(struct scheduler *s, struct task *t)
+{
+    atomic_fetch_add_explicit(&s->resumed, 1, memory_order_relaxed);
+    atomic_store_explicit(&t->state, TASK_RUNNING, memory_order_relaxed);
+    current_task = t;
+    coro_resume(t->co);
+    current_task = NULL;
+
+    if (coro_finished(t->co)) {
+        coro_destroy(t->co);
+        retire(t);
+        return;
+    }
+    // park; events may have arrived since the task last looked
+    atomic_store(&t->state, TASK_WAITING);
+    wake_if_ready(s, t);
+}
+
+static void
+timer_swap(struct scheduler *s, int i, int j)
+{
+    struct timer tmp = s->timers[i];
+    s->timers[i] = s->timers[j];
+    s->timers[j] = tmp;
+}
+
+/* Add t to s's timer heap.  Only s's thread may call this. */
+static void
+timer_push(struct scheduler *s, uint64_t deadline, struct task *t)
+{
+    if (s->ntimers == s->timers_capacity) {
+        s->timers_capacity = s->timers_capacity ? s->timers_capacity * 2 : 16;
+        s->timers = realloc(s->timers, s->timers_capacity * sizeof *s->timers);
+        if (s->timers == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    int i = s->ntimers++;
+    s->timers[i] = (struct timer) { deadline, t };
+    while (i > 0 && s->timers[(i - 1) / 2].deadline > s->timers[i].deadline) {
+        timer_swap(s, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void
+timer_pop(struct scheduler *s)
+{
+    s->timers[0] = s->timers[--s->ntimers];
+    for (int i = 0;;) {
+        int min = i, l = 2 * i + 1, r = l + 1;
+        if (l < s->ntimers && s->timers[l].deadline < s->timers[min].deadline)
+            min = l;
+        if (r < s->ntimers && s->timers[r].deadline < s->timers[min].deadline)
+            min = r;
+        if (min == i)
+            break;
+        timer_swap(s, i, min);
+        i = min;
+    }
+}
+
+/* Queue the tasks whose sleep has ended. */
+static void
+run_timers(struct scheduler *s)
+{
+    uint64_t now = timing_now();
+    while (s->ntimers > 0 && s->timers[0].deadline <= now) {
+        struct task *t = s->timers[0].task;
+        timer_pop(s);
+        atomic_fetch_or(&t->ready, TASK_TIMER);
+        wake_if_ready(s, t);
+    }
+}
+
+/* The epoll_wait timeout until the next deadline, -1 if there is none. */
+static int
+timer_timeout(struct scheduler *s)
+{
+    if (s->ntimers == 0)
+        return -1;
+    uint64_t now = timing_now();
+    if (s->timers[0].deadline <= now)
+        return 0;
+    // round up, so as not to wake before the deadline
+    return (s->timers[0].deadline - now + 999999) / 1000000;
+}
+
+static struct task *
+steal(struct scheduler *s)
+{
+    for (int i = 1; i < nschedulers; i++) {
+        struct scheduler *victim = &schedulers[(s->index + s->next_victim++) % nschedulers];
+        if (victim == s)
+            continue;
+        struct task *t = deque_steal(&victim->runq);
+        if (t != NULL) {
+            atomic_fetch_add_explicit(&s->steals, 1, memory_order_relaxed);
+            wake_thief(victim);
+            return t;
+        }
+    }
+    return NULL;
+}
+
+/* Is there work anywhere that s could take? */
+static bool
+work_available(struct scheduler *s)
+{
+    if (!inbox_empty(s))
+        return true;
+    for (int i = 0; i < nschedulers; i++)
+        if (deque_size(&schedulers[i].runq) > 0)
+            return true;
+    return false;
+}
+
+/* Poll s's epoll instance, queueing tasks whose sockets are ready.
+ * Returns the number of events. */
+static int
+poll_events(struct scheduler *s, int timeout)
+{
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(s->epfd, events, MAX_EVENTS, timeout);
+    atomic_fetch_add_explicit(&s->polls, 1, memory_order_relaxed);
+    if (n == -1) {
+        if (errno == EINTR)
+            return 0;
+        perror("epoll_wait");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < n; i++) {
+        struct task *t = events[i].data.ptr;
+        if (t == NULL) {
+            uint64_t count;
+            if (read(s->eventfd, &count, sizeof count) == -1 && errno != EAGAIN)
+                perror("read eventfd");
+            continue;
+        }
+        atomic_fetch_or(&t->ready, events[i].events);
+        wake_if_ready(s, t);
+    }
+    wake_thief(s);
+    return n;
+}
+
+static void *
+scheduler_thread(void *arg)
+{
+    struct scheduler *s = arg;
+    current_scheduler = s;
+    if (affinity_enabled)
+        affinity_local_memory();
+
+    for (;;) {
+        free_retired(s);
+        take_inbox(s);
+        run_timers(s);
+        wake_thief(s);
+
+        struct task *t;
+        while ((t = deque_pop(&s->runq)) != NULL)
+            run_task(s, t);
+
+        if (poll_events(s, 0) > 0)
+            continue;
+        if ((t = steal(s)) != NULL) {
+            run_task(s, t);
+            continue;
+        }
+
+        // nothing to do: sleep unless work appeared meanwhile
+        atomic_store(&s->sleeping, true);
+        atomic_fetch_add(&nsleeping, 1);
+        poll_events(s, work_available(s) ? 0 : timer_timeout(s));
+        atomic_fetch_sub(&nsleeping, 1);
+        atomic_store(&s->sleeping, false);
+    }
+    return NULL;
+}
+
+static void
+scheduler_report(FILE *out)
+{
+    for (int i = 0; i < nschedulers; i++) {
+        struct scheduler *s = &schedulers[i];
+        fprintf(out, "scheduler %d: queued %ld, spawned %lu, resumed %lu, steals %lu, polls %lu\n",
+                i, deque_size(&s->runq), atomic_load(&s->spawned), atomic_load(&s->resumed),
+                atomic_load(&s->steals), atomic_load(&s->polls));
+    }
+}
+
+/* Start nthreads schedulers.  With -C, they are pinned to the listed
+ * CPUs in turn. */
+bool
+scheduler_start(int nthreads)
+{
+    schedulers = calloc(nthreads, sizeof *schedulers);
+    if (schedulers == NULL) {
+        perror("calloc");
+        return false;
+    }
+    nschedulers = nthreads;
+
+    for (int i = 0; i < nthreads; i++) {
+        struct scheduler *s = &schedulers[i];
+        s->index = i;
+        deque_init(&s->runq);
+        pthread_mutex_init(&s->lock, NULL);
+        s->epfd = epoll_create1(EPOLL_CLOEXEC);
+        s->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (s->epfd == -1 || s->eventfd == -1) {
+            perror("epoll_create1/eventfd");
+            return false;
+        }
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+        if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->eventfd, &ev) == -1) {
+            perror("epoll_ctl");
+            return false;
+        }
+    }
+
+    for (int i = 0; i < nthreads; i++) {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (affinity_enabled)
+            affinity_pin(&attr, i);
+        pthread_t thread;
+        int rc = pthread_create(&thread, &attr, scheduler_thread, &schedulers[i]);
+        pthread_attr_destroy(&attr);
+        if (rc != 0) {
+            perror("pthread_create");
+            return false;
+        }
+        pthread_detach(thread);
+    }
+    stats_register("schedulers", scheduler_report);
+    return true;
+}
+
+/* Run fn(arg) as a coroutine on one of the schedulers.  fd is the
+ * socket the task will serve, or -1. */
+void
+scheduler_spawn(coro_fn fn, void *arg, int fd)
+{
+    struct task *t = malloc(sizeof *t);
+    if (t == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    int i = affinity_enabled && fd != -1 ? affinity_incoming(fd, nschedulers) : -1;
+    if (i == -1)
+        i = atomic_fetch_add(&next_scheduler, 1) % nschedulers;
+    struct scheduler *s = &schedulers[i];
+    t->co = coro_create(fn, arg);
+    t->home = NULL;
+    t->fd = -1;
+    atomic_init(&t->state, TASK_QUEUED);
+    atomic_init(&t->waiting, 0);
+    atomic_init(&t->ready, 0);
+    atomic_init(&t->unparking, 0);
+    atomic_fetch_add_explicit(&s->spawned, 1, memory_order_relaxed);
+    inbox_add(s, t);
+}
+
+/* The calling coroutine's task and scheduler, read so that the
+ * compiler cannot cache them across a switch; see coro_current(). */
+static struct task *
+task_current(void)
+{
+    __asm__ volatile("" ::: "memory");
+    return current_task;
+}
+
+static struct scheduler *
+scheduler_current(void)
+{
+    __asm__ volatile("" ::: "memory");
+    return current_scheduler;
+}
+
+/*
+ * Wait until fd is ready for events, a combination of SCHEDULER_READABLE
+ * and SCHEDULER_WRITABLE.  A task yields to its scheduler meanwhile; a
+ * task may only wait for one descriptor.  Outside a task, this blocks
+ * in poll().  Returns false on error.
+ */
+bool
+scheduler_wait_fd(int fd, int events)
+{
+    uint32_t want = (events & SCHEDULER_READABLE ? EPOLLIN : 0)
+                  | (events & SCHEDULER_WRITABLE ? EPOLLOUT : 0);
+    struct task *t = task_current();
+    if (t == NULL) {
+        struct pollfd pfd = { .fd = fd, .events = want };
+        return poll(&pfd, 1, -1) != -1 || errno == EINTR;
+    }
+
+    if (t->fd != fd) {
+        struct scheduler *s = scheduler_current();
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLET, .data.ptr = t };
+        if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+            return false;
+        t->home = s;
+        t->fd = fd;
+    }
+    atomic_store_explicit(&t->waiting, want, memory_order_relaxed);
+    coro_yield();
+    atomic_fetch_and(&t->ready, ~want);
+    return true;
+}
+
+/* The calling task, for scheduler_unpark(), or NULL outside a task. */
+struct task *
+scheduler_self(void)
+{
+    return task_current();
+}
+
+/* Park the calling task until another thread calls scheduler_unpark()
+ * for it.  Unparks that happen before the task parks are not lost. */
+void
+scheduler_park(void)
+{
+    struct task *t = task_current();
+    while (!(atomic_load(&t->ready) & TASK_UNPARKED)) {
+        atomic_store_explicit(&t->waiting, TASK_UNPARKED, memory_order_relaxed);
+        coro_yield();
+    }
+    atomic_fetch_and(&t->ready, ~TASK_UNPARKED);
+    // the unparking thread may still be touching the task
+    while (atomic_load(&t->unparking) > 0)
+        sched_yield();
+}
+
+/* Make task t, which is or will be parked, runnable again. */
+void
+scheduler_unpark(struct task *t)
+{
+    atomic_fetch_add(&t->unparking, 1);
+    atomic_fetch_or(&t->ready, TASK_UNPARKED);
+    int waiting = TASK_WAITING;
+    if (atomic_compare_exchange_strong(&t->state, &waiting, TASK_QUEUED))
+        inbox_add(t->home != NULL ? t->home : &schedulers[0], t);
+    atomic_fetch_sub(&t->unparking, 1);
+}
+
+/* Sleep for ns nanoseconds.  A task yields to its scheduler meanwhile;
+ * outside a task, this blocks the thread. */
+void
+scheduler_sleep(uint64_t ns)
+{
+    struct task *t = task_current();
+    if (t == NULL) {
+        struct timespec ts = { ns / 1000000000, ns % 1000000000 };
+        while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+            ;
+        return;
+    }
+
+    // the task stays on this thread until it yields, so the scheduler
+    // cannot see the timer expire before the task has parked
+    timer_push(scheduler_current(), timing_now() + ns, t);
+    while (!(atomic_load(&t->ready) & TASK_TIMER)) {
+        atomic_store_explicit(&t->waiting, TASK_TIMER, memory_order_relaxed);
+        coro_yield();
+    }
+    atomic_fetch_and(&t->ready, ~TASK_TIMER);
+}
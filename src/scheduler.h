@@ -0,0 +1,33 @@
+#ifndef _SCHEDULER_H
+#define _SCHEDULER_H
+/*
+ * Schedulers that multiplex connection coroutines onto a few threads.
+ *
+ * Each scheduler thread has its own run queue and epoll instance.
+ * A task, a coroutine spawned with scheduler_spawn(), runs until it must
+ * wait for its socket with scheduler_wait_fd(), which parks it until epoll
+ * reports the socket ready.  Sockets of tasks must be non-blocking.
+ * A task can also park until another thread unparks it, e.g. when a
+ * job it handed to that thread is done, or sleep for a while.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "coro.h"
+
+enum {
+    SCHEDULER_READABLE = 1,
+    SCHEDULER_WRITABLE = 2
+};
+
+bool scheduler_start(int nthreads);
+void scheduler_spawn(coro_fn fn, void *arg, int fd);
+bool scheduler_wait_fd(int fd, int events);
+
+struct task;
+struct task *scheduler_self(void);
+void scheduler_park(void);
+void scheduler_unpark(struct task *t);
+void scheduler_sleep(uint64_t ns);
+
+#endif /* _SCHEDULER_H */
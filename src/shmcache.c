@@ -0,0 +1,182 @@
+/*
+ * Shared-memory cache.
+ *
+ * Entries are kept in sets of WAYS slots, chosen by a hash of the key.
+ * Each slot is a seqlock: its sequence number is odd while the slot is
+ * being written.  A reader copies the slot and checks that the sequence
+ * number was even and did not change meanwhile, otherwise it reports a
+ * miss.  A writer claims the slot by making its sequence number odd
+ * with a compare-and-swap; if another writer holds it, the insertion
+ * is dropped.  So no process ever waits for another, and a worker that
+ * crashes while writing a slot only loses that slot.  A set's slots are
+ * replaced round-robin.
+ *
+ * The hit and miss counts are kept per process.
+ */
+#include <sys/mman.h>
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shmcache.h"
+#include "stats.h"
+
+#define WAYS 4
+
+struct slot {
+    _Atomic uint32_t seq;           // odd while being written, 0 if never used
+    _Atomic uint32_t hash;
+    unsigned char data[];           // key, then value
+};
+
+struct set {
+    _Atomic uint32_t next;          // slot to replace next
+};
+
+struct shmcache {
+    const char *name;
+    size_t key_size, value_size, slot_size;
+    unsigned nsets;
+    struct set *sets;               // in shared memory, followed by the slots
+    char *slots;
+    atomic_ulong hits, misses, stores, busy;
+    struct shmcache *next;
+};
+
+static struct shmcache *caches;
+
+/* Hash the key 8 bytes at a time; keys are mostly long paths. */
+static uint32_t
+hash_key(const struct shmcache *cache, const void *key)
+{
+    const unsigned char *p = key;
+    uint64_t h = cache->key_size;
+    size_t i = 0;
+    for (; i + 8 <= cache->key_size; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, 8);
+        h = (h ^ w) * 0x9E3779B97F4A7C15ULL;
+        h ^= h >> 29;
+    }
+    for (; i < cache->key_size; i++)
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    return (uint32_t) (h ^ h >> 32);
+}
+
+static struct slot *
+slot_at(const struct shmcache *cache, unsigned set, unsigned way)
+{
+    return (struct slot *) (cache->slots + ((size_t) set * WAYS + way) * cache->slot_size);
+}
+
+static void
+shmcache_report(FILE *out)
+{
+    for (struct shmcache *c = caches; c != NULL; c = c->next)
+        fprintf(out, "%s: hits: %lu, misses: %lu, stores: %lu, busy: %lu, %u entries\n",
+                c->name, atomic_load(&c->hits), atomic_load(&c->misses),
+                atomic_load(&c->stores), atomic_load(&c->busy), c->nsets * WAYS);
+}
+
+/* Create a cache of about nentries entries.  Must be called before
+ * the processes that share it are forked. */
+struct shmcache *
+shmcache_create(const char *name, unsigned nentries, size_t key_size, size_t value_size)
+{
+    assert(key_size + value_size <= SHMCACHE_MAX_ENTRY);
+    struct shmcache *cache = calloc(1, sizeof *cache);
+    if (cache == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    cache->name = name;
+    cache->key_size = key_size;
+    cache->value_size = value_size;
+    cache->slot_size = (sizeof(struct slot) + key_size + value_size + 7) & ~(size_t) 7;
+    cache->nsets = nentries / WAYS > 0 ? nentries / WAYS : 1;
+
+    size_t sets_size = (cache->nsets * sizeof(struct set) + 63) & ~(size_t) 63;
+    size_t size = sets_size + (size_t) cache->nsets * WAYS * cache->slot_size;
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    cache->sets = mem;
+    cache->slots = (char *) mem + sets_size;
+
+    if (caches == NULL)
+        stats_register("shared caches", shmcache_report);
+    cache->next = caches;
+    caches = cache;
+    return cache;
+}
+
+/* Look up key.  On a hit, copies the value into value and returns true. */
+bool
+shmcache_get(struct shmcache *cache, const void *key, void *value)
+{
+    uint32_t h = hash_key(cache, key);
+    unsigned set = h % cache->nsets;
+    for (unsigned way = 0; way < WAYS; way++) {
+        struct slot *s = slot_at(cache, set, way);
+        if (atomic_load_explicit(&s->hash, memory_order_relaxed) != h)
+            continue;
+
+        uint32_t seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+        unsigned char copy[SHMCACHE_MAX_ENTRY];
+        memcpy(copy, s->data, cache->key_size + cache->value_size);
+        atomic_thread_fence(memory_order_acquire);
+        if (seq % 2 == 1 || atomic_load_explicit(&s->seq, memory_order_relaxed) != seq)
+            continue;
+        if (memcmp(copy, key, cache->key_size) != 0)
+            continue;
+
+        memcpy(value, copy + cache->key_size, cache->value_size);
+        atomic_fetch_add_explicit(&cache->hits, 1, memory_order_relaxed);
+        return true;
+    }
+    atomic_fetch_add_explicit(&cache->misses, 1, memory_order_relaxed);
+    return false;
+}
+
+/* Insert or replace the entry for key, unless its slot is busy. */
+void
+shmcache_put(struct shmcache *cache, const void *key, const void *value)
+{
+    uint32_t h = hash_key(cache, key);
+    unsigned set = h % cache->nsets;
+
+    // the slot that holds key, else an unused one, else the next in turn
+    struct slot *s = NULL;
+    for (unsigned way = 0; way < WAYS && s == NULL; way++) {
+        struct slot *t = slot_at(cache, set, way);
+        if (atomic_load_explicit(&t->hash, memory_order_relaxed) == h
+            && memcmp(t->data, key, cache->key_size) == 0)
+            s = t;
+    }
+    for (unsigned way = 0; way < WAYS && s == NULL; way++) {
+        struct slot *t = slot_at(cache, set, way);
+        if (atomic_load_explicit(&t->seq, memory_order_relaxed) == 0)
+            s = t;
+    }
+    if (s == NULL) {
+        uint32_t way = atomic_fetch_add_explicit(&cache->sets[set].next, 1, memory_order_relaxed);
+        s = slot_at(cache, set, way % WAYS);
+    }
+
+    uint32_t seq = atomic_load_explicit(&s->seq, memory_order_relaxed);
+    if (seq % 2 == 1 || !atomic_compare_exchange_strong_explicit(&s->seq, &seq, seq + 1,
+                                memory_order_acquire, memory_order_relaxed)) {
+        atomic_fetch_add_explicit(&cache->busy, 1, memory_order_relaxed);
+        return;
+    }
+    atomic_store_explicit(&s->hash, h, memory_order_relaxed);
+    memcpy(s->data, key, cache->key_size);
+    memcpy(s->data + cache->key_size, value, cache->value_size);
+    atomic_store_explicit(&s->seq, seq + 2, memory_order_release);
+    atomic_fetch_add_explicit(&cache->stores, 1, memory_order_relaxed);
+}
@@ -0,0 +1,27 @@
+#ifndef _SHMCACHE_H
+#define _SHMCACHE_H
+/*
+ * A fixed-size cache in shared memory.
+ *
+ * The cache is mapped shared and anonymous, so a cache created before
+ * the server forks its worker processes (-P) is shared by all of them,
+ * including those restarted later.  Lookups take no lock and never
+ * wait; an insertion that finds its slot being written gives up.
+ *
+ * Keys and values are fixed-size byte strings, compared with memcmp,
+ * so keys must not contain uninitialized padding.  Being a cache, it
+ * may drop any entry at any time.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+
+#define SHMCACHE_MAX_ENTRY 512      // bytes of key plus value
+
+struct shmcache;
+
+struct shmcache *shmcache_create(const char *name, unsigned nentries,
+                                 size_t key_size, size_t value_size);
+bool shmcache_get(struct shmcache *cache, const void *key, void *value);
+void shmcache_put(struct shmcache *cache, const void *key, const void *value);
+
+#endif /* _SHMCACHE_H */
@@ -0,0 +1,97 @@
+/*
+ * Slab allocator.
+ *
+ * A slab's free objects form a singly linked list threaded through the
+ * objects themselves, under the slab's mutex.  When the list is empty,
+ * a new page is allocated and cut into objects.  Pages are never given
+ * back, so a slab's memory is that of its peak number of objects.
+ */
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "slab.h"
+#include "stats.h"
+
+#define SLAB_PAGE_SIZE (64 << 10)
+#define SLAB_ALIGN 16
+
+static pthread_mutex_t slabs_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct slab *slabs;
+
+static void
+slab_report(FILE *out)
+{
+    pthread_mutex_lock(&slabs_lock);
+    for (struct slab *s = slabs; s != NULL; s = s->next) {
+        pthread_mutex_lock(&s->lock);
+        fprintf(out, "%s: %zu in use, %zu pages of %d KB, %zu bytes each\n",
+                s->name, s->in_use, s->pages, SLAB_PAGE_SIZE >> 10, s->size);
+        pthread_mutex_unlock(&s->lock);
+    }
+    pthread_mutex_unlock(&slabs_lock);
+}
+
+/* Set up slab for objects of size bytes. */
+void
+slab_init(struct slab *slab, const char *name, size_t size)
+{
+    slab->name = name;
+    slab->size = (size + SLAB_ALIGN - 1) & ~(size_t) (SLAB_ALIGN - 1);
+    pthread_mutex_init(&slab->lock, NULL);
+    slab->free = NULL;
+    slab->pages = slab->in_use = 0;
+
+    pthread_mutex_lock(&slabs_lock);
+    bool first = slabs == NULL;
+    slab->next = slabs;
+    slabs = slab;
+    pthread_mutex_unlock(&slabs_lock);
+    // not under slabs_lock, which slab_report takes under the stats lock
+    if (first)
+        stats_register("slabs", slab_report);
+}
+
+/* Cut a new page into objects and put them on the free list.
+ * Called with the slab's lock held. */
+static void
+grow(struct slab *slab)
+{
+    char *page = malloc(SLAB_PAGE_SIZE);
+    if (page == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t off = 0; off + slab->size <= SLAB_PAGE_SIZE; off += slab->size) {
+        void **obj = (void **) (page + off);
+        *obj = slab->free;
+        slab->free = obj;
+    }
+    slab->pages++;
+}
+
+/* Allocate an object; its contents are undefined. */
+void *
+slab_alloc(struct slab *slab)
+{
+    pthread_mutex_lock(&slab->lock);
+    if (slab->free == NULL)
+        grow(slab);
+    void **obj = slab->free;
+    slab->free = *obj;
+    slab->in_use++;
+    pthread_mutex_unlock(&slab->lock);
+    return obj;
+}
+
+/* Free an object obtained from slab_alloc(slab). */
+void
+slab_free(struct slab *slab, void *obj)
+{
+    pthread_mutex_lock(&slab->lock);
+    *(void **) obj = slab->free;
+    slab->free = obj;
+    slab->in_use--;
+    pthread_mutex_unlock(&slab->lock);
+}
@@ -0,0 +1,27 @@
+#ifndef _SLAB_H
+#define _SLAB_H
+/*
+ * A slab allocator for small fixed-size objects, such as the state
+ * kept per connection.
+ *
+ * Objects are carved out of SLAB_PAGE_SIZE pages and recycled through
+ * a free list, so that allocating one takes no trip through malloc
+ * and objects of one kind are packed together.
+ */
+#include <pthread.h>
+#include <stddef.h>
+
+struct slab {
+    const char *name;
+    size_t size;                // of an object, rounded up for alignment
+    pthread_mutex_t lock;
+    void *free;                 // list of free objects
+    size_t pages, in_use;
+    struct slab *next;          // list of slabs, for statistics
+};
+
+void slab_init(struct slab *slab, const char *name, size_t size);
+void *slab_alloc(struct slab *slab);
+void slab_free(struct slab *slab, void *obj);
+
+#endif /* _SLAB_H */
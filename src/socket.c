@@ -7,13 +7,17 @@
  *
  * Written by G. Back for CS 3214 Spring 2018.
  */
-
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <errno.h>
 #include <unistd.h>
 #include <stdio.h>
@@ -24,6 +28,45 @@
 
 #include "socket.h"
 #include "main.h"
+#include "alog.h"
+
+/* Seconds the kernel holds a connection without data before
+ * passing it to accept anyway. */
+#define DEFER_ACCEPT_SECONDS 5
+
+/*
+ * Set options on a listening socket.  Accepted sockets inherit
+ * TCP_NODELAY, so it need not be set for each connection.
+ */
+static void
+tune_listener(int s)
+{
+    // See https://stackoverflow.com/a/3233022 for a good explanation of what this does
+    int opt = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    // worker processes (-P) each have a listener bound to the port
+    if (prefork_workers > 0 && setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) == -1)
+        perror("setsockopt SO_REUSEPORT");
+
+    /* Performance tuning.  Turn off Nagle's algorithm.
+     * Otherwise, when the servers sends a reply to the client, and the reply
+     * is small relative to the MSS size, there would be a delay of 40ms
+     * during which the OS would hope in vain for more data to be sent.
+     * See tcp(7)
+     */
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+    // don't wake up the server until the request has arrived
+    int secs = DEFER_ACCEPT_SECONDS;
+    if (setsockopt(s, IPPROTO_TCP, TCP_DEFER_ACCEPT, &secs, sizeof(secs)) == -1)
+        perror("setsockopt TCP_DEFER_ACCEPT");
+
+    // let clients send their request with the SYN
+    if (tcp_fastopen_qlen > 0
+        && setsockopt(s, IPPROTO_TCP, TCP_FASTOPEN, &tcp_fastopen_qlen, sizeof(tcp_fastopen_qlen)) == -1)
+        perror("setsockopt TCP_FASTOPEN");
+}
 
 /*
  * Find a suitable IPv4 address to bind to, create a socket, bind it,
@@ -82,16 +125,14 @@ int socket_open_bind_listen(char *port_number_string, int backlog)
             // Update ipv6 flag
             ipv6_found = 1;
 
-            s = socket(pinfo->ai_family, pinfo->ai_socktype, pinfo->ai_protocol);
+            s = socket(pinfo->ai_family, pinfo->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, pinfo->ai_protocol);
             if (s == -1)
             {
                 // Socket creation failed, go next
                 continue;
             }
 
-            // See https://stackoverflow.com/a/3233022 for a good explanation of what this does
-            int opt = 1;
-            setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+            tune_listener(s);
 
             rc = bind(s, pinfo->ai_addr, pinfo->ai_addrlen);
             if (rc == -1)
@@ -118,16 +159,14 @@ int socket_open_bind_listen(char *port_number_string, int backlog)
         {
             if (pinfo->ai_family == AF_INET)
             {
-                s = socket(pinfo->ai_family, pinfo->ai_socktype, pinfo->ai_protocol);
+                s = socket(pinfo->ai_family, pinfo->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, pinfo->ai_protocol);
                 if (s == -1)
                 {
                     // Socket creation failed, go next
                     continue;
                 }
 
-                // See https://stackoverflow.com/a/3233022 for a good explanation of what this does
-                int opt = 1;
-                setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+                tune_listener(s);
 
                 rc = bind(s, pinfo->ai_addr, pinfo->ai_addrlen);
                 if (rc == -1)
@@ -156,52 +195,159 @@ int socket_open_bind_listen(char *port_number_string, int backlog)
     return s;
 }
 
-/**
- * Accept a client, blocking if necessary.
+/*
+ * Create a UNIX domain stream socket bound to path and listen on it,
+ * for a front proxy on the same machine.  A socket left behind at
+ * path by an earlier instance is removed, but not one that a running
+ * server still listens on, nor any other file.
  *
- * Returns file descriptor of client accepted on success, returns
- * -1 on error.
+ * Returns -1 on error, the socket file descriptor otherwise.
  */
-int socket_accept_client(int accepting_socket)
+int socket_open_unix_listen(const char *path, int backlog)
 {
-    /* The address passed into accept must be large enough for either IPv4 & IPv6.
-     * Using a struct sockaddr is too small to hold a full IPv6 address and accept()
-     * would not return the full address.
-     */
-    struct sockaddr_storage peer;
-    socklen_t peersize = sizeof(peer);
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof addr.sun_path)
+    {
+        fprintf(stderr, "UNIX socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
 
-    int client = accept(accepting_socket, (struct sockaddr *)&peer, &peersize);
-    if (client == -1)
+    // a socket nothing listens on refuses connections and is stale;
+    // one that accepts belongs to a running server and is left alone
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
     {
-        perror("accept");
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (probe == -1)
+        {
+            perror("socket");
+            return -1;
+        }
+        int rc = connect(probe, (struct sockaddr *) &addr, sizeof addr);
+        int err = errno;
+        close(probe);
+        if (rc == 0)
+        {
+            fprintf(stderr, "%s: address in use\n", path);
+            return -1;
+        }
+        if (err == ECONNREFUSED)
+            unlink(path);
+    }
+
+    int s = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (s == -1)
+    {
+        perror("socket");
         return -1;
     }
+    if (bind(s, (struct sockaddr *) &addr, sizeof addr) == -1)
+    {
+        perror(path);
+        close(s);
+        return -1;
+    }
+    if (listen(s, backlog) == -1)
+    {
+        perror("listen");
+        close(s);
+        return -1;
+    }
+    return s;
+}
 
-    /* Performance tuning.  Turn off Nagle's algorithm.
-     * Otherwise, when the servers sends a reply to the client, and the reply
-     * is small relative to the MSS size, there would be a delay of 40ms
-     * during which the OS would hope in vain for more data to be sent.
-     * See tcp(7)
-     */
-    int i = 1;
-    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, (void *)&i, sizeof(i));
+/* Replace the unnamed address of a UNIX domain client by its credentials. */
+static void
+record_peercred(int client, struct sockaddr_storage *peer)
+{
+    struct sockaddr_peercred *pc = (struct sockaddr_peercred *) peer;
+    struct ucred cred;
+    socklen_t len = sizeof cred;
+    if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+        cred = (struct ucred) { 0, -1, -1 };
+    *pc = (struct sockaddr_peercred) { AF_UNIX, cred.pid, cred.uid, cred.gid };
+}
 
-    /* The following will help with debugging your server.
-     * Adjust and/or remove as you see fit.
-     */
-    if (!silent_mode)
+#define MAX_LISTENERS 16
+
+/**
+ * Accept up to max clients from the nsockets listening sockets,
+ * blocking until at least one is available or wake_fd, if not -1,
+ * becomes readable.
+ * The listening sockets are non-blocking, so after a wakeup the accept
+ * queue of each ready socket is drained with accept4 until it is empty
+ * or max clients have been accepted.  Accepted sockets are close-on-exec,
+ * and non-blocking if they are served by coroutines (-c).
+ * Their descriptors and addresses are stored in fds[] and peers[].
+ *
+ * Returns the number of clients accepted, 0 if woken through wake_fd,
+ * or -1 on error.
+ */
+int socket_accept_clients(const int *sockets, int nsockets, int wake_fd,
+                          int *fds, struct sockaddr_storage *peers, int max)
+{
+    assert(nsockets <= MAX_LISTENERS);
+    struct pollfd pfd[MAX_LISTENERS + 1];
+    for (int i = 0; i < nsockets; i++)
+        pfd[i] = (struct pollfd) { .fd = sockets[i], .events = POLLIN };
+    pfd[nsockets] = (struct pollfd) { .fd = wake_fd, .events = POLLIN };
+
+    int n = 0;
+    while (n == 0)
     {
-        char peer_addr[1024], peer_port[10];
-        int rc = getnameinfo((struct sockaddr *)&peer, peersize,
-                             peer_addr, sizeof peer_addr, peer_port, sizeof peer_port,
-                             NI_NUMERICHOST | NI_NUMERICSERV);
-        if (rc != 0)
+        if (poll(pfd, wake_fd == -1 ? nsockets : nsockets + 1, -1) == -1)
         {
-            fprintf(stderr, "getnameinfo error: %s\n", gai_strerror(rc));
+            if (errno == EINTR)
+                continue;
+            perror("poll");
             return -1;
         }
-        fprintf(stderr, "Accepted connection from %s:%s\n", peer_addr, peer_port);
+        if (wake_fd != -1 && pfd[nsockets].revents != 0)
+            return 0;
+
+        for (int i = 0; i < nsockets && n < max; i++)
+        {
+            if (pfd[i].revents == 0)
+                continue;
+            while (n < max)
+            {
+                /* The address passed into accept must be large enough for either IPv4 & IPv6.
+                 * Using a struct sockaddr is too small to hold a full IPv6 address and accept()
+                 * would not return the full address.
+                 */
+                socklen_t peersize = sizeof(peers[n]);
+                int client = accept4(sockets[i], (struct sockaddr *)&peers[n], &peersize,
+                                     SOCK_CLOEXEC | (coroutine_threads > 0 ? SOCK_NONBLOCK : 0));
+                if (client == -1)
+                {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK)
+                        break;
+                    // the connection was reset before it was accepted
+                    if (errno == ECONNABORTED || errno == EPROTO || errno == EINTR)
+                        continue;
+                    // out of descriptors: serve those we have, retry later
+                    if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+                    {
+                        perror("accept4");
+                        if (n == 0)
+                            usleep(10000);
+                        break;
+                    }
+                    perror("accept4");
+                    return n > 0 ? n : -1;
+                }
+
+                if (peers[n].ss_family == AF_UNIX && alog_enabled)
+                    record_peercred(client, &peers[n]);
+
+                /* Connections are recorded in the access log, which formats
+                 * the peer address off the accept path.
+                 */
+                alog_accept(&peers[n]);
+                fds[n++] = client;
+            }
+        }
     }
-    return client;
+    return n;
 }
@@ -1,7 +1,25 @@
 #ifndef _SOCKET_H
 #define _SOCKET_H
 
+#include <sys/socket.h>
+#include <sys/types.h>
+
+/*
+ * The address recorded for a client of a UNIX domain listener, which
+ * has no address of its own: the credentials of the connecting process
+ * (SO_PEERCRED), if the access log is enabled.  It fits into a struct
+ * sockaddr_storage.
+ */
+struct sockaddr_peercred {
+    sa_family_t family;         // AF_UNIX
+    pid_t pid;                  // 0 if unknown
+    uid_t uid;
+    gid_t gid;
+};
+
 int socket_open_bind_listen(char * port_number_string, int backlog);
-int socket_accept_client(int socket);
+int socket_open_unix_listen(const char *path, int backlog);
+int socket_accept_clients(const int *sockets, int nsockets, int wake_fd,
+                          int *fds, struct sockaddr_storage *peers, int max);
 
 #endif /* _SOCKET_H */
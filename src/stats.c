@@ -0,0 +1,77 @@
+/*
+ * Run-time statistics reporting.
+ *
+ * SIGUSR1 is blocked in every thread and handled synchronously
+ * by a dedicated thread via sigwait(), so reporters may use stdio
+ * and take locks without worrying about async-signal safety.
+ */
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "stats.h"
+
+#define MAX_REPORTERS 32
+
+static struct {
+    const char *name;
+    stats_reporter_t report;
+} reporters[MAX_REPORTERS];
+static int nreporters;
+static pthread_mutex_t reporters_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Register a reporter. */
+void
+stats_register(const char *name, stats_reporter_t reporter)
+{
+    pthread_mutex_lock(&reporters_lock);
+    if (nreporters == MAX_REPORTERS) {
+        fprintf(stderr, "too many stats reporters, ignoring %s\n", name);
+    } else {
+        reporters[nreporters].name = name;
+        reporters[nreporters].report = reporter;
+        nreporters++;
+    }
+    pthread_mutex_unlock(&reporters_lock);
+}
+
+static void *
+stats_thread(void *arg)
+{
+    sigset_t *set = arg;
+    for (;;) {
+        int sig;
+        if (sigwait(set, &sig) != 0)
+            continue;
+
+        pthread_mutex_lock(&reporters_lock);
+        for (int i = 0; i < nreporters; i++) {
+            fprintf(stderr, "=== %s ===\n", reporters[i].name);
+            reporters[i].report(stderr);
+        }
+        fflush(stderr);
+        pthread_mutex_unlock(&reporters_lock);
+    }
+    return NULL;
+}
+
+/* Block SIGUSR1 and start the reporting thread.
+ * Must be called before any other thread is created so
+ * that all threads inherit the signal mask.
+ */
+void
+stats_start(void)
+{
+    static sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, stats_thread, &set) != 0) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+}
@@ -0,0 +1,17 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stdio.h>
+
+/*
+ * Run-time statistics reporting.
+ *
+ * Subsystems register a reporter; sending SIGUSR1 to the server
+ * makes a dedicated thread invoke each reporter in turn.
+ */
+typedef void (*stats_reporter_t)(FILE *out);
+
+void stats_register(const char *name, stats_reporter_t reporter);
+void stats_start(void);
+
+#endif /* _STATS_H */
@@ -0,0 +1,150 @@
+/*
+ * Per-request phase timing and slowest-N request tracking.
+ *
+ * Completed requests are compared against the fastest of the currently
+ * retained N slowest requests.  That threshold is read without locking,
+ * so the common case (a request that is not among the slowest) costs
+ * a single atomic load.
+ */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "timing.h"
+#include "stats.h"
+
+bool timing_enabled = false;
+
+#define PATH_LEN 64
+
+struct slow_request {
+    uint64_t total_ns;
+    uint64_t phase_ns[PHASE_COUNT];
+    char method[8];
+    char path[PATH_LEN];
+    int status;
+};
+
+static const char *phase_names[PHASE_COUNT] = {
+    [PHASE_PARSE_REQUEST] = "parse_request",
+    [PHASE_PROCESS_HEADERS] = "process_headers",
+    [PHASE_READ_BODY] = "read_body",
+    [PHASE_VALIDATE_JWT] = "validate_jwt",
+    [PHASE_FS_LOOKUP] = "fs_lookup",
+    [PHASE_SEND_HEADERS] = "send_headers",
+    [PHASE_SENDFILE] = "sendfile",
+    [PHASE_SEND_RESPONSE] = "send_response",
+};
+
+static pthread_mutex_t slowest_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct slow_request *slowest;    // unordered, nslowest entries
+static int nslowest;
+static int nrecorded;
+static _Atomic uint64_t threshold_ns;   // fastest retained, once full
+static _Atomic uint64_t total_requests;
+
+static int
+compare_slow_requests(const void *a, const void *b)
+{
+    const struct slow_request *ra = a, *rb = b;
+    return ra->total_ns < rb->total_ns ? 1 : ra->total_ns > rb->total_ns ? -1 : 0;
+}
+
+static void
+timing_report(FILE *out)
+{
+    pthread_mutex_lock(&slowest_lock);
+    int n = nrecorded;
+    struct slow_request *copy = malloc(nslowest * sizeof copy[0]);
+    if (copy == NULL) {
+        pthread_mutex_unlock(&slowest_lock);
+        return;
+    }
+    memcpy(copy, slowest, n * sizeof copy[0]);
+    pthread_mutex_unlock(&slowest_lock);
+
+    qsort(copy, n, sizeof copy[0], compare_slow_requests);
+    fprintf(out, "%lu requests, %d slowest (times in us):\n",
+            (unsigned long) atomic_load(&total_requests), n);
+    for (int i = 0; i < n; i++) {
+        fprintf(out, "%10.1f %3d %s %s\n", copy[i].total_ns / 1e3,
+                copy[i].status, copy[i].method, copy[i].path);
+        for (int p = 0; p < PHASE_COUNT; p++)
+            if (copy[i].phase_ns[p])
+                fprintf(out, "           %-16s %10.1f\n", phase_names[p],
+                        copy[i].phase_ns[p] / 1e3);
+    }
+    free(copy);
+}
+
+/* Enable timing, retaining the nslowest slowest requests. */
+void
+timing_init(int n)
+{
+    if (n <= 0)
+        return;
+
+    slowest = calloc(n, sizeof *slowest);
+    if (slowest == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    nslowest = n;
+    timing_enabled = true;
+    stats_register("slowest requests", timing_report);
+}
+
+/* Mark the start of a request. */
+void
+timing_request_begin(struct req_timing *t)
+{
+    if (timing_enabled)
+        t->start_ns = timing_now();
+}
+
+/* Mark the end of a request and record it if it is among the slowest. */
+void
+timing_request_end(struct req_timing *t, const char *method,
+                   const char *path, int status)
+{
+    if (!timing_enabled)
+        return;
+
+    uint64_t total = timing_now() - t->start_ns;
+    atomic_fetch_add_explicit(&total_requests, 1, memory_order_relaxed);
+    if (total <= atomic_load_explicit(&threshold_ns, memory_order_relaxed))
+        return;
+
+    pthread_mutex_lock(&slowest_lock);
+    int slot = nrecorded;
+    if (nrecorded == nslowest) {
+        // replace the fastest retained entry
+        slot = 0;
+        for (int i = 1; i < nslowest; i++)
+            if (slowest[i].total_ns < slowest[slot].total_ns)
+                slot = i;
+        if (total <= slowest[slot].total_ns)
+            goto out;
+    } else {
+        nrecorded++;
+    }
+
+    struct slow_request *r = &slowest[slot];
+    r->total_ns = total;
+    memcpy(r->phase_ns, t->phase_ns, sizeof r->phase_ns);
+    snprintf(r->method, sizeof r->method, "%s", method);
+    snprintf(r->path, sizeof r->path, "%s", path ? path : "-");
+    r->status = status;
+
+    if (nrecorded == nslowest) {
+        uint64_t min = slowest[0].total_ns;
+        for (int i = 1; i < nslowest; i++)
+            if (slowest[i].total_ns < min)
+                min = slowest[i].total_ns;
+        atomic_store_explicit(&threshold_ns, min, memory_order_relaxed);
+    }
+out:
+    pthread_mutex_unlock(&slowest_lock);
+}
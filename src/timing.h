@@ -0,0 +1,76 @@
+#ifndef _TIMING_H
+#define _TIMING_H
+/*
+ * Per-request phase timing.
+ *
+ * Each transaction carries a struct req_timing.  If enabled with -T N,
+ * the time spent in each phase is accumulated and the N slowest requests
+ * are kept, along with their breakdown, for reporting via SIGUSR1.
+ *
+ * The PHASE_BEGIN/PHASE_END macros also fire the pserv:phase_begin/
+ * pserv:phase_end static tracepoints (see trace.h).
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "trace.h"
+
+enum request_phase {
+    PHASE_PARSE_REQUEST,
+    PHASE_PROCESS_HEADERS,
+    PHASE_READ_BODY,
+    PHASE_VALIDATE_JWT,
+    PHASE_FS_LOOKUP,
+    PHASE_SEND_HEADERS,
+    PHASE_SENDFILE,
+    PHASE_SEND_RESPONSE,
+    PHASE_COUNT
+};
+
+struct req_timing {
+    uint64_t start_ns;                  // when the request started
+    uint64_t phase_start_ns;            // when the current phase started
+    uint64_t phase_ns[PHASE_COUNT];     // accumulated time per phase
+};
+
+extern bool timing_enabled;
+
+static inline uint64_t
+timing_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void
+timing_phase_begin(struct req_timing *t)
+{
+    if (timing_enabled)
+        t->phase_start_ns = timing_now();
+}
+
+static inline void
+timing_phase_end(struct req_timing *t, enum request_phase phase)
+{
+    if (timing_enabled)
+        t->phase_ns[phase] += timing_now() - t->phase_start_ns;
+}
+
+#define PHASE_BEGIN(ta, phase) do { \
+    TRACE_PROBE2(phase_begin, (ta), (phase)); \
+    timing_phase_begin(&(ta)->timing); \
+} while (0)
+
+#define PHASE_END(ta, phase) do { \
+    timing_phase_end(&(ta)->timing, (phase)); \
+    TRACE_PROBE2(phase_end, (ta), (phase)); \
+} while (0)
+
+void timing_init(int nslowest);
+void timing_request_begin(struct req_timing *t);
+void timing_request_end(struct req_timing *t, const char *method,
+                        const char *path, int status);
+
+#endif /* _TIMING_H */
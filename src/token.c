@@ -0,0 +1,583 @@
+/*
+ * JSON Web Token support.
+ *
+ * HS256 tokens are handled by libjwt.  For RS256 and ES256, libjwt
+ * would parse the PEM key on every call, so these tokens are signed
+ * and verified here with OpenSSL, using a key parsed once by
+ * token_init() and digest contexts set up for it that each operation
+ * copies.  Signing runs on the offload pool, and so does verification
+ * when connections are served as coroutines, so that the schedulers
+ * keep serving other connections meanwhile.
+ *
+ * Tokens that were verified are remembered, with their expiry, in a
+ * cache in shared memory (see shmcache.c), keyed by the SHA-256 digest
+ * of the token, so that a token presented again to any worker process
+ * is not verified again.  Revocation is checked separately by callers.
+ */
+#include <jwt.h>
+#include <jansson.h>
+#include <openssl/ecdsa.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "token.h"
+#include "json.h"
+#include "offload.h"
+#include "shmcache.h"
+#include "main.h"
+
+#define MAX_SIGNATURE 1024          // bytes, enough for RSA-8192
+#define MAX_PAYLOAD 4096            // bytes of decoded claims
+#define ES256_SIZE 32               // bytes of each of r and s
+#define CACHE_ENTRIES 16384         // verified tokens to remember
+
+enum token_alg {
+    TOKEN_HS256,
+    TOKEN_RS256,
+    TOKEN_ES256
+};
+
+static enum token_alg alg = TOKEN_HS256;
+static EVP_PKEY *key;
+static bool can_sign;
+static EVP_MD_CTX *sign_template, *verify_template;
+static char header[64];             // encoded JOSE header for alg
+static size_t header_len;
+static struct shmcache *verified;   // SHA-256 of token -> int64_t expiry
+static EVP_MD *sha256;              // fetched once, not per digest
+
+static const char b64url[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+/* Encode len bytes as unpadded base64url into out, which must hold
+ * 4 * (len + 2) / 3 + 1 bytes.  Returns the length of the encoding. */
+static size_t
+base64url_encode(char *out, const unsigned char *in, size_t len)
+{
+    char *p = out;
+    size_t i;
+    for (i = 0; i + 2 < len; i += 3) {
+        uint32_t v = in[i] << 16 | in[i + 1] << 8 | in[i + 2];
+        *p++ = b64url[v >> 18];
+        *p++ = b64url[v >> 12 & 63];
+        *p++ = b64url[v >> 6 & 63];
+        *p++ = b64url[v & 63];
+    }
+    if (i < len) {
+        uint32_t v = in[i] << 16 | (i + 1 < len ? in[i + 1] << 8 : 0);
+        *p++ = b64url[v >> 18];
+        *p++ = b64url[v >> 12 & 63];
+        if (i + 1 < len)
+            *p++ = b64url[v >> 6 & 63];
+    }
+    *p = '\0';
+    return p - out;
+}
+
+static int
+base64url_value(char c)
+{
+    if (c >= 'A' && c <= 'Z')
+        return c - 'A';
+    if (c >= 'a' && c <= 'z')
+        return c - 'a' + 26;
+    if (c >= '0' && c <= '9')
+        return c - '0' + 52;
+    if (c == '-')
+        return 62;
+    if (c == '_')
+        return 63;
+    return -1;
+}
+
+/* Decode unpadded base64url into out, which must hold 3 * len / 4
+ * bytes.  Only the canonical encoding is accepted: the bits of the
+ * last character that do not make a whole byte must be zero.
+ * Returns the number of bytes, or -1 if in is not valid. */
+static ssize_t
+base64url_decode(unsigned char *out, const char *in, size_t len)
+{
+    if (len % 4 == 1)
+        return -1;
+    unsigned char *p = out;
+    uint32_t v = 0;
+    for (size_t i = 0; i < len; i++) {
+        int d = base64url_value(in[i]);
+        if (d == -1)
+            return -1;
+        v = v << 6 | d;
+        if (i % 4 == 3) {
+            *p++ = v >> 16;
+            *p++ = v >> 8;
+            *p++ = v;
+        }
+    }
+    if (len % 4 == 2) {
+        if (v & 0xf)
+            return -1;
+        *p++ = v >> 4;
+    } else if (len % 4 == 3) {
+        if (v & 0x3)
+            return -1;
+        *p++ = v >> 10;
+        *p++ = v >> 2;
+    }
+    return p - out;
+}
+
+/* Load the key from path: a private key, or for a server that only
+ * checks tokens, a public key. */
+static bool
+load_key(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return false;
+    }
+    key = PEM_read_PrivateKey(f, NULL, NULL, NULL);
+    can_sign = key != NULL;
+    if (key == NULL) {
+        rewind(f);
+        key = PEM_read_PUBKEY(f, NULL, NULL, NULL);
+    }
+    fclose(f);
+    if (key == NULL) {
+        fprintf(stderr, "%s: not a PEM private or public key\n", path);
+        return false;
+    }
+    return true;
+}
+
+/* Set up the algorithm used for tokens, "HS256", "RS256", or "ES256".
+ * HS256 tokens are signed with the SECRET environment variable, the
+ * others with the key in keyfile. */
+bool
+token_init(const char *algorithm, const char *keyfile)
+{
+    if (strcmp(algorithm, "HS256") == 0) {
+        alg = TOKEN_HS256;
+        return true;
+    } else if (strcmp(algorithm, "RS256") == 0) {
+        alg = TOKEN_RS256;
+    } else if (strcmp(algorithm, "ES256") == 0) {
+        alg = TOKEN_ES256;
+    } else {
+        fprintf(stderr, "unsupported token algorithm %s\n", algorithm);
+        return false;
+    }
+
+    if (keyfile == NULL) {
+        fprintf(stderr, "%s tokens need a key file (-K)\n", algorithm);
+        return false;
+    }
+    EVP_PKEY_free(key);
+    if (!load_key(keyfile))
+        return false;
+    if (alg == TOKEN_RS256 ? EVP_PKEY_base_id(key) != EVP_PKEY_RSA || EVP_PKEY_size(key) > MAX_SIGNATURE
+                           : EVP_PKEY_base_id(key) != EVP_PKEY_EC || EVP_PKEY_bits(key) != 256) {
+        fprintf(stderr, "%s: not a key for %s\n", keyfile, algorithm);
+        return false;
+    }
+
+    EVP_MD_CTX_free(sign_template);
+    EVP_MD_CTX_free(verify_template);
+    sign_template = NULL;
+    verify_template = EVP_MD_CTX_new();
+    if (verify_template == NULL
+        || EVP_DigestVerifyInit(verify_template, NULL, EVP_sha256(), NULL, key) != 1) {
+        fprintf(stderr, "%s: can't set up verification\n", keyfile);
+        return false;
+    }
+    if (can_sign) {
+        sign_template = EVP_MD_CTX_new();
+        if (sign_template == NULL
+            || EVP_DigestSignInit(sign_template, NULL, EVP_sha256(), NULL, key) != 1) {
+            fprintf(stderr, "%s: can't set up signing\n", keyfile);
+            return false;
+        }
+    }
+
+    char json[64];
+    snprintf(json, sizeof json, "{\"alg\":\"%s\",\"typ\":\"JWT\"}", algorithm);
+    header_len = base64url_encode(header, (unsigned char *)json, strlen(json));
+    return true;
+}
+
+/* The order n of the P-256 group, and n / 2.  If (r, s) is a valid
+ * ECDSA signature, so is (r, n - s), so ES256 tokens are only issued
+ * and accepted with s <= n / 2, which makes the signature unique. */
+static const unsigned char p256_order[ES256_SIZE] = {
+    0xff, 0xff, 0xff, 0xff, 0x00, 0x00, 0x00, 0x00,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xbc, 0xe6, 0xfa, 0xad, 0xa7, 0x17, 0x9e, 0x84,
+    0xf3, 0xb9, 0xca, 0xc2, 0xfc, 0x63, 0x25, 0x51
+};
+static const unsigned char p256_half_order[ES256_SIZE] = {
+    0x7f, 0xff, 0xff, 0xff, 0x80, 0x00, 0x00, 0x00,
+    0x7f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xde, 0x73, 0x7d, 0x56, 0xd3, 0x8b, 0xcf, 0x42,
+    0x79, 0xdc, 0xe5, 0x61, 0x7e, 0x31, 0x92, 0xa8
+};
+
+/* Replace the big-endian s by n - s. */
+static void
+negate_mod_order(unsigned char *s)
+{
+    int borrow = 0;
+    for (int i = ES256_SIZE - 1; i >= 0; i--) {
+        int d = p256_order[i] - s[i] - borrow;
+        borrow = d < 0;
+        s[i] = d + (borrow ? 256 : 0);
+    }
+}
+
+struct sign_job {
+    const char *input;
+    size_t len;
+    unsigned char sig[MAX_SIGNATURE];
+    size_t siglen;
+    bool ok;
+};
+
+/* Sign a job's input, producing a JWS signature: PKCS #1 v1.5 for
+ * RS256, the concatenated r and s for ES256. */
+static void
+sign(void *arg)
+{
+    struct sign_job *job = arg;
+    job->ok = false;
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    if (ctx == NULL || EVP_MD_CTX_copy_ex(ctx, sign_template) != 1)
+        goto out;
+
+    unsigned char der[MAX_SIGNATURE];
+    size_t len = sizeof der;
+    if (EVP_DigestSignUpdate(ctx, job->input, job->len) != 1
+        || EVP_DigestSignFinal(ctx, der, &len) != 1)
+        goto out;
+
+    if (alg == TOKEN_RS256) {
+        memcpy(job->sig, der, len);
+        job->siglen = len;
+    } else {
+        const unsigned char *p = der;
+        ECDSA_SIG *es = d2i_ECDSA_SIG(NULL, &p, len);
+        if (es == NULL)
+            goto out;
+        const BIGNUM *r, *s;
+        ECDSA_SIG_get0(es, &r, &s);
+        BN_bn2binpad(r, job->sig, ES256_SIZE);
+        BN_bn2binpad(s, job->sig + ES256_SIZE, ES256_SIZE);
+        ECDSA_SIG_free(es);
+        if (memcmp(job->sig + ES256_SIZE, p256_half_order, ES256_SIZE) > 0)
+            negate_mod_order(job->sig + ES256_SIZE);
+        job->siglen = 2 * ES256_SIZE;
+    }
+    job->ok = true;
+out:
+    EVP_MD_CTX_free(ctx);
+}
+
+struct verify_job {
+    const char *input;
+    size_t len;
+    unsigned char sig[MAX_SIGNATURE];
+    size_t siglen;
+    bool ok;
+};
+
+static void
+verify(void *arg)
+{
+    struct verify_job *job = arg;
+    job->ok = false;
+    unsigned char der[MAX_SIGNATURE];
+    const unsigned char *sig = job->sig;
+    size_t siglen = job->siglen;
+
+    if (alg == TOKEN_ES256) {
+        if (siglen != 2 * ES256_SIZE
+            || memcmp(sig + ES256_SIZE, p256_half_order, ES256_SIZE) > 0)
+            return;
+        ECDSA_SIG *es = ECDSA_SIG_new();
+        BIGNUM *r = BN_bin2bn(sig, ES256_SIZE, NULL);
+        BIGNUM *s = BN_bin2bn(sig + ES256_SIZE, ES256_SIZE, NULL);
+        if (es == NULL || r == NULL || s == NULL || ECDSA_SIG_set0(es, r, s) != 1) {
+            BN_free(r);
+            BN_free(s);
+            ECDSA_SIG_free(es);
+            return;
+        }
+        unsigned char *p = der;
+        int len = i2d_ECDSA_SIG(es, &p);
+        ECDSA_SIG_free(es);
+        if (len <= 0)
+            return;
+        sig = der;
+        siglen = len;
+    }
+
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    if (ctx != NULL && EVP_MD_CTX_copy_ex(ctx, verify_template) == 1
+        && EVP_DigestVerifyUpdate(ctx, job->input, job->len) == 1)
+        job->ok = EVP_DigestVerifyFinal(ctx, sig, siglen) == 1;
+    EVP_MD_CTX_free(ctx);
+}
+
+#define JTI_BYTES 12
+
+/* Make a random token id (jti claim), so that tokens issued to the same
+ * user within the same second differ: revoking one on logout must not
+ * revoke the token of the next login. */
+static bool
+make_jti(char *jti)
+{
+    unsigned char id[JTI_BYTES];
+    if (RAND_bytes(id, sizeof id) != 1)
+        return false;
+    base64url_encode(jti, id, sizeof id);
+    return true;
+}
+
+/* Generate an RS256 or ES256 token with the given claims. */
+static char *
+sign_token(const char *username, const char *jti, time_t now, time_t exp)
+{
+    if (!can_sign)
+        return NULL;
+
+    json_t *claims = json_object();
+    json_object_set_new(claims, "sub", json_string(username));
+    json_object_set_new(claims, "iat", json_integer(now));
+    json_object_set_new(claims, "exp", json_integer(exp));
+    json_object_set_new(claims, "jti", json_string(jti));
+    char *payload = json_dumps(claims, JSON_COMPACT);
+    json_decref(claims);
+    if (payload == NULL)
+        return NULL;
+
+    size_t payload_len = strlen(payload);
+    char *token = malloc(header_len + 4 * (payload_len + 2) / 3
+                         + 4 * (MAX_SIGNATURE + 2) / 3 + 3);
+    if (token == NULL) {
+        free(payload);
+        return NULL;
+    }
+    char *p = token;
+    memcpy(p, header, header_len);
+    p += header_len;
+    *p++ = '.';
+    p += base64url_encode(p, (unsigned char *)payload, payload_len);
+    free(payload);
+
+    struct sign_job job = { .input = token, .len = p - token };
+    offload_run(sign, &job);
+    if (!job.ok) {
+        free(token);
+        return NULL;
+    }
+    *p++ = '.';
+    base64url_encode(p, job.sig, job.siglen);
+    return token;
+}
+
+/* Generate a token for username, valid for token_expiration_time
+ * seconds.  Returns a string that must be freed by the caller,
+ * or NULL on failure.
+ */
+char *
+token_generate(const char *username)
+{
+    jwt_t *jwt = NULL;
+    const char *secret = getenv("SECRET");
+    time_t now = time(NULL);
+    int exp = now + token_expiration_time;
+    char jti[4 * (JTI_BYTES + 2) / 3 + 1];
+    if (!make_jti(jti))
+        return NULL;
+
+    if (alg != TOKEN_HS256)
+        return sign_token(username, jti, now, exp);
+
+    jwt_new(&jwt);
+    jwt_add_grant(jwt, "sub", username);
+    jwt_add_grant_int(jwt, "iat", now);
+    jwt_add_grant_int(jwt, "exp", exp);
+    jwt_add_grant(jwt, "jti", jti);
+    jwt_set_alg(jwt, JWT_ALG_HS256, (unsigned char *)secret, strlen(secret));
+
+    char *encoded = jwt_encode_str(jwt);
+    jwt_free(jwt);
+
+    return encoded;
+}
+
+/* Decode the payload of an RS256 or ES256 token into a string that
+ * must be freed by the caller.  Returns NULL if it is malformed. */
+static char *
+decode_payload(const char *token)
+{
+    const char *payload = token + header_len + 1;
+    const char *end = strchr(payload, '.');
+    if (end == NULL || end - payload > 4 * MAX_PAYLOAD / 3)
+        return NULL;
+    char *json = malloc(3 * (end - payload) / 4 + 1);
+    if (json == NULL)
+        return NULL;
+    ssize_t len = base64url_decode((unsigned char *)json, payload, end - payload);
+    if (len == -1) {
+        free(json);
+        return NULL;
+    }
+    json[len] = '\0';
+    return json;
+}
+
+/* Check the signature of an RS256 or ES256 token and get its expiry. */
+static bool
+verify_token(const char *token, time_t *exp)
+{
+    // only our own header is accepted, which fixes the algorithm
+    if (strncmp(token, header, header_len) != 0 || token[header_len] != '.')
+        return false;
+    const char *sig = strchr(token + header_len + 1, '.');
+    if (sig == NULL)
+        return false;
+
+    struct verify_job job = { .input = token, .len = sig - token };
+    size_t len = strlen(++sig);
+    if (len > 4 * MAX_SIGNATURE / 3)
+        return false;
+    ssize_t siglen = base64url_decode(job.sig, sig, len);
+    if (siglen == -1)
+        return false;
+    job.siglen = siglen;
+    if (coroutine_threads > 0)
+        offload_run(verify, &job);
+    else
+        verify(&job);
+    if (!job.ok)
+        return false;
+
+    char *payload = decode_payload(token);
+    json_t *claims = payload ? json_loadb(payload, strlen(payload), 0, NULL) : NULL;
+    free(payload);
+    if (claims == NULL)
+        return false;
+    json_int_t expires = 0;
+    json_unpack(claims, "{s?I}", "exp", &expires);
+    json_decref(claims);
+    *exp = expires;
+    return true;
+}
+
+/* Set up the cache of verified tokens.  Before forking workers,
+ * so that they share it. */
+void
+token_cache_init(void)
+{
+    sha256 = EVP_MD_fetch(NULL, "SHA256", NULL);
+    if (sha256 == NULL) {
+        fprintf(stderr, "cannot fetch SHA256, not caching tokens\n");
+        return;
+    }
+    verified = shmcache_create("verified tokens", CACHE_ENTRIES,
+                               SHA256_DIGEST_LENGTH, sizeof(int64_t));
+}
+
+/* Check a token's signature and get its expiry. */
+static bool
+check_signature(const char *token, time_t *exp)
+{
+    if (alg != TOKEN_HS256)
+        return verify_token(token, exp);
+
+    jwt_t *jwt = NULL;
+    const char *secret = getenv("SECRET");
+    if (jwt_decode(&jwt, token, (unsigned char *)secret, strlen(secret)) != 0)
+        return false;
+
+    // jwt_get_grant_int returns 0 if there is no exp claim
+    *exp = jwt_get_grant_int(jwt, "exp");
+    jwt_free(jwt);
+    return true;
+}
+
+/* Check a token's signature and expiry.  If exp is not NULL, the
+ * token's expiry time is stored there, or 0 if it has none.
+ */
+bool
+token_validate(const char *token, time_t *exp)
+{
+    time_t expires;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    int64_t cached;
+
+    if (verified != NULL) {
+        if (EVP_Digest(token, strlen(token), digest, NULL, sha256, NULL) != 1)
+            return false;
+        if (shmcache_get(verified, digest, &cached))
+            expires = cached;
+        else if (check_signature(token, &expires)) {
+            cached = expires;
+            shmcache_put(verified, digest, &cached);
+        } else
+            return false;
+    } else if (!check_signature(token, &expires))
+        return false;
+
+    if (expires != 0 && expires < time(NULL))
+        return false;
+    if (exp != NULL)
+        *exp = expires;
+    return true;
+}
+
+/* Return the claims of a validated token as JSON, in a string that
+ * must be freed by the caller, or NULL on failure. */
+char *
+token_claims(const char *token)
+{
+    if (alg != TOKEN_HS256)
+        return decode_payload(token);
+
+    jwt_t *jwt = NULL;
+    const char *secret = getenv("SECRET");
+    if (jwt_decode(&jwt, token, (unsigned char *)secret, strlen(secret)) != 0)
+        return NULL;
+    char *claims = jwt_get_grants_json(jwt, NULL);
+    jwt_free(jwt);
+    return claims;
+}
+
+/* Write the id of a validated token to id: its jti claim, or for a
+ * token without one, its signature.  Tokens cannot share a jti unless
+ * the signer made them so, whereas one signature may be encoded, and
+ * for ES256 computed, in more than one way.  Returns false if the id
+ * does not fit size bytes. */
+bool
+token_id(const char *token, char *id, size_t size)
+{
+    const char *payload = strchr(token, '.');
+    const char *sig = payload != NULL ? strchr(payload + 1, '.') : NULL;
+    if (sig == NULL)
+        return false;
+    payload++;
+    if (sig - payload <= 4 * MAX_PAYLOAD / 3) {
+        char json[MAX_PAYLOAD];
+        ssize_t len = base64url_decode((unsigned char *)json, payload, sig - payload);
+        struct json_field jti = { "jti" };
+        if (len != -1 && json_scan_object(json, len, &jti, 1) && jti.value != NULL)
+            return snprintf(id, size, "jti %s", jti.value) < (int) size;
+    }
+    return snprintf(id, size, "sig %s", sig + 1) < (int) size;
+}
@@ -0,0 +1,21 @@
+#ifndef _TOKEN_H
+#define _TOKEN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+/*
+ * Generation and validation of the JSON Web Tokens used
+ * for authentication.  Tokens are signed with HS256 using
+ * the key in the SECRET environment variable, or with RS256
+ * or ES256 using a key file.
+ */
+bool token_init(const char *algorithm, const char *keyfile);
+void token_cache_init(void);
+char *token_generate(const char *username);
+bool token_validate(const char *token, time_t *exp);
+char *token_claims(const char *token);
+bool token_id(const char *token, char *id, size_t size);
+
+#endif /* _TOKEN_H */
@@ -0,0 +1,30 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+/*
+ * Static tracepoints for the server's hot paths.
+ *
+ * When built with 'make USDT=1' (which requires <sys/sdt.h>, e.g., from
+ * systemtap-sdt-dev), each probe compiles into a single nop plus an
+ * ELF note that bpftrace and perf can attach to, e.g.
+ *
+ *   bpftrace -e 'usdt:./server:pserv:phase_end { @[arg1] = count(); }'
+ *   perf probe -x ./server sdt_pserv:phase_begin
+ *
+ * Otherwise, the probes expand to nothing.
+ *
+ * Probes provided:
+ *   pserv:request_begin(ta)
+ *   pserv:request_end(ta, status)
+ *   pserv:phase_begin(ta, phase)    phase is an enum request_phase
+ *   pserv:phase_end(ta, phase)
+ */
+#ifdef PSERV_USDT
+#include <sys/sdt.h>
+#define TRACE_PROBE1(name, a)       DTRACE_PROBE1(pserv, name, a)
+#define TRACE_PROBE2(name, a, b)    DTRACE_PROBE2(pserv, name, a, b)
+#else
+#define TRACE_PROBE1(name, a)       do { } while (0)
+#define TRACE_PROBE2(name, a, b)    do { } while (0)
+#endif
+
+#endif /* _TRACE_H */
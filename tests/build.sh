@@ -2,3 +2,6 @@
 gcc -fPIC -Wall -c getaddrinfo.c
 gcc -shared -o getaddrinfo.so.1.0.1 getaddrinfo.o -ldl
 
+
+# build the native load generator used by server_bench.py -L
+gcc -O2 -Wall -pthread -o loadgen loadgen.c -lm
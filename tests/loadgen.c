@@ -0,0 +1,911 @@
+/*
+ * A self-contained HTTP load generator for benchmarking the server
+ * on a single machine.
+ *
+ * Each thread drives its share of the connections through its own
+ * epoll instance.  By default, each connection issues its next request
+ * as soon as the previous one completes (closed loop).  With -R,
+ * requests are instead issued at a constant aggregate rate (open loop),
+ * and latency is measured from the time at which a request was
+ * scheduled to be sent, not from when a connection became available
+ * to send it, which avoids coordinated omission.
+ *
+ * Latencies are recorded in a log-linear histogram in the style of
+ * HdrHistogram (3 significant digits).  Results are written as JSON in
+ * the same shape as cs3214bench.lua produces for wrk, so server_bench.py
+ * can score them; -g additionally writes a HdrHistogram-style
+ * percentile distribution.
+ *
+ * The server may also be reached through a UNIX domain socket, with
+ * unix:/path/to/socket[:/path] in place of the URL.
+ *
+ * With -I pid, no requests are sent.  Instead, the connections are
+ * opened and left idle, and the growth of the server's resident set
+ * is reported per idle connection.
+ *
+ * Build with: gcc -O2 -pthread -o loadgen loadgen.c -lm (see build.sh)
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* The scenarios from server_bench.py */
+struct scenario {
+    const char *name;
+    int threads;
+    int connections;
+    int duration;       // seconds
+    int timeout;        // seconds
+    const char *path;
+};
+
+static struct scenario scenarios[] = {
+    { "login40",    40,    40, 10,  1, "/api/login" },
+    { "login500",   64,   500, 10,  5, "/api/login" },
+    { "login10k",   64, 10000, 30,  5, "/api/login" },
+    { "wwwcsvt100", 64,   100, 20,  5, "/www.cs.vt.edu-20200417.html" },
+    { "doom100",    40,    40, 20, 10, "/large" },
+};
+
+/********************************************************************/
+/* Log-linear histogram.  Values below 2^SUB_BITS are recorded
+ * exactly; larger values keep their top SUB_BITS bits.
+ */
+#define SUB_BITS 11
+#define SUB_HALF (1 << (SUB_BITS - 1))
+#define HIST_BUCKETS ((64 - SUB_BITS + 2) * SUB_HALF)
+
+struct hist {
+    uint64_t *counts;
+    uint64_t total;
+    uint64_t min, max;
+    double sum, sumsq;
+};
+
+static void
+hist_init(struct hist *h)
+{
+    h->counts = calloc(HIST_BUCKETS, sizeof h->counts[0]);
+    if (h->counts == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    h->total = 0;
+    h->min = UINT64_MAX;
+    h->max = 0;
+    h->sum = h->sumsq = 0;
+}
+
+static int
+hist_index(uint64_t v)
+{
+    if (v < (1 << SUB_BITS))
+        return v;
+    int shift = 63 - __builtin_clzll(v) - (SUB_BITS - 1);
+    return (shift << (SUB_BITS - 1)) + (v >> shift);
+}
+
+/* highest value that maps to the same bucket as index */
+static uint64_t
+hist_value(int index)
+{
+    if (index < (1 << SUB_BITS))
+        return index;
+    int shift = index / SUB_HALF - 1;
+    uint64_t m = index - shift * SUB_HALF;
+    return ((m + 1) << shift) - 1;
+}
+
+static void
+hist_record(struct hist *h, uint64_t v)
+{
+    h->counts[hist_index(v)]++;
+    h->total++;
+    if (v < h->min)
+        h->min = v;
+    if (v > h->max)
+        h->max = v;
+    h->sum += v;
+    h->sumsq += (double) v * v;
+}
+
+static void
+hist_merge(struct hist *into, struct hist *from)
+{
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        into->counts[i] += from->counts[i];
+    into->total += from->total;
+    if (from->min < into->min)
+        into->min = from->min;
+    if (from->max > into->max)
+        into->max = from->max;
+    into->sum += from->sum;
+    into->sumsq += from->sumsq;
+}
+
+static uint64_t
+hist_percentile(struct hist *h, double p)
+{
+    uint64_t want = ceil(p / 100.0 * h->total);
+    if (want == 0)
+        want = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= want)
+            return hist_value(i) < h->max ? hist_value(i) : h->max;
+    }
+    return h->max;
+}
+
+static double
+hist_mean(struct hist *h)
+{
+    return h->total ? h->sum / h->total : 0;
+}
+
+static double
+hist_stdev(struct hist *h)
+{
+    if (h->total < 2)
+        return 0;
+    double mean = hist_mean(h);
+    double var = (h->sumsq - h->total * mean * mean) / (h->total - 1);
+    return var > 0 ? sqrt(var) : 0;
+}
+
+/* Write the percentile distribution in HdrHistogram's text format,
+ * with values (recorded in us) scaled to ms.
+ */
+static void
+hist_write_hgrm(struct hist *h, FILE *f)
+{
+    const int ticks_per_half_distance = 5;
+    fprintf(f, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+
+    double next = 0;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS && seen < h->total; i++) {
+        if (h->counts[i] == 0)
+            continue;
+        seen += h->counts[i];
+        double pct = 100.0 * seen / h->total;
+        while (pct >= next && next < 100) {
+            double v = (hist_value(i) < h->max ? hist_value(i) : h->max) / 1e3;
+            fprintf(f, "%12.3f %14.12f %10lu %14.2f\n", v, next / 100,
+                    (unsigned long) seen, 1 / (1 - next / 100));
+            if (seen == h->total)   // the remaining ticks all fall into this bucket
+                break;
+            double half_distance = pow(2, floor(log2(100 / (100 - next))) + 1);
+            next += 100 / (ticks_per_half_distance * half_distance);
+        }
+    }
+    fprintf(f, "%12.3f %14.12f %10lu\n", h->max / 1e3, 1.0, (unsigned long) h->total);
+    fprintf(f, "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n", hist_mean(h) / 1e3, hist_stdev(h) / 1e3);
+    fprintf(f, "#[Max     = %12.3f, Total count    = %12lu]\n", h->max / 1e3, (unsigned long) h->total);
+    fprintf(f, "#[Buckets = %12d, SubBuckets     = %12d]\n", HIST_BUCKETS / SUB_HALF, 1 << SUB_BITS);
+}
+
+/********************************************************************/
+
+#define MAX_PIPELINE 64
+#define HDR_MAX 2048
+#define SAMPLE_INTERVAL_NS 100000000ULL     // request rate sampling
+
+enum conn_state {
+    CONN_IDLE,          // no request outstanding
+    CONN_CONNECTING,
+    CONN_ACTIVE,        // requests outstanding
+    CONN_BACKOFF,       // connect failed at once, retried by check_timeouts
+};
+
+struct worker;
+
+struct conn {
+    struct worker *w;
+    int fd;
+    enum conn_state state;
+    size_t wpos, wlen;                  // progress sending the request batch
+    int inflight;                       // requests awaiting a response
+    int head;                           // oldest outstanding request
+    uint64_t start_ns[MAX_PIPELINE];    // when each request was (to be) sent
+    uint64_t deadline_ns;
+    bool served;                        // completed at least one request
+    bool on_idle;                       // in w->idle (open loop)
+    bool refused;                       // last connect failed at once
+
+    // response parsing
+    char hdr[HDR_MAX];
+    size_t hdrlen;
+    bool in_body;
+    long long body_left;                // -1 means until EOF
+    bool server_close;
+};
+
+struct errors {
+    uint64_t connect, read, write, status, timeout;
+};
+
+struct worker {
+    pthread_t thread;
+    int epfd;
+    struct conn *conns;
+    int nconns;
+    struct hist latency;        // us
+    struct hist rate;           // requests/s per sample interval
+    uint64_t requests, bytes;
+    struct errors errors;
+
+    // open-loop schedule
+    double interval_ns;         // between requests of this thread, 0 = closed loop
+    uint64_t next_seq;
+    uint64_t start_ns;
+    struct conn **idle;
+    int nidle;
+};
+
+/* configuration */
+static struct addrinfo *server_addr;
+static char *request;               // a batch of 'pipeline' requests
+static size_t request_len;
+static int pipeline = 1;
+static bool keepalive = false;
+static uint64_t timeout_ns;
+static uint64_t end_ns;
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+conn_close(struct conn *c)
+{
+    if (c->fd != -1) {
+        close(c->fd);
+        c->fd = -1;
+    }
+    c->state = CONN_IDLE;
+    c->inflight = 0;
+}
+
+static void
+conn_watch(struct conn *c, uint32_t events, int op)
+{
+    struct epoll_event ev = { .events = events, .data.ptr = c };
+    if (epoll_ctl(c->w->epfd, op, c->fd, &ev) == -1) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Send the next batch of n requests, each scheduled at start[i]. */
+static void conn_fail(struct conn *c, uint64_t *counter);
+
+static void
+conn_dispatch(struct conn *c, uint64_t *start, int n)
+{
+    for (int i = 0; i < n; i++)
+        c->start_ns[i] = start[i];
+    c->head = 0;
+    c->inflight = n;
+    c->wpos = 0;
+    c->wlen = request_len / pipeline * n;
+    c->hdrlen = 0;
+    c->in_body = false;
+    c->deadline_ns = start[0] + timeout_ns;
+
+    if (c->fd != -1) {
+        c->state = CONN_ACTIVE;
+        conn_watch(c, EPOLLOUT, EPOLL_CTL_MOD);
+        return;
+    }
+
+    c->fd = socket(server_addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd == -1) {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    c->state = CONN_CONNECTING;
+    if (connect(c->fd, server_addr->ai_addr, server_addr->ai_addrlen) == -1
+        && errno != EINPROGRESS) {
+        // e.g. EAGAIN from a UNIX domain socket with a full backlog
+        c->refused = true;
+        conn_fail(c, &c->w->errors.connect);
+        return;
+    }
+    conn_watch(c, EPOLLOUT, EPOLL_CTL_ADD);
+}
+
+/* Park c until a request is due.  An idle keep-alive connection the
+ * server closes comes back here while it is still parked. */
+static void
+worker_idle(struct worker *w, struct conn *c)
+{
+    if (c->on_idle)
+        return;
+    c->on_idle = true;
+    w->idle[w->nidle++] = c;
+}
+
+/* Start the next request(s) on an idle connection (closed loop). */
+static void
+conn_next(struct conn *c)
+{
+    uint64_t start[MAX_PIPELINE];
+    uint64_t now = now_ns();
+    if (now >= end_ns) {
+        conn_close(c);
+        return;
+    }
+    if (c->w->interval_ns > 0) {
+        if (c->fd != -1 && !keepalive)
+            conn_close(c);
+        worker_idle(c->w, c);
+        return;
+    }
+    if (c->refused) {
+        // retrying right away would recurse for as long as connect fails
+        c->state = CONN_BACKOFF;
+        return;
+    }
+    for (int i = 0; i < pipeline; i++)
+        start[i] = now;
+    conn_dispatch(c, start, pipeline);
+}
+
+/* A request failed; drop the connection and start over. */
+static void
+conn_fail(struct conn *c, uint64_t *counter)
+{
+    (*counter)++;
+    conn_close(c);
+    conn_next(c);
+}
+
+static void
+response_done(struct conn *c, uint64_t now)
+{
+    struct worker *w = c->w;
+    uint64_t start = c->start_ns[c->head];
+    hist_record(&w->latency, (now - start) / 1000);
+    w->requests++;
+    c->served = true;
+    c->head++;
+    c->inflight--;
+    c->hdrlen = 0;
+    c->in_body = false;
+    if (c->inflight > 0) {
+        c->deadline_ns = c->start_ns[c->head] + timeout_ns;
+        return;
+    }
+
+    if (!keepalive || c->server_close)
+        conn_close(c);
+    else
+        c->state = CONN_IDLE;
+    conn_next(c);
+}
+
+/* Parse the status line and headers in c->hdr. */
+static bool
+parse_headers(struct conn *c)
+{
+    int status;
+    c->hdr[c->hdrlen] = '\0';
+    if (sscanf(c->hdr, "HTTP/%*d.%*d %d", &status) != 1)
+        return false;
+    if (status < 200 || status >= 400)
+        c->w->errors.status++;
+
+    c->body_left = -1;
+    c->server_close = strncmp(c->hdr, "HTTP/1.0", 8) == 0;
+    for (char *line = strstr(c->hdr, "\r\n"); line != NULL; line = strstr(line + 2, "\r\n")) {
+        if (!strncasecmp(line + 2, "Content-Length:", 15))
+            c->body_left = atoll(line + 17);
+        else if (!strncasecmp(line + 2, "Connection: close", 17))
+            c->server_close = true;
+        else if (!strncasecmp(line + 2, "Connection: keep-alive", 22))
+            c->server_close = false;
+    }
+    if (c->body_left == -1)
+        c->server_close = true;
+    return true;
+}
+
+/* Consume received data, completing any responses it contains. */
+static bool
+consume(struct conn *c, char *data, size_t len, uint64_t now)
+{
+    while (len > 0 && c->inflight > 0) {
+        if (!c->in_body) {
+            size_t n = 0;
+            bool end = false;
+            while (n < len && c->hdrlen < HDR_MAX - 1) {
+                c->hdr[c->hdrlen++] = data[n++];
+                if (c->hdrlen >= 4 && !memcmp(c->hdr + c->hdrlen - 4, "\r\n\r\n", 4)) {
+                    end = true;
+                    break;
+                }
+            }
+            data += n;
+            len -= n;
+            if (!end) {
+                if (c->hdrlen == HDR_MAX - 1)
+                    return false;
+                continue;
+            }
+            if (!parse_headers(c))
+                return false;
+            c->in_body = true;
+        }
+        if (c->body_left == -1)     // until EOF
+            return true;
+
+        size_t n = (size_t) c->body_left < len ? (size_t) c->body_left : len;
+        c->body_left -= n;
+        data += n;
+        len -= n;
+        if (c->body_left == 0)
+            response_done(c, now);
+    }
+    return true;
+}
+
+static void
+conn_event(struct conn *c, uint32_t events, char *scratch, size_t scratchlen)
+{
+    struct worker *w = c->w;
+    if (c->state == CONN_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof err;
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            conn_fail(c, &w->errors.connect);
+            return;
+        }
+        c->state = CONN_ACTIVE;
+    }
+
+    if (c->wpos < c->wlen) {
+        ssize_t rc = write(c->fd, request + c->wpos, c->wlen - c->wpos);
+        if (rc == -1 && errno != EAGAIN) {
+            conn_fail(c, &w->errors.write);
+            return;
+        }
+        if (rc > 0)
+            c->wpos += rc;
+        if (c->wpos == c->wlen)
+            conn_watch(c, EPOLLIN, EPOLL_CTL_MOD);
+        return;
+    }
+
+    for (;;) {
+        ssize_t rc = read(c->fd, scratch, scratchlen);
+        if (rc == -1) {
+            if (errno != EAGAIN)
+                conn_fail(c, &w->errors.read);
+            return;
+        }
+        uint64_t now = now_ns();
+        if (rc == 0) {
+            if (c->in_body && c->body_left == -1) {
+                c->server_close = true;
+                response_done(c, now);
+            } else if (c->inflight > 0) {
+                conn_fail(c, &w->errors.read);
+            } else {
+                conn_close(c);
+                conn_next(c);
+            }
+            return;
+        }
+        w->bytes += rc;
+        int fd = c->fd;
+        if (!consume(c, scratch, rc, now)) {
+            conn_fail(c, &w->errors.read);
+            return;
+        }
+        // a completed response may have closed or reused the connection
+        if (c->fd != fd || c->state != CONN_ACTIVE || c->wpos < c->wlen)
+            return;
+    }
+}
+
+/* Open loop: hand out all requests that are due to idle connections. */
+static uint64_t
+dispatch_due(struct worker *w, uint64_t now)
+{
+    for (;;) {
+        uint64_t due = w->start_ns + w->next_seq * w->interval_ns;
+        if (due > now || due >= end_ns)
+            return due;
+        if (w->nidle == 0)
+            return now + 1000000;   // all busy, check again in 1ms
+
+        struct conn *c = w->idle[--w->nidle];
+        c->on_idle = false;
+        uint64_t start[MAX_PIPELINE];
+        int n = 0;
+        while (n < pipeline) {
+            due = w->start_ns + w->next_seq * w->interval_ns;
+            if (due > now)
+                break;
+            start[n++] = due;
+            w->next_seq++;
+        }
+        conn_dispatch(c, start, n);
+    }
+}
+
+static void
+check_timeouts(struct worker *w, uint64_t now)
+{
+    for (int i = 0; i < w->nconns; i++) {
+        struct conn *c = &w->conns[i];
+        if (c->state == CONN_BACKOFF) {
+            c->refused = false;
+            conn_next(c);
+        } else if (c->state != CONN_IDLE && now > c->deadline_ns)
+            conn_fail(c, &w->errors.timeout);
+    }
+}
+
+static void *
+worker_run(void *arg)
+{
+    struct worker *w = arg;
+    static __thread char scratch[256 * 1024];
+    struct epoll_event events[256];
+
+    w->start_ns = now_ns();
+    for (int i = 0; i < w->nconns; i++)
+        conn_next(&w->conns[i]);
+
+    uint64_t last_check = w->start_ns, last_sample = w->start_ns, last_requests = 0;
+    for (;;) {
+        uint64_t now = now_ns();
+        if (now >= end_ns)
+            break;
+
+        uint64_t wake = now + 10000000;
+        if (w->interval_ns > 0) {
+            uint64_t due = dispatch_due(w, now);
+            if (due < wake)
+                wake = due;
+        }
+        int ms = (wake - now + 999999) / 1000000;
+        int n = epoll_wait(w->epfd, events, 256, ms);
+        for (int i = 0; i < n; i++)
+            conn_event(events[i].data.ptr, events[i].events, scratch, sizeof scratch);
+
+        now = now_ns();
+        if (now - last_check > 10000000) {
+            check_timeouts(w, now);
+            last_check = now;
+        }
+        if (now - last_sample >= SAMPLE_INTERVAL_NS) {
+            hist_record(&w->rate, (w->requests - last_requests) * 1e9 / (now - last_sample));
+            last_requests = w->requests;
+            last_sample = now;
+        }
+    }
+    for (int i = 0; i < w->nconns; i++)
+        conn_close(&w->conns[i]);
+    return NULL;
+}
+
+/********************************************************************/
+
+static void
+print_stat(FILE *f, const char *name, struct hist *h, bool last)
+{
+    fprintf(f, "  \"%s\": {\n", name);
+    fprintf(f, "    \"min\": %lu,\n", (unsigned long) (h->total ? h->min : 0));
+    fprintf(f, "    \"max\": %lu,\n", (unsigned long) h->max);
+    fprintf(f, "    \"mean\": %.3f,\n", hist_mean(h));
+    fprintf(f, "    \"stdev\": %.3f,\n", hist_stdev(h));
+    fprintf(f, "    \"percentiles\": {\n");
+    fprintf(f, "      \"50\": %lu,\n", (unsigned long) hist_percentile(h, 50));
+    fprintf(f, "      \"90\": %lu,\n", (unsigned long) hist_percentile(h, 90));
+    fprintf(f, "      \"95\": %lu,\n", (unsigned long) hist_percentile(h, 95));
+    fprintf(f, "      \"99\": %lu,\n", (unsigned long) hist_percentile(h, 99));
+    fprintf(f, "      \"99.999\": %lu\n", (unsigned long) hist_percentile(h, 99.999));
+    fprintf(f, "    }\n  }%s\n", last ? "" : ",");
+}
+
+/********************************************************************/
+/* Idle connection memory */
+
+static long
+rss_kb(pid_t pid)
+{
+    char path[64], line[256];
+    snprintf(path, sizeof path, "/proc/%d/status", (int) pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    long kb = -1;
+    while (fgets(line, sizeof line, f) != NULL)
+        if (sscanf(line, "VmRSS: %ld kB", &kb) == 1)
+            break;
+    fclose(f);
+    return kb;
+}
+
+/* Open nconns connections to the server, which runs as pid, without
+ * sending anything, and report its resident set growth per connection
+ * after seconds, which should be longer than the server defers accepting
+ * connections without data for (TCP_DEFER_ACCEPT). */
+static void
+measure_idle(pid_t pid, int nconns, int seconds, const char *outfile)
+{
+    int *fds = malloc(nconns * sizeof *fds);
+    if (fds == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    long before = rss_kb(pid);
+    int opened = 0;
+    for (; opened < nconns; opened++) {
+        fds[opened] = socket(server_addr->ai_family, SOCK_STREAM, 0);
+        if (fds[opened] == -1
+            || connect(fds[opened], server_addr->ai_addr, server_addr->ai_addrlen) == -1) {
+            perror("connect");
+            if (fds[opened] != -1)
+                close(fds[opened]);
+            break;
+        }
+    }
+    sleep(seconds);
+    long after = rss_kb(pid);
+    for (int i = 0; i < opened; i++)
+        close(fds[i]);
+    free(fds);
+
+    double per_conn = opened ? (after - before) * 1024.0 / opened : 0;
+    FILE *f = outfile ? fopen(outfile, "w") : stdout;
+    if (f == NULL) {
+        perror(outfile);
+        exit(EXIT_FAILURE);
+    }
+    fprintf(f, "{\n  \"idle\": {\n");
+    fprintf(f, "    \"connections\": %d,\n", opened);
+    fprintf(f, "    \"rss_before_kb\": %ld,\n", before);
+    fprintf(f, "    \"rss_after_kb\": %ld,\n", after);
+    fprintf(f, "    \"bytes_per_connection\": %.0f\n", per_conn);
+    fprintf(f, "  }\n}\n");
+    if (outfile)
+        fclose(f);
+    fprintf(stderr, "%d idle connections: server RSS %ld -> %ld KB, %.0f bytes per connection\n",
+            opened, before, after, per_conn);
+}
+
+static void
+usage(char *av0)
+{
+    fprintf(stderr, "Usage: %s [options] http://host:port[/path] | unix:socket[:/path]\n"
+        "  -S name      run a predefined scenario (login40, login500, login10k,\n"
+        "               wwwcsvt100, doom100); other options override it\n"
+        "  -t threads   number of threads\n"
+        "  -c conns     total number of connections\n"
+        "  -d seconds   duration\n"
+        "  -x seconds   request timeout\n"
+        "  -R rate      open loop: total requests per second\n"
+        "  -k           keep connections alive between requests\n"
+        "  -P depth     pipeline depth per connection (default 1)\n"
+        "  -H header    add a request header\n"
+        "  -o file      write JSON results to file instead of stdout\n"
+        "  -g file      write HdrHistogram percentile distribution to file\n"
+        "  -I pid       open the connections idle and report the memory used\n"
+        "               per connection by the server running as pid\n"
+        , av0);
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int ac, char *av[])
+{
+    struct scenario sc = { "custom", 2, 10, 10, 5, NULL };
+    int threads = -1, conns = -1, duration = -1, timeout = -1;
+    double rate = 0;
+    char headers[4096] = "";
+    char *outfile = NULL, *hgrmfile = NULL;
+    pid_t idle_pid = 0;
+    int opt;
+
+    while ((opt = getopt(ac, av, "S:t:c:d:x:R:kP:H:o:g:I:h")) != -1) {
+        switch (opt) {
+        case 'S': {
+            int i, n = sizeof scenarios / sizeof scenarios[0];
+            for (i = 0; i < n && strcmp(scenarios[i].name, optarg); i++)
+                ;
+            if (i == n) {
+                fprintf(stderr, "unknown scenario %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            sc = scenarios[i];
+            break;
+        }
+        case 't': threads = atoi(optarg); break;
+        case 'c': conns = atoi(optarg); break;
+        case 'd': duration = atoi(optarg); break;
+        case 'x': timeout = atoi(optarg); break;
+        case 'R': rate = atof(optarg); break;
+        case 'k': keepalive = true; break;
+        case 'P': pipeline = atoi(optarg); break;
+        case 'H':
+            strncat(headers, optarg, sizeof headers - strlen(headers) - 3);
+            strcat(headers, "\r\n");
+            break;
+        case 'o': outfile = optarg; break;
+        case 'g': hgrmfile = optarg; break;
+        case 'I': idle_pid = atoi(optarg); break;
+        default: usage(av[0]);
+        }
+    }
+    if (optind != ac - 1)
+        usage(av[0]);
+    if (threads > 0) sc.threads = threads;
+    if (conns > 0) sc.connections = conns;
+    if (duration > 0) sc.duration = duration;
+    if (timeout > 0) sc.timeout = timeout;
+    if (pipeline < 1 || pipeline > MAX_PIPELINE)
+        usage(av[0]);
+    if (sc.threads > sc.connections)
+        sc.threads = sc.connections;
+
+    char host[256], port[16] = "80", path[2048] = "/", authority[300];
+    const char *host_header = authority;
+    static struct sockaddr_un sun = { .sun_family = AF_UNIX };
+    static struct addrinfo unix_addr = { .ai_family = AF_UNIX, .ai_socktype = SOCK_STREAM };
+    if (strncmp(av[optind], "unix:", 5) == 0) {
+        if (sscanf(av[optind] + 5, "%107[^:]:%2047s", sun.sun_path, path) < 1)
+            usage(av[0]);
+        unix_addr.ai_addr = (struct sockaddr *) &sun;
+        unix_addr.ai_addrlen = sizeof sun;
+        server_addr = &unix_addr;
+        host_header = "localhost";
+        snprintf(authority, sizeof authority, "unix:%s", sun.sun_path);
+    } else {
+        if (sscanf(av[optind], "http://%255[^:/]:%15[0-9]%2047s", host, port, path) < 2
+            && sscanf(av[optind], "http://%255[^:/]%2047s", host, path) < 1)
+            usage(av[0]);
+        struct addrinfo hint = { .ai_socktype = SOCK_STREAM };
+        int rc = getaddrinfo(host, port, &hint, &server_addr);
+        if (rc != 0) {
+            fprintf(stderr, "%s: %s\n", host, gai_strerror(rc));
+            exit(EXIT_FAILURE);
+        }
+        snprintf(authority, sizeof authority, "%s:%s", host, port);
+    }
+    if (sc.path != NULL && strcmp(path, "/") == 0)
+        snprintf(path, sizeof path, "%s", sc.path);
+    if (idle_pid > 0) {
+        measure_idle(idle_pid, sc.connections, sc.duration, outfile);
+        return 0;
+    }
+
+    char one[8192];
+    int onelen = snprintf(one, sizeof one, "GET %s HTTP/1.1\r\nHost: %s\r\n%s%s\r\n",
+                          path, host_header, keepalive ? "" : "Connection: close\r\n", headers);
+    request_len = onelen * pipeline;
+    request = malloc(request_len);
+    for (int i = 0; i < pipeline; i++)
+        memcpy(request + i * onelen, one, onelen);
+
+    timeout_ns = sc.timeout * 1000000000ULL;
+    fprintf(stderr, "Running %s: %ds, %d threads, %d connections, %s %s%s against %s%s\n",
+            sc.name, sc.duration, sc.threads, sc.connections,
+            rate > 0 ? "open loop" : "closed loop", keepalive ? "keep-alive" : "close",
+            pipeline > 1 ? ", pipelined" : "", authority, path);
+
+    struct worker *workers = calloc(sc.threads, sizeof *workers);
+    uint64_t start = now_ns();
+    end_ns = start + sc.duration * 1000000000ULL;
+    for (int t = 0; t < sc.threads; t++) {
+        struct worker *w = &workers[t];
+        w->nconns = sc.connections / sc.threads + (t < sc.connections % sc.threads);
+        w->conns = calloc(w->nconns, sizeof *w->conns);
+        w->idle = calloc(w->nconns, sizeof *w->idle);
+        w->epfd = epoll_create1(0);
+        if (w->conns == NULL || w->idle == NULL || w->epfd == -1) {
+            perror("worker setup");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < w->nconns; i++) {
+            w->conns[i].w = w;
+            w->conns[i].fd = -1;
+        }
+        hist_init(&w->latency);
+        hist_init(&w->rate);
+        if (rate > 0)
+            w->interval_ns = 1e9 * sc.threads / rate;
+        pthread_create(&w->thread, NULL, worker_run, w);
+    }
+
+    struct hist latency, reqrate;
+    hist_init(&latency);
+    hist_init(&reqrate);
+    struct errors errors = { 0 };
+    uint64_t requests = 0, bytes = 0, served = 0;
+    for (int t = 0; t < sc.threads; t++) {
+        struct worker *w = &workers[t];
+        pthread_join(w->thread, NULL);
+        hist_merge(&latency, &w->latency);
+        hist_merge(&reqrate, &w->rate);
+        requests += w->requests;
+        bytes += w->bytes;
+        errors.connect += w->errors.connect;
+        errors.read += w->errors.read;
+        errors.write += w->errors.write;
+        errors.status += w->errors.status;
+        errors.timeout += w->errors.timeout;
+        for (int i = 0; i < w->nconns; i++)
+            served += w->conns[i].served;
+    }
+    uint64_t elapsed_us = (now_ns() - start) / 1000;
+
+    FILE *f = outfile ? fopen(outfile, "w") : stdout;
+    if (f == NULL) {
+        perror(outfile);
+        exit(EXIT_FAILURE);
+    }
+    fprintf(f, "{\n  \"summary\": {\n");
+    fprintf(f, "    \"duration\": %lu,\n", (unsigned long) elapsed_us);
+    fprintf(f, "    \"requests\": %lu,\n", (unsigned long) requests);
+    fprintf(f, "    \"bytes\": %lu,\n", (unsigned long) bytes);
+    fprintf(f, "    \"connections\": %d,\n", sc.connections);
+    fprintf(f, "    \"served\": %lu,\n", (unsigned long) served);
+    fprintf(f, "    \"errors\": {\n");
+    fprintf(f, "      \"connect\": %lu,\n", (unsigned long) errors.connect);
+    fprintf(f, "      \"read\": %lu,\n", (unsigned long) errors.read);
+    fprintf(f, "      \"write\": %lu,\n", (unsigned long) errors.write);
+    fprintf(f, "      \"status\": %lu,\n", (unsigned long) errors.status);
+    fprintf(f, "      \"timeout\": %lu\n", (unsigned long) errors.timeout);
+    fprintf(f, "    }\n  },\n");
+    print_stat(f, "latency", &latency, false);
+    print_stat(f, "requests", &reqrate, true);
+    fprintf(f, "}\n");
+    if (outfile)
+        fclose(f);
+
+    fprintf(stderr, "%lu requests in %.2fs, %.1f req/s, %.2f MB/s, p50 %.3fms p99 %.3fms\n",
+            (unsigned long) requests, elapsed_us / 1e6, requests * 1e6 / elapsed_us,
+            bytes / (double) elapsed_us, hist_percentile(&latency, 50) / 1e3,
+            hist_percentile(&latency, 99) / 1e3);
+
+    if (hgrmfile) {
+        FILE *g = fopen(hgrmfile, "w");
+        if (g == NULL) {
+            perror(hgrmfile);
+            exit(EXIT_FAILURE);
+        }
+        hist_write_hgrm(&latency, g);
+        fclose(g);
+    }
+    return 0;
+}
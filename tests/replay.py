@@ -0,0 +1,334 @@
+#!/usr/bin/env python3
+
+#
+# Record, convert, and replay request traces to benchmark the server
+# with a production-like request mix rather than a single URL.
+#
+#   replay.py record -l port -u host:port -o trace.jsonl
+#       Run a recording proxy on the given local port that forwards
+#       to the server at host:port, e.g., while driving the server with
+#       a browser or with server_unit_test_pserv.py.
+#
+#   replay.py convert -o trace.jsonl [-g seconds] file.comux ...
+#       Convert gurthang comux files (see sfi/concepts_gurthang.md)
+#       into a trace, spacing connections -g seconds apart.
+#
+#   replay.py replay [-s speed] [-c max_conns] [-n loops] [-o results.json]
+#                    trace.jsonl http://host:port
+#       Replay a trace.  Each connection is opened at its recorded time,
+#       divided by the speedup factor.  Latency is measured from the
+#       scheduled start of a connection until the server has sent its
+#       complete response, and reported per request class.  With -s 0,
+#       the trace is replayed as fast as possible, limited only by -c,
+#       and latency is measured from when a connection is opened.
+#
+# A trace has one JSON object per line and connection:
+#
+#   { "t": <start time in seconds>,
+#     "chunks": [ { "dt": <seconds after start>, "data": <base64> }, ... ] }
+#
+
+import argparse, asyncio, base64, json, math, struct, sys, time
+
+
+def classify(data):
+    """Map the first request line of a connection to a request class."""
+    line = data.split(b"\r\n", 1)[0].decode("latin-1", "replace")
+    parts = line.split(" ")
+    if len(parts) < 2:
+        return "malformed"
+    method, path = parts[0], parts[1].split("?", 1)[0]
+    if path.startswith("/api/"):
+        name = path
+    elif path.startswith("/private"):
+        name = "/private/*"
+    elif path.endswith(".mp4"):
+        name = "video"
+    elif path == "/" or path.endswith(".html") or "." not in path.rsplit("/", 1)[-1]:
+        name = "html"
+    else:
+        name = "asset"
+    return "%s %s" % (method, name)
+
+
+def write_entry(out, start, chunks):
+    entry = dict(
+        t=round(start, 6),
+        chunks=[dict(dt=round(dt, 6), data=base64.b64encode(d).decode("ascii")) for dt, d in chunks],
+    )
+    out.write(json.dumps(entry) + "\n")
+    out.flush()
+
+
+def read_trace(fname):
+    with open(fname) as f:
+        for line in f:
+            if line.strip():
+                entry = json.loads(line)
+                chunks = [(c["dt"], base64.b64decode(c["data"])) for c in entry["chunks"]]
+                yield entry["t"], chunks
+
+
+#
+# record
+#
+async def record(args):
+    uhost, uport = args.upstream.rsplit(":", 1)
+    out = open(args.output, "w")
+    t0 = time.monotonic()
+
+    async def pipe(reader, writer, chunks=None, start=None):
+        try:
+            while True:
+                data = await reader.read(65536)
+                if not data:
+                    break
+                if chunks is not None:
+                    chunks.append((time.monotonic() - start, data))
+                writer.write(data)
+                await writer.drain()
+        except ConnectionError:
+            pass
+        finally:
+            writer.close()
+
+    async def handle(creader, cwriter):
+        start = time.monotonic()
+        chunks = []
+        try:
+            sreader, swriter = await asyncio.open_connection(uhost, int(uport))
+        except OSError as e:
+            print("cannot connect to %s: %s" % (args.upstream, e), file=sys.stderr)
+            cwriter.close()
+            return
+        await asyncio.gather(
+            pipe(creader, swriter, chunks, start),
+            pipe(sreader, cwriter),
+        )
+        if chunks:
+            write_entry(out, start - t0, chunks)
+
+    server = await asyncio.start_server(handle, "localhost", args.listen)
+    print("Recording to %s, forwarding localhost:%d to %s; hit ^C to stop"
+          % (args.output, args.listen, args.upstream))
+    async with server:
+        await server.serve_forever()
+
+
+#
+# convert
+#
+COMUX_MAGIC = b"comux"
+COMUX_VERSION = 0
+
+
+def read_comux(fname):
+    """
+    Parse a comux file, returning a dict mapping connection ids to their data.
+
+    The layout follows gurthang's comux format: the magic string, followed
+    by the format version, the number of connections, and the number of
+    chunks (uint32 each), followed by the chunks.  Each chunk has a header
+    of connection id (uint32), data length (uint64), scheduling value
+    (uint32), and flags (uint32), followed by its data.  Integers are
+    little-endian.  Chunks are sent in the order of their scheduling values.
+    Files of other versions are rejected rather than misparsed.
+    """
+    with open(fname, "rb") as f:
+        raw = f.read()
+    if raw[: len(COMUX_MAGIC)].lower() != COMUX_MAGIC:
+        raise ValueError("%s: not a comux file" % fname)
+    off = len(COMUX_MAGIC)
+    version, nconns, nchunks = struct.unpack_from("<III", raw, off)
+    off += 12
+    if version != COMUX_VERSION:
+        raise ValueError("%s: unsupported comux version %d" % (fname, version))
+    chunks = []
+    for i in range(nchunks):
+        conn, length, sched, flags = struct.unpack_from("<IQII", raw, off)
+        off += struct.calcsize("<IQII")
+        if off + length > len(raw):
+            raise ValueError("%s: chunk %d is truncated" % (fname, i))
+        chunks.append((sched, i, conn, raw[off : off + length]))
+        off += length
+
+    conns = {}
+    for sched, i, conn, data in sorted(chunks):
+        conns.setdefault(conn, []).append(data)
+    return conns
+
+
+def convert(args):
+    t = 0.0
+    n = 0
+    with open(args.output, "w") as out:
+        for fname in args.files:
+            try:
+                conns = read_comux(fname)
+            except (ValueError, struct.error) as e:
+                print("skipping %s: %s" % (fname, e), file=sys.stderr)
+                continue
+            for conn in sorted(conns):
+                write_entry(out, t, [(0.0, d) for d in conns[conn]])
+                t += args.gap
+                n += 1
+    print("Wrote %d connections to %s" % (n, args.output))
+
+
+#
+# replay
+#
+async def read_response(reader):
+    """Read a response, returning its status, or None on a protocol error."""
+    head = await reader.readuntil(b"\r\n\r\n")
+    try:
+        status = int(head.split(b" ", 2)[1])
+    except (IndexError, ValueError):
+        return None
+    length = None
+    for line in head.split(b"\r\n")[1:]:
+        name, _, value = line.partition(b":")
+        if name.strip().lower() == b"content-length":
+            length = int(value.strip())
+    if length is None:
+        while await reader.read(65536):
+            pass
+    else:
+        await reader.readexactly(length)
+    return status
+
+
+async def replay_one(host, port, chunks, scheduled, sem, results, cls):
+    async with sem:
+        if scheduled is None:   # as fast as possible, measure from actual start
+            scheduled = time.monotonic()
+        try:
+            reader, writer = await asyncio.open_connection(host, port)
+            start = time.monotonic()
+            for dt, data in chunks:
+                delay = start + dt - time.monotonic()
+                if delay > 0:
+                    await asyncio.sleep(delay)
+                writer.write(data)
+            await writer.drain()
+            status = await read_response(reader)
+            writer.close()
+        except (OSError, asyncio.IncompleteReadError, asyncio.LimitOverrunError):
+            status = None
+    elapsed = time.monotonic() - scheduled
+    results.setdefault(cls, []).append((elapsed, status))
+
+
+def percentile(values, p):
+    if not values:
+        return 0
+    k = max(0, min(len(values) - 1, math.ceil(p / 100 * len(values)) - 1))
+    return values[k]
+
+
+def summarize(samples):
+    latencies = sorted(1e3 * t for t, status in samples)
+    errors = sum(1 for t, status in samples if status is None)
+    statuses = {}
+    for t, status in samples:
+        key = str(status) if status is not None else "error"
+        statuses[key] = statuses.get(key, 0) + 1
+    return dict(
+        count=len(samples),
+        errors=errors,
+        status=statuses,
+        latency=dict(
+            min=latencies[0],
+            mean=sum(latencies) / len(latencies),
+            p50=percentile(latencies, 50),
+            p90=percentile(latencies, 90),
+            p99=percentile(latencies, 99),
+            p999=percentile(latencies, 99.9),
+            max=latencies[-1],
+        ),
+    )
+
+
+async def replay(args):
+    url = args.url[len("http://"):] if args.url.startswith("http://") else args.url
+    host, port = url.rstrip("/").rsplit(":", 1)
+    trace = list(read_trace(args.trace))
+    if not trace:
+        print("%s is empty" % args.trace)
+        return
+
+    sem = asyncio.Semaphore(args.conns)
+    results = {}
+    tasks = []
+    duration = trace[-1][0] - trace[0][0]
+    t0 = time.monotonic()
+    for loop in range(args.loops):
+        for t, chunks in trace:
+            offset = loop * duration + (t - trace[0][0])
+            scheduled = None
+            if args.speed > 0:
+                scheduled = t0 + offset / args.speed
+                delay = scheduled - time.monotonic()
+                if delay > 0:
+                    await asyncio.sleep(delay)
+            cls = classify(chunks[0][1]) if chunks else "empty"
+            if args.speed > 0:
+                chunks = [(dt / args.speed, d) for dt, d in chunks]
+            tasks.append(asyncio.create_task(
+                replay_one(host, int(port), chunks, scheduled, sem, results, cls)))
+    await asyncio.gather(*tasks)
+    elapsed = time.monotonic() - t0
+
+    report = dict(
+        duration=elapsed,
+        connections=len(tasks),
+        overall=summarize([s for samples in results.values() for s in samples]),
+        classes={cls: summarize(samples) for cls, samples in sorted(results.items())},
+    )
+    print("%d connections in %.2fs (%.1f/s)" % (len(tasks), elapsed, len(tasks) / elapsed))
+    print("%-28s %7s %6s %9s %9s %9s %9s" % ("class", "count", "errors", "p50 ms", "p90 ms", "p99 ms", "max ms"))
+    for cls, r in list(report["classes"].items()) + [("overall", report["overall"])]:
+        lat = r["latency"]
+        print("%-28s %7d %6d %9.3f %9.3f %9.3f %9.3f"
+              % (cls, r["count"], r["errors"], lat["p50"], lat["p90"], lat["p99"], lat["max"]))
+    if args.output:
+        with open(args.output, "w") as f:
+            json.dump(report, f, indent=2)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Record, convert, and replay request traces")
+    sub = parser.add_subparsers(dest="cmd", required=True)
+
+    p = sub.add_parser("record", help="record traffic through a forwarding proxy")
+    p.add_argument("-l", "--listen", type=int, required=True, help="local port to listen on")
+    p.add_argument("-u", "--upstream", required=True, help="server to forward to, host:port")
+    p.add_argument("-o", "--output", required=True, help="trace file to write")
+
+    p = sub.add_parser("convert", help="convert comux files into a trace")
+    p.add_argument("-o", "--output", required=True, help="trace file to write")
+    p.add_argument("-g", "--gap", type=float, default=0.001, help="seconds between connections")
+    p.add_argument("files", nargs="+")
+
+    p = sub.add_parser("replay", help="replay a trace against a server")
+    p.add_argument("-s", "--speed", type=float, default=1.0, help="speedup, 0 for as fast as possible")
+    p.add_argument("-c", "--conns", type=int, default=1000, help="maximum concurrent connections")
+    p.add_argument("-n", "--loops", type=int, default=1, help="number of times to replay the trace")
+    p.add_argument("-o", "--output", help="write JSON results to this file")
+    p.add_argument("trace")
+    p.add_argument("url", help="http://host:port of the server")
+
+    args = parser.parse_args()
+    try:
+        if args.cmd == "record":
+            asyncio.run(record(args))
+        elif args.cmd == "convert":
+            convert(args)
+        else:
+            asyncio.run(replay(args))
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
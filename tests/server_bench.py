@@ -30,6 +30,7 @@ VERSION = "1.1"
 server_exe = "./server"
 server_root = "_serverroot_"
 wrk_exe = "/home/courses/cs3214/bin/wrk"
+loadgen_exe = "loadgen"
 nthreads = 64
 
 # tests will be run in this order
@@ -144,6 +145,10 @@ Usage: %s [-hv] [-l] [-s server] [-R serverroot] [-t test1,test2,...] [url]
    -t test                run just the tests specified
    -l                     list available tests with their descriptions
    -i                     activate ink tracing tool
+   -L                     run server and client on this machine, using
+                            the loadgen program (see build.sh) instead of wrk
+   -U                     with -L, also run each test over a UNIX domain
+                            socket and compare it with loopback TCP
    url                    URL where your server can be reached, i.e.
                             http://hickory.rlogin:12306/
 
@@ -153,13 +158,16 @@ On the first node, run it without a URL to start the server.
 Then run it on a second node with the URL printed out by the
 first run.
 
+Alternatively, run it with -L and without a URL to start the server and
+benchmark it locally.
+
     """
         % (sys.argv[0], server_exe, server_root)
     )
 
 
 try:
-    opts, args = getopt.getopt(sys.argv[1:], "ihvs:R:t:l", ["help", "verbose"])
+    opts, args = getopt.getopt(sys.argv[1:], "ihvs:R:t:lLU", ["help", "verbose"])
 except getopt.GetoptError as err:
     print(str(err))
     usage()
@@ -168,6 +176,8 @@ except getopt.GetoptError as err:
 verbose = False
 hostname = socket.gethostname()
 useInk = False
+useLoadgen = False
+useUnix = False
 
 for opt, arg in opts:
     if opt == "-h":
@@ -177,6 +187,10 @@ for opt, arg in opts:
         verbose = True
     elif opt == "-i":
         useInk = True
+    elif opt == "-L":
+        useLoadgen = True
+    elif opt == "-U":
+        useUnix = True
     elif opt == "-s":
         server_exe = arg
     elif opt == "-R":
@@ -209,7 +223,7 @@ def raise_thread_limit():
 #
 # Start the server.
 #
-def start_server(root_dir):
+def start_server(root_dir, local=False):
     print("I will now prepare your server for benchmarking.")
     if not os.access(server_exe, os.X_OK):
         print("Did not find server executable: %s" % (server_exe))
@@ -238,17 +252,23 @@ def start_server(root_dir):
     port = (os.getpid() % 10000) + 20000
 
     cmd = [server_exe, "-p", str(port), "-R", root_dir, "-s"]
+    if local and useUnix:
+        cmd += ["-U", unix_socket_path]
 
     raise_fd_limit()
     raise_thread_limit()
 
+    global server_pid
     server = subprocess.Popen(cmd, stdout=open(os.devnull, "w"), stderr=sys.stderr)
+    server_pid = server.pid
 
     def clean_up_testing():
         try:
             os.kill(server.pid, signal.SIGKILL)
         except:
             pass
+        if local and useUnix and os.path.exists(unix_socket_path):
+            os.unlink(unix_socket_path)
 
     atexit.register(clean_up_testing)
 
@@ -297,6 +317,9 @@ def start_server(root_dir):
         print("Your server did not start, giving up after 10 tries")
         sys.exit(0)
 
+    if local:
+        return port
+
     this_script = os.path.realpath(sys.argv[0])
     print(
         f"""
@@ -353,15 +376,103 @@ def start_wrk(url, test):
         return r
 
 
-if len(args) == 0:
+#
+# Run the same scenario with the native load generator, which writes
+# results in the same format as cs3214bench.lua.
+#
+def start_loadgen(url, test):
+    exe = loadgen_exe if os.path.isabs(loadgen_exe) else "%s/%s" % (script_dir, loadgen_exe)
+    if not os.access(exe, os.X_OK):
+        print("Did not find %s, please run build.sh" % exe)
+        sys.exit(-1)
+
+    resfile = "ssresults.json"
+    cmd = [
+        exe,
+        "-S", test.name,
+        "-o", resfile,
+        "-g", test.name + ".hgrm",
+        url + test.path,
+    ]
+    if verbose:
+        print("I will now run", " ".join(cmd))
+
+    subprocess.run(cmd, stdout=sys.stdout, stderr=sys.stderr, check=True)
+    with open(resfile) as jfile:
+        r = json.load(jfile)
+        os.unlink(resfile)
+        return r
+
+
+#
+# Measure the memory the server uses per idle connection, that is, a
+# connection that was accepted but has not sent its request yet.
+# Only possible when the server was started locally.
+#
+idle_connections = 10000
+idle_target = 5120  # bytes per idle connection
+
+
+def measure_idle(url):
+    exe = loadgen_exe if os.path.isabs(loadgen_exe) else "%s/%s" % (script_dir, loadgen_exe)
+    resfile = "idleresults.json"
+    cmd = [
+        exe,
+        "-I", str(server_pid),
+        "-c", str(idle_connections),
+        "-d", "10",
+        "-o", resfile,
+        url + "/small",
+    ]
+    if verbose:
+        print("I will now run", " ".join(cmd))
+
+    subprocess.run(cmd, stdout=sys.stdout, stderr=sys.stderr, check=True)
+    with open(resfile) as jfile:
+        r = json.load(jfile)["idle"]
+        os.unlink(resfile)
+    print(
+        "Memory per idle connection: %.0f bytes (target: %d bytes) %s"
+        % (
+            r["bytes_per_connection"],
+            idle_target,
+            "ok" if r["bytes_per_connection"] <= idle_target else "MISSED",
+        )
+    )
+    return r
+
+
+#
+# Report the throughput of a test over the UNIX domain socket relative
+# to loopback TCP.
+#
+def compare_unix(testname, tcp, unix):
+    def rate(r):
+        s = r["summary"]
+        return 1e6 * s["requests"] / s["duration"], 1e6 * s["bytes"] / s["duration"] / 1024 / 1024
+
+    (tcp_rps, tcp_mbps), (unix_rps, unix_mbps) = rate(tcp), rate(unix)
+    print(
+        "%s: TCP %.0f req/s %.1f MB/s, UNIX socket %.0f req/s %.1f MB/s (%+.0f%%)"
+        % (testname, tcp_rps, tcp_mbps, unix_rps, unix_mbps,
+           100 * (unix_rps / tcp_rps - 1) if tcp_rps > 0 else 0)
+    )
+
+
+server_pid = None
+unix_socket_path = "/tmp/server_bench.%d.sock" % os.getpid()
+if len(args) == 0 and not useLoadgen:
     start_server(server_root)
 else:
-    url = args[0]
+    if len(args) == 0:
+        url = "http://localhost:%d" % start_server(server_root, local=True)
+    else:
+        url = args[0]
     # strip ending / since the path args contain them
     while url.endswith("/"):
         url = url[:-1]
 
-    if hostname in url:
+    if hostname in url and not useLoadgen:
         print("Please do not start the client on the same machine as the server.")
         sys.exit(-1)
 
@@ -378,12 +489,28 @@ else:
         test = testsbyname[testname]
         print("Now running test: %s\n" % (testname))
         try:
-            results[testname] = start_wrk(url, test)
+            if useLoadgen:
+                results[testname] = start_loadgen(url, test)
+            else:
+                results[testname] = start_wrk(url, test)
+            if useUnix and server_pid is not None:
+                print("Now running test: %s over a UNIX domain socket\n" % (testname))
+                unix = start_loadgen("unix:%s:" % unix_socket_path, test)
+                results[testname + "-unix"] = unix
+                compare_unix(testname, results[testname], unix)
         except Exception as e:
             # print the backtrace
             traceback.print_exc(file=sys.stderr)
             print("An exception occurred %s, skipping this test" % (str(e)))
 
+    if server_pid is not None:
+        print("Now measuring memory per idle connection\n")
+        try:
+            results["idle"] = measure_idle(url)
+        except Exception as e:
+            traceback.print_exc(file=sys.stderr)
+            print("An exception occurred %s, skipping this measurement" % (str(e)))
+
     ofilename = "pserv.results.%d.json" % (os.getpid())
     print("Writing results to %s" % ofilename)
     with open(ofilename, "w") as ofile:
@@ -11,8 +11,8 @@
 #
 
 import atexit, base64, errno, getopt, json, multiprocessing, os
-import random, requests, signal, socket, struct, string, subprocess
-import sys, time, traceback, unittest, re, os
+import random, requests, shutil, signal, socket, struct, string, subprocess
+import sys, tempfile, time, traceback, unittest, re, os
 
 from datetime import datetime
 from fractions import Fraction as F
@@ -176,6 +176,36 @@ def decode_base64(data):
     return base64.b64decode(data)
 
 
+def start_another_server(args, stderr=subprocess.DEVNULL):
+    """
+    Start a second server, next to the one under test, with the given
+    arguments, for tests that need it configured differently.  It runs in
+    its own process group, so that killserver() stops it.
+    """
+    env = dict(os.environ)
+    for variable, value in [('USER_NAME', USERNAME), ('USER_PASS', PASSWORD), ('SECRET', SECRET)]:
+        env.setdefault(variable, value)
+    return subprocess.Popen([server_path] + args, preexec_fn=lambda: os.setpgid(0, 0),
+                            env=env, stdout=subprocess.DEVNULL, stderr=stderr)
+
+
+def wait_for_server(process, connect):
+    """
+    Wait up to 5 seconds for connect() to return a connection to a server
+    started with start_another_server().  Returns False if it did not, or
+    if the server exited.
+    """
+    for i in range(50):
+        if process.poll() is not None:
+            return False
+        try:
+            connect().close()
+            return True
+        except (OSError, ValueError):
+            time.sleep(.1)
+    return False
+
+
 # Install the default exception handler
 sys.excepthook = handle_exception
 
@@ -2161,6 +2191,168 @@ class Authentication(Doc_Print_Test_Case):
             # Close the session
             self.sessions[i].close()
 
+    def test_logout_revokes_token(self):
+        """ Test Name: test_logout_revokes_token
+        Number Connections: N/A
+        Procedure: Logs in, keeps a copy of the token, and logs out.  Checks
+                   that the copied token no longer grants access to private
+                   files, and that logging in again does.  An error here means
+                   that logout does not revoke the token on the server, or that
+                   it revokes the tokens of later logins as well.
+        """
+        base_url = 'http://%s:%s' % (self.hostname, self.port)
+        private_url = '%s/%s' % (base_url, self.private_file)
+        credentials = {'username': self.username, 'password': self.password}
+
+        self.sessions.append(requests.Session())
+        response = self.sessions[0].post(base_url + '/api/login', json=credentials, timeout=2)
+        self.assertEqual(response.status_code, requests.codes.ok, "Authentication failed.")
+        token = self.sessions[0].cookies.get('auth_jwt_token')
+        self.assertIsNotNone(token, "No valid cookie found.")
+
+        response = self.sessions[0].post(base_url + '/api/logout', timeout=2)
+        self.assertEqual(response.status_code, requests.codes.ok, "Logout failed.")
+
+        # a client that kept the cookie must not get in with it
+        response = requests.get(private_url, cookies={'auth_jwt_token': token}, timeout=2)
+        self.assertEqual(response.status_code, requests.codes.forbidden,
+                         "A token was still accepted after logging out.")
+
+        # logging in again must still work
+        self.sessions.append(requests.Session())
+        response = self.sessions[1].post(base_url + '/api/login', json=credentials, timeout=2)
+        self.assertEqual(response.status_code, requests.codes.ok, "Authentication after logout failed.")
+        self.assertNotEqual(self.sessions[1].cookies.get('auth_jwt_token'), token,
+                            "Logging in again returned the revoked token.")
+        response = self.sessions[1].get(private_url, timeout=2)
+        self.assertEqual(response.status_code, requests.codes.ok,
+                         "Server failed to respond with private file after logging in again.")
+        for session in self.sessions:
+            session.close()
+
+class Signed_Tokens(Doc_Print_Test_Case):
+    """
+    Test cases for tokens signed with a key pair (-A RS256 or ES256, -K),
+    against a second server started with a freshly generated key.
+    """
+
+    def __init__(self, testname, hostname, port):
+        """
+        Prepare the test case for creating connections.
+        """
+        super(Signed_Tokens, self).__init__(testname)
+
+        self.hostname = hostname
+        self.port = port
+        self.private_file = 'private/secure.html'
+
+    def setUp(self):
+        """  Test Name: None -- setUp function\n\
+        Number Connections: N/A \n\
+        Procedure: Creates a directory for the key.
+        """
+        self.tmpdir = tempfile.mkdtemp()
+        self.other_server = None
+
+    def tearDown(self):
+        """  Test Name: None -- tearDown function\n\
+        Number Connections: N/A \n\
+        Procedure: Stops the second server and removes the key.
+        """
+        if self.other_server is not None:
+            killserver(self.other_server)
+            self.other_server.wait()
+        shutil.rmtree(self.tmpdir)
+
+    def start_with_key(self, algorithm, keygen_options):
+        keyfile = os.path.join(self.tmpdir, 'key.pem')
+        subprocess.run(['openssl', 'genpkey', '-out', keyfile] + keygen_options,
+                       check=True, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        self.other_port = int(self.port) + 10000
+        self.other_server = start_another_server(['-p', str(self.other_port), '-R', base_dir,
+                                                  '-A', algorithm, '-K', keyfile])
+        self.assertTrue(wait_for_server(self.other_server,
+                                        lambda: get_socket_connection(self.hostname, self.other_port)),
+                        "The server did not start with an %s key." % algorithm)
+
+    def get_private(self, token):
+        return requests.get('http://%s:%s/%s' % (self.hostname, self.other_port, self.private_file),
+                            cookies={'auth_jwt_token': token}, timeout=2).status_code
+
+    @staticmethod
+    def b64url_decode(data):
+        return base64.urlsafe_b64decode(data + '=' * (-len(data) % 4))
+
+    # Log in, use the token, and log out again.
+    def check_round_trip(self, algorithm):
+        url = 'http://%s:%s/api/login' % (self.hostname, self.other_port)
+        response = requests.post(url, json={'username': USERNAME, 'password': PASSWORD}, timeout=2)
+        self.assertEqual(response.status_code, requests.codes.ok)
+        token = response.cookies['auth_jwt_token']
+        header, payload, signature = token.split('.')
+        self.assertEqual(json.loads(self.b64url_decode(header))['alg'], algorithm)
+
+        response = requests.get(url, cookies={'auth_jwt_token': token}, timeout=2)
+        claims = response.json()
+        self.assertEqual(claims.get('sub'), USERNAME, "The claims of the token are not returned.")
+        self.assertIn('jti', claims)
+        self.assertEqual(self.get_private(token), requests.codes.ok,
+                         "A valid %s token was not accepted." % algorithm)
+
+        # changed bits of the signature, in its middle and in the unused
+        # bits of its last character, which decode to the same bytes
+        tampered = signature[:10] + ('A' if signature[10] != 'A' else 'B') + signature[11:]
+        self.assertEqual(self.get_private('.'.join([header, payload, tampered])), requests.codes.forbidden)
+        alphabet = string.ascii_uppercase + string.ascii_lowercase + string.digits + '-_'
+        noncanonical = signature[:-1] + alphabet[alphabet.index(signature[-1]) | 1]
+        self.assertNotEqual(noncanonical, signature)
+        self.assertEqual(self.get_private('.'.join([header, payload, noncanonical])), requests.codes.forbidden,
+                         "A signature that is not encoded canonically was accepted.")
+
+        requests.post('http://%s:%s/api/logout' % (self.hostname, self.other_port),
+                      cookies={'auth_jwt_token': token}, timeout=2)
+        self.assertEqual(self.get_private(token), requests.codes.forbidden,
+                         "The token was accepted after logging out.")
+
+    # ================================ Tests ================================= #
+
+    def test_rs256_round_trip(self):
+        """ Test Name: test_rs256_round_trip
+        Number Connections: 7
+        Procedure: Starts a server with an RSA key, logs in, accesses a
+                   private file, and logs out.  A failure here means that
+                   an RS256 token was not issued or accepted, or that a
+                   modified one was accepted.
+        """
+        self.start_with_key('RS256', ['-algorithm', 'RSA', '-pkeyopt', 'rsa_keygen_bits:2048'])
+        self.check_round_trip('RS256')
+
+    def test_es256_round_trip(self):
+        """ Test Name: test_es256_round_trip
+        Number Connections: 8
+        Procedure: Starts a server with a P-256 key, logs in, accesses a
+                   private file, and logs out.  Also sends the token with
+                   its signature's s replaced by n - s, which is just as
+                   valid but must be refused.  A failure here means that
+                   an ES256 token was not issued or accepted, or that a
+                   modified one was accepted.
+        """
+        self.start_with_key('ES256', ['-algorithm', 'EC', '-pkeyopt', 'ec_paramgen_curve:P-256'])
+        url = 'http://%s:%s/api/login' % (self.hostname, self.other_port)
+        response = requests.post(url, json={'username': USERNAME, 'password': PASSWORD}, timeout=2)
+        token = response.cookies['auth_jwt_token']
+        header, payload, signature = token.split('.')
+        raw = self.b64url_decode(signature)
+        n = 0xffffffff00000000ffffffffffffffffbce6faada7179e84f3b9cac2fc632551
+        s = int.from_bytes(raw[32:], 'big')
+        self.assertLessEqual(s, n // 2, "An ES256 signature with a high s was issued.")
+        high_s = raw[:32] + (n - s).to_bytes(32, 'big')
+        high_s = base64.urlsafe_b64encode(high_s).rstrip(b'=').decode()
+        self.assertEqual(self.get_private('.'.join([header, payload, high_s])), requests.codes.forbidden,
+                         "An ES256 signature with a high s was accepted.")
+        self.check_round_trip('ES256')
+
+
 class VideoStreaming(Doc_Print_Test_Case):
     """
     Test cases for the /api/video endpoint and using Range requests to stream
@@ -2249,6 +2441,67 @@ class VideoStreaming(Doc_Print_Test_Case):
         fp.close()
         return True
 
+    # Yields the type, and the start and end of the payload, of each box
+    # of an MP4 file in data[start:end].
+    @staticmethod
+    def mp4_boxes(data, start, end):
+        while start + 8 <= end:
+            size, kind = struct.unpack_from('>I4s', data, start)
+            header = 8
+            if size == 1:
+                size = struct.unpack_from('>Q', data, start + 8)[0]
+                header = 16
+            elif size == 0:
+                size = end - start
+            yield kind.decode('latin-1'), start + header, start + size
+            start += size
+
+    # Returns the payload of the box at path below data[start:end].
+    def mp4_find(self, data, start, end, path):
+        for kind, s, e in self.mp4_boxes(data, start, end):
+            if kind == path[0]:
+                return (s, e) if len(path) == 1 else self.mp4_find(data, s, e, path[1:])
+        return None
+
+    # Returns the times, in seconds, and the offsets in the file of the
+    # keyframes of the video track of an MP4 file's contents.
+    def mp4_keyframes(self, data):
+        moov = self.mp4_find(data, 0, len(data), ['moov'])
+        for kind, s, e in self.mp4_boxes(data, *moov):
+            hdlr = self.mp4_find(data, s, e, ['mdia', 'hdlr']) if kind == 'trak' else None
+            if hdlr is not None and data[hdlr[0] + 8:hdlr[0] + 12] == b'vide':
+                break
+        mdhd = self.mp4_find(data, s, e, ['mdia', 'mdhd'])
+        timescale = struct.unpack_from('>I', data, mdhd[0] + (20 if data[mdhd[0]] == 1 else 12))[0]
+        stbl = self.mp4_find(data, s, e, ['mdia', 'minf', 'stbl'])
+
+        def table(name, skip, fmt):
+            box = self.mp4_find(data, *stbl, [name])
+            if box is None:
+                return None
+            n = struct.unpack_from('>I', data, box[0] + 4 + skip)[0]
+            return list(struct.iter_unpack(fmt, data[box[0] + 8 + skip:box[0] + 8 + skip + n * struct.calcsize(fmt)]))
+
+        chunks = [c[0] for c in table('stco', 0, '>I') or table('co64', 0, '>Q')]
+        stsc = table('stsc', 0, '>III')
+        fixed_size = struct.unpack_from('>I', data, self.mp4_find(data, *stbl, ['stsz'])[0] + 4)[0]
+        sizes = None if fixed_size else [z[0] for z in table('stsz', 4, '>I')]
+        durations = [d for count, d in table('stts', 0, '>II') for i in range(count)]
+        sync = table('stss', 0, '>I')
+        sync = None if sync is None else set(n[0] for n in sync)
+
+        keyframes = []
+        sample, elapsed = 1, 0
+        for chunk, offset in enumerate(chunks, 1):
+            per_chunk = [n for first, n, desc in stsc if first <= chunk][-1]
+            for k in range(per_chunk):
+                if sync is None or sample in sync:
+                    keyframes.append((elapsed / timescale, offset))
+                offset += fixed_size or sizes[sample - 1]
+                elapsed += durations[sample - 1]
+                sample += 1
+        return keyframes
+
     def test_api_video(self):
         """ Test Name: test_api_video
         Number Connections: N/A
@@ -2327,6 +2580,78 @@ class VideoStreaming(Doc_Print_Test_Case):
                 raise AssertionError("Incorrect size reported for \"%s\" in response to GET /api/video. Expected %d, received %d" %
                                      (expected_str, expected_size, entry["size"]))
 
+    # Read a complete response from sock, returning its status line, its
+    # headers (with lower-case names), and its body, undoing the chunked
+    # transfer coding if used.
+    def read_raw_response(self, sock):
+        data = b''
+        while True:
+            chunk = sock.recv(65536)
+            if not chunk:
+                break
+            data += chunk
+        head, _, body = data.partition(b'\r\n\r\n')
+        lines = head.decode('latin-1').split('\r\n')
+        headers = {}
+        for line in lines[1:]:
+            name, _, value = line.partition(':')
+            headers[name.strip().lower()] = value.strip()
+        if headers.get('transfer-encoding', '').lower() == 'chunked':
+            decoded = b''
+            while True:
+                size_line, _, body = body.partition(b'\r\n')
+                size = int(size_line.split(b';')[0], 16)
+                if size == 0:
+                    self.assertTrue(body.startswith(b'\r\n'), "Chunked response was not terminated.")
+                    break
+                self.assertEqual(body[size:size + 2], b'\r\n', "Chunk is not followed by CRLF.")
+                decoded += body[:size]
+                body = body[size + 2:]
+            body = decoded
+        return lines[0], headers, body
+
+    def test_api_video_streamed(self):
+        """ Test Name: test_api_video_streamed
+        Number Connections: 2
+        Procedure: Fills the root directory with enough files that the listing
+        from /api/video is streamed rather than sent at once, then requests it
+        with HTTP/1.1, which must get a chunked response, and with HTTP/1.0,
+        which must get a response ended by closing the connection.  A failure
+        here means the listing was garbled when streamed.
+        """
+        extra = []
+        try:
+            for i in range(400):
+                fname = 'streamed-listing-test-%d-%s.txt' % (i, 'x' * 40)
+                with open(os.path.join(base_dir, fname), 'w') as f:
+                    f.write('x' * i)
+                extra.append(fname)
+            expected = {f: os.path.getsize(os.path.join(base_dir, f)) for f in os.listdir(base_dir)}
+
+            for version in ['HTTP/1.1', 'HTTP/1.0']:
+                sock = get_socket_connection(self.hostname, self.port)
+                sock.send(encode('GET /api/video %s\r\nHost: %s\r\n\r\n' % (version, self.hostname)))
+                status, headers, body = self.read_raw_response(sock)
+                sock.close()
+
+                self.assertEqual(status.split(' ')[1], '200', "%s request failed" % version)
+                self.assertNotIn('content-length', headers, "%s listing was not streamed" % version)
+                if version == 'HTTP/1.1':
+                    self.assertEqual(headers.get('transfer-encoding', '').lower(), 'chunked',
+                                     "HTTP/1.1 listing was not chunked")
+                else:
+                    self.assertNotIn('transfer-encoding', headers,
+                                     "HTTP/1.0 listing must not use chunked transfer coding")
+                try:
+                    jdata = json.loads(body)
+                except ValueError as e:
+                    raise AssertionError("%s listing is not valid JSON: %s" % (version, str(e)))
+                listed = {e['name']: e['size'] for e in jdata if e['name'] not in ('.', '..')}
+                self.assertEqual(listed, expected, "%s listing differs from the directory" % version)
+        finally:
+            for fname in extra:
+                os.unlink(os.path.join(base_dir, fname))
+
     def test_accept_ranges_header(self):
         """ Test Name: test_accept_ranges_header
         Number Connections: N/A
@@ -2502,6 +2827,429 @@ class VideoStreaming(Doc_Print_Test_Case):
                 raise AssertionError("Server didn't send the correct bytes. Should have been bytes %d-%d"
                                      "\nRange request sent: '%s'" % (byte_start, byte_start + content_length_expect - 1, rgheader))
 
+    def test_video_seek(self):
+        """ Test Name: test_video_seek
+        Number Connections: 3
+        Procedure: Requests a video with ?t= for a few times.  The response
+                   must be 206 Partial Content, name the time of the last
+                   keyframe before the requested time in X-Seek-Time, and
+                   start at that keyframe.  A failure here means that the
+                   keyframe index is wrong, or that seeking is not supported.
+        """
+        with open(self.vids[0], 'rb') as f:
+            data = f.read()
+        keyframes = self.mp4_keyframes(data)
+        url = 'http://%s:%s/%s' % (self.hostname, self.port, os.path.relpath(self.vids[0], base_dir))
+        for t in [0, keyframes[-1][0] / 2, keyframes[-1][0] + 0.5]:
+            seek_time, offset = [k for k in keyframes if k[0] <= t][-1]
+            response = self.session.get(url, params={'t': t}, timeout=2)
+            self.assertEqual(response.status_code, requests.codes.partial_content,
+                             "A request with ?t=%s was not answered with 206 Partial Content." % t)
+            self.assertEqual(self.find_header(response, 'X-Seek-Time'), '%.3f' % seek_time)
+            self.assertEqual(self.find_header(response, 'Content-Range'),
+                             'bytes %d-%d/%d' % (offset, len(data) - 1, len(data)),
+                             "A request with ?t=%s did not start at the keyframe at %.3fs." % (t, seek_time))
+            self.assertEqual(response.content, data[offset:])
+
+    def test_video_faststart(self):
+        """ Test Name: test_video_faststart
+        Number Connections: 4
+        Procedure: Starts a second server with -V, which serves MP4 files
+                   with the moov box ahead of the media data, and gets a
+                   video in full, in a range, and with ?t=.  A failure here
+                   means that the boxes were not reordered, or that the
+                   reordered file's sample offsets do not point at the
+                   same samples as the original's.
+        """
+        with open(self.vids[0], 'rb') as f:
+            data = f.read()
+        other_port = int(self.port) + 10000
+        other_server = start_another_server(['-p', str(other_port), '-R', base_dir, '-V'])
+        try:
+            self.assertTrue(wait_for_server(other_server, lambda: get_socket_connection(self.hostname, other_port)),
+                            "The server did not start with -V.")
+            url = 'http://%s:%s/%s' % (self.hostname, other_port, os.path.relpath(self.vids[0], base_dir))
+            response = self.session.get(url, timeout=2)
+            self.assertEqual(response.status_code, requests.codes.ok)
+            served = response.content
+            self.assertEqual(len(served), len(data))
+            boxes = [kind for kind, start, end in self.mp4_boxes(served, 0, len(served))]
+            self.assertLess(boxes.index('moov'), boxes.index('mdat'), "The moov box was not moved to the front.")
+
+            # each keyframe of the served file is the same sample as in the original
+            original = self.mp4_keyframes(data)
+            reordered = self.mp4_keyframes(served)
+            self.assertEqual([k[0] for k in reordered], [k[0] for k in original])
+            for (keyframe_time, offset), (_, new_offset) in zip(original, reordered):
+                self.assertEqual(served[new_offset:new_offset + 64], data[offset:offset + 64],
+                                 "The keyframe at %.3fs moved to the wrong place." % keyframe_time)
+
+            response = self.session.get(url, headers={'Range': 'bytes=100-20000'}, timeout=2)
+            self.assertEqual(response.status_code, requests.codes.partial_content)
+            self.assertEqual(response.content, served[100:20001])
+
+            seek_time, offset = reordered[-1]
+            response = self.session.get(url, params={'t': seek_time}, timeout=2)
+            self.assertEqual(response.status_code, requests.codes.partial_content)
+            self.assertEqual(self.find_header(response, 'X-Seek-Time'), '%.3f' % seek_time)
+            self.assertEqual(response.content, served[offset:])
+        finally:
+            killserver(other_server)
+            other_server.wait()
+
+
+class Trace_Replay(Doc_Print_Test_Case):
+    """
+    Test cases for replay.py, converting a comux file into a trace and
+    replaying it against the server.
+    """
+
+    def __init__(self, testname, hostname, port):
+        """
+        Prepare the test case for creating connections.
+        """
+        super(Trace_Replay, self).__init__(testname)
+
+        self.hostname = hostname
+        self.port = port
+        self.comux_file = f'{script_dir}/res/sample.comux'
+
+    def setUp(self):
+        """  Test Name: None -- setUp function\n\
+        Number Connections: N/A \n\
+        Procedure: Creates a directory for the trace and the results.
+        """
+        self.tmpdir = tempfile.mkdtemp()
+
+    def tearDown(self):
+        """  Test Name: None -- tearDown function\n\
+        Number Connections: N/A \n\
+        Procedure: Removes the trace and the results.  An error here \
+                   means the server crashed after servicing the request from \
+                   the previous test.
+        """
+        shutil.rmtree(self.tmpdir)
+        if server.poll() is not None:
+            print("The server has crashed.  Please investigate.")
+
+    def test_replay_comux(self):
+        """ Test Name: test_replay_comux
+        Number Connections: 3
+        Procedure: Parses res/sample.comux, converts it into a trace, and
+                   replays the trace.  A failure here means that the comux
+                   file was not parsed as expected, or that a replayed
+                   connection did not receive a response.
+        """
+        import replay
+
+        # the chunks of each connection, in the order of their scheduling values
+        conns = replay.read_comux(self.comux_file)
+        self.assertEqual(sorted(conns), [0, 1, 2])
+        self.assertEqual(b"".join(conns[1]),
+                         b"GET /api/login HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n")
+
+        # a file of another version of the format is refused
+        with open(self.comux_file, 'rb') as f:
+            raw = f.read()
+        other_version = os.path.join(self.tmpdir, 'other.comux')
+        with open(other_version, 'wb') as f:
+            f.write(raw[:5] + struct.pack('<I', 1) + raw[9:])
+        self.assertRaises(ValueError, replay.read_comux, other_version)
+
+        trace = os.path.join(self.tmpdir, 'trace.jsonl')
+        results = os.path.join(self.tmpdir, 'results.json')
+        replay_py = f'{script_dir}/replay.py'
+        subprocess.run([sys.executable, replay_py, 'convert', '-o', trace, self.comux_file],
+                       check=True, stdout=subprocess.DEVNULL, timeout=10)
+        subprocess.run([sys.executable, replay_py, 'replay', '-s', '0', '-o', results,
+                        trace, 'http://%s:%s' % (self.hostname, self.port)],
+                       check=True, stdout=subprocess.DEVNULL, timeout=10)
+
+        with open(results) as f:
+            report = json.load(f)
+        self.assertEqual(report['connections'], 3)
+        self.assertEqual(report['overall']['errors'], 0, "A replayed connection got no response.")
+        self.assertEqual(report['classes']['GET /api/login']['status'], {'200': 1})
+        self.assertEqual(report['classes']['GET html']['count'], 2)
+
+
+class Upload(Doc_Print_Test_Case):
+    """
+    Test cases for POST /api/upload, which stores the request body as a
+    file in the server's root directory for an authenticated user.
+    """
+
+    def __init__(self, testname, hostname, port):
+        """
+        Prepare the test case for creating connections.
+        """
+        super(Upload, self).__init__(testname)
+
+        self.hostname = hostname
+        self.port = port
+        self.username = USERNAME
+        self.password = PASSWORD
+        self.upload_name = 'upload-test-%d.bin' % os.getpid()
+
+    def setUp(self):
+        """  Test Name: None -- setUp function\n\
+        Number Connections: N/A \n\
+        Procedure: Logs in.  An error here means that the user could not \
+                   be authenticated.
+        """
+        self.session = requests.Session()
+        response = self.session.post('http://%s:%s/api/login' % (self.hostname, self.port),
+                                     json={'username': self.username, 'password': self.password},
+                                     timeout=2)
+        self.assertEqual(response.status_code, requests.codes.ok, "Authentication failed.")
+        self.token = self.session.cookies.get('auth_jwt_token')
+
+    def tearDown(self):
+        """  Test Name: None -- tearDown function\n\
+        Number Connections: N/A \n\
+        Procedure: Removes the uploaded file.  An error here means the \
+                   server crashed after servicing the request from the \
+                   previous test.
+        """
+        self.session.close()
+        try:
+            os.unlink(f'{base_dir}/{self.upload_name}')
+        except FileNotFoundError:
+            pass
+        if server.poll() is not None:
+            print("The server has crashed.  Please investigate.")
+
+    # =============================== Helpers ================================ #
+    def upload_url(self, name):
+        return 'http://%s:%s/api/upload?name=%s' % (self.hostname, self.port, name)
+
+    # Send a raw request, half-close the connection, and return the status
+    # of the response.
+    def raw_request(self, request):
+        sock = get_socket_connection(self.hostname, self.port)
+        sock.send(request)
+        sock.shutdown(socket.SHUT_WR)
+        response = b''
+        while True:
+            data = sock.recv(4096)
+            if not data:
+                break
+            response += data
+        sock.close()
+        return int(response.split(b' ', 2)[1])
+
+    # Check that the file was stored and is served as uploaded.
+    def check_round_trip(self, content):
+        with open(f'{base_dir}/{self.upload_name}', 'rb') as f:
+            self.assertEqual(f.read(), content, "The stored file differs from the upload.")
+        response = requests.get('http://%s:%s/%s' % (self.hostname, self.port, self.upload_name),
+                                timeout=2)
+        self.assertEqual(response.status_code, requests.codes.ok)
+        self.assertEqual(response.content, content, "The uploaded file is not served as uploaded.")
+
+    def leftover_temporary_files(self):
+        return [f for f in os.listdir(base_dir) if f.startswith('.upload-')]
+
+    def server_open_files(self):
+        return len(os.listdir('/proc/%d/fd' % server.pid))
+
+    # ================================ Tests ================================= #
+    def test_upload_no_token(self):
+        """ Test Name: test_upload_no_token
+        Number Connections: N/A
+        Procedure: Uploads without a token and with an invalid one.  A failure
+                   here means that unauthenticated users can write files.
+        """
+        response = requests.post(self.upload_url(self.upload_name), data=b'x', timeout=2)
+        self.assertEqual(response.status_code, requests.codes.forbidden)
+        response = requests.post(self.upload_url(self.upload_name), data=b'x', timeout=2,
+                                 cookies={'auth_jwt_token': 'not.a.token'})
+        self.assertEqual(response.status_code, requests.codes.forbidden)
+        self.assertFalse(os.path.exists(f'{base_dir}/{self.upload_name}'))
+
+    def test_upload_invalid_name(self):
+        """ Test Name: test_upload_invalid_name
+        Number Connections: N/A
+        Procedure: Uploads with file names that lead out of the root directory
+                   or name hidden files, and without a name.  A failure here
+                   means that such names are accepted.
+        """
+        for name in ['../x', '.hidden', '']:
+            response = self.session.post(self.upload_url(name), data=b'x', timeout=2)
+            self.assertEqual(response.status_code, requests.codes.bad_request,
+                             "Upload as '%s' was not rejected." % name)
+        response = self.session.post('http://%s:%s/api/upload' % (self.hostname, self.port),
+                                     data=b'x', timeout=2)
+        self.assertEqual(response.status_code, requests.codes.bad_request,
+                         "Upload without a name was not rejected.")
+        self.assertFalse(os.path.exists(f'{base_dir}/../x'))
+        self.assertFalse(os.path.exists(f'{base_dir}/.hidden'))
+
+    def test_upload_content_length(self):
+        """ Test Name: test_upload_content_length
+        Number Connections: N/A
+        Procedure: Uploads a body with a Content-Length and gets it back.
+        """
+        content = bytes(random.getrandbits(8) for i in range(100000))
+        response = self.session.post(self.upload_url(self.upload_name), data=content, timeout=2)
+        self.assertEqual(response.status_code, requests.codes.created)
+        self.assertEqual(response.json(), {'name': self.upload_name, 'size': len(content)})
+        self.check_round_trip(content)
+
+    def test_upload_chunked(self):
+        """ Test Name: test_upload_chunked
+        Number Connections: 1
+        Procedure: Uploads a chunked body that ends with a trailer field and
+                   gets it back.
+        """
+        parts = [b'hello, ', b'chunked ' * 1000, b'world\n']
+        request = (b'POST /api/upload?name=%s HTTP/1.1\r\n' % encode(self.upload_name)
+                   + b'Host: %s\r\n' % encode(self.hostname)
+                   + b'Cookie: auth_jwt_token=%s\r\n' % encode(self.token)
+                   + b'Transfer-Encoding: chunked\r\n\r\n')
+        for part in parts:
+            request += b'%x\r\n%s\r\n' % (len(part), part)
+        request += b'0\r\nX-Checksum: none\r\n\r\n'
+        self.assertEqual(self.raw_request(request), 201)
+        self.check_round_trip(b''.join(parts))
+
+    def test_upload_truncated(self):
+        """ Test Name: test_upload_truncated
+        Number Connections: 2
+        Procedure: Sends less of the body than announced, with a Content-Length
+                   and in chunks, then closes the connection.  A failure here
+                   means that a partial upload was stored, or that its
+                   temporary file was left behind or kept open.
+        """
+        open_files = self.server_open_files()
+        head = (b'POST /api/upload?name=%s HTTP/1.1\r\n' % encode(self.upload_name)
+                + b'Host: %s\r\n' % encode(self.hostname)
+                + b'Cookie: auth_jwt_token=%s\r\n' % encode(self.token))
+        self.assertEqual(self.raw_request(head + b'Content-Length: 1000\r\n\r\n' + b'x' * 500), 400)
+        self.assertEqual(self.raw_request(head + b'Transfer-Encoding: chunked\r\n\r\n'
+                                          + b'3e8\r\n' + b'x' * 500), 400)
+        self.assertFalse(os.path.exists(f'{base_dir}/{self.upload_name}'))
+        self.assertEqual(self.leftover_temporary_files(), [])
+        self.assertEqual(self.server_open_files(), open_files,
+                         "The server did not close the files of failed uploads.")
+
+
+class Unix_Socket(Doc_Print_Test_Case):
+    """
+    Test cases for serving on a UNIX domain socket (-U), against a second
+    server started on a socket in a temporary directory.
+    """
+
+    def __init__(self, testname, hostname, port):
+        """
+        Prepare the test case for creating connections.
+        """
+        super(Unix_Socket, self).__init__(testname)
+
+        self.hostname = hostname
+        self.port = port
+        self.public_file = 'index.html'
+
+    def setUp(self):
+        """  Test Name: None -- setUp function\n\
+        Number Connections: N/A \n\
+        Procedure: Creates a directory for the socket.
+        """
+        self.tmpdir = tempfile.mkdtemp()
+        self.path = os.path.join(self.tmpdir, 'server.sock')
+        self.servers = []
+
+    def tearDown(self):
+        """  Test Name: None -- tearDown function\n\
+        Number Connections: N/A \n\
+        Procedure: Stops the servers started on the socket and removes it.
+        """
+        for other_server in self.servers:
+            killserver(other_server)
+            other_server.wait()
+        shutil.rmtree(self.tmpdir)
+
+    def connect(self):
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        try:
+            sock.connect(self.path)
+        except OSError:
+            sock.close()
+            raise
+        return sock
+
+    def start_on_socket(self, stderr=subprocess.DEVNULL):
+        other_server = start_another_server(['-U', self.path, '-R', base_dir], stderr=stderr)
+        self.servers.append(other_server)
+        return other_server
+
+    # Gets the public file over the socket and checks the response.
+    def check_request(self):
+        sock = self.connect()
+        sock.settimeout(2)
+        sock.sendall(b'GET /%s HTTP/1.0\r\n\r\n' % encode(self.public_file))
+        response = b''
+        while True:
+            data = sock.recv(4096)
+            if not data:
+                break
+            response += data
+        sock.close()
+        head, body = response.split(b'\r\n\r\n', 1)
+        self.assertTrue(head.startswith(b'HTTP/1.0 200') or head.startswith(b'HTTP/1.1 200'),
+                        "A request over the UNIX socket was not answered with 200 OK.")
+        with open(f'{base_dir}/{self.public_file}', 'rb') as f:
+            self.assertEqual(body, f.read())
+
+    # ================================ Tests ================================= #
+
+    def test_unix_socket_request(self):
+        """ Test Name: test_unix_socket_request
+        Number Connections: 1
+        Procedure: Starts a server with -U and no port, and gets a file over
+                   the socket.  A failure here means that the server does not
+                   listen on the socket, or does not serve its clients.
+        """
+        other_server = self.start_on_socket()
+        self.assertTrue(wait_for_server(other_server, self.connect), "The server did not start with -U.")
+        self.check_request()
+
+    def test_unix_socket_stale(self):
+        """ Test Name: test_unix_socket_stale
+        Number Connections: 1
+        Procedure: Leaves a socket behind that nothing listens on, as a
+                   server that crashed would, and starts a server on its
+                   path.  A failure here means that the stale socket was
+                   not replaced.
+        """
+        stale = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        stale.bind(self.path)
+        stale.close()
+        self.assertTrue(os.path.exists(self.path))
+        other_server = self.start_on_socket()
+        self.assertTrue(wait_for_server(other_server, self.connect),
+                        "The server did not start on the path of a stale socket.")
+        self.check_request()
+
+    def test_unix_socket_in_use(self):
+        """ Test Name: test_unix_socket_in_use
+        Number Connections: 2
+        Procedure: Starts a second server on the socket of a running one.
+                   It must exit, reporting that the address is in use, and
+                   leave the running server reachable.  A failure here means
+                   that the socket of a live server was taken over.
+        """
+        first = self.start_on_socket()
+        self.assertTrue(wait_for_server(first, self.connect), "The server did not start with -U.")
+        second = self.start_on_socket(stderr=subprocess.PIPE)
+        try:
+            _, errors = second.communicate(timeout=5)
+        except subprocess.TimeoutExpired:
+            self.fail("A second server started on the socket of a live one.")
+        self.assertNotEqual(second.returncode, 0)
+        self.assertIn(b'address in use', errors)
+        self.check_request()
+
 
 ###############################################################################
 # Globally define the Server object so it can be checked by all test cases
@@ -2608,6 +3356,22 @@ def make_suite_extra(hostname, port):
             extra_tests_suite.addTest(Single_Conn_Bad_Case(test_function, hostname, port))
     # In particular, add the 1.1 protocol persistent connection check from Single_Conn_Protocol_Case
     extra_tests_suite.addTest(Single_Conn_Protocol_Case("test_http_1_1_compliance", hostname, port))
+    # Add all of the tests from the class Upload
+    for test_function in dir(Upload):
+        if test_function.startswith("test_"):
+            extra_tests_suite.addTest(Upload(test_function, hostname, port))
+    # Add all of the tests from the class Signed_Tokens
+    for test_function in dir(Signed_Tokens):
+        if test_function.startswith("test_"):
+            extra_tests_suite.addTest(Signed_Tokens(test_function, hostname, port))
+    # Add all of the tests from the class Trace_Replay
+    for test_function in dir(Trace_Replay):
+        if test_function.startswith("test_"):
+            extra_tests_suite.addTest(Trace_Replay(test_function, hostname, port))
+    # Add all of the tests from the class Unix_Socket
+    for test_function in dir(Unix_Socket):
+        if test_function.startswith("test_"):
+            extra_tests_suite.addTest(Unix_Socket(test_function, hostname, port))
     return extra_tests_suite
 
 # Suite builder function for malicious tests.
@@ -2754,7 +3518,7 @@ if __name__ == '__main__':
 
     alltests = [Single_Conn_Good_Case, Multi_Conn_Sequential_Case, Single_Conn_Bad_Case,
                 Single_Conn_Malicious_Case, Single_Conn_Protocol_Case, Access_Control,
-                Authentication, Fallback, VideoStreaming]
+                Authentication, Signed_Tokens, Fallback, VideoStreaming, Upload, Trace_Replay, Unix_Socket]
 
 
     def findtest(tname):